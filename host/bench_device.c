@@ -0,0 +1,1061 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+/* The device logic of webcamdevice.c - snapshots, the stream, the pre-event
+   upload, the spool and the incoming messages - against a simulated camera
+   and a stand-in of the HTTP/2 client in virtual time.
+
+   The camera runs at its frame rate (the snapshot frame sizes at the half
+   of it) and gives the payloads round robin: esp_camera_fb_get waits for
+   the next frame, the frames captured while no buffer is held go to the
+   frame hook (the pre-event ring). The stand-in of wch2pcapp sets the bits
+   of the app_main tasks by their periods, calls their on_sync and
+   on_finish_step, polls the server for the messages every recv_msgs_period
+   and sends the outgoing ones every send_msgs_period. The server asks for a
+   snapshot, the pre-event frames and a thumbnail by the periods of the
+   options, a button is pressed the same way.
+
+   An exchange with the server costs 2 x delay + len / bandwidth (a stream
+   frame - delay + len / bandwidth). A lost exchange drops the connection
+   for the outage: the device is not authorized meanwhile and the snapshot
+   taken at the drop goes to the spool.
+
+   usage: bench_device [options] [frame.jpg ...]
+     -t seconds (60)                      -f fps (25)
+     -S stream period ms (of app_main)    -d delay ms (20)
+     -b bandwidth kbit/s (4000)           -l loss % (0)
+     -o outage ms (3000)                  -s snapshot request period ms (5000)
+     -p pre-event request period ms (0)   -k button press period ms (0)
+     -g thumbnail request period ms (0)   -r seed (1)
+     -F spool partition file              -v logs of the device
+   Without the files the payloads are synthetic scenes encoded by to_jpg.c,
+   VGA for the stream and SXGA for the snapshots. Prints the throughput,
+   the latency percentiles and the peak memory. Exits with 1 if the uploads
+   counted by the device (getstats) differ from the ones the server got or
+   its percentiles are out of the histogram resolution */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "esp_partition.h"
+#include "host_shim.h"
+#include "../main/webcamdevice.c"
+
+#define BENCH_PAYLOADS_MAX  16
+#define BENCH_INBOX_MAX     64       // messages of the server not polled yet
+#define BENCH_OUTBOX_MAX    32       // outgoing messages waiting for the send period
+#define BENCH_SNAP_REQ_MAX  64
+#define BENCH_DEVICE_NAME   "bench-cam"
+#define BENCH_SERVER_NAME   "server"
+#define BENCH_PART_SIZE     (256 * SPI_FLASH_SEC_SIZE)
+
+const char *JSON_RPC_MID = "mid";
+
+typedef struct {
+    uint8_t *buf;
+    size_t len;
+} payload_t;
+
+/* payloads by the mode of the camera */
+typedef enum {
+    SET_STREAM = 0,
+    SET_SNAP,
+    SET_MAX
+} payload_set_t;
+
+static payload_t s_payloads[SET_MAX][BENCH_PAYLOADS_MAX];
+static int s_payload_cnt[SET_MAX];
+
+static struct {
+    int seconds;
+    int fps;
+    int stream_ms;               // 0 - the period of app_main
+    int delay_ms;
+    int kbps;
+    double loss;                 // of an exchange, 0..1
+    int outage_ms;
+    int snap_ms;
+    int preevent_ms;
+    int button_ms;
+    int thumb_ms;
+    uint32_t seed;
+    const char *spool_path;
+} s_opt = {
+    .seconds = 60,
+    .fps = 25,
+    .delay_ms = 20,
+    .kbps = 4000,
+    .outage_ms = 3000,
+    .snap_ms = 5000,
+    .seed = 1,
+    .spool_path = "bench_device.bin",
+};
+
+/* latencies in ms, as wc_perf floors them */
+typedef struct {
+    uint32_t *ms;
+    size_t cnt;
+    size_t cap;
+} samples_t;
+
+static void samples_add(samples_t *s, int64_t us)
+{
+    if (s->cnt == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 256;
+        s->ms = (uint32_t *) realloc(s->ms, s->cap * sizeof(uint32_t));
+    }
+    s->ms[s->cnt++] = (us > 0) ? (uint32_t) (us / 1000) : 0;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* nearest rank, as wc_perf counts the target */
+static uint32_t samples_pct(samples_t *s, uint32_t pct)
+{
+    if (s->cnt == 0) {
+        return 0;
+    }
+    qsort(s->ms, s->cnt, sizeof(uint32_t), cmp_u32);
+    size_t target = (s->cnt * pct + 99) / 100;
+    return s->ms[target ? target - 1 : 0];
+}
+
+/* --- the camera --- */
+
+static struct {
+    framesize_t fsz;
+    int64_t period_us;
+    int64_t origin_us;           // a VSYNC of the current mode
+    int64_t armed_us;            // frames started before it are dropped
+    int64_t hook_us;             // frames started before it were counted or lost
+    uint32_t seq;
+    bool held;
+    camera_fb_t fb;
+    void (*hook)(const camera_fb_t *fb, void *arg);
+    void *hook_arg;
+    camera_stats_t st;
+    uint32_t flashes;
+} s_cam;
+
+static payload_set_t cam_set(void)
+{
+    return (s_cam.fsz > FRAMESIZE_SVGA) ? SET_SNAP : SET_STREAM;
+}
+
+/* the first VSYNC at t or after it */
+static int64_t cam_vsync(int64_t t)
+{
+    int64_t d = t - s_cam.origin_us;
+    if (d <= 0) {
+        return s_cam.origin_us;
+    }
+    return s_cam.origin_us + ((d + s_cam.period_us - 1) / s_cam.period_us) * s_cam.period_us;
+}
+
+static void cam_mode(framesize_t fsz)
+{
+    int64_t now = esp_timer_get_time();
+    s_cam.fsz = fsz;
+    // the sensor in the UXGA mode (frame sizes above SVGA) runs at the half rate
+    s_cam.period_us = 1000000 / s_opt.fps * ((fsz > FRAMESIZE_SVGA) ? 2 : 1);
+    s_cam.origin_us = now;
+    s_cam.armed_us = now + CONFIG_CAMERA_SETTLE_FRAMES * s_cam.period_us;
+    s_cam.hook_us = now;
+}
+
+static void cam_fill(int64_t start)
+{
+    payload_set_t set = cam_set();
+    const payload_t *p = &s_payloads[set][s_cam.seq++ % s_payload_cnt[set]];
+    s_cam.fb.buf = p->buf;
+    s_cam.fb.len = p->len;
+    s_cam.fb.width = resolution[s_cam.fsz].width;
+    s_cam.fb.height = resolution[s_cam.fsz].height;
+    s_cam.fb.format = PIXFORMAT_JPEG;
+    s_cam.fb.timestamp.tv_sec = start / 1000000;
+    s_cam.fb.timestamp.tv_usec = start % 1000000;
+    s_cam.st.frames_captured++;
+}
+
+/* the frames completed until the time while no buffer was held */
+static void cam_catch_up(int64_t until)
+{
+    if (s_cam.period_us == 0 || s_cam.held) {
+        return;
+    }
+    int64_t start = cam_vsync(s_cam.hook_us > s_cam.armed_us ? s_cam.hook_us : s_cam.armed_us);
+    for (; start + s_cam.period_us <= until; start += s_cam.period_us) {
+        cam_fill(start);
+    }
+    if (start > s_cam.hook_us) {
+        s_cam.hook_us = start;
+    }
+}
+
+esp_err_t esp_camera_init(const camera_config_t *config)
+{
+    memset(&s_cam, 0, sizeof(s_cam));
+    cam_mode(config->frame_size);
+    return ESP_OK;
+}
+
+esp_err_t esp_camera_set_framesize(framesize_t fsz)
+{
+    cam_catch_up(esp_timer_get_time());
+    cam_mode(fsz);
+    return ESP_OK;
+}
+
+esp_err_t esp_camera_set_window(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t out_w, uint16_t out_h)
+{
+    cam_catch_up(esp_timer_get_time());
+    s_cam.armed_us = esp_timer_get_time() + CONFIG_CAMERA_SETTLE_FRAMES * s_cam.period_us;
+    return ESP_OK;
+}
+
+void esp_camera_settle()
+{
+    int64_t now = esp_timer_get_time();
+    cam_catch_up(now);
+    s_cam.armed_us = cam_vsync(now) + CONFIG_CAMERA_SETTLE_FRAMES * s_cam.period_us;
+}
+
+void esp_camera_do_snap()
+{
+    // the capture restarts, the frame in progress is lost
+    int64_t now = esp_timer_get_time();
+    cam_catch_up(now);
+    s_cam.armed_us = now;
+}
+
+camera_fb_t *esp_camera_fb_get()
+{
+    int64_t now = esp_timer_get_time();
+    if (s_cam.held) {
+        s_cam.st.fb_timeout++;
+        return NULL;
+    }
+    cam_catch_up(now);
+    int64_t start = cam_vsync(now > s_cam.armed_us ? now : s_cam.armed_us);
+    // the frames completed while waiting
+    cam_catch_up(start);
+    host_time_advance(start + s_cam.period_us - now);
+    cam_fill(start);
+    // the hook of esp_camera_fb_get sees the taken frames only
+    if (s_cam.hook) {
+        s_cam.hook(&s_cam.fb, s_cam.hook_arg);
+    }
+    s_cam.held = true;
+    s_cam.st.frames_delivered++;
+    s_cam.st.bytes_delivered += s_cam.fb.len;
+    return &s_cam.fb;
+}
+
+void esp_camera_fb_return(camera_fb_t *fb)
+{
+    s_cam.held = false;
+    s_cam.hook_us = esp_timer_get_time();
+}
+
+void esp_camera_get_stats(camera_stats_t *stats, bool reset)
+{
+    *stats = s_cam.st;
+    stats->avg_frame_size = stats->frames_delivered ? (uint32_t) (stats->bytes_delivered / stats->frames_delivered) : 0;
+    if (reset) {
+        memset(&s_cam.st, 0, sizeof(s_cam.st));
+    }
+}
+
+void esp_camera_flash(int pin, int on_level, uint8_t frames)
+{
+    gpio_set_level(pin, frames ? on_level : !on_level);
+    if (frames) {
+        s_cam.flashes++;
+    }
+}
+
+void esp_camera_set_frame_hook(void (*hook)(const camera_fb_t *fb, void *arg), void *arg)
+{
+    s_cam.hook = hook;
+    s_cam.hook_arg = arg;
+}
+
+/* --- board io --- */
+
+typedef struct {
+    button_cb cb;
+    void *arg;
+} bench_button_t;
+
+static bench_button_t s_buttons[BUTTONS_CNT];
+static int s_button_cnt = 0;
+
+button_handle_t iot_button_create(gpio_num_t gpio_num, button_active_t active_level)
+{
+    if (s_button_cnt == BUTTONS_CNT) {
+        return NULL;
+    }
+    return &s_buttons[s_button_cnt++];
+}
+
+esp_err_t iot_button_set_evt_cb(button_handle_t btn_handle, button_cb_type_t type, button_cb cb, void *arg)
+{
+    if (type == BUTTON_CB_PUSH) {
+        ((bench_button_t *) btn_handle)->cb = cb;
+        ((bench_button_t *) btn_handle)->arg = arg;
+    }
+    return ESP_OK;
+}
+
+/* the steps after the first one are not run, the pins stay taken until stopped */
+static uint64_t s_seq_pins = 0;
+
+esp_err_t out_seq_init()
+{
+    return ESP_OK;
+}
+
+void out_seq_apply(uint64_t set_mask, uint64_t clr_mask)
+{
+    for (int pin = 0; pin < GPIO_NUM_MAX; pin++) {
+        if ((set_mask | clr_mask) & (1ULL << pin)) {
+            gpio_set_level(pin, (set_mask >> pin) & 1);
+        }
+    }
+}
+
+esp_err_t out_seq_start(const out_seq_step_t *steps, size_t cnt, uint32_t repeat)
+{
+    if (cnt == 0 || cnt > OUT_SEQ_MAX_STEPS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    out_seq_apply(steps[0].set_mask, steps[0].clr_mask);
+    s_seq_pins = 0;
+    for (size_t i = 0; i < cnt; i++) {
+        s_seq_pins |= steps[i].set_mask | steps[i].clr_mask;
+    }
+    return ESP_OK;
+}
+
+void out_seq_stop()
+{
+    s_seq_pins = 0;
+}
+
+bool out_seq_busy()
+{
+    return s_seq_pins != 0;
+}
+
+uint64_t out_seq_pins()
+{
+    return s_seq_pins;
+}
+
+/* a steady level, the thresholds are never crossed */
+static adc_probe_events_t s_adc_events;
+
+esp_err_t adc_probe_init(const adc_probe_config_t *cfg, const adc_probe_events_t *ev)
+{
+    s_adc_events = *ev;
+    return ESP_OK;
+}
+
+esp_err_t adc_probe_sample(uint32_t *mv, bool *event)
+{
+    *mv = adc_probe_value();
+    *event = false;
+    return ESP_OK;
+}
+
+uint32_t adc_probe_value()
+{
+    return 1000;
+}
+
+size_t adc_probe_series(uint32_t since_ms, adc_probe_point_t *out, size_t max)
+{
+    return 0;
+}
+
+void adc_probe_set_events(const adc_probe_events_t *ev)
+{
+    s_adc_events = *ev;
+}
+
+void adc_probe_get_events(adc_probe_events_t *ev)
+{
+    *ev = s_adc_events;
+}
+
+/* --- the link and the server --- */
+
+typedef struct {
+    const char *kind;
+    cJSON *params;
+} outmsg_t;
+
+typedef struct {
+    const char *kind;
+    int64_t issued_us;
+} inmsg_t;
+
+static struct {
+    bool connected;
+    bool streaming;
+    int64_t down_until_us;
+    int64_t down_us;
+    uint32_t rng;
+    uint32_t drops;
+    size_t frame_len;
+    // uploads
+    uint32_t frames;
+    uint64_t frame_bytes;
+    uint32_t snaps;
+    uint64_t snap_bytes;
+    uint32_t records;            // pre-event frames, thumbnails, spooled snapshots
+    uint64_t record_bytes;
+    samples_t stream_lat;        // capture to the sent frame
+    samples_t snap_lat;          // request of the server to the uploaded snapshot
+    // messages
+    outmsg_t outbox[BENCH_OUTBOX_MAX];
+    int out_cnt;
+    int out_peak;
+    uint32_t out_sent;
+    uint32_t out_dropped;
+    inmsg_t inbox[BENCH_INBOX_MAX];
+    int in_cnt;
+    uint32_t in_dropped;
+    int64_t snap_req[BENCH_SNAP_REQ_MAX]; // issue times of the delivered "dosnap"
+    int snap_req_cnt;
+    uint32_t snap_requested;
+    uint32_t snap_spooled;
+    uint32_t spooled_msgs;
+    uint32_t preevent_msgs;
+    uint32_t msg_id;
+} s_link;
+
+static double link_random(void)
+{
+    // xorshift32
+    s_link.rng ^= s_link.rng << 13;
+    s_link.rng ^= s_link.rng >> 17;
+    s_link.rng ^= s_link.rng << 5;
+    return (double) s_link.rng / 4294967296.0;
+}
+
+static void link_drop(void)
+{
+    int64_t now = esp_timer_get_time();
+    s_link.connected = false;
+    s_link.streaming = false;
+    s_link.drops++;
+    s_link.down_until_us = now + (int64_t) s_opt.outage_ms * 1000;
+    s_link.down_us += (int64_t) s_opt.outage_ms * 1000;
+    h2pca_locked_CLR_STATE(AUTHORIZED_BIT);
+}
+
+/* reconnects and authorizes the device after the outage */
+static void link_poll(void)
+{
+    if (!s_link.connected && esp_timer_get_time() >= s_link.down_until_us) {
+        s_link.connected = true;
+        h2pca_locked_SET_STATE(AUTHORIZED_BIT);
+    }
+}
+
+/* len bytes to the server and trips of the delay, false - the connection
+   dropped in the middle */
+static bool link_exchange(size_t len, int trips)
+{
+    int64_t cost = (int64_t) trips * s_opt.delay_ms * 1000 + (int64_t) len * 8 * 1000 / s_opt.kbps;
+    if (s_opt.loss > 0 && link_random() < s_opt.loss) {
+        host_time_advance(cost / 2);
+        link_drop();
+        return false;
+    }
+    host_time_advance(cost);
+    return true;
+}
+
+bool h2pc_get_connected(void)
+{
+    link_poll();
+    return s_link.connected;
+}
+
+bool h2pc_get_is_streaming(void)
+{
+    return s_link.streaming;
+}
+
+esp_err_t h2pc_req_send_media_record_sync(char *buf, size_t len)
+{
+    if (!h2pc_get_connected() || !link_exchange(len, 2)) {
+        return ESP_FAIL;
+    }
+    if (s_cam.held && (uint8_t *) buf == s_cam.fb.buf && cam_set() == SET_SNAP) {
+        int64_t now = esp_timer_get_time();
+        s_link.snaps++;
+        s_link.snap_bytes += len;
+        for (int i = 0; i < s_link.snap_req_cnt; i++) {
+            samples_add(&s_link.snap_lat, now - s_link.snap_req[i]);
+        }
+        s_link.snap_req_cnt = 0;
+    } else {
+        s_link.records++;
+        s_link.record_bytes += len;
+    }
+    return ESP_OK;
+}
+
+void h2pc_om_add_msg_res(const char *kind, const char *target, cJSON *params, bool ok)
+{
+    if (s_link.out_cnt == BENCH_OUTBOX_MAX) {
+        s_link.out_dropped++;
+        cJSON_Delete(params);
+        return;
+    }
+    s_link.outbox[s_link.out_cnt].kind = kind;
+    s_link.outbox[s_link.out_cnt].params = params;
+    if (++s_link.out_cnt > s_link.out_peak) {
+        s_link.out_peak = s_link.out_cnt;
+    }
+}
+
+void h2pc_os_prepare_frame(char *buf, size_t len)
+{
+    s_link.frame_len = len;
+}
+
+void h2pc_os_prepare(const char *sub_proto)
+{
+    // the stream request
+    if (h2pc_get_connected() && link_exchange(0, 2)) {
+        s_link.streaming = true;
+    }
+}
+
+void h2pc_os_wait_for_frame(void)
+{
+    if (!s_link.streaming || !link_exchange(s_link.frame_len, 1)) {
+        return;
+    }
+    s_link.frames++;
+    s_link.frame_bytes += s_link.frame_len;
+    samples_add(&s_link.stream_lat, esp_timer_get_time() - fb_time_us(&s_cam.fb));
+}
+
+/* the outgoing messages are counted and deleted */
+static void link_send_msgs(void)
+{
+    for (int i = 0; i < s_link.out_cnt; i++) {
+        if (strcmp(s_link.outbox[i].kind, JSON_RPC_SPOOLED) == 0) {
+            s_link.spooled_msgs++;
+        } else if (strcmp(s_link.outbox[i].kind, JSON_RPC_PREEVENT) == 0) {
+            s_link.preevent_msgs++;
+        }
+        cJSON_Delete(s_link.outbox[i].params);
+    }
+    s_link.out_sent += s_link.out_cnt;
+    s_link.out_cnt = 0;
+}
+
+static void server_request(const char *kind)
+{
+    if (s_link.in_cnt == BENCH_INBOX_MAX) {
+        s_link.in_dropped++;
+        return;
+    }
+    s_link.inbox[s_link.in_cnt].kind = kind;
+    s_link.inbox[s_link.in_cnt].issued_us = esp_timer_get_time();
+    s_link.in_cnt++;
+}
+
+static void deliver(const inmsg_t *m)
+{
+    cJSON *src = cJSON_CreateString(BENCH_SERVER_NAME);
+    cJSON *kind = cJSON_CreateString(m->kind);
+    cJSON *mid = cJSON_CreateNumber(++s_link.msg_id);
+    if (strcmp(m->kind, JSON_RPC_DOSNAP) == 0) {
+        s_link.snap_requested++;
+        if (s_link.snap_req_cnt < BENCH_SNAP_REQ_MAX) {
+            s_link.snap_req[s_link.snap_req_cnt++] = m->issued_us;
+        }
+    }
+    on_incoming_msg(src, kind, NULL, mid);
+    cJSON_Delete(src);
+    cJSON_Delete(kind);
+    cJSON_Delete(mid);
+}
+
+/* --- wch2pcapp --- */
+
+static struct {
+    h2pca_config *cfg;
+    h2pca_status status;
+    h2pca_state state;
+    int64_t recv_next_us;
+    int64_t send_next_us;
+} s_app;
+
+esp_err_t h2pca_init_cfg(h2pca_config *cfg)
+{
+    memset(cfg, 0, sizeof(h2pca_config));
+    return ESP_OK;
+}
+
+h2pca_task *h2pca_new_task(const char *name, h2pca_task_id id, void *user_data, esp_err_t *err)
+{
+    h2pca_task *t = (h2pca_task *) calloc(1, sizeof(h2pca_task));
+    *err = t ? ESP_OK : ESP_ERR_NO_MEM;
+    if (t) {
+        t->name = name;
+        t->id = id;
+        t->user_data = user_data;
+    }
+    return t;
+}
+
+esp_err_t h2pca_task_pool_add_task(h2pca_task_pool *pool, h2pca_task *task)
+{
+    if (pool->cnt == H2PCA_TASKS_MAX) {
+        return ESP_ERR_NO_MEM;
+    }
+    pool->tasks[pool->cnt++] = task;
+    return ESP_OK;
+}
+
+h2pca_status *h2pca_init(h2pca_config *cfg, esp_err_t *err)
+{
+    s_app.cfg = cfg;
+    s_app.status.device_name = BENCH_DEVICE_NAME;
+    *err = ESP_OK;
+    return &s_app.status;
+}
+
+void h2pca_start(int core)
+{
+    int64_t now = esp_timer_get_time();
+    for (int i = 0; i < s_app.cfg->tasks.cnt; i++) {
+        h2pca_task *t = s_app.cfg->tasks.tasks[i];
+        if (s_opt.stream_ms && t->apply_bitmask == MODE_STREAM_NEXT_FRAME) {
+            t->period = s_opt.stream_ms * 1000;
+        }
+        t->next_us = now + t->period;
+    }
+    s_app.recv_next_us = now + s_app.cfg->recv_msgs_period;
+    s_app.send_next_us = now + s_app.cfg->send_msgs_period;
+    s_app.cfg->on_ble_cfg_finished();
+    link_poll();
+}
+
+void h2pca_locked_SET_STATE(uint32_t bits)
+{
+    s_app.state |= bits;
+}
+
+void h2pca_locked_CLR_STATE(uint32_t bits)
+{
+    s_app.state &= ~bits;
+}
+
+bool h2pca_locked_CHK_STATE(uint32_t bits)
+{
+    return (s_app.state & bits) == bits;
+}
+
+/* --- the run --- */
+
+typedef struct {
+    const int *period_ms;
+    int64_t next_us;
+} schedule_t;
+
+enum { EV_SNAP = 0, EV_PREEVENT, EV_BUTTON, EV_THUMB, EV_MAX };
+
+static schedule_t s_sched[EV_MAX] = {
+    { &s_opt.snap_ms, 0 },
+    { &s_opt.preevent_ms, 0 },
+    { &s_opt.button_ms, 0 },
+    { &s_opt.thumb_ms, 0 },
+};
+
+static void server_schedule(int64_t now)
+{
+    for (int i = 0; i < EV_MAX; i++) {
+        if (*s_sched[i].period_ms == 0 || now < s_sched[i].next_us) {
+            continue;
+        }
+        s_sched[i].next_us = now + (int64_t) *s_sched[i].period_ms * 1000;
+        switch (i) {
+        case EV_SNAP:
+            server_request(JSON_RPC_DOSNAP);
+            break;
+        case EV_PREEVENT:
+            server_request(JSON_RPC_PREEVENT);
+            break;
+        case EV_BUTTON:
+            if (s_buttons[0].cb) {
+                s_buttons[0].cb(s_buttons[0].arg);
+            }
+            break;
+        case EV_THUMB:
+            server_request(JSON_RPC_GETTHUMB);
+            break;
+        }
+    }
+}
+
+static void app_recv_msgs(void)
+{
+    if (!h2pc_get_connected() || !link_exchange(0, 2)) {
+        return;
+    }
+    int n = (s_link.in_cnt < (int) s_app.cfg->inmsgs_proceed_chunk) ? s_link.in_cnt : (int) s_app.cfg->inmsgs_proceed_chunk;
+    for (int i = 0; i < n; i++) {
+        deliver(&s_link.inbox[i]);
+    }
+    memmove(s_link.inbox, &s_link.inbox[n], (s_link.in_cnt - n) * sizeof(inmsg_t));
+    s_link.in_cnt -= n;
+}
+
+static void app_send_msgs(void)
+{
+    if (s_link.out_cnt && h2pc_get_connected() && link_exchange(0, 2)) {
+        link_send_msgs();
+    }
+}
+
+static int64_t next_event(int64_t now, int64_t end)
+{
+    int64_t t = end;
+#define BENCH_NEXT(v) do { if ((v) > now && (v) < t) t = (v); } while (0)
+    for (int i = 0; i < s_app.cfg->tasks.cnt; i++) {
+        BENCH_NEXT(s_app.cfg->tasks.tasks[i]->next_us);
+    }
+    for (int i = 0; i < EV_MAX; i++) {
+        if (*s_sched[i].period_ms) {
+            BENCH_NEXT(s_sched[i].next_us);
+        }
+    }
+    BENCH_NEXT(s_app.recv_next_us);
+    BENCH_NEXT(s_app.send_next_us);
+    if (!s_link.connected) {
+        BENCH_NEXT(s_link.down_until_us);
+    }
+#undef BENCH_NEXT
+    return (t > now) ? t : now + 1000;
+}
+
+static void bench_run(void)
+{
+    int64_t end = esp_timer_get_time() + (int64_t) s_opt.seconds * 1000000;
+    while (esp_timer_get_time() < end) {
+        int64_t now = esp_timer_get_time();
+        link_poll();
+        server_schedule(now);
+        if (now >= s_app.recv_next_us) {
+            s_app.recv_next_us = now + s_app.cfg->recv_msgs_period;
+            app_recv_msgs();
+        }
+        for (int i = 0; i < s_app.cfg->tasks.cnt; i++) {
+            h2pca_task *t = s_app.cfg->tasks.tasks[i];
+            if (esp_timer_get_time() >= t->next_us) {
+                t->next_us = esp_timer_get_time() + t->period;
+                h2pca_locked_SET_STATE(t->apply_bitmask);
+            }
+            if (h2pca_locked_CHK_STATE(t->apply_bitmask | t->req_bitmask)) {
+                uint32_t restart = 0;
+                t->on_sync(t->id, s_app.state, t->user_data, &restart);
+            }
+        }
+        s_app.cfg->on_finish_step();
+        if (s_link.snap_req_cnt && !h2pca_locked_CHK_STATE(MODE_SEND_FB)) {
+            // the snapshot is done without the upload - spooled
+            s_link.snap_spooled += s_link.snap_req_cnt;
+            s_link.snap_req_cnt = 0;
+        }
+        if (esp_timer_get_time() >= s_app.send_next_us) {
+            s_app.send_next_us = esp_timer_get_time() + s_app.cfg->send_msgs_period;
+            app_send_msgs();
+        }
+        cam_catch_up(esp_timer_get_time());
+        if (esp_timer_get_time() == now) {
+            host_time_advance(next_event(now, end) - now);
+        }
+    }
+}
+
+/* the response to the message of the server, taken from the outbox at once */
+static cJSON *bench_query(const char *kind)
+{
+    inmsg_t m = { kind, esp_timer_get_time() };
+    link_send_msgs();
+    deliver(&m);
+    if (s_link.out_cnt == 0) {
+        return NULL;
+    }
+    cJSON *params = s_link.outbox[--s_link.out_cnt].params;
+    s_link.out_sent++;
+    return params;
+}
+
+/* --- payloads --- */
+
+static bool load_payload(const char *path)
+{
+    if (s_payload_cnt[SET_STREAM] == BENCH_PAYLOADS_MAX) {
+        fprintf(stderr, "%s: too many payloads\n", path);
+        return false;
+    }
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        return false;
+    }
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *buf = (uint8_t *) malloc(len > 0 ? len : 1);
+    bool ok = buf && len > 4 && fread(buf, 1, len, f) == (size_t) len && buf[0] == 0xFF && buf[1] == 0xD8;
+    fclose(f);
+    if (!ok) {
+        fprintf(stderr, "%s: not a JPEG file\n", path);
+        free(buf);
+        return false;
+    }
+    // the recordings serve both modes
+    for (int set = 0; set < SET_MAX; set++) {
+        s_payloads[set][s_payload_cnt[set]].buf = buf;
+        s_payloads[set][s_payload_cnt[set]].len = len;
+        s_payload_cnt[set]++;
+    }
+    return true;
+}
+
+/* scenes of the frame size: gradient, a moving box and noise */
+static bool make_payloads(payload_set_t set, framesize_t fsz, int cnt)
+{
+    uint16_t w = resolution[fsz].width;
+    uint16_t h = resolution[fsz].height;
+    uint8_t *rgb = (uint8_t *) malloc((size_t) w * h * 3);
+    uint32_t seed = 12345;
+    if (rgb == NULL) {
+        return false;
+    }
+    for (int n = 0; n < cnt; n++) {
+        uint16_t bx = w / 8 + n * w / (2 * cnt), by = h / 4;
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                uint8_t *p = &rgb[((size_t) y * w + x) * 3];
+                seed = seed * 1103515245 + 12345;
+                uint8_t noise = (seed >> 24) & 0x0F;
+                bool box = x >= bx && x < bx + w / 4 && y >= by && y < by + h / 3;
+                p[0] = box ? 200 : (uint8_t) (x * 255 / w) ^ noise;
+                p[1] = box ? 40 + n * 30 : (uint8_t) (y * 255 / h) + noise;
+                p[2] = (uint8_t) ((x + y + n * 16) & 0xFF);
+            }
+        }
+        if (!fmt2jpg(rgb, (size_t) w * h * 3, w, h, PIXFORMAT_RGB888, 60,
+                     &s_payloads[set][n].buf, &s_payloads[set][n].len)) {
+            free(rgb);
+            return false;
+        }
+        s_payload_cnt[set]++;
+    }
+    free(rgb);
+    return true;
+}
+
+/* --- the report --- */
+
+typedef struct {
+    uint32_t count;
+    double bytes;
+    int lat[4];                  // p50, p90, p99, max
+} dev_perf_t;
+
+static void get_dev_perf(const cJSON *stats, const char *name, dev_perf_t *p)
+{
+    memset(p, 0, sizeof(dev_perf_t));
+    cJSON *perf = stats ? cJSON_GetObjectItem(stats, name) : NULL;
+    cJSON *count = cJSON_GetObjectItem(perf, JSON_RPC_COUNT);
+    cJSON *bytes = cJSON_GetObjectItem(perf, JSON_RPC_BYTES);
+    cJSON *lat = cJSON_GetObjectItem(perf, JSON_RPC_LAT);
+    p->count = count ? count->valueint : 0;
+    p->bytes = bytes ? bytes->valuedouble : 0;
+    for (int i = 0; i < 4; i++) {
+        cJSON *v = cJSON_GetArrayItem(lat, i);
+        p->lat[i] = v ? v->valueint : 0;
+    }
+}
+
+static void print_lat(const char *name, samples_t *s, const dev_perf_t *dev)
+{
+    printf("  %s latency ms: p50 %u, p90 %u, p99 %u, max %u", name,
+           samples_pct(s, 50), samples_pct(s, 90), samples_pct(s, 99), samples_pct(s, 100));
+    if (dev) {
+        printf(" (device: %d, %d, %d, %d)", dev->lat[0], dev->lat[1], dev->lat[2], dev->lat[3]);
+    }
+    printf("\n");
+}
+
+/* the device percentile is the top of its bucket - up to 1/4 above */
+static bool check_pct(const char *name, samples_t *s, int dev, uint32_t pct)
+{
+    uint32_t exact = samples_pct(s, pct);
+    if ((uint32_t) dev < exact || (uint32_t) dev > exact + exact / 4 + 1) {
+        fprintf(stderr, "FAIL: %s p%u %d ms, %u ms expected\n", name, pct, dev, exact);
+        return false;
+    }
+    return true;
+}
+
+static bool check_perf(const char *name, samples_t *s, uint32_t count, uint64_t bytes, const dev_perf_t *dev)
+{
+    if (dev->count != count || dev->bytes != (double) bytes) {
+        fprintf(stderr, "FAIL: %s %u uploads of %.0f bytes by the device, %u of %llu by the server\n",
+                name, dev->count, dev->bytes, count, (unsigned long long) bytes);
+        return false;
+    }
+    // NULL - the server sees other latencies than the device
+    if (count == 0 || s == NULL) {
+        return true;
+    }
+    return check_pct(name, s, dev->lat[0], 50) && check_pct(name, s, dev->lat[1], 90) &&
+           check_pct(name, s, dev->lat[2], 99) && (uint32_t) dev->lat[3] == samples_pct(s, 100);
+}
+
+static void print_payloads(const char *name, payload_set_t set)
+{
+    size_t min_len = SIZE_MAX, max_len = 0;
+    for (int i = 0; i < s_payload_cnt[set]; i++) {
+        min_len = s_payloads[set][i].len < min_len ? s_payloads[set][i].len : min_len;
+        max_len = s_payloads[set][i].len > max_len ? s_payloads[set][i].len : max_len;
+    }
+    printf("%s: %d payloads of %u..%u bytes\n", name, s_payload_cnt[set], (unsigned) min_len, (unsigned) max_len);
+}
+
+static int bench_report(double host_s)
+{
+    double secs = s_opt.seconds;
+    cJSON *stats = bench_query(JSON_RPC_GETSTATS);
+    cJSON *mem = bench_query(JSON_RPC_GETMEM);
+    dev_perf_t dev_stream, dev_snap;
+    get_dev_perf(stats, JSON_RPC_STREAM, &dev_stream);
+    get_dev_perf(stats, JSON_RPC_SNAP, &dev_snap);
+
+    print_payloads("stream", SET_STREAM);
+    print_payloads("snap", SET_SNAP);
+    printf("link: delay %d ms, %d kbit/s, loss %.1f%%, outage %d ms - %u drops, %.1f s down\n",
+           s_opt.delay_ms, s_opt.kbps, s_opt.loss * 100, s_opt.outage_ms, s_link.drops, s_link.down_us / 1e6);
+    printf("stream: %u frames, %.2f fps, %.0f B/s\n", s_link.frames, s_link.frames / secs, s_link.frame_bytes / secs);
+    print_lat("capture to sent", &s_link.stream_lat, &dev_stream);
+    printf("snap: %u requested, %u uploaded, %u spooled, %u lit; %.0f B/s\n", s_link.snap_requested,
+           s_link.snaps, s_link.snap_spooled, s_cam.flashes, s_link.snap_bytes / secs);
+    print_lat("request to upload", &s_link.snap_lat, NULL);
+    printf("  device (receipt to upload) ms: p50 %d, p90 %d, p99 %d, max %d\n",
+           dev_snap.lat[0], dev_snap.lat[1], dev_snap.lat[2], dev_snap.lat[3]);
+    printf("records: %u (pre-event, thumbnails, spooled), %.0f B/s; spool: %u sent, %u pending\n",
+           s_link.records, s_link.record_bytes / secs, s_link.spooled_msgs, (unsigned) frame_spool_pending());
+    printf("messages: %u sent, %u dropped, outbox peak %d; %u pre-event, %d not polled\n",
+           s_link.out_sent, s_link.out_dropped + s_link.in_dropped, s_link.out_peak, s_link.preevent_msgs, s_link.in_cnt);
+
+    printf("peak memory:");
+    for (int t = 0; t < WC_MEM_TAG_MAX; t++) {
+        cJSON *tag = cJSON_GetObjectItem(mem, wc_mem_tag_name(t));
+        for (int c = 0; c < WC_MEM_CLASS_MAX; c++) {
+            cJSON *peak = cJSON_GetArrayItem(cJSON_GetObjectItem(tag, wc_mem_class_name(c)), 1);
+            if (peak && peak->valueint) {
+                printf(" %s/%s %d,", wc_mem_tag_name(t), wc_mem_class_name(c), peak->valueint);
+            }
+        }
+    }
+    size_t cjson_cur, cjson_peak;
+    cJSON_Delete(stats);
+    cJSON_Delete(mem);
+    host_cjson_get_usage(&cjson_cur, &cjson_peak);
+    printf(" cJSON %u bytes\n", (unsigned) cjson_peak);
+    printf("host: %.2f s for %.1f s virtual\n", host_s, secs);
+
+    bool ok = check_perf("stream", &s_link.stream_lat, s_link.frames, s_link.frame_bytes, &dev_stream) &
+              check_perf("snap", NULL, s_link.snaps, s_link.snap_bytes, &dev_snap);
+    if (s_link.frames == 0) {
+        fprintf(stderr, "FAIL: no stream frames\n");
+        ok = false;
+    }
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    host_log_level = ESP_LOG_ERROR;
+    while ((opt = getopt(argc, argv, "t:f:S:d:b:l:o:s:p:k:g:r:F:v")) != -1) {
+        switch (opt) {
+        case 't': s_opt.seconds = atoi(optarg); break;
+        case 'f': s_opt.fps = atoi(optarg); break;
+        case 'S': s_opt.stream_ms = atoi(optarg); break;
+        case 'd': s_opt.delay_ms = atoi(optarg); break;
+        case 'b': s_opt.kbps = atoi(optarg); break;
+        case 'l': s_opt.loss = atof(optarg) / 100; break;
+        case 'o': s_opt.outage_ms = atoi(optarg); break;
+        case 's': s_opt.snap_ms = atoi(optarg); break;
+        case 'p': s_opt.preevent_ms = atoi(optarg); break;
+        case 'k': s_opt.button_ms = atoi(optarg); break;
+        case 'g': s_opt.thumb_ms = atoi(optarg); break;
+        case 'r': s_opt.seed = strtoul(optarg, NULL, 0); break;
+        case 'F': s_opt.spool_path = optarg; break;
+        case 'v': host_log_level = ESP_LOG_INFO; break;
+        default:
+            fprintf(stderr, "usage: bench_device [-t seconds] [-f fps] [-S stream ms] [-d delay ms] "
+                            "[-b kbit/s] [-l loss %%] [-o outage ms] [-s snap ms] [-p pre-event ms] "
+                            "[-k button ms] [-g thumb ms] [-r seed] [-F spool file] [-v] [frame.jpg ...]\n");
+            return 2;
+        }
+    }
+    if (s_opt.seconds <= 0 || s_opt.fps <= 0 || s_opt.stream_ms < 0 || s_opt.delay_ms < 0 || s_opt.kbps <= 0 ||
+        s_opt.loss < 0 || s_opt.loss > 1 || s_opt.outage_ms < 0 || s_opt.snap_ms < 0 || s_opt.preevent_ms < 0 ||
+        s_opt.button_ms < 0 || s_opt.thumb_ms < 0) {
+        fprintf(stderr, "bad options\n");
+        return 2;
+    }
+    s_link.rng = s_opt.seed ? s_opt.seed : 1;
+    for (int i = optind; i < argc; i++) {
+        if (!load_payload(argv[i])) {
+            return 2;
+        }
+    }
+    if (s_payload_cnt[SET_STREAM] == 0 &&
+        (!make_payloads(SET_STREAM, CAM_STREAM_FRAMESIZE, 4) || !make_payloads(SET_SNAP, CAM_SNAP_FRAMESIZE, 2))) {
+        fprintf(stderr, "payloads are not encoded\n");
+        return 2;
+    }
+    if (host_partition_open(CONFIG_WC_SPOOL_PARTITION, s_opt.spool_path, BENCH_PART_SIZE, true) != ESP_OK) {
+        fprintf(stderr, "%s: spool partition is not opened\n", s_opt.spool_path);
+        return 2;
+    }
+
+    clock_t start = clock();
+    app_main();
+    bench_run();
+    int res = bench_report((double) (clock() - start) / CLOCKS_PER_SEC);
+
+    host_partition_close(CONFIG_WC_SPOOL_PARTITION);
+    return res;
+}
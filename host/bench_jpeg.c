@@ -0,0 +1,303 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+/* The stripe encoder of to_jpg.c against libjpeg: a VGA frame is encoded
+   from every pixel format the camera gives out, the time, the size and the
+   PSNR of the decoded frame are reported. libjpeg (4:2:0, standard tables,
+   the same quality) encodes the RGB and the gray frame as the reference.
+   The times are of the host CPU.
+
+   PSNR is taken against the source frame - of R, G and B for the color
+   formats (the loss of RGB565 and of the YUV conversion included), of the
+   luma for GRAYSCALE.
+
+   usage: bench_jpeg [options] [frame.ppm]
+     -n iterations (20)                     -q quality (80)
+     -d max dB below the reference (0.5)    -r max size over the reference, % (10)
+   Without the file the frame is a synthetic scene of gradients, shapes
+   and noise. Exits with 1 if a frame is not encoded or decoded, or the
+   RGB888 / GRAYSCALE frames are worse than the reference by -d or -r */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <jpeglib.h>
+#include "img_converters.h"
+
+#define WIDTH   640
+#define HEIGHT  480
+#define PIXELS  (WIDTH * HEIGHT)
+
+static uint8_t s_rgb[PIXELS * 3];   // R, G, B
+static uint8_t s_luma[PIXELS];
+static int s_failed = 0;
+
+static uint8_t clamp8(double v)
+{
+    return v < 0 ? 0 : (v > 255 ? 255 : (uint8_t) (v + 0.5));
+}
+
+static void make_luma(void)
+{
+    for (int i = 0; i < PIXELS; i++) {
+        const uint8_t * p = &s_rgb[i * 3];
+        s_luma[i] = clamp8(0.299 * p[0] + 0.587 * p[1] + 0.114 * p[2]);
+    }
+}
+
+static bool load_ppm(const char * path)
+{
+    FILE * f = fopen(path, "rb");
+    int w, h, maxv;
+    if (f == NULL) {
+        return false;
+    }
+    bool ok = fscanf(f, "P6 %d %d %d", &w, &h, &maxv) == 3 && fgetc(f) != EOF &&
+              w == WIDTH && h == HEIGHT && maxv == 255 &&
+              fread(s_rgb, 1, sizeof(s_rgb), f) == sizeof(s_rgb);
+    fclose(f);
+    return ok;
+}
+
+/* sky gradient, discs, a striped board and sensor noise */
+static void make_scene(void)
+{
+    uint32_t seed = 12345;
+    for (int y = 0; y < HEIGHT; y++) {
+        for (int x = 0; x < WIDTH; x++) {
+            uint8_t * p = &s_rgb[(y * WIDTH + x) * 3];
+            double r = 60 + 120.0 * y / HEIGHT, g = 90 + 100.0 * x / WIDTH, b = 200 - 80.0 * y / HEIGHT;
+            int dx = x - 200, dy = y - 260;
+            if (dx * dx + dy * dy < 110 * 110) {
+                r = 210 - dy * 0.3;
+                g = 120 + dx * 0.2;
+                b = 40;
+            }
+            dx = x - 470;
+            dy = y - 150;
+            if (dx * dx + dy * dy < 70 * 70) {
+                r = g = b = 235 - (dx * dx + dy * dy) / 40.0;
+            }
+            if (x >= 360 && x < 600 && y >= 300 && y < 440) {
+                int v = (((x / 6) + (y / 10)) & 1) ? 30 : 220;
+                r = g = b = v;
+            }
+            seed = seed * 1103515245 + 12345;
+            int noise = (int) ((seed >> 24) & 0x0F) - 8;
+            p[0] = clamp8(r + noise);
+            p[1] = clamp8(g + noise);
+            p[2] = clamp8(b + noise);
+        }
+    }
+}
+
+/* the frame as the camera gives it out in the format */
+static size_t convert(pixformat_t format, uint8_t * out)
+{
+    for (int i = 0; i < PIXELS; i++) {
+        const uint8_t * p = &s_rgb[i * 3];
+        switch (format) {
+        case PIXFORMAT_RGB888: // stored as BGR
+            out[i * 3] = p[2];
+            out[i * 3 + 1] = p[1];
+            out[i * 3 + 2] = p[0];
+            break;
+        case PIXFORMAT_RGB565:
+            out[i * 2] = (p[0] & 0xF8) | (p[1] >> 5);
+            out[i * 2 + 1] = ((p[1] << 3) & 0xE0) | (p[2] >> 3);
+            break;
+        case PIXFORMAT_YUV422: // Y0 U Y1 V, the chroma of the pair is averaged
+            out[i * 2] = s_luma[i];
+            if (i & 1) {
+                const uint8_t * q = p - 3;
+                double r = (p[0] + q[0]) / 2.0, g = (p[1] + q[1]) / 2.0, b = (p[2] + q[2]) / 2.0;
+                out[i * 2 - 1] = clamp8(-0.168736 * r - 0.331264 * g + 0.5 * b + 128);
+                out[i * 2 + 1] = clamp8(0.5 * r - 0.418688 * g - 0.081312 * b + 128);
+            }
+            break;
+        default:
+            out[i] = s_luma[i];
+            break;
+        }
+    }
+    return (size_t) PIXELS * (format == PIXFORMAT_RGB888 ? 3 : (format == PIXFORMAT_GRAYSCALE ? 1 : 2));
+}
+
+/* decoded by libjpeg to RGB or to gray */
+static bool decode(const uint8_t * jpg, size_t len, bool gray, uint8_t * out)
+{
+    struct jpeg_decompress_struct d;
+    struct jpeg_error_mgr err;
+    d.err = jpeg_std_error(&err);
+    jpeg_create_decompress(&d);
+    jpeg_mem_src(&d, (unsigned char *) jpg, len);
+    bool ok = jpeg_read_header(&d, TRUE) == JPEG_HEADER_OK;
+    if (ok) {
+        d.out_color_space = gray ? JCS_GRAYSCALE : JCS_RGB;
+        jpeg_start_decompress(&d);
+        ok = d.output_width == WIDTH && d.output_height == HEIGHT;
+        while (ok && d.output_scanline < d.output_height) {
+            JSAMPROW row = out + (size_t) d.output_scanline * WIDTH * d.output_components;
+            jpeg_read_scanlines(&d, &row, 1);
+        }
+        jpeg_abort_decompress(&d);
+    }
+    jpeg_destroy_decompress(&d);
+    return ok;
+}
+
+static size_t ref_encode(bool gray, int quality, unsigned char ** out)
+{
+    struct jpeg_compress_struct c;
+    struct jpeg_error_mgr err;
+    unsigned long len = 0;
+    *out = NULL;
+    c.err = jpeg_std_error(&err);
+    jpeg_create_compress(&c);
+    jpeg_mem_dest(&c, out, &len);
+    c.image_width = WIDTH;
+    c.image_height = HEIGHT;
+    c.input_components = gray ? 1 : 3;
+    c.in_color_space = gray ? JCS_GRAYSCALE : JCS_RGB;
+    jpeg_set_defaults(&c);
+    jpeg_set_quality(&c, quality, TRUE);
+    jpeg_start_compress(&c, TRUE);
+    while (c.next_scanline < HEIGHT) {
+        JSAMPROW row = gray ? &s_luma[c.next_scanline * WIDTH] : &s_rgb[c.next_scanline * WIDTH * 3];
+        jpeg_write_scanlines(&c, &row, 1);
+    }
+    jpeg_finish_compress(&c);
+    jpeg_destroy_compress(&c);
+    return len;
+}
+
+static double psnr(const uint8_t * a, const uint8_t * b, size_t len)
+{
+    double se = 0;
+    for (size_t i = 0; i < len; i++) {
+        double d = (double) a[i] - b[i];
+        se += d * d;
+    }
+    return se ? 10 * log10(255.0 * 255.0 * len / se) : 99.0;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+typedef struct {
+    size_t len;
+    double db;
+} jpg_result_t;
+
+static jpg_result_t s_ref[2];       // RGB, gray
+
+static void bench_reference(int quality)
+{
+    static uint8_t dec[PIXELS * 3];
+    for (int gray = 0; gray < 2; gray++) {
+        unsigned char * jpg;
+        s_ref[gray].len = ref_encode(gray, quality, &jpg);
+        if (!decode(jpg, s_ref[gray].len, gray, dec)) {
+            fprintf(stderr, "FAIL: libjpeg %s frame is not decoded\n", gray ? "gray" : "RGB");
+            s_failed++;
+        }
+        s_ref[gray].db = psnr(dec, gray ? s_luma : s_rgb, gray ? PIXELS : PIXELS * 3);
+        printf("%-10s %8s %7u B %6.2f dB\n", "libjpeg", gray ? "GRAY" : "RGB", (unsigned) s_ref[gray].len, s_ref[gray].db);
+        free(jpg);
+    }
+}
+
+static void bench_format(const char * name, pixformat_t format, int quality, int iters, double max_db, int max_size)
+{
+    static uint8_t src[PIXELS * 3];
+    static uint8_t dec[PIXELS * 3];
+    bool gray = (format == PIXFORMAT_GRAYSCALE);
+    size_t src_len = convert(format, src);
+    uint8_t * jpg = NULL;
+    size_t len = 0;
+
+    double t0 = now_ns();
+    for (int i = 0; i < iters; i++) {
+        free(jpg);
+        jpg = NULL;
+        if (!fmt2jpg(src, src_len, WIDTH, HEIGHT, format, quality, &jpg, &len)) {
+            fprintf(stderr, "FAIL: %s frame is not encoded\n", name);
+            s_failed++;
+            return;
+        }
+    }
+    double ms = (now_ns() - t0) / iters / 1e6;
+
+    jpg_result_t res = { len, 0 };
+    if (!decode(jpg, len, gray, dec)) {
+        fprintf(stderr, "FAIL: %s frame is not decoded\n", name);
+        s_failed++;
+    } else {
+        res.db = psnr(dec, gray ? s_luma : s_rgb, gray ? PIXELS : PIXELS * 3);
+    }
+    free(jpg);
+
+    const jpg_result_t * ref = &s_ref[gray];
+    printf("%-10s %8.2f ms %7u B %6.2f dB  (%+.1f%%, %+.2f dB)\n", name, ms, (unsigned) res.len, res.db,
+           100.0 * ((double) res.len - ref->len) / ref->len, res.db - ref->db);
+    // the formats with the same input as the reference are held to it
+    if (format == PIXFORMAT_RGB888 || gray) {
+        if (res.db < ref->db - max_db || res.len * 100 > ref->len * (100 + max_size)) {
+            fprintf(stderr, "FAIL: %s is worse than libjpeg\n", name);
+            s_failed++;
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int iters = 20, quality = 80, max_size = 10;
+    double max_db = 0.5;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:q:d:r:")) != -1) {
+        switch (opt) {
+        case 'n': iters = atoi(optarg); break;
+        case 'q': quality = atoi(optarg); break;
+        case 'd': max_db = atof(optarg); break;
+        case 'r': max_size = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: bench_jpeg [-n iterations] [-q quality] [-d dB] [-r %%] [frame.ppm]\n");
+            return 2;
+        }
+    }
+    if (iters < 1 || quality < 1 || quality > 100) {
+        fprintf(stderr, "bad options\n");
+        return 2;
+    }
+    if (optind < argc) {
+        if (!load_ppm(argv[optind])) {
+            fprintf(stderr, "%s: not a %dx%d binary PPM\n", argv[optind], WIDTH, HEIGHT);
+            return 2;
+        }
+    } else {
+        make_scene();
+    }
+    make_luma();
+
+    printf("%dx%d, quality %d, %d iterations\n", WIDTH, HEIGHT, quality, iters);
+    bench_reference(quality);
+    bench_format("RGB888", PIXFORMAT_RGB888, quality, iters, max_db, max_size);
+    bench_format("RGB565", PIXFORMAT_RGB565, quality, iters, max_db, max_size);
+    bench_format("YUV422", PIXFORMAT_YUV422, quality, iters, max_db, max_size);
+    bench_format("GRAYSCALE", PIXFORMAT_GRAYSCALE, quality, iters, max_db, max_size);
+    return s_failed ? 1 : 0;
+}
@@ -0,0 +1,167 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+/* The motion kernels against their scalar references: every kernel is
+   checked on random and edge frames for all thresholds, then timed.
+   The host compiler vectorizes the scalar loops, so the times show the
+   host CPU only - on ESP32 the kernels do 4 pixels per operation.
+
+   usage: bench_motion [iterations] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "motion.h"
+
+#define WIDTH   160
+#define HEIGHT  120
+#define LEN     (WIDTH * HEIGHT)
+
+static uint32_t s_frame_a[LEN / 4];
+static uint32_t s_frame_b[LEN / 4];
+static int s_failed = 0;
+
+static size_t ref_diff_count(const uint8_t * a, const uint8_t * b, size_t len, uint8_t threshold)
+{
+    size_t cnt = 0;
+    for (size_t i = 0; i < len; i++) {
+        int d = (a[i] >> 1) - (b[i] >> 1);
+        cnt += abs(d) > (threshold >> 1);
+    }
+    return cnt;
+}
+
+static uint32_t ref_sum(const uint8_t * p, size_t len)
+{
+    uint32_t s = 0;
+    for (size_t i = 0; i < len; i++) {
+        s += p[i];
+    }
+    return s;
+}
+
+static void ref_histogram(const uint8_t * p, size_t len, uint32_t * hist)
+{
+    for (size_t i = 0; i < len; i++) {
+        hist[p[i] * MOTION_HIST_BINS / 256]++;
+    }
+}
+
+static uint32_t rnd(void)
+{
+    static uint32_t x = 2463534242u;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+/* random, saturated and close frames */
+static void fill(int pattern, uint8_t * a, uint8_t * b)
+{
+    for (size_t i = 0; i < LEN; i++) {
+        uint8_t v = (uint8_t) rnd();
+        switch (pattern) {
+        case 0:
+            a[i] = v;
+            b[i] = (uint8_t) rnd();
+            break;
+        case 1:
+            a[i] = (v & 1) ? 0xFF : 0;
+            b[i] = (v & 2) ? 0xFF : 0;
+            break;
+        default:
+            a[i] = v;
+            b[i] = (uint8_t) (v + (int8_t) (rnd() % 9 - 4));
+            break;
+        }
+    }
+}
+
+static void check(void)
+{
+    uint8_t * a = (uint8_t *) s_frame_a;
+    uint8_t * b = (uint8_t *) s_frame_b;
+    for (int pattern = 0; pattern < 3; pattern++) {
+        fill(pattern, a, b);
+        for (int t = 0; t < 256; t++) {
+            size_t got = motion_diff_count(a, b, LEN, (uint8_t) t);
+            size_t exp = ref_diff_count(a, b, LEN, (uint8_t) t);
+            if (got != exp) {
+                fprintf(stderr, "FAIL: diff_count pattern %d threshold %d: %u, expected %u\n",
+                        pattern, t, (unsigned) got, (unsigned) exp);
+                s_failed++;
+            }
+        }
+        if (motion_sum(a, LEN) != ref_sum(a, LEN)) {
+            fprintf(stderr, "FAIL: sum pattern %d\n", pattern);
+            s_failed++;
+        }
+        uint32_t h[MOTION_HIST_BINS] = { 0 }, h_ref[MOTION_HIST_BINS] = { 0 };
+        motion_histogram(a, LEN, h);
+        ref_histogram(a, LEN, h_ref);
+        if (memcmp(h, h_ref, sizeof(h)) != 0) {
+            fprintf(stderr, "FAIL: histogram pattern %d\n", pattern);
+            s_failed++;
+        }
+    }
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* the results are summed, so the calls are not optimized away */
+static volatile uint32_t s_sink;
+
+#define BENCH(name, iters, call, ref_call) do {                                 \
+        double t0 = now_ns();                                                   \
+        for (int i = 0; i < iters; i++) s_sink += (uint32_t) (call);            \
+        double t1 = now_ns();                                                   \
+        for (int i = 0; i < iters; i++) s_sink += (uint32_t) (ref_call);        \
+        double t2 = now_ns();                                                   \
+        printf("%-14s %8.3f ns/px, scalar %8.3f ns/px, x%.1f\n", name,          \
+               (t1 - t0) / iters / LEN, (t2 - t1) / iters / LEN, (t2 - t1) / (t1 - t0)); \
+    } while (0)
+
+int main(int argc, char **argv)
+{
+    int iters = (argc > 1) ? atoi(argv[1]) : 200;
+    uint8_t * a = (uint8_t *) s_frame_a;
+    uint8_t * b = (uint8_t *) s_frame_b;
+
+    check();
+    printf("motion kernels: %s\n", s_failed ? "MISMATCH" : "match the scalar reference");
+
+    fill(0, a, b);
+    uint32_t h[MOTION_HIST_BINS];
+    printf("%dx%d gray frame, %d iterations\n", WIDTH, HEIGHT, iters);
+    BENCH("diff_count", iters, motion_diff_count(a, b, LEN, 24), ref_diff_count(a, b, LEN, 24));
+    BENCH("sum", iters, motion_sum(a, LEN), ref_sum(a, LEN));
+    BENCH("histogram", iters, (motion_histogram(a, LEN, h), h[0]), (ref_histogram(a, LEN, h), h[0]));
+
+    // the whole probe: the first frame only becomes the reference
+    motion_result_t res;
+    if (motion_init(WIDTH, HEIGHT, 20) != ESP_OK) {
+        fprintf(stderr, "FAIL: motion_init\n");
+        return 1;
+    }
+    motion_process(b, LEN, 24, 10, &res);
+    double t0 = now_ns();
+    for (int i = 0; i < iters; i++) {
+        motion_process((i & 1) ? b : a, LEN, 24, 10, &res);
+    }
+    printf("%-14s %8.1f us/frame\n", "motion_process", (now_ns() - t0) / iters / 1000);
+    return s_failed ? 1 : 0;
+}
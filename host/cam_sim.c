@@ -0,0 +1,957 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+/* The JPEG capture of cam_hal.c against a fake ll_cam in virtual time.
+
+   The sensor sends the payload of each frame evenly between the VSYNCs
+   (less the blanking at both ends). The fake DMA stores every byte as a
+   4 byte sample into the ring of half buffers like the I2S of ESP32 and
+   raises EOF when a half buffer is full. The VSYNC and EOF events go
+   through ll_cam_send_event, cam_task is woken after the wake latency
+   and runs the real cam_next_event/cam_task_step; the copies cost virtual
+   time per DMA byte. A consumer on the other core polls cam_take, checks
+   every frame against the payload the sensor sent and gives it back after
+   the hold time. The interrupts are handled in the order of their times,
+   the ones that fall inside a cam_task step are seen from the next call
+   to ll_cam_* or at the end of the step.
+
+   Trace lines (# - comment):
+     vsync <us> [payload]  the VSYNC of a frame, the payload index in the
+                           order of the files (default - round robin)
+     stall <us> <us>       cam_task does not run from the time for the duration
+     settle <us>           the consumer calls cam_settle, the frames started
+                           before the next CONFIG_CAMERA_SETTLE_FRAMES frames
+                           must not be delivered
+   Without vsync lines the VSYNCs are generated by -f and -n.
+
+   usage: cam_sim [options] [frame.jpg ...]
+     -t file   trace                        -n frames (300)
+     -f fps (15)                            -s frame size index (VGA)
+     -b frame buffers (2)                   -g buffer:half DMA geometry
+     -k blanking us (2000)                  -c copy ns per DMA byte (2.5)
+     -w cam_task wake latency us (30)       -e cam_task step us (5)
+     -p consumer poll us (5000)             -o consumer hold us (0)
+     -d min dropped frames                  -D max dropped frames
+     -r cycles of cam_reconfig and cam_deinit/cam_config instead of the
+        capture, the largest free blocks must not shrink and every frame
+        size gets its own DMA layout
+     -v logs of cam_hal
+   Prints the host time of cam_take and of its cam_check_jpeg per delivered
+   frame; cam_sim_nocheck is built without CONFIG_CAMERA_JPEG_VALIDATE.
+   Without the files the payloads are synthetic scenes encoded by to_jpg.c.
+   Exits with 1 if a delivered frame differs from the payload or was not
+   settled, or the dropped frames are out of -d..-D */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "host_shim.h"
+#include "../main/cam_hal.c"
+
+#define SIM_PAYLOADS_MAX 16
+#define SIM_STALLS_MAX   64
+#define SIM_SETTLES_MAX  64
+#define SIM_CAM_CORE     0
+#define SIM_APP_CORE     1
+
+typedef struct {
+    uint8_t *buf;
+    size_t len;
+} sim_payload_t;
+
+typedef struct {
+    int64_t t;
+    int payload;                 // -1 - no data after the VSYNC
+} sim_vsync_t;
+
+typedef struct {
+    int64_t t;
+    int64_t dur;
+} sim_stall_t;
+
+static struct {
+    int frames;
+    int fps;
+    framesize_t frame_size;
+    int fb_count;
+    cam_dma_geometry_t geometry;
+    int64_t blank_us;
+    double copy_ns;
+    int64_t wake_us;
+    int64_t step_us;
+    int64_t poll_us;
+    int64_t hold_us;
+    int min_drops;
+    int max_drops;
+} s_opt = {
+    .frames = 300,
+    .fps = 15,
+    .frame_size = FRAMESIZE_VGA,
+    .fb_count = 2,
+    .blank_us = 2000,
+    .copy_ns = 2.5,
+    .wake_us = 30,
+    .step_us = 5,
+    .poll_us = 5000,
+    .hold_us = 0,
+    .min_drops = 0,
+    .max_drops = -1,
+};
+
+static sim_payload_t s_payloads[SIM_PAYLOADS_MAX];
+static int s_payload_cnt = 0;
+static sim_vsync_t *s_vsync = NULL;
+static int s_vsync_cnt = 0;
+static sim_stall_t s_stalls[SIM_STALLS_MAX];
+static int s_stall_cnt = 0;
+static int64_t s_settles[SIM_SETTLES_MAX];
+static int s_settle_cnt = 0;
+
+/* sensor and DMA */
+static struct {
+    int next_vsync;              // VSYNCs sent so far
+    size_t sent;                 // bytes of the current frame sent
+    bool vsync_en;
+    bool armed;
+    uint32_t items;              // samples stored since ll_cam_start
+    int64_t wake_at;             // cam_task runs at, INT64_MAX - sleeps
+} s_hw = { .wake_at = INT64_MAX };
+
+static struct {
+    int streamed;
+    int taken;
+    int ok;
+    int corrupted;
+    int queued;                  // left in the queue at the end
+    int settles;                 // cam_settle calls so far
+    int first_settled;           // the first frame to be delivered after them
+    int unsettled;               // delivered before it
+    uint64_t copy_bytes;
+    uint64_t copy_host_ns;
+    uint64_t take_host_ns;       // cam_take of the delivered frames
+    uint64_t check_host_ns;      // cam_check_jpeg of them
+    int64_t hold_until;
+    camera_fb_t *held;
+} s_sim;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int64_t sim_now(void)
+{
+    return esp_timer_get_time();
+}
+
+/* --- sensor --- */
+
+static size_t frame_len(int k)
+{
+    if (k < 0 || k + 1 >= s_vsync_cnt || s_vsync[k].payload < 0) {
+        return 0;
+    }
+    return s_payloads[s_vsync[k].payload].len;
+}
+
+static const uint8_t *frame_data(int k)
+{
+    return s_payloads[s_vsync[k].payload].buf;
+}
+
+/* bytes of the frame k sent by the time t */
+static size_t frame_sent(int k, int64_t t)
+{
+    size_t len = frame_len(k);
+    if (len == 0) {
+        return 0;
+    }
+    int64_t start = s_vsync[k].t + s_opt.blank_us;
+    int64_t active = s_vsync[k + 1].t - s_opt.blank_us - start;
+    if (t <= start) {
+        return 0;
+    }
+    if (active <= 0 || t - start >= active) {
+        return len;
+    }
+    return (size_t)((double)len * (t - start) / active);
+}
+
+/* time the byte pos of the frame k is sent */
+static int64_t frame_byte_time(int k, size_t pos)
+{
+    int64_t start = s_vsync[k].t + s_opt.blank_us;
+    int64_t active = s_vsync[k + 1].t - s_opt.blank_us - start;
+    if (active <= 0) {
+        return start;
+    }
+    // the first t with frame_sent(k, t) > pos
+    int64_t t = start + (int64_t)((double)(pos + 1) * active / frame_len(k));
+    while (t > start && frame_sent(k, t - 1) > pos) {
+        t--;
+    }
+    while (frame_sent(k, t) <= pos) {
+        t++;
+    }
+    return t;
+}
+
+/* --- fake DMA: the I2S stores 00 00 b 00 per byte (SM_0A00_0B00) --- */
+
+static uint32_t dma_items_per_half(void)
+{
+    return cam_obj->dma_half_buffer_size / cam_obj->dma_bytes_per_item;
+}
+
+static void dma_store(const uint8_t *data, size_t len, int64_t t_last)
+{
+    BaseType_t woken;
+    uint32_t half = dma_items_per_half();
+    uint32_t ring = cam_obj->dma_buffer_size / cam_obj->dma_bytes_per_item;
+    for (size_t i = 0; i < len; i++) {
+        uint32_t *item = (uint32_t *)cam_obj->dma_buffer + (s_hw.items % ring);
+        *item = (uint32_t)data[i] << 16;
+        if (++s_hw.items % half == 0) {
+            // the chunks end at the EOFs
+            if (!(cam_obj->task_handle->notify & CAM_NOTIFY_EVENT) && s_hw.wake_at == INT64_MAX) {
+                s_hw.wake_at = t_last + s_opt.wake_us;
+            }
+            ll_cam_send_event(cam_obj, CAM_IN_SUC_EOF_EVENT, &woken);
+        }
+    }
+}
+
+/* sends the bytes of the current frame up to the time t */
+static void sensor_run(int64_t t)
+{
+    int k = s_hw.next_vsync - 1;
+    size_t sent = frame_sent(k, t);
+    if (sent <= s_hw.sent) {
+        return;
+    }
+    if (s_hw.armed) {
+        // byte by byte up to each EOF, so the event gets its time
+        uint32_t half = dma_items_per_half();
+        while (s_hw.sent < sent) {
+            size_t n = half - s_hw.items % half;
+            if (n > sent - s_hw.sent) {
+                n = sent - s_hw.sent;
+            }
+            dma_store(frame_data(k) + s_hw.sent, n, frame_byte_time(k, s_hw.sent + n - 1));
+            s_hw.sent += n;
+        }
+    }
+    s_hw.sent = sent;
+}
+
+static void sim_vsync_isr(int64_t t)
+{
+    BaseType_t woken;
+    if (!(cam_obj->task_handle->notify & CAM_NOTIFY_EVENT) && s_hw.wake_at == INT64_MAX) {
+        s_hw.wake_at = t + s_opt.wake_us;
+    }
+    ll_cam_send_event(cam_obj, CAM_VSYNC_EVENT, &woken);
+}
+
+/* the sensor and the DMA come to the time t, the interrupts fire on the way */
+static void world_run(int64_t t)
+{
+    while (s_hw.next_vsync < s_vsync_cnt && s_vsync[s_hw.next_vsync].t <= t) {
+        int64_t tv = s_vsync[s_hw.next_vsync].t;
+        sensor_run(tv);
+        if (frame_len(s_hw.next_vsync)) {
+            s_sim.streamed++;
+        }
+        s_hw.next_vsync++;
+        s_hw.sent = 0;
+        if (s_hw.vsync_en) {
+            sim_vsync_isr(tv);
+        }
+    }
+    sensor_run(t);
+}
+
+/* time of the next VSYNC or EOF */
+static int64_t world_next(void)
+{
+    int64_t t = (s_hw.next_vsync < s_vsync_cnt) ? s_vsync[s_hw.next_vsync].t : INT64_MAX;
+    int k = s_hw.next_vsync - 1;
+    if (s_hw.armed && k >= 0) {
+        uint32_t half = dma_items_per_half();
+        size_t pos = s_hw.sent + (half - s_hw.items % half) - 1;
+        if (pos < frame_len(k)) {
+            int64_t te = frame_byte_time(k, pos);
+            if (te < t) {
+                t = te;
+            }
+        }
+    }
+    return t;
+}
+
+/* --- fake ll_cam --- */
+
+bool ll_cam_stop(cam_obj_t *cam)
+{
+    world_run(sim_now());
+    s_hw.armed = false;
+    return true;
+}
+
+bool ll_cam_start(cam_obj_t *cam, int frame_pos)
+{
+    world_run(sim_now());
+    // the DMA starts at descriptor 0 with the bytes that come from now
+    s_hw.armed = true;
+    s_hw.items = 0;
+    return true;
+}
+
+void ll_cam_vsync_manual(cam_obj_t *cam)
+{
+}
+
+esp_err_t ll_cam_config(cam_obj_t *cam, const camera_config_t *config)
+{
+    return ESP_OK;
+}
+
+esp_err_t ll_cam_deinit(cam_obj_t *cam)
+{
+    return ESP_OK;
+}
+
+void ll_cam_vsync_intr_enable(cam_obj_t *cam, bool en)
+{
+    s_hw.vsync_en = en;
+}
+
+esp_err_t ll_cam_set_pin(cam_obj_t *cam, const camera_config_t *config)
+{
+    return ESP_OK;
+}
+
+esp_err_t ll_cam_init_isr(cam_obj_t *cam)
+{
+    return ESP_OK;
+}
+
+void ll_cam_do_vsync(cam_obj_t *cam)
+{
+}
+
+uint8_t ll_cam_get_dma_align(cam_obj_t *cam)
+{
+    return 64;
+}
+
+bool ll_cam_dma_sizes(cam_obj_t *cam)
+{
+    // JPEG layout of ll_cam.c for ESP32
+    cam->dma_bytes_per_item = 4;
+    size_t half = cam->dma_geometry.half_buffer_size ? cam->dma_geometry.half_buffer_size : 4096;
+    size_t total = cam->dma_geometry.buffer_size ? cam->dma_geometry.buffer_size : 8 * half;
+    cam->dma_node_buffer_size = (half < 2048) ? half : 2048;
+    cam->dma_half_buffer_size = half;
+    cam->dma_half_buffer_cnt = total / half;
+    if (cam->dma_half_buffer_cnt < 2) {
+        cam->dma_half_buffer_cnt = 2;
+    }
+    cam->dma_buffer_size = cam->dma_half_buffer_cnt * cam->dma_half_buffer_size;
+    return true;
+}
+
+/* ll_cam_dma_filter_jpeg, costs copy_ns per DMA byte of virtual time */
+size_t ll_cam_memcpy(cam_obj_t *cam, uint8_t *out, const uint8_t *in, size_t len)
+{
+    double t0 = now_ns();
+    const uint32_t *el = (const uint32_t *)in;
+    size_t elements = len / sizeof(uint32_t);
+    for (size_t i = 0; i < (elements & ~3u); i++) {
+        out[i] = (uint8_t)(el[i] >> 16);
+    }
+    s_sim.copy_host_ns += (uint64_t)(now_ns() - t0);
+    s_sim.copy_bytes += len;
+    host_time_advance((int64_t)(len * s_opt.copy_ns / 1000));
+    world_run(sim_now());
+    return elements;
+}
+
+esp_err_t ll_cam_set_sample_mode(cam_obj_t *cam, pixformat_t pix_format, uint32_t xclk_freq_hz, uint16_t sensor_pid)
+{
+    if (pix_format != PIXFORMAT_JPEG) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    cam->in_bytes_per_pixel = 1;
+    cam->fb_bytes_per_pixel = 1;
+    return ESP_OK;
+}
+
+/* --- cam_task and the consumer --- */
+
+static cam_task_ctx_t s_ctx;
+
+static bool sim_stalled(int64_t t, int64_t *until)
+{
+    for (int i = 0; i < s_stall_cnt; i++) {
+        if (t >= s_stalls[i].t && t < s_stalls[i].t + s_stalls[i].dur) {
+            *until = s_stalls[i].t + s_stalls[i].dur;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* the loop of cam_task from the wake up to the next wait */
+static void sim_cam_task(void)
+{
+    TaskHandle_t task = cam_obj->task_handle;
+    cam_event_t cam_event;
+    host_core_id = SIM_CAM_CORE;
+    host_task_set_current(task);
+    s_hw.wake_at = INT64_MAX;
+    while (task->notify & (CAM_NOTIFY_EVENT | CAM_NOTIFY_SETTLE)) {
+        task->notify &= ~(CAM_NOTIFY_EVENT | CAM_NOTIFY_SETTLE);
+        if (cam_obj->settle_done != cam_obj->settle_req) {
+            cam_apply_settle();
+        }
+        while (cam_next_event(&s_ctx.eof_done, &s_ctx.vsync_done, &cam_event)) {
+            int64_t t_event = sim_now();
+            s_ctx.waited = 0;
+            host_time_advance(s_opt.step_us);
+            cam_task_step(&s_ctx, cam_event);
+            cam_account_busy(t_event + s_ctx.waited);
+            world_run(sim_now());
+        }
+    }
+    s_hw.wake_at = INT64_MAX;
+    host_task_set_current(NULL);
+}
+
+/* frame sent by the sensor when the capture was started at t */
+static int sim_frame_at(int64_t t)
+{
+    int k = -1;
+    while (k + 1 < s_vsync_cnt && s_vsync[k + 1].t <= t) {
+        k++;
+    }
+    return k;
+}
+
+static void sim_consumer(void)
+{
+    host_core_id = SIM_APP_CORE;
+    if (s_sim.held) {
+        if (sim_now() < s_sim.hold_until) {
+            return;
+        }
+        cam_give(s_sim.held);
+        s_sim.held = NULL;
+    }
+    while (uxQueueMessagesWaiting(cam_obj->frame_buffer_queue)) {
+        double t0 = now_ns();
+        camera_fb_t *fb = cam_take(0);
+        if (fb == NULL) {
+            break;
+        }
+        s_sim.take_host_ns += (uint64_t)(now_ns() - t0);
+#if CONFIG_CAMERA_JPEG_VALIDATE
+        // the check of cam_take once more, alone
+        t0 = now_ns();
+        cam_check_jpeg(fb->buf, fb->len, cam_obj->out_width, cam_obj->out_height);
+        s_sim.check_host_ns += (uint64_t)(now_ns() - t0);
+#endif
+        s_sim.taken++;
+        int64_t ts = (int64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec;
+        int k = sim_frame_at(ts);
+        size_t len = frame_len(k);
+        if (k < s_sim.first_settled) {
+            s_sim.unsettled++;
+            fprintf(stderr, "frame %d started before the sensor settled (frame %d)\n", k, s_sim.first_settled);
+        }
+        if (len && fb->len == len && memcmp(fb->buf, frame_data(k), len) == 0) {
+            s_sim.ok++;
+        } else {
+            s_sim.corrupted++;
+            fprintf(stderr, "frame %d started at %lld us: %u bytes, sent %u\n",
+                    k, (long long)ts, (unsigned)fb->len, (unsigned)len);
+        }
+        if (s_opt.hold_us) {
+            s_sim.held = fb;
+            s_sim.hold_until = sim_now() + s_opt.hold_us;
+            break;
+        }
+        cam_give(fb);
+    }
+}
+
+/* cam_settle from the app core, the frames started before the next
+   CONFIG_CAMERA_SETTLE_FRAMES complete frames are not delivered */
+static void sim_settle(void)
+{
+    host_core_id = SIM_APP_CORE;
+    cam_settle(0, 0);
+    if (s_hw.wake_at == INT64_MAX) {
+        s_hw.wake_at = sim_now() + s_opt.wake_us;
+    }
+    s_sim.first_settled = sim_frame_at(sim_now()) + 1 + CONFIG_CAMERA_SETTLE_FRAMES;
+    s_sim.settles++;
+}
+
+/* --- payloads and the trace --- */
+
+static bool load_payload(const char *path)
+{
+    if (s_payload_cnt == SIM_PAYLOADS_MAX) {
+        fprintf(stderr, "%s: too many payloads\n", path);
+        return false;
+    }
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        return false;
+    }
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *buf = (uint8_t *)malloc(len > 0 ? len : 1);
+    bool ok = buf && len > 4 && fread(buf, 1, len, f) == (size_t)len && buf[0] == 0xFF && buf[1] == 0xD8;
+    fclose(f);
+    if (!ok) {
+        fprintf(stderr, "%s: not a JPEG file\n", path);
+        free(buf);
+        return false;
+    }
+    s_payloads[s_payload_cnt].buf = buf;
+    s_payloads[s_payload_cnt].len = len;
+    s_payload_cnt++;
+    return true;
+}
+
+/* scenes of the size of the frames: gradient, a moving box and noise */
+static bool make_payloads(int cnt)
+{
+    uint16_t w = resolution[s_opt.frame_size].width;
+    uint16_t h = resolution[s_opt.frame_size].height;
+    uint8_t *rgb = (uint8_t *)malloc((size_t)w * h * 3);
+    uint32_t seed = 12345;
+    if (rgb == NULL) {
+        return false;
+    }
+    for (int n = 0; n < cnt; n++) {
+        uint16_t bx = w / 8 + n * w / (2 * cnt), by = h / 4;
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                uint8_t *p = &rgb[((size_t)y * w + x) * 3];
+                seed = seed * 1103515245 + 12345;
+                uint8_t noise = (seed >> 24) & 0x1F;
+                bool box = x >= bx && x < bx + w / 4 && y >= by && y < by + h / 3;
+                p[0] = box ? 200 : (uint8_t)(x * 255 / w) ^ noise;
+                p[1] = box ? 40 + n * 30 : (uint8_t)(y * 255 / h) + noise;
+                p[2] = (uint8_t)((x + y + n * 16) & 0xFF);
+            }
+        }
+        if (!fmt2jpg(rgb, (size_t)w * h * 3, w, h, PIXFORMAT_RGB888, 60,
+                     &s_payloads[n].buf, &s_payloads[n].len)) {
+            free(rgb);
+            return false;
+        }
+        s_payload_cnt++;
+    }
+    free(rgb);
+    return true;
+}
+
+static bool add_vsync(int64_t t, int payload)
+{
+    if (s_vsync_cnt && t <= s_vsync[s_vsync_cnt - 1].t) {
+        fprintf(stderr, "vsync %lld: the times must grow\n", (long long)t);
+        return false;
+    }
+    sim_vsync_t *v = (sim_vsync_t *)realloc(s_vsync, (s_vsync_cnt + 1) * sizeof(sim_vsync_t));
+    if (v == NULL) {
+        return false;
+    }
+    s_vsync = v;
+    s_vsync[s_vsync_cnt].t = t;
+    s_vsync[s_vsync_cnt].payload = payload;
+    s_vsync_cnt++;
+    return true;
+}
+
+static bool load_trace(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    char line[256];
+    int ln = 0;
+    if (f == NULL) {
+        perror(path);
+        return false;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        long long a, b;
+        char kind[16];
+        int n;
+        ln++;
+        if (line[0] == '#' || sscanf(line, "%15s", kind) != 1) {
+            continue;
+        }
+        n = sscanf(line, "%15s %lld %lld", kind, &a, &b);
+        if (strcmp(kind, "vsync") == 0 && n >= 2) {
+            if (!add_vsync(a, n == 3 ? (int)b : -2)) {
+                break;
+            }
+        } else if (strcmp(kind, "settle") == 0 && n == 2 && s_settle_cnt < SIM_SETTLES_MAX &&
+                   (s_settle_cnt == 0 || a > s_settles[s_settle_cnt - 1])) {
+            s_settles[s_settle_cnt++] = a;
+        } else if (strcmp(kind, "stall") == 0 && n == 3 && s_stall_cnt < SIM_STALLS_MAX) {
+            s_stalls[s_stall_cnt].t = a;
+            s_stalls[s_stall_cnt].dur = b;
+            s_stall_cnt++;
+        } else {
+            fprintf(stderr, "%s:%d: bad line\n", path, ln);
+            fclose(f);
+            return false;
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+/* VSYNCs of the frames and the one that ends the last of them */
+static bool make_vsyncs(void)
+{
+    if (s_vsync_cnt == 0) {
+        int64_t period = 1000000 / s_opt.fps;
+        for (int i = 0; i <= s_opt.frames; i++) {
+            if (!add_vsync(10000 + i * period, -2)) {
+                return false;
+            }
+        }
+    }
+    for (int i = 0; i < s_vsync_cnt; i++) {
+        if (i + 1 == s_vsync_cnt) {
+            s_vsync[i].payload = -1;
+        } else if (s_vsync[i].payload == -2) {
+            s_vsync[i].payload = i % s_payload_cnt;
+        } else if (s_vsync[i].payload >= s_payload_cnt) {
+            fprintf(stderr, "vsync %d: no payload %d\n", i, s_vsync[i].payload);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* --- run --- */
+
+static camera_config_t sim_config(framesize_t frame_size, int fb_count, camera_fb_location_t fb_location)
+{
+    camera_config_t config = {
+        .pin_vsync = 25,
+        .xclk_freq_hz = 20000000,
+        .pixel_format = PIXFORMAT_JPEG,
+        .frame_size = frame_size,
+        .jpeg_quality = 12,
+        .fb_count = fb_count,
+        .fb_location = fb_location,
+        .grab_mode = CAMERA_GRAB_LATEST,
+    };
+    return config;
+}
+
+static esp_err_t sim_camera_init(void)
+{
+    camera_config_t config = sim_config(s_opt.frame_size, s_opt.fb_count, CAMERA_FB_IN_DRAM);
+    if (s_opt.geometry.buffer_size || s_opt.geometry.half_buffer_size) {
+        cam_set_dma_geometry(PIXFORMAT_JPEG, s_opt.frame_size, &s_opt.geometry);
+    }
+    esp_err_t err = cam_init(&config);
+    if (err == ESP_OK) {
+        err = cam_config(&config, s_opt.frame_size, 0);
+    }
+    if (err != ESP_OK) {
+        return err;
+    }
+    // cam_take checks the frame size as after cam_settle
+    cam_obj->out_width = resolution[s_opt.frame_size].width;
+    cam_obj->out_height = resolution[s_opt.frame_size].height;
+
+    // the start of cam_task
+    cam_obj->state = CAM_STATE_IDLE;
+    s_ctx.eof_done = cam_obj->isr_eof_cnt;
+    s_ctx.vsync_done = cam_obj->isr_vsync_cnt;
+    cam_start();
+    return ESP_OK;
+}
+
+static void sim_run(void)
+{
+    int64_t end = s_vsync[s_vsync_cnt - 1].t + 2 * s_opt.poll_us;
+    int64_t next_poll = s_opt.poll_us;
+
+    while (1) {
+        int64_t t = world_next();
+        int64_t wake = s_hw.wake_at, until;
+        if (wake != INT64_MAX && sim_stalled(wake, &until)) {
+            wake = s_hw.wake_at = until;
+        }
+        if (wake < t) {
+            t = wake;
+        }
+        if (next_poll < t) {
+            t = next_poll;
+        }
+        if (s_sim.settles < s_settle_cnt && s_settles[s_sim.settles] < t) {
+            t = s_settles[s_sim.settles];
+        }
+        if (t > end) {
+            break;
+        }
+        if (t > sim_now()) {
+            host_time_advance(t - sim_now());
+        }
+        world_run(sim_now());
+        if (s_sim.settles < s_settle_cnt && s_settles[s_sim.settles] <= sim_now()) {
+            sim_settle();
+        }
+        if (s_hw.wake_at <= sim_now() && !sim_stalled(sim_now(), &until)) {
+            sim_cam_task();
+        }
+        if (next_poll <= sim_now()) {
+            sim_consumer();
+            next_poll += s_opt.poll_us;
+        }
+    }
+    if (s_sim.held) {
+        cam_give(s_sim.held);
+        s_sim.held = NULL;
+    }
+    s_sim.queued = uxQueueMessagesWaiting(cam_obj->frame_buffer_queue);
+}
+
+static int sim_report(void)
+{
+    camera_stats_t st;
+    cam_dma_stats_t dma;
+    cam_get_stats(&st, false);
+    cam_get_dma_stats(&dma, false);
+
+    int dropped = s_sim.streamed - s_sim.taken;
+    int in_capture = st.no_soi + st.fb_ovf + st.fbq_snd + st.fbq_rcv;
+    int replaced = st.frames_captured - s_sim.taken - st.no_eoi - st.fb_bad - s_sim.queued;
+    int missed = s_sim.streamed - st.frames_captured - in_capture;
+    size_t min_len = SIZE_MAX, max_len = 0;
+    for (int i = 0; i < s_payload_cnt; i++) {
+        min_len = s_payloads[i].len < min_len ? s_payloads[i].len : min_len;
+        max_len = s_payloads[i].len > max_len ? s_payloads[i].len : max_len;
+    }
+
+    printf("%dx%d JPEG, %d payloads of %u..%u bytes, %d frame buffers, DMA %u x %u bytes\n",
+           resolution[s_opt.frame_size].width, resolution[s_opt.frame_size].height, s_payload_cnt,
+           (unsigned)min_len, (unsigned)max_len, s_opt.fb_count,
+           cam_obj->dma_half_buffer_cnt, cam_obj->dma_half_buffer_size);
+    printf("frames: streamed %d, delivered %d (ok %d, corrupted %d), dropped %d\n",
+           s_sim.streamed, s_sim.taken, s_sim.ok, s_sim.corrupted, dropped);
+    printf("dropped in capture: NO-SOI %u, FB-OVF %u, FBQ %u, EV-OVF events %u\n",
+           st.no_soi, st.fb_ovf, st.fbq_snd + st.fbq_rcv, st.ev_ovf);
+    printf("dropped by cam_take: NO-EOI %u, FB-BAD %u; replaced in the queue %d; left queued %d\n",
+           st.no_eoi, st.fb_bad, replaced, s_sim.queued);
+    printf("not captured (no free buffer or lost by EV-OVF): %d\n", missed);
+    if (s_sim.settles) {
+        printf("cam_settle: %d calls, %d frames delivered before the sensor settled\n",
+               s_sim.settles, s_sim.unsettled);
+    }
+    printf("copy: %llu us virtual (%.1f us/frame), host %.3f ns/DMA byte\n",
+           (unsigned long long)dma.copy_us, s_sim.taken ? (double)dma.copy_us / s_sim.taken : 0.0,
+           s_sim.copy_bytes ? (double)s_sim.copy_host_ns / s_sim.copy_bytes : 0.0);
+#if CONFIG_CAMERA_JPEG_VALIDATE
+    printf("cam_take: host %.2f us/frame, JPEG check %.2f us/frame\n",
+           s_sim.taken ? s_sim.take_host_ns / 1e3 / s_sim.taken : 0.0,
+           s_sim.taken ? s_sim.check_host_ns / 1e3 / s_sim.taken : 0.0);
+#else
+    printf("cam_take: host %.2f us/frame, JPEG check off\n",
+           s_sim.taken ? s_sim.take_host_ns / 1e3 / s_sim.taken : 0.0);
+#endif
+    printf("cam_task: %u EOF handled, busy %.2f%% of %.1f s\n", dma.eof_cnt,
+           dma.period_us ? 100.0 * dma.busy_us[SIM_CAM_CORE] / dma.period_us : 0.0, dma.period_us / 1e6);
+
+    bool fail = s_sim.corrupted > 0 || s_sim.unsettled > 0 || dropped < s_opt.min_drops ||
+                (s_opt.max_drops >= 0 && dropped > s_opt.max_drops);
+    if (fail) {
+        fprintf(stderr, "FAIL: %d corrupted, %d not settled, %d dropped (expected %d..%d)\n",
+                s_sim.corrupted, s_sim.unsettled, dropped, s_opt.min_drops, s_opt.max_drops);
+    }
+    return fail ? 1 : 0;
+}
+
+/* the layouts of the application: stream, snapshot, small and large frames */
+static const struct {
+    framesize_t frame_size;
+    int fb_count;
+} s_layouts[] = {
+    { FRAMESIZE_VGA, 2 },
+    { FRAMESIZE_SXGA, 2 },
+    { FRAMESIZE_QVGA, 3 },
+    { FRAMESIZE_UXGA, 1 },
+    { FRAMESIZE_SVGA, 2 },
+};
+
+#define SIM_LAYOUTS     (sizeof(s_layouts) / sizeof(s_layouts[0]))
+#define SIM_APP_BLOCK   16384
+#define SIM_TUNED_SIZE  FRAMESIZE_SXGA     // has its own DMA layout as by esp_camera_tune_dma
+
+/* every cycle the application holds a block of each heap while the camera
+   is rebuilt - the memory of the camera must come back to the same place */
+static int sim_arena_cycles(int cycles)
+{
+    static const uint32_t caps[2] = { MALLOC_CAP_INTERNAL, MALLOC_CAP_SPIRAM };
+    static const char *names[2] = { "internal", "psram" };
+    camera_config_t config = sim_config(s_layouts[0].frame_size, s_layouts[0].fb_count, CAMERA_FB_IN_PSRAM);
+    if (cam_init(&config) != ESP_OK || cam_config(&config, config.frame_size, 0) != ESP_OK) {
+        fprintf(stderr, "camera is not initialized\n");
+        return 2;
+    }
+    size_t largest[2], free_size[2];
+    for (int k = 0; k < 2; k++) {
+        largest[k] = heap_caps_get_largest_free_block(caps[k]);
+        free_size[k] = heap_caps_get_free_size(caps[k]);
+    }
+    const cam_dma_geometry_t tuned = { 16384, 2048 };
+    cam_set_dma_geometry(PIXFORMAT_JPEG, SIM_TUNED_SIZE, &tuned);
+
+    int rebuilds = 0;
+    for (int i = 1; i <= cycles; i++) {
+        config = sim_config(s_layouts[i % SIM_LAYOUTS].frame_size, s_layouts[i % SIM_LAYOUTS].fb_count,
+                            CAMERA_FB_IN_PSRAM);
+        void *app[2];
+        for (int k = 0; k < 2; k++) {
+            app[k] = heap_caps_malloc(SIM_APP_BLOCK, caps[k]);
+        }
+        // cam_task is not running, cam_release_task need not wait for it
+        cam_obj->task_parked = true;
+        esp_err_t err;
+        if (i % 4 == 0) {
+            cam_deinit();
+            err = cam_init(&config);
+            if (err == ESP_OK) {
+                err = cam_config(&config, config.frame_size, 0);
+            }
+            rebuilds++;
+        } else {
+            err = cam_reconfig(&config, config.frame_size, config.frame_size, 0);
+        }
+        for (int k = 0; k < 2; k++) {
+            heap_caps_free(app[k]);
+        }
+        if (err != ESP_OK) {
+            fprintf(stderr, "FAIL: cycle %d: %s\n", i, esp_err_to_name(err));
+            return 1;
+        }
+        // the layout of the output size, the other sizes keep the default one
+        bool is_tuned = config.frame_size == SIM_TUNED_SIZE;
+        if ((cam_obj->dma_half_buffer_size == tuned.half_buffer_size) != is_tuned ||
+            cam_dma_layout_changes(PIXFORMAT_JPEG, config.frame_size) ||
+            cam_dma_layout_changes(PIXFORMAT_JPEG, SIM_TUNED_SIZE) == is_tuned) {
+            fprintf(stderr, "FAIL: cycle %d: DMA %u x %u bytes for frame size %d\n", i,
+                    cam_obj->dma_half_buffer_cnt, cam_obj->dma_half_buffer_size, config.frame_size);
+            return 1;
+        }
+    }
+
+    printf("%d cycles (%d cam_deinit/cam_config), arenas: fb %u, dma %u bytes\n", cycles, rebuilds,
+           (unsigned)s_fb_arena.size, (unsigned)s_dma_arena.size);
+    int res = 0;
+    for (int k = 0; k < 2; k++) {
+        size_t l = heap_caps_get_largest_free_block(caps[k]), f = heap_caps_get_free_size(caps[k]);
+        printf("%-8s largest free block %u -> %u, free %u -> %u bytes\n", names[k],
+               (unsigned)largest[k], (unsigned)l, (unsigned)free_size[k], (unsigned)f);
+        if (l < largest[k] || f < free_size[k]) {
+            fprintf(stderr, "FAIL: the %s heap shrank\n", names[k]);
+            res = 1;
+        }
+    }
+    cam_obj->task_parked = true;
+    cam_deinit();
+    return res;
+}
+
+int main(int argc, char **argv)
+{
+    int cycles = 0;
+    const char *trace = NULL;
+    int opt;
+    host_log_level = ESP_LOG_ERROR;
+    while ((opt = getopt(argc, argv, "t:n:f:s:b:g:k:c:w:e:p:o:d:D:r:v")) != -1) {
+        switch (opt) {
+        case 't': trace = optarg; break;
+        case 'n': s_opt.frames = atoi(optarg); break;
+        case 'f': s_opt.fps = atoi(optarg); break;
+        case 's': s_opt.frame_size = (framesize_t)atoi(optarg); break;
+        case 'b': s_opt.fb_count = atoi(optarg); break;
+        case 'g':
+            if (sscanf(optarg, "%u:%u", &s_opt.geometry.buffer_size, &s_opt.geometry.half_buffer_size) != 2) {
+                fprintf(stderr, "-g buffer:half\n");
+                return 2;
+            }
+            break;
+        case 'k': s_opt.blank_us = atoll(optarg); break;
+        case 'c': s_opt.copy_ns = atof(optarg); break;
+        case 'w': s_opt.wake_us = atoll(optarg); break;
+        case 'e': s_opt.step_us = atoll(optarg); break;
+        case 'p': s_opt.poll_us = atoll(optarg); break;
+        case 'o': s_opt.hold_us = atoll(optarg); break;
+        case 'd': s_opt.min_drops = atoi(optarg); break;
+        case 'D': s_opt.max_drops = atoi(optarg); break;
+        case 'r': cycles = atoi(optarg); break;
+        case 'v': host_log_level = ESP_LOG_INFO; break;
+        default:
+            fprintf(stderr, "usage: cam_sim [-t trace] [-n frames] [-f fps] [-s frame size] [-b fb count] "
+                            "[-g buffer:half] [-k blank us] [-c copy ns] [-w wake us] [-e step us] "
+                            "[-p poll us] [-o hold us] [-d min drops] [-D max drops] [-r cycles] [-v] [frame.jpg ...]\n");
+            return 2;
+        }
+    }
+    if (s_opt.frame_size >= FRAMESIZE_INVALID || s_opt.fps <= 0 || s_opt.fb_count < 1 || s_opt.poll_us <= 0) {
+        fprintf(stderr, "bad options\n");
+        return 2;
+    }
+    if (cycles > 0) {
+        return sim_arena_cycles(cycles);
+    }
+    for (int i = optind; i < argc; i++) {
+        if (!load_payload(argv[i])) {
+            return 2;
+        }
+    }
+    if (s_payload_cnt == 0 && !make_payloads(4)) {
+        fprintf(stderr, "payloads are not encoded\n");
+        return 2;
+    }
+    if ((trace && !load_trace(trace)) || !make_vsyncs() || s_vsync_cnt < 2) {
+        return 2;
+    }
+    if (sim_camera_init() != ESP_OK) {
+        fprintf(stderr, "camera is not initialized\n");
+        return 2;
+    }
+
+    sim_run();
+    int res = sim_report();
+
+    // cam_task is not running, cam_release_task need not wait for it
+    cam_obj->task_parked = true;
+    cam_deinit();
+    return res;
+}
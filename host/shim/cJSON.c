@@ -0,0 +1,273 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "cJSON.h"
+#include "host_shim.h"
+
+/* the size is kept before the block - the usage is counted as cJSON allocates */
+typedef union {
+    size_t size;
+    long double align;
+} cjson_block_t;
+
+static size_t s_cur = 0;
+static size_t s_peak = 0;
+
+static void *cjson_malloc(size_t size)
+{
+    cjson_block_t *b = (cjson_block_t *) malloc(sizeof(cjson_block_t) + size);
+    if (b == NULL) {
+        return NULL;
+    }
+    b->size = size;
+    s_cur += size;
+    if (s_cur > s_peak) {
+        s_peak = s_cur;
+    }
+    return b + 1;
+}
+
+static void cjson_free(void *ptr)
+{
+    if (ptr) {
+        cjson_block_t *b = (cjson_block_t *) ptr - 1;
+        s_cur -= b->size;
+        free(b);
+    }
+}
+
+static char *cjson_strdup(const char *s)
+{
+    size_t len = strlen(s) + 1;
+    char *d = (char *) cjson_malloc(len);
+    if (d) {
+        memcpy(d, s, len);
+    }
+    return d;
+}
+
+void host_cjson_get_usage(size_t *cur, size_t *peak)
+{
+    *cur = s_cur;
+    *peak = s_peak;
+}
+
+static cJSON *cjson_new(int type)
+{
+    cJSON *item = (cJSON *) cjson_malloc(sizeof(cJSON));
+    if (item) {
+        memset(item, 0, sizeof(cJSON));
+        item->type = type;
+    }
+    return item;
+}
+
+cJSON *cJSON_CreateNull(void)
+{
+    return cjson_new(cJSON_NULL);
+}
+
+cJSON *cJSON_CreateTrue(void)
+{
+    return cjson_new(cJSON_True);
+}
+
+cJSON *cJSON_CreateFalse(void)
+{
+    return cjson_new(cJSON_False);
+}
+
+cJSON *cJSON_CreateBool(cJSON_bool b)
+{
+    return cjson_new(b ? cJSON_True : cJSON_False);
+}
+
+cJSON *cJSON_CreateNumber(double num)
+{
+    cJSON *item = cjson_new(cJSON_Number);
+    if (item) {
+        item->valuedouble = num;
+        // saturated like cJSON does
+        if (num >= 2147483647.0) {
+            item->valueint = 2147483647;
+        } else if (num <= -2147483648.0) {
+            item->valueint = -2147483647 - 1;
+        } else {
+            item->valueint = (int) num;
+        }
+    }
+    return item;
+}
+
+cJSON *cJSON_CreateString(const char *string)
+{
+    cJSON *item = cjson_new(cJSON_String);
+    if (item) {
+        item->valuestring = cjson_strdup(string);
+        if (item->valuestring == NULL) {
+            cJSON_Delete(item);
+            return NULL;
+        }
+    }
+    return item;
+}
+
+cJSON *cJSON_CreateArray(void)
+{
+    return cjson_new(cJSON_Array);
+}
+
+cJSON *cJSON_CreateObject(void)
+{
+    return cjson_new(cJSON_Object);
+}
+
+cJSON *cJSON_CreateIntArray(const int *numbers, int count)
+{
+    cJSON *a = cJSON_CreateArray();
+    for (int i = 0; a && i < count; i++) {
+        cJSON_AddItemToArray(a, cJSON_CreateNumber(numbers[i]));
+    }
+    return a;
+}
+
+void cJSON_Delete(cJSON *item)
+{
+    while (item) {
+        cJSON *next = item->next;
+        cJSON_Delete(item->child);
+        cjson_free(item->valuestring);
+        cjson_free(item->string);
+        cjson_free(item);
+        item = next;
+    }
+}
+
+cJSON_bool cJSON_AddItemToArray(cJSON *array, cJSON *item)
+{
+    if (array == NULL || item == NULL) {
+        return 0;
+    }
+    if (array->child == NULL) {
+        array->child = item;
+        // the first item keeps the last one in prev
+        item->prev = item;
+    } else {
+        cJSON *last = array->child->prev;
+        last->next = item;
+        item->prev = last;
+        array->child->prev = item;
+    }
+    item->next = NULL;
+    return 1;
+}
+
+cJSON_bool cJSON_AddItemToObject(cJSON *object, const char *string, cJSON *item)
+{
+    if (item == NULL || string == NULL) {
+        return 0;
+    }
+    cjson_free(item->string);
+    item->string = cjson_strdup(string);
+    return cJSON_AddItemToArray(object, item);
+}
+
+cJSON *cJSON_AddNumberToObject(cJSON *object, const char *name, double number)
+{
+    cJSON *item = cJSON_CreateNumber(number);
+    if (!cJSON_AddItemToObject(object, name, item)) {
+        cJSON_Delete(item);
+        return NULL;
+    }
+    return item;
+}
+
+cJSON *cJSON_AddStringToObject(cJSON *object, const char *name, const char *string)
+{
+    cJSON *item = cJSON_CreateString(string);
+    if (!cJSON_AddItemToObject(object, name, item)) {
+        cJSON_Delete(item);
+        return NULL;
+    }
+    return item;
+}
+
+cJSON *cJSON_AddBoolToObject(cJSON *object, const char *name, cJSON_bool boolean)
+{
+    cJSON *item = cJSON_CreateBool(boolean);
+    if (!cJSON_AddItemToObject(object, name, item)) {
+        cJSON_Delete(item);
+        return NULL;
+    }
+    return item;
+}
+
+int cJSON_GetArraySize(const cJSON *array)
+{
+    int n = 0;
+    const cJSON *item;
+    cJSON_ArrayForEach(item, array) {
+        n++;
+    }
+    return n;
+}
+
+cJSON *cJSON_GetArrayItem(const cJSON *array, int index)
+{
+    cJSON *item;
+    cJSON_ArrayForEach(item, array) {
+        if (index-- == 0) {
+            return item;
+        }
+    }
+    return NULL;
+}
+
+cJSON *cJSON_GetObjectItem(const cJSON *object, const char *string)
+{
+    cJSON *item;
+    if (string == NULL) {
+        return NULL;
+    }
+    cJSON_ArrayForEach(item, object) {
+        if (item->string && strcasecmp(item->string, string) == 0) {
+            return item;
+        }
+    }
+    return NULL;
+}
+
+cJSON_bool cJSON_IsTrue(const cJSON *item)
+{
+    return item && item->type == cJSON_True;
+}
+
+cJSON_bool cJSON_IsNumber(const cJSON *item)
+{
+    return item && item->type == cJSON_Number;
+}
+
+cJSON_bool cJSON_IsString(const cJSON *item)
+{
+    return item && item->type == cJSON_String;
+}
+
+cJSON_bool cJSON_IsArray(const cJSON *item)
+{
+    return item && item->type == cJSON_Array;
+}
+
+cJSON_bool cJSON_IsObject(const cJSON *item)
+{
+    return item && item->type == cJSON_Object;
+}
@@ -0,0 +1,190 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_partition.h"
+#include "host_shim.h"
+
+#define HOST_PARTITIONS 4
+
+/* the flash content is kept in memory and written through to the file,
+   so the next run (or the test after a power cut) opens the same state */
+typedef struct {
+    esp_partition_t part;
+    FILE *file;
+    uint8_t *mem;
+    uint32_t cut_at;             // operation number of the power cut, 0 - none
+    host_partition_stats_t stats;
+} host_partition_t;
+
+static host_partition_t s_parts[HOST_PARTITIONS];
+
+static host_partition_t *find(const char *label)
+{
+    for (int i = 0; i < HOST_PARTITIONS; i++) {
+        if (s_parts[i].mem && strcmp(s_parts[i].part.label, label) == 0) {
+            return &s_parts[i];
+        }
+    }
+    return NULL;
+}
+
+static host_partition_t *of(const esp_partition_t *partition)
+{
+    return (host_partition_t *) partition;
+}
+
+static void sync_range(host_partition_t *p, size_t offset, size_t size)
+{
+    fseek(p->file, offset, SEEK_SET);
+    fwrite(&p->mem[offset], 1, size, p->file);
+    fflush(p->file);
+}
+
+esp_err_t host_partition_open(const char *label, const char *path, uint32_t size, bool erase)
+{
+    if (find(label) || size % SPI_FLASH_SEC_SIZE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    host_partition_t *p = NULL;
+    for (int i = 0; i < HOST_PARTITIONS && p == NULL; i++) {
+        if (s_parts[i].mem == NULL) {
+            p = &s_parts[i];
+        }
+    }
+    if (p == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    memset(p, 0, sizeof(*p));
+    p->mem = (uint8_t *) malloc(size);
+    if (p->mem == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    memset(p->mem, 0xFF, size);
+    p->file = fopen(path, erase ? "w+b" : "r+b");
+    if (p->file == NULL && !erase) {
+        p->file = fopen(path, "w+b");
+        erase = true;
+    }
+    if (p->file == NULL) {
+        free(p->mem);
+        p->mem = NULL;
+        return ESP_FAIL;
+    }
+    if (!erase) {
+        // the part past the end of a short file stays erased
+        (void) fread(p->mem, 1, size, p->file);
+    }
+    sync_range(p, 0, size);
+
+    p->part.type = ESP_PARTITION_TYPE_DATA;
+    p->part.subtype = ESP_PARTITION_SUBTYPE_ANY;
+    p->part.size = size;
+    strncpy(p->part.label, label, sizeof(p->part.label) - 1);
+    return ESP_OK;
+}
+
+void host_partition_close(const char *label)
+{
+    host_partition_t *p = find(label);
+    if (p) {
+        fclose(p->file);
+        free(p->mem);
+        memset(p, 0, sizeof(*p));
+    }
+}
+
+void host_partition_cut(const char *label, uint32_t ops)
+{
+    host_partition_t *p = find(label);
+    if (p) {
+        p->cut_at = ops ? p->stats.ops + ops : 0;
+        p->stats.cut = false;
+    }
+}
+
+void host_partition_get_stats(const char *label, host_partition_stats_t *stats)
+{
+    host_partition_t *p = find(label);
+    if (p) {
+        *stats = p->stats;
+    } else {
+        memset(stats, 0, sizeof(*stats));
+    }
+}
+
+/* how much of the operation is done: all, a part at the power cut or nothing */
+static size_t power_budget(host_partition_t *p, size_t size)
+{
+    if (p->stats.cut) {
+        return 0;
+    }
+    p->stats.ops++;
+    if (p->cut_at && p->stats.ops == p->cut_at) {
+        p->stats.cut = true;
+        // a pseudo-random part, the same for the same operation
+        return (size_t) ((p->stats.ops * 2654435761u) % (size + 1)) % size;
+    }
+    return size;
+}
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label)
+{
+    host_partition_t *p = find(label);
+    if (p == NULL || p->part.type != type) {
+        return NULL;
+    }
+    return &p->part;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size)
+{
+    host_partition_t *p = of(partition);
+    if (src_offset + size > p->part.size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (p->stats.cut) {
+        return ESP_FAIL;
+    }
+    memcpy(dst, &p->mem[src_offset], size);
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t dst_offset, const void *src, size_t size)
+{
+    host_partition_t *p = of(partition);
+    if (dst_offset + size > p->part.size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    size_t done = power_budget(p, size);
+    const uint8_t *s = (const uint8_t *) src;
+    for (size_t i = 0; i < done; i++) {
+        // NOR flash - programming only clears bits
+        p->mem[dst_offset + i] &= s[i];
+    }
+    sync_range(p, dst_offset, done);
+    p->stats.written += done;
+    return (done == size) ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size)
+{
+    host_partition_t *p = of(partition);
+    if (offset % SPI_FLASH_SEC_SIZE || size % SPI_FLASH_SEC_SIZE || offset + size > p->part.size) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    size_t done = power_budget(p, size);
+    memset(&p->mem[offset], 0xFF, done);
+    sync_range(p, offset, done);
+    p->stats.erased += done;
+    return (done == size) ? ESP_OK : ESP_FAIL;
+}
@@ -0,0 +1,189 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "esp_crc.h"
+#include "driver/gpio.h"
+#include "hal/gpio_ll.h"
+#include "host_shim.h"
+
+esp_log_level_t host_log_level = ESP_LOG_WARN;
+
+uint8_t host_gpio_level[GPIO_NUM_MAX];
+gpio_dev_t GPIO;
+
+static int64_t s_now_us = 0;
+
+int64_t esp_timer_get_time(void)
+{
+    return s_now_us;
+}
+
+void host_time_advance(int64_t us)
+{
+    s_now_us += us;
+}
+
+const char *esp_err_to_name(esp_err_t code)
+{
+    switch (code) {
+    case ESP_OK:                    return "ESP_OK";
+    case ESP_FAIL:                  return "ESP_FAIL";
+    case ESP_ERR_NO_MEM:            return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG:       return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE:     return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_INVALID_SIZE:      return "ESP_ERR_INVALID_SIZE";
+    case ESP_ERR_NOT_FOUND:         return "ESP_ERR_NOT_FOUND";
+    case ESP_ERR_NOT_SUPPORTED:     return "ESP_ERR_NOT_SUPPORTED";
+    case ESP_ERR_TIMEOUT:           return "ESP_ERR_TIMEOUT";
+    case ESP_ERR_INVALID_RESPONSE:  return "ESP_ERR_INVALID_RESPONSE";
+    case ESP_ERR_INVALID_CRC:       return "ESP_ERR_INVALID_CRC";
+    default:                        return "UNKNOWN ERROR";
+    }
+}
+
+/* the memory comes from malloc, the placement of the blocks is modeled on two
+   heaps (internal with DMA, PSRAM) of HOST_HEAP_SIZE each, first fit - so
+   the free size and the largest free block show the fragmentation */
+#define HOST_HEAP_SIZE (4 * 1024 * 1024)
+
+typedef struct {
+    void *ptr;
+    size_t off;
+    size_t size;
+} host_block_t;
+
+typedef struct {
+    host_block_t *blocks;        // by offset
+    int cnt;
+    int cap;
+} host_heap_t;
+
+static host_heap_t s_heaps[2];
+
+static host_heap_t *host_heap(uint32_t caps)
+{
+    return &s_heaps[(caps & MALLOC_CAP_SPIRAM) ? 1 : 0];
+}
+
+static void host_heap_place(host_heap_t *h, void *ptr, size_t size)
+{
+    size = (size + 3) & ~(size_t) 3;
+    size_t off = 0;
+    int i;
+    for (i = 0; i < h->cnt; i++) {
+        if (h->blocks[i].off - off >= size) {
+            break;
+        }
+        off = h->blocks[i].off + h->blocks[i].size;
+    }
+    // past the end of the heap the block is placed anyway, the heap shows no free space
+    if (h->cnt == h->cap) {
+        h->cap = h->cap ? h->cap * 2 : 64;
+        h->blocks = (host_block_t *) realloc(h->blocks, h->cap * sizeof(host_block_t));
+    }
+    memmove(&h->blocks[i + 1], &h->blocks[i], (h->cnt - i) * sizeof(host_block_t));
+    h->blocks[i] = (host_block_t) { ptr, off, size };
+    h->cnt++;
+}
+
+static void host_heap_forget(uintptr_t addr)
+{
+    for (int k = 0; k < 2; k++) {
+        host_heap_t *h = &s_heaps[k];
+        for (int i = 0; i < h->cnt; i++) {
+            if ((uintptr_t) h->blocks[i].ptr == addr) {
+                memmove(&h->blocks[i], &h->blocks[i + 1], (h->cnt - i - 1) * sizeof(host_block_t));
+                h->cnt--;
+                return;
+            }
+        }
+    }
+}
+
+void *heap_caps_malloc(size_t size, uint32_t caps)
+{
+    void *p = malloc(size);
+    if (p) {
+        host_heap_place(host_heap(caps), p, size);
+    }
+    return p;
+}
+
+void *heap_caps_calloc(size_t n, size_t size, uint32_t caps)
+{
+    void *p = calloc(n, size);
+    if (p) {
+        host_heap_place(host_heap(caps), p, n * size);
+    }
+    return p;
+}
+
+void *heap_caps_realloc(void *ptr, size_t size, uint32_t caps)
+{
+    uintptr_t old = (uintptr_t) ptr;
+    void *p = realloc(ptr, size);
+    if (p) {
+        host_heap_forget(old);
+        host_heap_place(host_heap(caps), p, size);
+    }
+    return p;
+}
+
+void heap_caps_free(void *ptr)
+{
+    if (ptr) {
+        host_heap_forget((uintptr_t) ptr);
+    }
+    free(ptr);
+}
+
+size_t heap_caps_get_free_size(uint32_t caps)
+{
+    host_heap_t *h = host_heap(caps);
+    size_t used = 0;
+    for (int i = 0; i < h->cnt; i++) {
+        used += h->blocks[i].size;
+    }
+    return used < HOST_HEAP_SIZE ? HOST_HEAP_SIZE - used : 0;
+}
+
+size_t heap_caps_get_largest_free_block(uint32_t caps)
+{
+    host_heap_t *h = host_heap(caps);
+    size_t off = 0, largest = 0;
+    for (int i = 0; i <= h->cnt; i++) {
+        size_t end = (i < h->cnt) ? h->blocks[i].off : HOST_HEAP_SIZE;
+        if (end > off && end - off > largest) {
+            largest = end - off;
+        }
+        if (i < h->cnt) {
+            off = h->blocks[i].off + h->blocks[i].size;
+        }
+    }
+    return largest;
+}
+
+uint32_t esp_crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len)
+{
+    crc = ~crc;
+    while (len--) {
+        crc ^= *buf++;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
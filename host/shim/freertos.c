@@ -0,0 +1,299 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "host_shim.h"
+
+int host_core_id = 0;
+
+static TaskHandle_t s_current = NULL;
+
+/* a blocking call that can not be served - the time of the timeout passes */
+static void wait_ticks(TickType_t ticks)
+{
+    if (ticks == portMAX_DELAY) {
+        fprintf(stderr, "host: blocked forever\n");
+        abort();
+    }
+    host_time_advance((int64_t) ticks * 1000000 / configTICK_RATE_HZ);
+}
+
+void host_task_set_current(TaskHandle_t task)
+{
+    s_current = task;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack, void *arg,
+                                   UBaseType_t prio, TaskHandle_t *handle, BaseType_t core)
+{
+    host_task_t *t = (host_task_t *) calloc(1, sizeof(host_task_t));
+    if (t == NULL) {
+        return pdFAIL;
+    }
+    t->fn = fn;
+    t->arg = arg;
+    t->name = name;
+    if (handle) {
+        *handle = t;
+    }
+    return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg,
+                       UBaseType_t prio, TaskHandle_t *handle)
+{
+    return xTaskCreatePinnedToCore(fn, name, stack, arg, prio, handle, tskNO_AFFINITY);
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    if (task == NULL) {
+        task = s_current;
+    }
+    if (task) {
+        // kept allocated - a notification of the deleted task is caught by the check below
+        task->deleted = true;
+    }
+}
+
+void vTaskSuspend(TaskHandle_t task)
+{
+    if (task == NULL) {
+        task = s_current;
+    }
+    if (task) {
+        task->suspended = true;
+    }
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    host_time_advance((int64_t) ticks * 1000000 / configTICK_RATE_HZ);
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return (TickType_t) (esp_timer_get_time() * configTICK_RATE_HZ / 1000000);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    return s_current;
+}
+
+static void notify_check(TaskHandle_t task)
+{
+    if (task->deleted) {
+        fprintf(stderr, "host: notification of the deleted task %s\n", task->name);
+        abort();
+    }
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks)
+{
+    TaskHandle_t t = s_current;
+    if (t == NULL || t->notify == 0) {
+        wait_ticks(ticks);
+        return 0;
+    }
+    uint32_t v = t->notify;
+    t->notify = clear ? 0 : v - 1;
+    return v;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    notify_check(task);
+    task->notify++;
+    return pdPASS;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *woken)
+{
+    xTaskNotifyGive(task);
+    if (woken) {
+        *woken = pdTRUE;
+    }
+}
+
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value, eNotifyAction action)
+{
+    notify_check(task);
+    switch (action) {
+    case eSetBits:
+        task->notify |= value;
+        break;
+    case eIncrement:
+        task->notify++;
+        break;
+    case eSetValueWithOverwrite:
+    case eSetValueWithoutOverwrite:
+        task->notify = value;
+        break;
+    default:
+        break;
+    }
+    return pdPASS;
+}
+
+BaseType_t xTaskNotifyFromISR(TaskHandle_t task, uint32_t value, eNotifyAction action, BaseType_t *woken)
+{
+    if (woken) {
+        *woken = pdTRUE;
+    }
+    return xTaskNotify(task, value, action);
+}
+
+BaseType_t xTaskNotifyWait(uint32_t clear_on_entry, uint32_t clear_on_exit, uint32_t *value, TickType_t ticks)
+{
+    TaskHandle_t t = s_current;
+    if (t == NULL || t->notify == 0) {
+        wait_ticks(ticks);
+        return pdFALSE;
+    }
+    if (value) {
+        *value = t->notify;
+    }
+    t->notify &= ~clear_on_exit;
+    return pdTRUE;
+}
+
+struct host_queue {
+    UBaseType_t len;
+    UBaseType_t size;
+    UBaseType_t head;
+    UBaseType_t cnt;
+    uint8_t data[];
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    QueueHandle_t q = (QueueHandle_t) calloc(1, sizeof(struct host_queue) + length * item_size);
+    if (q) {
+        q->len = length;
+        q->size = item_size;
+    }
+    return q;
+}
+
+void vQueueDelete(QueueHandle_t q)
+{
+    free(q);
+}
+
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t ticks)
+{
+    if (q->cnt == q->len) {
+        wait_ticks(ticks);
+        return pdFALSE;
+    }
+    memcpy(&q->data[((q->head + q->cnt) % q->len) * q->size], item, q->size);
+    q->cnt++;
+    return pdTRUE;
+}
+
+BaseType_t xQueueSendFromISR(QueueHandle_t q, const void *item, BaseType_t *woken)
+{
+    return xQueueSend(q, item, 0);
+}
+
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t ticks)
+{
+    if (q->cnt == 0) {
+        wait_ticks(ticks);
+        return pdFALSE;
+    }
+    memcpy(item, &q->data[q->head * q->size], q->size);
+    q->head = (q->head + 1) % q->len;
+    q->cnt--;
+    return pdTRUE;
+}
+
+BaseType_t xQueueReset(QueueHandle_t q)
+{
+    q->head = q->cnt = 0;
+    return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q)
+{
+    return q->cnt;
+}
+
+struct host_sem {
+    int count;
+    int max;
+};
+
+static SemaphoreHandle_t sem_create(int count, int max)
+{
+    SemaphoreHandle_t s = (SemaphoreHandle_t) calloc(1, sizeof(struct host_sem));
+    if (s) {
+        s->count = count;
+        s->max = max;
+    }
+    return s;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    return sem_create(1, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex(void)
+{
+    // one thread always owns it
+    return sem_create(1, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return sem_create(0, 1);
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem)
+{
+    free(sem);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+    if (sem->count == 0) {
+        wait_ticks(ticks);
+        return pdFALSE;
+    }
+    sem->count--;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    if (sem->count == sem->max) {
+        return pdFALSE;
+    }
+    sem->count++;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t sem, TickType_t ticks)
+{
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t sem)
+{
+    return pdTRUE;
+}
@@ -0,0 +1,81 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+/* host build - the output levels are kept in host_gpio_level */
+
+#ifndef DRIVER_GPIO_H_
+#define DRIVER_GPIO_H_
+
+#include <stdint.h>
+#include "esp_err.h"
+
+#define GPIO_NUM_MAX 40
+
+typedef int gpio_num_t;
+typedef struct host_intr *intr_handle_t;
+
+#define GPIO_NUM_0  0
+#define GPIO_NUM_2  2
+#define GPIO_NUM_4  4
+#define GPIO_NUM_5  5
+#define GPIO_NUM_12 12
+#define GPIO_NUM_13 13
+#define GPIO_NUM_14 14
+#define GPIO_NUM_15 15
+#define GPIO_NUM_16 16
+#define GPIO_NUM_18 18
+#define GPIO_NUM_19 19
+#define GPIO_NUM_21 21
+#define GPIO_NUM_22 22
+#define GPIO_NUM_23 23
+#define GPIO_NUM_25 25
+#define GPIO_NUM_26 26
+#define GPIO_NUM_27 27
+#define GPIO_NUM_32 32
+#define GPIO_NUM_33 33
+#define GPIO_NUM_34 34
+#define GPIO_NUM_35 35
+#define GPIO_NUM_36 36
+#define GPIO_NUM_39 39
+
+typedef enum {
+    GPIO_MODE_DISABLE = 0,
+    GPIO_MODE_INPUT,
+    GPIO_MODE_OUTPUT,
+    GPIO_MODE_INPUT_OUTPUT,
+} gpio_mode_t;
+
+extern uint8_t host_gpio_level[GPIO_NUM_MAX];
+
+static inline esp_err_t gpio_set_level(gpio_num_t pin, uint32_t level)
+{
+    if (pin < 0 || pin >= GPIO_NUM_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    host_gpio_level[pin] = level ? 1 : 0;
+    return ESP_OK;
+}
+
+static inline void gpio_pad_select_gpio(uint8_t pin)
+{
+}
+
+static inline esp_err_t gpio_set_direction(gpio_num_t pin, gpio_mode_t mode)
+{
+    return (pin >= 0 && pin < GPIO_NUM_MAX) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+static inline int gpio_get_level(gpio_num_t pin)
+{
+    return (pin >= 0 && pin < GPIO_NUM_MAX) ? host_gpio_level[pin] : 0;
+}
+
+#endif
@@ -0,0 +1,30 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+/* host build - DMA descriptor of the ROM, the fake DMA does not follow the links */
+
+#ifndef LLDESC_H_
+#define LLDESC_H_
+
+#include <stdint.h>
+
+typedef struct lldesc_s {
+    volatile uint32_t size   : 12,
+                      length : 12,
+                      offset : 5,
+                      sosf   : 1,
+                      eof    : 1,
+                      owner  : 1;
+    volatile uint8_t *buf;
+    uint32_t empty;              // the next descriptor, truncated on 64 bit hosts
+} lldesc_t;
+
+#endif
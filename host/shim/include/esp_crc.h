@@ -0,0 +1,20 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef ESP_CRC_H_
+#define ESP_CRC_H_
+
+#include <stdint.h>
+
+/* crc32 of the ROM: reflected 0xEDB88320, the value is inverted on entry and exit */
+uint32_t esp_crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len);
+
+#endif
@@ -0,0 +1,63 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+/* host build - FreeRTOS without a scheduler. Everything runs in the thread
+   of the test: blocking calls do not wait, they move the virtual time by
+   their timeout and fail (see host_shim.h) */
+
+#ifndef FREERTOS_H_
+#define FREERTOS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "sdkconfig.h"
+#include "esp_attr.h"
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+#define portBASE_TYPE int
+
+#define pdTRUE  1
+#define pdFALSE 0
+#define pdPASS  pdTRUE
+#define pdFAIL  pdFALSE
+
+#define portMAX_DELAY       ((TickType_t) 0xFFFFFFFF)
+#define configTICK_RATE_HZ  CONFIG_FREERTOS_HZ
+#define portTICK_PERIOD_MS  ((TickType_t) 1000 / configTICK_RATE_HZ)
+#define portTICK_RATE_MS    portTICK_PERIOD_MS
+#define pdMS_TO_TICKS(ms)   ((TickType_t) (((uint64_t) (ms) * configTICK_RATE_HZ) / 1000))
+#define configMAX_PRIORITIES 25
+#define portNUM_PROCESSORS  2
+
+/* one thread - the critical sections only have to nest */
+typedef struct {
+    int nest;
+} portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED { 0 }
+
+#define portENTER_CRITICAL(m)       ((m)->nest++)
+#define portEXIT_CRITICAL(m)        ((m)->nest--)
+#define portENTER_CRITICAL_ISR(m)   portENTER_CRITICAL(m)
+#define portEXIT_CRITICAL_ISR(m)    portEXIT_CRITICAL(m)
+#define taskENTER_CRITICAL(m)       portENTER_CRITICAL(m)
+#define taskEXIT_CRITICAL(m)        portEXIT_CRITICAL(m)
+#define taskENTER_CRITICAL_ISR(m)   portENTER_CRITICAL(m)
+#define taskEXIT_CRITICAL_ISR(m)    portEXIT_CRITICAL(m)
+#define portYIELD_FROM_ISR(x)       ((void) (x))
+
+/* the core the code "runs" on, set by the test */
+extern int host_core_id;
+#define xPortGetCoreID() host_core_id
+
+#endif
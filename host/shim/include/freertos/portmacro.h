@@ -0,0 +1,16 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#ifndef FREERTOS_PORTMACRO_H_
+#define FREERTOS_PORTMACRO_H_
+
+#include "freertos/FreeRTOS.h"
+
+#endif
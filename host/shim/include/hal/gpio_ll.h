@@ -0,0 +1,36 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+/* host build - the set/clear registers write host_gpio_level */
+
+#ifndef HAL_GPIO_LL_H_
+#define HAL_GPIO_LL_H_
+
+#include <stdint.h>
+#include "driver/gpio.h"
+
+typedef struct {
+    uint32_t unused;
+} gpio_dev_t;
+
+extern gpio_dev_t GPIO;
+
+static inline void gpio_ll_set_level(gpio_dev_t *hw, gpio_num_t gpio_num, uint32_t level)
+{
+    gpio_set_level(gpio_num, level);
+}
+
+static inline int gpio_ll_get_level(gpio_dev_t *hw, gpio_num_t gpio_num)
+{
+    return gpio_get_level(gpio_num);
+}
+
+#endif
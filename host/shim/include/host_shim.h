@@ -0,0 +1,58 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+/* host build - controls of the shims that ESP-IDF does not have */
+
+#ifndef HOST_SHIM_H_
+#define HOST_SHIM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+/* esp_timer_get_time and the tick count follow the virtual time */
+void host_time_advance(int64_t us);
+
+/* the task of the code the test calls now (NULL - none) */
+void host_task_set_current(TaskHandle_t task);
+
+/* bytes of the cJSON items now and at most since start */
+void host_cjson_get_usage(size_t *cur, size_t *peak);
+
+typedef struct {
+    uint32_t ops;                // writes and erases since open
+    uint64_t written;
+    uint64_t erased;
+    bool     cut;                // power is off
+} host_partition_stats_t;
+
+/**
+ * @brief Back the data partition with the file. Flash rules are kept:
+ *        a write only clears bits, an erase is sector aligned and sets them
+ *
+ * @param erase start with the erased flash, else keep the file content
+ */
+esp_err_t host_partition_open(const char *label, const char *path, uint32_t size, bool erase);
+void host_partition_close(const char *label);
+
+/**
+ * @brief Cut the power at the flash operation ops from now (1 - the next one).
+ *        The operation is done only partially: a write stores a prefix of
+ *        the data, an erase clears a prefix of the range. All the later
+ *        operations fail. 0 - power stays on
+ */
+void host_partition_cut(const char *label, uint32_t ops);
+
+void host_partition_get_stats(const char *label, host_partition_stats_t *stats);
+
+#endif
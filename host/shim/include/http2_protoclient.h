@@ -0,0 +1,42 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+/* host build - the part of the HTTP/2 client component used by the device.
+   The bench that links the device code serves it */
+
+#ifndef HTTP2_PROTOCLIENT_H_
+#define HTTP2_PROTOCLIENT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "cJSON.h"
+
+#define H2PC_MODE_MESSAGING     (1 << 0)
+#define H2PC_MODE_OUTGOING      (1 << 1)
+
+bool h2pc_get_connected(void);
+bool h2pc_get_is_streaming(void);
+
+/* POST of the media record, returns when the response is received */
+esp_err_t h2pc_req_send_media_record_sync(char *buf, size_t len);
+
+/* the outgoing message, params are owned by the message */
+void h2pc_om_add_msg_res(const char *kind, const char *target, cJSON *params, bool ok);
+
+/* the output stream: the frame to send, the start of the stream with
+   the sub protocol and the wait until the frame is sent */
+void h2pc_os_prepare_frame(char *buf, size_t len);
+void h2pc_os_prepare(const char *sub_proto);
+void h2pc_os_wait_for_frame(void);
+
+#endif
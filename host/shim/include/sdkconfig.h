@@ -0,0 +1,28 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+/* host build - the options of the tested code, see main/Kconfig.projbuild */
+
+#ifndef SDKCONFIG_H_
+#define SDKCONFIG_H_
+
+#define CONFIG_FREERTOS_HZ 1000
+
+/* cam_hal as on the board: ESP32, JPEG checked, no copy worker */
+#define CONFIG_IDF_TARGET_ESP32 1
+#define CONFIG_CAMERA_CORE0 1
+#define CONFIG_CAMERA_SETTLE_FRAMES 1
+#ifndef CONFIG_CAMERA_JPEG_VALIDATE
+#define CONFIG_CAMERA_JPEG_VALIDATE 1
+#endif
+#define CONFIG_CAMERA_FB_ARENA_SIZE 0x96000
+#define CONFIG_CAMERA_DMA_BUFFER_SIZE_MAX 16384
+
+#endif
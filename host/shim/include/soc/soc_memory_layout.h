@@ -0,0 +1,24 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef SOC_MEMORY_LAYOUT_H_
+#define SOC_MEMORY_LAYOUT_H_
+
+#include <stdbool.h>
+
+/* the host heap is not split into the memory classes */
+static inline bool esp_ptr_external_ram(const void *p)
+{
+    (void) p;
+    return false;
+}
+
+#endif
@@ -0,0 +1,77 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+/* host build - the part of the wch2pcapp component used by the device.
+   The bench that links the device code serves it */
+
+#ifndef WCH2PCAPP_H_
+#define WCH2PCAPP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "cJSON.h"
+#include "http2_protoclient.h"
+
+#define H2PCA_TASKS_MAX 8
+
+typedef uint32_t h2pca_state;
+typedef int h2pca_task_id;
+
+typedef void (*h2pca_on_sync)(h2pca_task_id id, h2pca_state cur_state, void *user_data,
+                              uint32_t *restart_period);
+
+/* on_sync is called while the state has req_bitmask and apply_bitmask,
+   apply_bitmask is set every period (us) */
+typedef struct h2pca_task {
+    const char *name;
+    h2pca_task_id id;
+    void *user_data;
+    h2pca_on_sync on_sync;
+    uint32_t apply_bitmask;
+    uint32_t req_bitmask;
+    uint32_t period;
+    int64_t next_us;
+} h2pca_task;
+
+typedef struct {
+    h2pca_task *tasks[H2PCA_TASKS_MAX];
+    int cnt;
+} h2pca_task_pool;
+
+typedef struct {
+    const char *LOG_TAG;
+    int h2pcmode;
+    uint32_t recv_msgs_period;   // us
+    uint32_t send_msgs_period;   // us
+    uint32_t inmsgs_proceed_chunk;
+    void (*on_ble_cfg_finished)(void);
+    bool (*on_next_inmsg)(const cJSON *src, const cJSON *kind, const cJSON *iparams, const cJSON *msg_id);
+    void (*on_finish_step)(void);
+    h2pca_task_pool tasks;
+} h2pca_config;
+
+typedef struct {
+    char *device_name;
+} h2pca_status;
+
+esp_err_t h2pca_init_cfg(h2pca_config *cfg);
+h2pca_task *h2pca_new_task(const char *name, h2pca_task_id id, void *user_data, esp_err_t *err);
+esp_err_t h2pca_task_pool_add_task(h2pca_task_pool *pool, h2pca_task *task);
+h2pca_status *h2pca_init(h2pca_config *cfg, esp_err_t *err);
+void h2pca_start(int core);
+
+void h2pca_locked_SET_STATE(uint32_t bits);
+void h2pca_locked_CLR_STATE(uint32_t bits);
+/* all the bits are set */
+bool h2pca_locked_CHK_STATE(uint32_t bits);
+
+#endif
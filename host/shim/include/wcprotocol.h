@@ -0,0 +1,25 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+/* host build - the part of the wcprotocol component used by the device */
+
+#ifndef WCPROTOCOL_H_
+#define WCPROTOCOL_H_
+
+#include "esp_bit_defs.h"
+#include "cJSON.h"
+
+extern const char *JSON_RPC_MID;
+
+/* the device is logged in to the server */
+#define AUTHORIZED_BIT BIT0
+
+#endif
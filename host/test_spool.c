@@ -0,0 +1,233 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+/* frame_spool on the file-backed partition: the power is cut at every flash
+   operation of a write/upload scenario (and once more while the log is
+   restored), then the spool is opened again and the recovered log is checked
+   against what the scenario saw completed. Prints the flash traffic.
+
+   usage: test_spool [file] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "host_shim.h"
+#include "../main/frame_spool.c"
+
+#define LABEL       "spool"
+#define PART_SIZE   (8 * SPI_FLASH_SEC_SIZE)
+#define FRAMES      64
+#define MAX_LEN     3400
+
+static const char *s_path = "test_spool.bin";
+static int s_failed = 0;
+
+#define CHECK(cond, ...) do {                           \
+        if (!(cond)) {                                  \
+            fprintf(stderr, "FAIL: " __VA_ARGS__);      \
+            fprintf(stderr, "\n");                      \
+            s_failed++;                                 \
+            return false;                               \
+        }                                               \
+    } while (0)
+
+/* frame n - its number in the first bytes, the rest is derived from it */
+static size_t make_frame(uint32_t n, uint8_t *buf)
+{
+    size_t len = 300 + (n * 7919) % (MAX_LEN - 300);
+    memcpy(buf, &n, sizeof(n));
+    for (size_t i = sizeof(n); i < len; i++) {
+        buf[i] = (uint8_t) (n * 31 + i * 7);
+    }
+    return len;
+}
+
+typedef enum {
+    FR_NONE = 0,
+    FR_SPOOLED,                  // append returned ESP_OK
+    FR_SENT,                     // uploaded and marked in flash
+    FR_UNSURE,                   // the power was cut in the middle of its append or mark
+} frame_state_t;
+
+typedef struct {
+    frame_state_t state[FRAMES];
+    uint32_t got[FRAMES];        // uploaded by the last flush
+    uint32_t got_cnt;
+    uint32_t seen[FRAMES];       // uploads of the frame
+    uint32_t first_new;          // frames from this one are spooled in this boot
+} model_t;
+
+static model_t s_model;
+
+static esp_err_t collect(void *arg, uint8_t *buf, size_t len, int64_t ts_us)
+{
+    model_t *m = (model_t *) arg;
+    static uint8_t ref[MAX_LEN];
+    uint32_t n;
+    memcpy(&n, buf, sizeof(n));
+    if (len < sizeof(n) || n >= FRAMES || make_frame(n, ref) != len || memcmp(ref, buf, len) != 0) {
+        fprintf(stderr, "FAIL: frame %u is corrupted\n", (len < sizeof(n)) ? 0 : n);
+        s_failed++;
+        return ESP_FAIL;
+    }
+    if (m->got_cnt && n <= m->got[m->got_cnt - 1]) {
+        fprintf(stderr, "FAIL: frame %u after %u\n", n, m->got[m->got_cnt - 1]);
+        s_failed++;
+    }
+    // the time of the frames of the previous boot is unknown
+    int64_t ts_expected = (n >= m->first_new) ? (int64_t) n * 1000 : -1;
+    if (ts_us != ts_expected) {
+        fprintf(stderr, "FAIL: frame %u ts %lld, expected %lld\n", n, (long long) ts_us, (long long) ts_expected);
+        s_failed++;
+    }
+    m->got[m->got_cnt++] = n;
+    m->seen[n]++;
+    return ESP_OK;
+}
+
+static void spool_reset(void)
+{
+    if (spool.mux) {
+        vSemaphoreDelete(spool.mux);
+    }
+    memset(&spool, 0, sizeof(spool));
+}
+
+static bool power_cut(void)
+{
+    host_partition_stats_t st;
+    host_partition_get_stats(LABEL, &st);
+    return st.cut;
+}
+
+/* the frames uploaded before the power cut are sent, the one in flight is unsure */
+static void scenario_flush(model_t *m, size_t cnt)
+{
+    m->got_cnt = 0;
+    frame_spool_flush(cnt, collect, m);
+    for (uint32_t i = 0; i < m->got_cnt; i++) {
+        bool last = (i + 1 == m->got_cnt);
+        m->state[m->got[i]] = (last && power_cut()) ? FR_UNSURE : FR_SENT;
+    }
+}
+
+/* the scenario until the end or the power cut */
+static host_partition_stats_t run_scenario(uint32_t cut)
+{
+    uint8_t buf[MAX_LEN];
+    host_partition_open(LABEL, s_path, PART_SIZE, true);
+    spool_reset();
+    if (frame_spool_init(LABEL) != ESP_OK) {
+        fprintf(stderr, "FAIL: init of the erased partition\n");
+        s_failed++;
+    }
+    host_partition_cut(LABEL, cut);
+
+    memset(&s_model, 0, sizeof(s_model));
+    for (uint32_t n = 0; n < FRAMES - 4 && !power_cut(); n++) {
+        size_t len = make_frame(n, buf);
+        esp_err_t err = frame_spool_append(buf, len, (int64_t) n * 1000);
+        s_model.state[n] = (err == ESP_OK) ? FR_SPOOLED : FR_UNSURE;
+        if (n % 3 == 2) {
+            scenario_flush(&s_model, 2);
+        }
+        if (n % 10 == 9) {
+            scenario_flush(&s_model, FRAMES);
+        }
+    }
+    host_partition_stats_t st;
+    host_partition_get_stats(LABEL, &st);
+    host_partition_close(LABEL);
+    return st;
+}
+
+/* open the spool after the power cut and check the log */
+static bool check_recovery(uint32_t cut, uint32_t recovery_cut)
+{
+    model_t m = { 0 };
+    memcpy(m.state, s_model.state, sizeof(m.state));
+    m.first_new = FRAMES;
+
+    host_partition_open(LABEL, s_path, PART_SIZE, false);
+    if (recovery_cut) {
+        // the power fails again while the log is restored
+        spool_reset();
+        host_partition_cut(LABEL, recovery_cut);
+        frame_spool_init(LABEL);
+        host_partition_close(LABEL);
+        host_partition_open(LABEL, s_path, PART_SIZE, false);
+    }
+    spool_reset();
+    CHECK(frame_spool_init(LABEL) == ESP_OK, "cut %u/%u: init after the power cut", cut, recovery_cut);
+
+    size_t expected = 0;
+    for (uint32_t n = 0; n < FRAMES; n++) {
+        expected += (m.state[n] == FR_SPOOLED);
+    }
+    size_t pending = frame_spool_pending();
+    CHECK(pending >= expected, "cut %u/%u: %u frames pending, %u expected", cut, recovery_cut,
+          (unsigned) pending, (unsigned) expected);
+
+    m.got_cnt = 0;
+    CHECK(frame_spool_flush(FRAMES, collect, &m) == ESP_OK, "cut %u/%u: flush", cut, recovery_cut);
+    CHECK(frame_spool_pending() == 0, "cut %u/%u: %u frames left", cut, recovery_cut, (unsigned) frame_spool_pending());
+    for (uint32_t n = 0; n < FRAMES; n++) {
+        if (m.state[n] == FR_SPOOLED) {
+            CHECK(m.seen[n] == 1, "cut %u/%u: spooled frame %u is uploaded %u times", cut, recovery_cut, n, m.seen[n]);
+        } else if (m.state[n] != FR_UNSURE) {
+            CHECK(m.seen[n] == 0, "cut %u/%u: frame %u is uploaded again", cut, recovery_cut, n);
+        } else {
+            CHECK(m.seen[n] <= 1, "cut %u/%u: frame %u is uploaded %u times", cut, recovery_cut, n, m.seen[n]);
+        }
+    }
+
+    // the log goes on after the recovery
+    uint8_t buf[MAX_LEN];
+    m.first_new = FRAMES - 4;
+    for (uint32_t n = FRAMES - 4; n < FRAMES; n++) {
+        size_t len = make_frame(n, buf);
+        CHECK(frame_spool_append(buf, len, (int64_t) n * 1000) == ESP_OK, "cut %u/%u: append after recovery", cut, recovery_cut);
+    }
+    m.got_cnt = 0;
+    CHECK(frame_spool_flush(FRAMES, collect, &m) == ESP_OK && m.got_cnt == 4,
+          "cut %u/%u: %u frames uploaded after recovery", cut, recovery_cut, m.got_cnt);
+    host_partition_close(LABEL);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1) {
+        s_path = argv[1];
+    }
+    host_log_level = ESP_LOG_NONE;
+
+    host_partition_stats_t full = run_scenario(0);
+    size_t payload = 0;
+    uint8_t buf[MAX_LEN];
+    for (uint32_t n = 0; n < FRAMES - 4; n++) {
+        payload += make_frame(n, buf);
+    }
+    printf("spool: %u frames, %u bytes - %u flash operations, %.2f bytes written and %.2f erased per byte\n",
+           FRAMES - 4, (unsigned) payload, full.ops,
+           (double) full.written / payload, (double) full.erased / payload);
+
+    uint32_t runs = 0;
+    for (uint32_t cut = 1; cut <= full.ops && s_failed <= 20; cut++) {
+        for (uint32_t recovery_cut = 0; recovery_cut <= 2; recovery_cut++) {
+            run_scenario(cut);
+            check_recovery(cut, recovery_cut);
+            runs++;
+        }
+    }
+    printf("spool: %u power cuts replayed, %d failures\n", runs, s_failed);
+    remove(s_path);
+    return s_failed ? 1 : 0;
+}
@@ -0,0 +1,266 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+/* tile_stream against a receiver: a VGA scene with a moving box and sensor
+   noise is encoded to JPEG as the camera frames, every frame goes through
+   tile_stream_encode and the receiver builds its frame from the tiles of
+   the packets. The built frame is checked against the camera frame: every
+   8x8 block average luma must be within the threshold and the loss of the
+   tile encoding (-s). Prints the bytes of the packets against the camera
+   frames (RAW_JPEG).
+
+   usage: test_tile_stream [options]
+     -n frames (60)                         -k keyframe period (30)
+     -t threshold (6)                       -q tile quality (80)
+     -c camera quality (80)                 -s allowed loss of the tiles (4)
+     -v every frame */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include "host_shim.h"
+#include "img_converters.h"
+#include "esp_jpg_decode.h"
+#include "tile_stream.h"
+
+#define WIDTH   640
+#define HEIGHT  480
+#define TILE    80
+#define PIXELS  (WIDTH * HEIGHT)
+#define TILES   ((WIDTH / TILE) * (HEIGHT / TILE))
+
+static uint8_t s_scene[PIXELS * 3];     // BGR as the input of to_jpg
+static uint8_t s_cam[PIXELS * 3];       // RGB of the camera frame
+static uint8_t s_rx[PIXELS * 3];        // RGB of the receiver
+static int s_failed = 0;
+
+#define CHECK(cond, ...) do {                           \
+        if (!(cond)) {                                  \
+            fprintf(stderr, "FAIL: " __VA_ARGS__);      \
+            fprintf(stderr, "\n");                      \
+            s_failed++;                                 \
+            return false;                               \
+        }                                               \
+    } while (0)
+
+/* a static background, a box moving over a part of it and the noise of every frame */
+static void make_scene(int n)
+{
+    static uint32_t seed = 12345;
+    int bx = 40 + n * 7, by = 200 + (n % 20) * 3;
+    for (int y = 0; y < HEIGHT; y++) {
+        for (int x = 0; x < WIDTH; x++) {
+            uint8_t * p = &s_scene[(y * WIDTH + x) * 3];
+            int r = 60 + 120 * y / HEIGHT, g = 90 + 100 * x / WIDTH, b = 200 - 80 * y / HEIGHT;
+            if (((x / 32) + (y / 32)) % 5 == 0) {
+                r = g = b = 230;
+            }
+            if (x >= bx && x < bx + 96 && y >= by && y < by + 64) {
+                r = 200;
+                g = 40;
+                b = 40;
+            }
+            seed = seed * 1103515245 + 12345;
+            int noise = (int) ((seed >> 24) & 0x07) - 4;
+            p[0] = (uint8_t) (b + noise);
+            p[1] = (uint8_t) (g + noise);
+            p[2] = (uint8_t) (r + noise);
+        }
+    }
+}
+
+typedef struct {
+    const uint8_t * src;
+    uint8_t * out;
+    uint16_t x;
+    uint16_t y;
+    uint16_t w;
+    uint16_t h;
+} rx_decode_t;
+
+static size_t rx_read(void * arg, size_t index, uint8_t * buf, size_t len)
+{
+    memcpy(buf, ((rx_decode_t *) arg)->src + index, len);
+    return len;
+}
+
+static bool rx_write(void * arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t * data)
+{
+    rx_decode_t * d = (rx_decode_t *) arg;
+    if (data == NULL) {
+        return w == d->w && h == d->h;
+    }
+    for (uint16_t iy = 0; iy < h; iy++) {
+        memcpy(d->out + ((size_t) (d->y + y + iy) * WIDTH + d->x + x) * 3, data + (size_t) iy * w * 3, (size_t) w * 3);
+    }
+    return true;
+}
+
+static bool decode_at(const uint8_t * jpg, size_t len, uint8_t * out, uint16_t x, uint16_t y, uint16_t w, uint16_t h)
+{
+    rx_decode_t d = { jpg, out, x, y, w, h };
+    return esp_jpg_decode(len, JPG_SCALE_NONE, rx_read, rx_write, &d) == ESP_OK;
+}
+
+/* the packet is applied to the receiver frame */
+static bool rx_packet(const uint8_t * p, size_t len, uint32_t seq, bool key, uint16_t * count)
+{
+    tile_frame_hdr_t hdr;
+    CHECK(len >= sizeof(hdr), "frame %u: short packet", seq);
+    memcpy(&hdr, p, sizeof(hdr));
+    CHECK(hdr.version == TILE_STREAM_VERSION && hdr.tile == TILE && hdr.width == WIDTH && hdr.height == HEIGHT,
+          "frame %u: bad header", seq);
+    CHECK(hdr.seq == seq, "frame %u: seq %u", seq, hdr.seq);
+    CHECK(((hdr.flags & TILE_FLAG_KEYFRAME) != 0) == key, "frame %u: keyframe flag %u", seq, hdr.flags);
+    CHECK(!key || hdr.count == TILES, "frame %u: keyframe of %u tiles", seq, hdr.count);
+    size_t off = sizeof(hdr);
+    int last = -1;
+    for (uint16_t i = 0; i < hdr.count; i++) {
+        tile_hdr_t th;
+        CHECK(off + sizeof(th) <= len, "frame %u: tile %u header out of the packet", seq, i);
+        memcpy(&th, p + off, sizeof(th));
+        off += sizeof(th);
+        CHECK(th.index < TILES && (int) th.index > last, "frame %u: tile index %u after %d", seq, th.index, last);
+        CHECK(off + th.len <= len, "frame %u: tile %u out of the packet", seq, th.index);
+        last = th.index;
+        uint16_t tx = th.index % (WIDTH / TILE), ty = th.index / (WIDTH / TILE);
+        CHECK(decode_at(p + off, th.len, s_rx, tx * TILE, ty * TILE, TILE, TILE), "frame %u: tile %u is not decoded",
+              seq, th.index);
+        off += th.len;
+    }
+    CHECK(off == len, "frame %u: %u bytes after the tiles", seq, (unsigned) (len - off));
+    *count = hdr.count;
+    return true;
+}
+
+static int block_luma(const uint8_t * rgb, int bx, int by)
+{
+    int sum = 0;
+    for (int y = 0; y < 8; y++) {
+        const uint8_t * p = rgb + ((size_t) (by * 8 + y) * WIDTH + bx * 8) * 3;
+        for (int x = 0; x < 8; x++, p += 3) {
+            sum += (19595 * p[0] + 38470 * p[1] + 7471 * p[2] + 32768) >> 16;
+        }
+    }
+    return sum / 64;
+}
+
+/* the largest block difference and PSNR of the receiver frame */
+static int rx_compare(double * db)
+{
+    int worst = 0;
+    for (int by = 0; by < HEIGHT / 8; by++) {
+        for (int bx = 0; bx < WIDTH / 8; bx++) {
+            int d = abs(block_luma(s_rx, bx, by) - block_luma(s_cam, bx, by));
+            if (d > worst) {
+                worst = d;
+            }
+        }
+    }
+    double se = 0;
+    for (size_t i = 0; i < sizeof(s_rx); i++) {
+        double d = (double) s_rx[i] - s_cam[i];
+        se += d * d;
+    }
+    *db = se ? 10 * log10(255.0 * 255.0 * sizeof(s_rx) / se) : 99.0;
+    return worst;
+}
+
+int main(int argc, char **argv)
+{
+    int frames = 60, keyframe = 30, threshold = 6, quality = 80, cam_quality = 80, slack = 4;
+    bool verbose = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:k:t:q:c:s:v")) != -1) {
+        switch (opt) {
+        case 'n': frames = atoi(optarg); break;
+        case 'k': keyframe = atoi(optarg); break;
+        case 't': threshold = atoi(optarg); break;
+        case 'q': quality = atoi(optarg); break;
+        case 'c': cam_quality = atoi(optarg); break;
+        case 's': slack = atoi(optarg); break;
+        case 'v': verbose = true; break;
+        default:
+            fprintf(stderr, "usage: test_tile_stream [-n frames] [-k keyframe] [-t threshold] [-q quality] "
+                    "[-c camera quality] [-s loss] [-v]\n");
+            return 2;
+        }
+    }
+    if (frames < 1 || keyframe < 0 || threshold < 1 || threshold > 255 || quality < 1 || quality > 100 ||
+        cam_quality < 1 || cam_quality > 100) {
+        fprintf(stderr, "bad options\n");
+        return 2;
+    }
+    if (tile_stream_init(WIDTH, HEIGHT, TILE) != ESP_OK) {
+        fprintf(stderr, "FAIL: tile_stream_init\n");
+        return 1;
+    }
+
+    double raw_bytes = 0, tile_bytes = 0, key_bytes = 0, min_db = 99;
+    int keys = 0, worst = 0;
+    uint32_t tiles = 0;
+    for (int n = 0; n < frames && !s_failed; n++) {
+        camera_fb_t fb = { 0 };
+        make_scene(n);
+        if (!fmt2jpg(s_scene, sizeof(s_scene), WIDTH, HEIGHT, PIXFORMAT_RGB888, cam_quality, &fb.buf, &fb.len) ||
+            !decode_at(fb.buf, fb.len, s_cam, 0, 0, WIDTH, HEIGHT)) {
+            fprintf(stderr, "FAIL: camera frame %d\n", n);
+            return 1;
+        }
+        fb.width = WIDTH;
+        fb.height = HEIGHT;
+        fb.format = PIXFORMAT_JPEG;
+
+        const uint8_t * packet;
+        size_t len;
+        bool key = (n == 0) || (keyframe && n % keyframe == 0);
+        uint16_t count = 0;
+        if (tile_stream_encode(&fb, quality, threshold, keyframe, &packet, &len) != ESP_OK) {
+            fprintf(stderr, "FAIL: frame %d is not encoded\n", n);
+            s_failed++;
+        } else if (rx_packet(packet, len, n, key, &count)) {
+            double db;
+            int d = rx_compare(&db);
+            if (d > threshold + slack) {
+                fprintf(stderr, "FAIL: frame %d: block luma differs by %d\n", n, d);
+                s_failed++;
+            }
+            worst = d > worst ? d : worst;
+            min_db = db < min_db ? db : min_db;
+            raw_bytes += fb.len;
+            tile_bytes += len;
+            tiles += count;
+            if (key) {
+                keys++;
+                key_bytes += len;
+            }
+            if (verbose) {
+                printf("frame %3d: %5u B raw, %5u B %2u tiles%s, block diff %d, %.2f dB\n", n, (unsigned) fb.len,
+                       (unsigned) len, count, key ? " (key)" : "", d, db);
+            }
+        }
+        free(fb.buf);
+    }
+    if (s_failed) {
+        return 1;
+    }
+
+    printf("%d VGA frames, %dx%d tiles, threshold %d, quality %d, keyframe every %d\n", frames, TILE, TILE,
+           threshold, quality, keyframe);
+    printf("RAW_JPEG:  %8.0f B, %6.0f B/frame\n", raw_bytes, raw_bytes / frames);
+    printf("TILE_JPEG: %8.0f B, %6.0f B/frame (%.1f%%), keyframes %.0f B, deltas %.0f B, %.1f tiles/delta\n",
+           tile_bytes, tile_bytes / frames, 100.0 * tile_bytes / raw_bytes, keys ? key_bytes / keys : 0,
+           frames > keys ? (tile_bytes - key_bytes) / (frames - keys) : 0,
+           frames > keys ? (double) (tiles - keys * TILES) / (frames - keys) : 0);
+    printf("receiver: block luma within %d, PSNR >= %.2f dB\n", worst, min_db);
+    return 0;
+}
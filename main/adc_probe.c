@@ -0,0 +1,211 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+#include "esp_adc_cal.h"
+#include "esp_log.h"
+#include "adc_probe.h"
+
+static const char *TAG = "adc_probe";
+
+/* filters work on raw values with 4 fractional bits */
+#define ADC_FRAC_BITS 4
+
+static adc_probe_config_t s_cfg;
+static esp_adc_cal_characteristics_t s_chars;
+
+static int32_t s_win[ADC_PROBE_MAX_MEDIAN];
+static uint32_t s_win_cnt = 0;
+static uint32_t s_win_pos = 0;
+static int32_t s_iir = 0;
+static bool s_seeded = false;
+
+#if (CONFIG_WC_ADC_SERIES_LEN & (CONFIG_WC_ADC_SERIES_LEN - 1)) != 0
+#error "CONFIG_WC_ADC_SERIES_LEN must be a power of two"
+#endif
+
+/* the sampler is the only writer, readers check s_head after copying */
+static adc_probe_point_t s_ring[CONFIG_WC_ADC_SERIES_LEN];
+static volatile uint32_t s_head = 0;
+static volatile uint32_t s_value = 0;
+
+static portMUX_TYPE s_mux = portMUX_INITIALIZER_UNLOCKED;
+static adc_probe_events_t s_ev = {0};
+static int s_zone = 0;                  // -1 below low_mv, 1 above high_mv
+static bool s_reported = false;
+static uint32_t s_reported_mv = 0;
+
+esp_err_t adc_probe_init(const adc_probe_config_t * cfg, const adc_probe_events_t * ev)
+{
+    s_cfg = *cfg;
+    if (s_cfg.oversample < 1)
+        s_cfg.oversample = 1;
+    if (s_cfg.oversample > 64)
+        s_cfg.oversample = 64;
+    if (s_cfg.median < 1)
+        s_cfg.median = 1;
+    if (s_cfg.median > ADC_PROBE_MAX_MEDIAN)
+        s_cfg.median = ADC_PROBE_MAX_MEDIAN;
+    s_cfg.median |= 1;
+    s_win_cnt = s_win_pos = 0;
+    s_seeded = false;
+
+    esp_adc_cal_characterize(ADC_UNIT_2, s_cfg.atten, ADC_WIDTH_BIT_12, 1100, &s_chars);
+    esp_err_t err = adc2_config_channel_atten(s_cfg.channel, s_cfg.atten);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Channel %d is not configured", s_cfg.channel);
+        return err;
+    }
+    adc_probe_set_events(ev);
+    return ESP_OK;
+}
+
+static int32_t adc_median(int32_t x)
+{
+    s_win[s_win_pos] = x;
+    s_win_pos = (s_win_pos + 1) % s_cfg.median;
+    if (s_win_cnt < s_cfg.median)
+        s_win_cnt++;
+
+    int32_t w[ADC_PROBE_MAX_MEDIAN];
+    memcpy(w, s_win, s_win_cnt * sizeof(int32_t));
+    for (uint32_t i = 1; i < s_win_cnt; i++) {
+        int32_t v = w[i];
+        uint32_t j = i;
+        for (; j > 0 && w[j - 1] > v; j--)
+            w[j] = w[j - 1];
+        w[j] = v;
+    }
+    return w[s_win_cnt / 2];
+}
+
+/* stays in the zone until the value passes the threshold by hyst_mv */
+static int adc_zone(uint32_t mv, int zone, const adc_probe_events_t * ev)
+{
+    if (ev->low_mv && mv < ((zone < 0) ? ev->low_mv + ev->hyst_mv : ev->low_mv))
+        return -1;
+    if (ev->high_mv) {
+        uint32_t high = (zone > 0) ? ((ev->high_mv > ev->hyst_mv) ? ev->high_mv - ev->hyst_mv : 0) : ev->high_mv;
+        if (mv > high)
+            return 1;
+    }
+    return 0;
+}
+
+esp_err_t adc_probe_sample(uint32_t * mv, bool * event)
+{
+    // ADC2 is shared with Wi-Fi - reads may time out
+    uint32_t sum = 0, n = 0;
+    for (int i = 0; i < s_cfg.oversample; i++) {
+        int raw;
+        if (adc2_get_raw(s_cfg.channel, ADC_WIDTH_BIT_12, &raw) == ESP_OK) {
+            sum += raw;
+            n++;
+        }
+    }
+    if (n == 0)
+        return ESP_ERR_TIMEOUT;
+
+    int32_t x = (int32_t) ((sum << ADC_FRAC_BITS) / n);
+    if (s_cfg.median > 1)
+        x = adc_median(x);
+    if (s_cfg.iir_shift && s_seeded)
+        s_iir += (x - s_iir) >> s_cfg.iir_shift;
+    else
+        s_iir = x;
+    s_seeded = true;
+
+    uint32_t v = esp_adc_cal_raw_to_voltage((s_iir + (1 << (ADC_FRAC_BITS - 1))) >> ADC_FRAC_BITS, &s_chars);
+
+    uint32_t head = s_head;
+    adc_probe_point_t * pt = &s_ring[head & (CONFIG_WC_ADC_SERIES_LEN - 1)];
+    pt->ts_ms = (uint32_t) (esp_timer_get_time() / 1000);
+    pt->mv = v;
+    __sync_synchronize();
+    s_head = head + 1;
+    s_value = v;
+
+    bool ev = false;
+    taskENTER_CRITICAL(&s_mux);
+    int zone = adc_zone(v, s_zone, &s_ev);
+    if (s_ev.low_mv || s_ev.high_mv || s_ev.delta_mv) {
+        if (!s_reported || zone != s_zone)
+            ev = true;
+        else if (s_ev.delta_mv && ((v > s_reported_mv) ? v - s_reported_mv : s_reported_mv - v) >= s_ev.delta_mv)
+            ev = true;
+    }
+    s_zone = zone;
+    if (ev) {
+        s_reported = true;
+        s_reported_mv = v;
+    }
+    taskEXIT_CRITICAL(&s_mux);
+
+    *mv = v;
+    if (event)
+        *event = ev;
+    return ESP_OK;
+}
+
+uint32_t adc_probe_value()
+{
+    return s_value;
+}
+
+size_t adc_probe_series(uint32_t since_ms, adc_probe_point_t * out, size_t max)
+{
+    uint32_t head = s_head;
+    __sync_synchronize();
+    uint32_t start = (head > CONFIG_WC_ADC_SERIES_LEN) ? head - CONFIG_WC_ADC_SERIES_LEN : 0;
+    if (head - start > max)
+        start = head - max;
+    size_t n = 0;
+    for (uint32_t i = start; i != head; i++) {
+        adc_probe_point_t pt = s_ring[i & (CONFIG_WC_ADC_SERIES_LEN - 1)];
+        if (n == 0 && since_ms && (int32_t) (pt.ts_ms - since_ms) <= 0) {
+            // older than requested
+            start = i + 1;
+            continue;
+        }
+        out[n++] = pt;
+    }
+    __sync_synchronize();
+
+    // slots older than valid were overwritten, the one of s_head may be in writing
+    uint32_t head2 = s_head;
+    uint32_t valid = (head2 + 1 > CONFIG_WC_ADC_SERIES_LEN) ? head2 + 1 - CONFIG_WC_ADC_SERIES_LEN : 0;
+    if ((int32_t) (valid - start) > 0) {
+        size_t drop = valid - start;
+        if (drop > n)
+            drop = n;
+        memmove(out, out + drop, (n - drop) * sizeof(adc_probe_point_t));
+        n -= drop;
+    }
+    return n;
+}
+
+void adc_probe_set_events(const adc_probe_events_t * ev)
+{
+    taskENTER_CRITICAL(&s_mux);
+    s_ev = *ev;
+    // the next sample is reported with the new settings
+    s_reported = false;
+    taskEXIT_CRITICAL(&s_mux);
+}
+
+void adc_probe_get_events(adc_probe_events_t * ev)
+{
+    taskENTER_CRITICAL(&s_mux);
+    *ev = s_ev;
+    taskEXIT_CRITICAL(&s_mux);
+}
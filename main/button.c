@@ -12,23 +12,21 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include <stdio.h>
+#include <stdbool.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "freertos/queue.h"
-#include "freertos/timers.h"
+#include "freertos/semphr.h"
 #include "esp_log.h"
 #include "driver/gpio.h"
 #include "iot_button.h"
 #include "esp_timer.h"
 
-#define USE_ESP_TIMER   1
-#if USE_ESP_TIMER
-#define STOP_TIMER(tmr)   esp_timer_stop(tmr)
-#define DELETE_TIMER(tmr) esp_timer_delete(tmr)
-#else
-#define STOP_TIMER(tmr)   xTimerStop(tmr, portMAX_DELAY)
-#define DELETE_TIMER(tmr) xTimerDelete(tmr, portMAX_DELAY);
-#endif
+/*
+ * All the buttons share one task. The GPIO ISR only puts the level and the
+ * time of the edge to a ring, the task turns the edges into deadlines
+ * (glitch filter, serial trigger, long press) kept in one list sorted by
+ * time and sleeps until the nearest of them
+ */
 
 #define IOT_CHECK(tag, a, ret)  if(!(a)) {                                             \
         ESP_LOGE(tag,"%s:%d (%s)", __FILE__, __LINE__, __FUNCTION__);      \
@@ -45,17 +43,20 @@ typedef enum {
 
 typedef struct button_dev button_dev_t;
 typedef struct btn_cb button_cb_t;
+typedef struct btn_deadline btn_deadline_t;
+
+struct btn_deadline{
+    int64_t due;                // esp_timer time, us
+    bool armed;
+    void (* fire)(button_dev_t *btn, int64_t now);
+    button_dev_t *pbtn;
+    btn_deadline_t *next;
+};
 
 struct btn_cb{
-    TickType_t interval;
+    int64_t interval_us;
     button_cb cb;
     void* arg;
-    #if !USE_ESP_TIMER
-    TimerHandle_t tmr;
-    #else
-    esp_timer_handle_t tmr;
-    #endif
-    button_dev_t *pbtn;
     button_cb_t *next_cb;
 };
 
@@ -68,22 +69,87 @@ struct button_dev{
     button_cb_t tap_psh_cb;
     button_cb_t tap_rls_cb;
     button_cb_t press_serial_cb;
-    button_cb_t* cb_head;
+    button_cb_t* cb_head;       // custom press callbacks, by interval
+    button_cb_t* press_next;    // next custom callback of the press
+    int64_t press_us;           // time of the last active edge
+    btn_deadline_t psh_dl;
+    btn_deadline_t rls_dl;
+    btn_deadline_t serial_dl;
+    btn_deadline_t press_dl;
+    button_dev_t *next;
 };
 
+typedef struct {
+    button_dev_t *btn;
+    int64_t ts;
+    int level;
+} btn_edge_t;
+
 #define BUTTON_GLITCH_FILTER_TIME_MS   CONFIG_BUTTON_IO_GLITCH_FILTER_TIME_MS
+#define BUTTON_GLITCH_FILTER_US        (BUTTON_GLITCH_FILTER_TIME_MS * 1000)
+#define BUTTON_EDGE_RING_LEN           16
+#define BUTTON_TASK_STACK              3584
+#define BUTTON_TASK_PRIORITY           5
 static const char* TAG = "button";
 
-// static void button_press_cb(xTimerHandle tmr)
-static void button_press_cb(void* tmr)
+/* written by the GPIO ISR, read by the button task */
+static btn_edge_t s_edges[BUTTON_EDGE_RING_LEN];
+static volatile uint32_t s_edge_head = 0;
+static volatile uint32_t s_edge_tail = 0;
+static volatile uint32_t s_edge_ovf = 0;
+
+/* the rest is guarded by s_lock - the callbacks may call the API */
+static SemaphoreHandle_t s_lock = NULL;
+static TaskHandle_t s_task = NULL;
+static button_dev_t *s_buttons = NULL;
+static btn_deadline_t *s_deadlines = NULL;
+
+static void deadline_disarm(btn_deadline_t *dl)
+{
+    if (!dl->armed) {
+        return;
+    }
+    for (btn_deadline_t **pp = &s_deadlines; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == dl) {
+            *pp = dl->next;
+            break;
+        }
+    }
+    dl->armed = false;
+}
+
+static void deadline_arm(btn_deadline_t *dl, int64_t due)
+{
+    deadline_disarm(dl);
+    dl->due = due;
+    btn_deadline_t **pp = &s_deadlines;
+    while (*pp != NULL && (*pp)->due <= due) {
+        pp = &(*pp)->next;
+    }
+    dl->next = *pp;
+    *pp = dl;
+    dl->armed = true;
+}
+
+static void deadline_init(btn_deadline_t *dl, button_dev_t *btn, void (* fire)(button_dev_t *, int64_t))
 {
-    #if !USE_ESP_TIMER
-    button_cb_t* btn_cb = (button_cb_t*) pvTimerGetTimerID(tmr);
-    #else
-    button_cb_t* btn_cb = (button_cb_t*)(tmr);
-    #endif
+    dl->armed = false;
+    dl->fire = fire;
+    dl->pbtn = btn;
+    dl->next = NULL;
+}
 
-    button_dev_t* btn = btn_cb->pbtn;
+static void button_press_fire(button_dev_t* btn, int64_t now)
+{
+    button_cb_t* btn_cb = btn->press_next;
+    if (btn_cb == NULL) {
+        return;
+    }
+    // one deadline per button - the next custom callback is armed here
+    btn->press_next = btn_cb->next_cb;
+    if (btn->press_next) {
+        deadline_arm(&btn->press_dl, btn->press_us + btn->press_next->interval_us);
+    }
     // low, then restart
     if (btn->active_level == gpio_get_level(btn->io_num)) {
         btn->state = BUTTON_STATE_PRESSED;
@@ -93,73 +159,36 @@ static void button_press_cb(void* tmr)
     }
 }
 
-// static void button_tap_psh_cb(xTimerHandle tmr)
-static void button_tap_psh_cb(void* tmr)
+static void button_tap_psh_fire(button_dev_t* btn, int64_t now)
 {
-    #if !USE_ESP_TIMER
-    button_cb_t* btn_cb = (button_cb_t*) pvTimerGetTimerID(tmr);
-    #else
-    button_cb_t* btn_cb = (button_cb_t*)(tmr);
-    #endif
-
-    button_dev_t* btn = btn_cb->pbtn;
-    STOP_TIMER(btn->tap_rls_cb.tmr);
+    deadline_disarm(&btn->rls_dl);
 
     int lv = gpio_get_level(btn->io_num);
 
     if (btn->active_level == lv) {
         // high, then key is up
         btn->state = BUTTON_STATE_PUSH;
-        if (btn->press_serial_cb.tmr) {
-            #if !USE_ESP_TIMER
-            xTimerChangePeriod(btn->press_serial_cb.tmr, btn->serial_thres_sec*1000 / portTICK_PERIOD_MS, portMAX_DELAY);
-            xTimerReset(btn->press_serial_cb.tmr, portMAX_DELAY);
-            #else
-            esp_timer_stop(btn->press_serial_cb.tmr);
-            esp_timer_start_once(btn->press_serial_cb.tmr, btn->serial_thres_sec * 1000 * 1000);
-            #endif
-
+        if (btn->press_serial_cb.cb) {
+            deadline_arm(&btn->serial_dl, now + (int64_t) btn->serial_thres_sec * 1000 * 1000);
         }
         if (btn->tap_psh_cb.cb) {
             btn->tap_psh_cb.cb(btn->tap_psh_cb.arg);
         }
     } else {
         // 50ms, check if this is a real key up
-        if (btn->tap_rls_cb.tmr) {
-            STOP_TIMER(btn->tap_rls_cb.tmr);
-            #if !USE_ESP_TIMER
-            xTimerReset(btn->tap_rls_cb.tmr, portMAX_DELAY);
-            #else
-            esp_timer_start_once(btn->tap_rls_cb.tmr, btn->tap_rls_cb.interval * portTICK_PERIOD_MS * 1000);
-            #endif
-        }
+        deadline_arm(&btn->rls_dl, now + BUTTON_GLITCH_FILTER_US);
     }
 }
 
-static void button_tap_rls_cb(void* tmr)
+static void button_tap_rls_fire(button_dev_t* btn, int64_t now)
 {
-    #if !USE_ESP_TIMER
-    button_cb_t* btn_cb = (button_cb_t*) pvTimerGetTimerID(tmr);
-    #else
-    button_cb_t* btn_cb = (button_cb_t*)(tmr);
-    #endif
-    button_dev_t* btn = btn_cb->pbtn;
-    STOP_TIMER(btn->tap_rls_cb.tmr);
-
     if (btn->active_level == gpio_get_level(btn->io_num)) {
 
     } else {
         // high, then key is up
-        button_cb_t *pcb = btn->cb_head;
-        while (pcb != NULL) {
-            if (pcb->tmr != NULL) {
-                STOP_TIMER(pcb->tmr);
-            }
-            pcb = pcb->next_cb;
-        }
-        if (btn->press_serial_cb.tmr && btn->press_serial_cb.tmr != NULL) {
-            STOP_TIMER(btn->press_serial_cb.tmr);
-        }
+        deadline_disarm(&btn->press_dl);
+        btn->press_next = NULL;
+        deadline_disarm(&btn->serial_dl);
         if (btn->tap_short_cb.cb && btn->state == BUTTON_STATE_PUSH) {
             btn->tap_short_cb.cb(btn->tap_short_cb.arg);
         }
@@ -170,83 +199,103 @@ static void button_tap_rls_cb(void* tmr)
     }
 }
 
-static void button_press_serial_cb(void* tmr)
+static void button_press_serial_fire(button_dev_t* btn, int64_t now)
 {
-    #if !USE_ESP_TIMER
-    button_dev_t* btn = (button_dev_t*) pvTimerGetTimerID(tmr);
-    #else
-    button_dev_t* btn = (button_dev_t*)(tmr);
-    #endif
-
     if (btn->press_serial_cb.cb) {
         btn->press_serial_cb.cb(btn->press_serial_cb.arg);
+        deadline_arm(&btn->serial_dl, now + btn->press_serial_cb.interval_us);
     }
-    #if !USE_ESP_TIMER
-    xTimerChangePeriod(btn->press_serial_cb.tmr, btn->press_serial_cb.interval, portMAX_DELAY);
-    xTimerReset(btn->press_serial_cb.tmr, portMAX_DELAY);
-    #else
-    esp_timer_stop(btn->press_serial_cb.tmr);
-    esp_timer_start_once(btn->press_serial_cb.tmr, btn->press_serial_cb.interval * portTICK_PERIOD_MS * 1000);
-    #endif
 }
 
-static void button_gpio_isr_handler(void* arg)
+static void button_edge(button_dev_t* btn, int level, int64_t ts)
 {
-    button_dev_t* btn = (button_dev_t*) arg;
-    portBASE_TYPE HPTaskAwoken = pdFALSE;
-    int level = gpio_get_level(btn->io_num);
     if (level == btn->active_level) {
-        if (btn->tap_psh_cb.tmr) {
-            #if !USE_ESP_TIMER
-            xTimerStopFromISR(btn->tap_psh_cb.tmr, &HPTaskAwoken);
-            xTimerResetFromISR(btn->tap_psh_cb.tmr, &HPTaskAwoken);
-            #else
-            esp_timer_stop(btn->tap_psh_cb.tmr);
-            esp_timer_start_once(btn->tap_psh_cb.tmr, btn->tap_psh_cb.interval * portTICK_PERIOD_MS * 1000);
-            #endif
+        deadline_arm(&btn->psh_dl, ts + BUTTON_GLITCH_FILTER_US);
+        // the long press is counted from the last bounce
+        btn->press_us = ts;
+        btn->press_next = btn->cb_head;
+        if (btn->press_next) {
+            deadline_arm(&btn->press_dl, ts + btn->press_next->interval_us);
         }
+    } else {
+        // 50ms, check if this is a real key up
+        deadline_arm(&btn->rls_dl, ts + BUTTON_GLITCH_FILTER_US);
+    }
+}
 
-        button_cb_t *pcb = btn->cb_head;
-        while (pcb != NULL) {
-            if (pcb->tmr != NULL) {
-                #if !USE_ESP_TIMER
-                xTimerStopFromISR(pcb->tmr, &HPTaskAwoken);
-                xTimerResetFromISR(pcb->tmr, &HPTaskAwoken);
-                #else
-                esp_timer_stop(pcb->tmr);
-                esp_timer_start_once(pcb->tmr, pcb->interval * portTICK_PERIOD_MS * 1000);
-                #endif
+static void button_task(void* arg)
+{
+    uint32_t ovf = 0;
+    while (1) {
+        xSemaphoreTakeRecursive(s_lock, portMAX_DELAY);
+        while (s_edge_tail != s_edge_head) {
+            btn_edge_t edge = s_edges[s_edge_tail % BUTTON_EDGE_RING_LEN];
+            __sync_synchronize();
+            s_edge_tail++;
+            if (edge.btn) {
+                button_edge(edge.btn, edge.level, edge.ts);
             }
-            pcb = pcb->next_cb;
         }
-    } else {
-        // 50ms, check if this is a real key up
-        if (btn->tap_rls_cb.tmr) {
-            #if !USE_ESP_TIMER
-            xTimerStopFromISR(btn->tap_rls_cb.tmr, &HPTaskAwoken);
-            xTimerResetFromISR(btn->tap_rls_cb.tmr, &HPTaskAwoken);
-            #else
-            esp_timer_stop(btn->tap_rls_cb.tmr);
-            esp_timer_start_once(btn->tap_rls_cb.tmr, btn->tap_rls_cb.interval * portTICK_PERIOD_MS * 1000);
-            #endif
+        int64_t now = esp_timer_get_time();
+        if (ovf != s_edge_ovf) {
+            ovf = s_edge_ovf;
+            // edges were lost - take the levels as they are now
+            ESP_LOGW(TAG, "Edge ring overflow");
+            for (button_dev_t *btn = s_buttons; btn != NULL; btn = btn->next) {
+                button_edge(btn, gpio_get_level(btn->io_num), now);
+            }
+        }
+        while (s_deadlines != NULL && s_deadlines->due <= now) {
+            btn_deadline_t *dl = s_deadlines;
+            deadline_disarm(dl);
+            dl->fire(dl->pbtn, now);
         }
+        TickType_t wait = portMAX_DELAY;
+        if (s_deadlines != NULL) {
+            int64_t tick_us = portTICK_PERIOD_MS * 1000;
+            wait = (TickType_t) ((s_deadlines->due - now + tick_us - 1) / tick_us);
+        }
+        xSemaphoreGiveRecursive(s_lock);
+        ulTaskNotifyTake(pdTRUE, wait);
     }
+}
+
+static void button_gpio_isr_handler(void* arg)
+{
+    button_dev_t* btn = (button_dev_t*) arg;
+    portBASE_TYPE HPTaskAwoken = pdFALSE;
+    uint32_t head = s_edge_head;
+    if (head - s_edge_tail < BUTTON_EDGE_RING_LEN) {
+        btn_edge_t *edge = &s_edges[head % BUTTON_EDGE_RING_LEN];
+        edge->btn = btn;
+        edge->level = gpio_get_level(btn->io_num);
+        edge->ts = esp_timer_get_time();
+        __sync_synchronize();
+        s_edge_head = head + 1;
+    } else {
+        s_edge_ovf++;
+    }
+    vTaskNotifyGiveFromISR(s_task, &HPTaskAwoken);
     if(HPTaskAwoken == pdTRUE) {
         portYIELD_FROM_ISR();
     }
 }
 
-#if !USE_ESP_TIMER
-static void button_free_tmr(xTimerHandle* tmr)
-#else
-static void button_free_tmr(esp_timer_handle_t *tmr)
-#endif
+static esp_err_t button_task_start()
 {
-    if (tmr && *tmr) {
-        STOP_TIMER(*tmr);
-        DELETE_TIMER(*tmr);
-        *tmr = NULL;
+    if (s_task != NULL) {
+        return ESP_OK;
+    }
+    s_lock = xSemaphoreCreateRecursiveMutex();
+    POINT_ASSERT(TAG, s_lock, ESP_FAIL);
+    if (xTaskCreate(button_task, "button", BUTTON_TASK_STACK, NULL, BUTTON_TASK_PRIORITY, &s_task) != pdPASS) {
+        vSemaphoreDelete(s_lock);
+        s_lock = NULL;
+        s_task = NULL;
+        ESP_LOGE(TAG, "Button task is not created");
+        return ESP_FAIL;
     }
+    return ESP_OK;
 }
 
 esp_err_t iot_button_delete(button_handle_t btn_handle)
@@ -256,15 +305,28 @@ esp_err_t iot_button_delete(button_handle_t btn_handle)
     gpio_set_intr_type(btn->io_num, GPIO_INTR_DISABLE);
     gpio_isr_handler_remove(btn->io_num);
 
-    button_free_tmr(&btn->tap_rls_cb.tmr);
-    button_free_tmr(&btn->tap_psh_cb.tmr);
-    button_free_tmr(&btn->tap_short_cb.tmr);
-    button_free_tmr(&btn->press_serial_cb.tmr);
+    xSemaphoreTakeRecursive(s_lock, portMAX_DELAY);
+    deadline_disarm(&btn->psh_dl);
+    deadline_disarm(&btn->rls_dl);
+    deadline_disarm(&btn->serial_dl);
+    deadline_disarm(&btn->press_dl);
+    // edges of the button not handled yet
+    for (uint32_t i = s_edge_tail; i != s_edge_head; i++) {
+        if (s_edges[i % BUTTON_EDGE_RING_LEN].btn == btn) {
+            s_edges[i % BUTTON_EDGE_RING_LEN].btn = NULL;
+        }
+    }
+    for (button_dev_t **pp = &s_buttons; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == btn) {
+            *pp = btn->next;
+            break;
+        }
+    }
+    xSemaphoreGiveRecursive(s_lock);
 
     button_cb_t *pcb = btn->cb_head;
     while (pcb != NULL) {
         button_cb_t *cb_next = pcb->next_cb;
-        button_free_tmr(&pcb->tmr);
         free(pcb);
         pcb = cb_next;
     }
@@ -274,48 +336,23 @@ esp_err_t iot_button_delete(button_handle_t btn_handle)
 
 button_handle_t iot_button_create(gpio_num_t gpio_num, button_active_t active_level)
 {
-    #if USE_ESP_TIMER
-    ets_printf("use esp timer !!!\n");
-    esp_timer_init();
-    #endif
-
     IOT_CHECK(TAG, gpio_num < GPIO_NUM_MAX, NULL);
+    IOT_CHECK(TAG, button_task_start() == ESP_OK, NULL);
     button_dev_t* btn = (button_dev_t*) calloc(1, sizeof(button_dev_t));
     POINT_ASSERT(TAG, btn, NULL);
     btn->active_level = active_level;
     btn->io_num = gpio_num;
     btn->state = BUTTON_STATE_IDLE;
-    btn->tap_rls_cb.arg = NULL;
-    btn->tap_rls_cb.cb = NULL;
-    btn->tap_rls_cb.interval = BUTTON_GLITCH_FILTER_TIME_MS / portTICK_PERIOD_MS;
-    btn->tap_rls_cb.pbtn = btn;
-    #if !USE_ESP_TIMER
-    btn->tap_rls_cb.tmr = xTimerCreate("btn_rls_tmr", btn->tap_rls_cb.interval, pdFALSE,
-            &btn->tap_rls_cb, button_tap_rls_cb);
-    #else
-    esp_timer_create_args_t tmr_param_rls;
-    tmr_param_rls.arg = &btn->tap_rls_cb;
-    tmr_param_rls.callback = button_tap_rls_cb;
-    tmr_param_rls.dispatch_method = ESP_TIMER_TASK;
-    tmr_param_rls.name = "btn_rls_tmr";
-    esp_timer_create(&tmr_param_rls, &btn->tap_rls_cb.tmr);
-    #endif
-
-    btn->tap_psh_cb.arg = NULL;
-    btn->tap_psh_cb.cb = NULL;
-    btn->tap_psh_cb.interval = BUTTON_GLITCH_FILTER_TIME_MS / portTICK_PERIOD_MS;
-    btn->tap_psh_cb.pbtn = btn;
-    #if !USE_ESP_TIMER
-    btn->tap_psh_cb.tmr = xTimerCreate("btn_psh_tmr", btn->tap_psh_cb.interval, pdFALSE,
-            &btn->tap_psh_cb, button_tap_psh_cb);
-    #else
-    esp_timer_create_args_t tmr_param_psh;
-    tmr_param_psh.arg = &btn->tap_psh_cb;
-    tmr_param_psh.callback = button_tap_psh_cb;
-    tmr_param_psh.dispatch_method = ESP_TIMER_TASK;
-    tmr_param_psh.name = "btn_psh_tmr";
-    esp_timer_create(&tmr_param_psh, &btn->tap_psh_cb.tmr);
-    #endif
+    deadline_init(&btn->psh_dl, btn, button_tap_psh_fire);
+    deadline_init(&btn->rls_dl, btn, button_tap_rls_fire);
+    deadline_init(&btn->serial_dl, btn, button_press_serial_fire);
+    deadline_init(&btn->press_dl, btn, button_press_fire);
+
+    xSemaphoreTakeRecursive(s_lock, portMAX_DELAY);
+    btn->next = s_buttons;
+    s_buttons = btn;
+    xSemaphoreGiveRecursive(s_lock);
+
     gpio_install_isr_service(0);
     gpio_config_t gpio_conf;
     gpio_conf.intr_type = GPIO_INTR_ANYEDGE;
@@ -330,6 +367,7 @@ button_handle_t iot_button_create(gpio_num_t gpio_num, button_active_t active_le
 
 esp_err_t iot_button_rm_cb(button_handle_t btn_handle, button_cb_type_t type)
 {
+    POINT_ASSERT(TAG, btn_handle, ESP_ERR_INVALID_ARG);
     button_dev_t* btn = (button_dev_t*) btn_handle;
     button_cb_t* btn_cb = NULL;
     if (type == BUTTON_CB_PUSH) {
@@ -341,38 +379,27 @@ esp_err_t iot_button_rm_cb(button_handle_t btn_handle, button_cb_type_t type)
     } else if (type == BUTTON_CB_SERIAL) {
         btn_cb = &btn->press_serial_cb;
     }
+    IOT_CHECK(TAG, btn_cb != NULL, ESP_ERR_INVALID_ARG);
+    xSemaphoreTakeRecursive(s_lock, portMAX_DELAY);
     btn_cb->cb = NULL;
     btn_cb->arg = NULL;
-    btn_cb->pbtn = btn;
-    button_free_tmr(&btn_cb->tmr);
+    if (type == BUTTON_CB_SERIAL) {
+        deadline_disarm(&btn->serial_dl);
+    }
+    xSemaphoreGiveRecursive(s_lock);
     return ESP_OK;
 }
 
 esp_err_t iot_button_set_serial_cb(button_handle_t btn_handle, uint32_t start_after_sec, TickType_t interval_tick, button_cb cb, void* arg)
 {
+    POINT_ASSERT(TAG, btn_handle, ESP_ERR_INVALID_ARG);
     button_dev_t* btn = (button_dev_t*) btn_handle;
+    xSemaphoreTakeRecursive(s_lock, portMAX_DELAY);
     btn->serial_thres_sec = start_after_sec;
-
-    if (btn->press_serial_cb.tmr == NULL) {
-        #if !USE_ESP_TIMER
-        btn->press_serial_cb.tmr = xTimerCreate("btn_serial_tmr", btn->serial_thres_sec*1000 / portTICK_PERIOD_MS,
-                            pdFALSE, btn, button_press_serial_cb);
-        #else
-        esp_timer_create_args_t tmr_param_ser;
-        tmr_param_ser.arg = btn;
-        tmr_param_ser.callback = button_press_serial_cb;
-        tmr_param_ser.dispatch_method = ESP_TIMER_TASK;
-        tmr_param_ser.name = "btn_serial_tmr";
-        esp_timer_create(&tmr_param_ser, &btn->press_serial_cb.tmr);
-        #endif
-    }
     btn->press_serial_cb.arg = arg;
     btn->press_serial_cb.cb = cb;
-    btn->press_serial_cb.interval = interval_tick;
-    btn->press_serial_cb.pbtn = btn;
-    #if !USE_ESP_TIMER
-    xTimerChangePeriod(btn->press_serial_cb.tmr, btn->serial_thres_sec*1000 / portTICK_PERIOD_MS, portMAX_DELAY);
-    #endif
+    btn->press_serial_cb.interval_us = (int64_t) interval_tick * portTICK_PERIOD_MS * 1000;
+    xSemaphoreGiveRecursive(s_lock);
     return ESP_OK;
 }
 
@@ -380,30 +407,21 @@ esp_err_t iot_button_set_evt_cb(button_handle_t btn_handle, button_cb_type_t typ
 {
     POINT_ASSERT(TAG, btn_handle, ESP_ERR_INVALID_ARG);
     button_dev_t* btn = (button_dev_t*) btn_handle;
+    if (type == BUTTON_CB_SERIAL) {
+        return iot_button_set_serial_cb(btn_handle, 1, 1000 / portTICK_RATE_MS, cb, arg);
+    }
+    xSemaphoreTakeRecursive(s_lock, portMAX_DELAY);
     if (type == BUTTON_CB_PUSH) {
         btn->tap_psh_cb.arg = arg;
         btn->tap_psh_cb.cb = cb;
-        btn->tap_psh_cb.interval = BUTTON_GLITCH_FILTER_TIME_MS / portTICK_RATE_MS;
-        btn->tap_psh_cb.pbtn = btn;
-        #if !USE_ESP_TIMER
-        xTimerChangePeriod(btn->tap_psh_cb.tmr, btn->tap_psh_cb.interval, portMAX_DELAY);
-        #endif
     } else if (type == BUTTON_CB_RELEASE) {
         btn->tap_rls_cb.arg = arg;
         btn->tap_rls_cb.cb = cb;
-        btn->tap_rls_cb.interval = BUTTON_GLITCH_FILTER_TIME_MS / portTICK_RATE_MS;
-        btn->tap_rls_cb.pbtn = btn;
-        #if !USE_ESP_TIMER
-        xTimerChangePeriod(btn->tap_rls_cb.tmr, btn->tap_psh_cb.interval, portMAX_DELAY);
-        #endif
     } else if (type == BUTTON_CB_TAP) {
         btn->tap_short_cb.arg = arg;
         btn->tap_short_cb.cb = cb;
-        btn->tap_short_cb.interval = BUTTON_GLITCH_FILTER_TIME_MS / portTICK_RATE_MS;
-        btn->tap_short_cb.pbtn = btn;
-    } else if (type == BUTTON_CB_SERIAL) {
-        iot_button_set_serial_cb(btn_handle, 1, 1000 / portTICK_RATE_MS, cb, arg);
     }
+    xSemaphoreGiveRecursive(s_lock);
     return ESP_OK;
 }
 
@@ -416,19 +434,16 @@ esp_err_t iot_button_add_custom_cb(button_handle_t btn_handle, uint32_t press_se
     POINT_ASSERT(TAG, cb_new, ESP_FAIL);
     cb_new->arg = arg;
     cb_new->cb = cb;
-    cb_new->interval = press_sec * 1000 / portTICK_PERIOD_MS;
-    cb_new->pbtn = btn;
-    #if !USE_ESP_TIMER
-    cb_new->tmr = xTimerCreate("btn_press_tmr", cb_new->interval, pdFALSE, cb_new, button_press_cb);
-    #else
-    esp_timer_create_args_t tmr_param_cus;
-    tmr_param_cus.arg = cb_new;
-    tmr_param_cus.callback = button_press_cb;
-    tmr_param_cus.dispatch_method = ESP_TIMER_TASK;
-    tmr_param_cus.name = "btn_press_custom_tmr";
-    esp_timer_create(&tmr_param_cus, &cb_new->tmr);
-    #endif
-    cb_new->next_cb = btn->cb_head;
-    btn->cb_head = cb_new;
+    cb_new->interval_us = (int64_t) press_sec * 1000 * 1000;
+
+    // sorted by the press time, a press in progress is not affected
+    xSemaphoreTakeRecursive(s_lock, portMAX_DELAY);
+    button_cb_t **pp = &btn->cb_head;
+    while (*pp != NULL && (*pp)->interval_us <= cb_new->interval_us) {
+        pp = &(*pp)->next_cb;
+    }
+    cb_new->next_cb = *pp;
+    *pp = cb_new;
+    xSemaphoreGiveRecursive(s_lock);
     return ESP_OK;
 }
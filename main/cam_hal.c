@@ -15,13 +15,132 @@
 #include <stdio.h>
 #include <string.h>
 #include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "driver/gpio.h"
+#include "hal/gpio_ll.h"
 #include "ll_cam.h"
 #include "cam_hal.h"
+#include "wc_mem.h"
+#include "wc_trace.h"
 
 static const char *TAG = "cam_hal";
 
 static cam_obj_t *cam_obj = NULL;
 
+/*
+ * All the camera memory is carved from two arenas reserved once and kept
+ * between cam_deinit/cam_init cycles, so reconfiguration does not fragment
+ * the heap. cam_deinit only resets them.
+ *   fb arena  - frame buffers (PSRAM or internal RAM by fb_location)
+ *   dma arena - cam_obj, frames, DMA descriptors and DMA buffer (internal, DMA capable)
+ */
+typedef struct {
+    uint8_t *base;
+    size_t size;
+    size_t used;
+    uint32_t caps;
+    wc_mem_tag_t tag;
+} cam_arena_t;
+
+static cam_arena_t s_fb_arena = { .tag = WC_MEM_CAMERA };
+static cam_arena_t s_dma_arena = { .tag = WC_MEM_CAM_DMA };
+
+/* JPEG mode uses 8 x 4KB DMA buffer, RGB modes up to CONFIG_CAMERA_DMA_BUFFER_SIZE_MAX */
+#define CAM_DMA_BUFFER_MAX (CONFIG_CAMERA_DMA_BUFFER_SIZE_MAX > 32768 ? CONFIG_CAMERA_DMA_BUFFER_SIZE_MAX : 32768)
+/* cam_obj, frames and DMA descriptors */
+#define CAM_DMA_ARENA_EXTRA 4096
+/* room for the alignment of the PSRAM frame buffers */
+#define CAM_FB_ARENA_ALIGN 64
+
+static bool cam_arena_reserve(cam_arena_t *arena, size_t size, uint32_t caps)
+{
+    arena->used = 0;
+    if (arena->base && arena->size >= size && arena->caps == caps) {
+        return true;
+    }
+    wc_mem_free(arena->base);
+    arena->size = 0;
+    arena->base = (uint8_t *)wc_mem_malloc(arena->tag, size, caps);
+    if (arena->base == NULL) {
+        ESP_LOGE(TAG, "Arena %d Byte malloc failed, the current largest free block:%d Byte", size, heap_caps_get_largest_free_block(caps));
+        return false;
+    }
+    arena->size = size;
+    arena->caps = caps;
+    return true;
+}
+
+static void *cam_arena_alloc(cam_arena_t *arena, size_t size, size_t align)
+{
+    if (arena->base == NULL) {
+        return NULL;
+    }
+    if (align < 4) {
+        align = 4;
+    }
+    uintptr_t start = (uintptr_t)arena->base;
+    size_t offset = ((start + arena->used + align - 1) & ~(uintptr_t)(align - 1)) - start;
+    if (offset + size > arena->size) {
+        ESP_LOGE(TAG, "Arena is full: %d of %d Byte used, %d Byte requested", arena->used, arena->size, size);
+        return NULL;
+    }
+    arena->used = offset + size;
+    return arena->base + offset;
+}
+
+/* DMA layouts chosen for the format and the frame size of the sensor output */
+#define CAM_DMA_TABLE_LEN 8
+
+typedef struct {
+    uint8_t format;
+    uint8_t frame_size;
+    cam_dma_geometry_t geometry;
+} cam_dma_entry_t;
+
+static cam_dma_entry_t s_dma_table[CAM_DMA_TABLE_LEN];
+static int s_dma_table_len = 0;
+
+static void cam_arena_stats(void)
+{
+    ESP_LOGI(TAG, "Arenas: fb %d/%d Byte, dma %d/%d Byte. Largest free block: psram %d Byte, dma %d Byte",
+             s_fb_arena.used, s_fb_arena.size, s_dma_arena.used, s_dma_arena.size,
+             heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM), heap_caps_get_largest_free_block(MALLOC_CAP_DMA));
+}
+
+/* health counters - updated by cam_task, the copy worker and cam_take callers */
+static camera_stats_t s_stats = {0};
+static portMUX_TYPE s_stats_lock = portMUX_INITIALIZER_UNLOCKED;   // 64-bit bytes_delivered and DMA times
+
+#define CAM_STAT_INC(field) __atomic_fetch_add(&s_stats.field, 1, __ATOMIC_RELAXED)
+
+/* cam_task and the copy worker add to the DMA stats from both cores */
+#define CAM_DMA_STAT_INC(field) __atomic_fetch_add(&cam_obj->dma_stats.field, 1, __ATOMIC_RELAXED)
+#define CAM_DMA_STAT_ADD_US(field, us) do {                                  \
+        portENTER_CRITICAL(&s_stats_lock);                                   \
+        cam_obj->dma_stats.field += (us);                                    \
+        portEXIT_CRITICAL(&s_stats_lock);                                    \
+    } while (0)
+
+/* cam_task notification bits */
+#define CAM_NOTIFY_EVENT    (1 << 0)       // ISR: EOF or VSYNC counted
+#define CAM_NOTIFY_COPY     (1 << 1)       // copy worker: the ring is empty
+#define CAM_NOTIFY_SETTLE   (1 << 2)       // cam_settle: the sensor was reconfigured
+
+/* sees the valid JPEG frames in cam_take, on the task that takes them */
+static cam_frame_hook_t s_frame_hook = NULL;
+static void *s_frame_hook_arg = NULL;
+
+/* flash request - switched by cam_task on VSYNC through the set/clear
+   registers, the other outputs (out_seq of the application) are not touched */
+static struct {
+    int pin;                     // -1 - no request
+    int on_level;
+    uint8_t frames;
+    bool lit;
+    uint32_t off_vsync;
+} s_flash = { .pin = -1 };
+static portMUX_TYPE s_flash_lock = portMUX_INITIALIZER_UNLOCKED;
+
 static const uint32_t JPEG_SOI_MARKER = 0xFFD8FF;  // written in little-endian for esp32
 static const uint16_t JPEG_EOI_MARKER = 0xD9FF;  // written in little-endian for esp32
 
@@ -37,6 +156,7 @@ static int cam_verify_jpeg_soi(const uint8_t *inbuf, uint32_t length)
             }
         }
         ESP_LOGW(TAG, "NO-SOI");
+        CAM_STAT_INC(no_soi);
         return -1;
     }
     return 0;
@@ -58,6 +178,92 @@ static int cam_verify_jpeg_eoi(const uint8_t *inbuf, uint32_t length)
     return -1;
 }
 
+#if CONFIG_CAMERA_JPEG_VALIDATE
+#define JPEG_M_SOF0 0xC0
+#define JPEG_M_SOF1 0xC1
+#define JPEG_M_DHT  0xC4
+#define JPEG_M_SOI  0xD8
+#define JPEG_M_EOI  0xD9
+#define JPEG_M_SOS  0xDA
+#define JPEG_M_DQT  0xDB
+
+/*
+ * Walk the marker segments from SOI to the start of the entropy coded data.
+ * length is the frame length up to EOI. Returns NULL if the structure is
+ * consistent or the reason of the failure
+ */
+static const char *cam_check_jpeg(const uint8_t *inbuf, uint32_t length, uint16_t width, uint16_t height)
+{
+    bool has_sof = false, has_dqt = false, has_dht = false;
+    uint32_t i = 2;
+
+    if (length < 4 || inbuf[0] != 0xFF || inbuf[1] != JPEG_M_SOI) {
+        return "SOI";
+    }
+    while (i + 4 <= length) {
+        if (inbuf[i] != 0xFF) {
+            return "MARKER";
+        }
+        uint8_t marker = inbuf[i + 1];
+        if (marker == 0xFF) {
+            i++; // fill byte
+            continue;
+        }
+        if (marker == JPEG_M_EOI) {
+            return "NO-SOS";
+        }
+        uint32_t seg = ((uint32_t)inbuf[i + 2] << 8) | inbuf[i + 3];
+        if (seg < 2 || i + 2 + seg > length) {
+            return "SEGMENT";
+        }
+        const uint8_t *p = &inbuf[i + 4];
+        switch (marker) {
+        case JPEG_M_SOF0:
+        case JPEG_M_SOF1:
+            // the component count p[5] is inside the segment only if seg >= 8
+            if (seg < 8 || seg < 8 + 3 * p[5] || p[0] != 8) {
+                return "SOF";
+            }
+            if (width && ((((uint16_t)p[1] << 8) | p[2]) != height || (((uint16_t)p[3] << 8) | p[4]) != width)) {
+                return "DIM";
+            }
+            has_sof = true;
+            break;
+        case JPEG_M_DQT:
+            has_dqt = true;
+            break;
+        case JPEG_M_DHT:
+            has_dht = true;
+            break;
+        case JPEG_M_SOS:
+            if (!has_sof || !has_dqt || !has_dht) {
+                return "TABLES";
+            }
+            if (seg < 3 || seg != 6 + 2 * p[0]) {
+                return "SOS";
+            }
+            // entropy coded data must not be empty
+            return (i + 2 + seg < length) ? NULL : "SCAN";
+        default:
+            if (marker >= 0xC2 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+                return "SOF"; // not a baseline frame
+            }
+            break;
+        }
+        i += 2 + seg;
+    }
+    return "NO-SOS";
+}
+#endif
+
+static void cam_frame_tap(const camera_fb_t *fb)
+{
+    cam_frame_hook_t hook = s_frame_hook;
+    if (hook) {
+        hook(fb, s_frame_hook_arg);
+    }
+}
+
 static bool cam_get_next_frame(int * frame_pos)
 {
     if(!cam_obj->frames[*frame_pos].en){
@@ -79,6 +285,7 @@ static bool cam_start_frame(int * frame_pos)
         if(ll_cam_start(cam_obj, *frame_pos)){
             // Vsync the frame manually
             ll_cam_do_vsync(cam_obj);
+            cam_obj->frames[*frame_pos].vsync = cam_obj->vsync_cnt;
             uint64_t us = (uint64_t)esp_timer_get_time();
             cam_obj->frames[*frame_pos].fb.timestamp.tv_sec = us / 1000000UL;
             cam_obj->frames[*frame_pos].fb.timestamp.tv_usec = us % 1000000UL;
@@ -88,137 +295,433 @@ static bool cam_start_frame(int * frame_pos)
     return false;
 }
 
+static int64_t s_stats_reset_us = 0;
+static uint32_t s_stats_isr_us = 0;         // cam_obj->isr_us at the reset
+
+static inline void cam_account_busy(int64_t since)
+{
+    CAM_DMA_STAT_ADD_US(busy_us[xPortGetCoreID() & 1], esp_timer_get_time() - since);
+}
+
+#if CONFIG_CAMERA_COPY_WORKER
+#if CONFIG_CAMERA_CORE0
+#define CAM_COPY_WORKER_CORE 1
+#elif CONFIG_CAMERA_CORE1
+#define CAM_COPY_WORKER_CORE 0
+#else
+#define CAM_COPY_WORKER_CORE tskNO_AFFINITY
+#endif
+
+/* copies half buffers queued by cam_task, wakes it up when the ring is empty */
+static void cam_copy_task(void *arg)
+{
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        while (cam_obj->copy_tail != cam_obj->copy_head) {
+            cam_copy_job_t *job = &cam_obj->copy_ring[cam_obj->copy_tail % CAM_COPY_RING_LEN];
+            int64_t t_copy = esp_timer_get_time();
+            WC_TRACE(WC_TR_COPY_B, job->len);
+            size_t len = ll_cam_memcpy(cam_obj, job->dst, job->src, job->len);
+            WC_TRACE(WC_TR_COPY_E, len);
+            CAM_DMA_STAT_ADD_US(copy_us, esp_timer_get_time() - t_copy);
+            cam_account_busy(t_copy);
+            if (len != job->out) {
+                cam_obj->copy_bad++;
+            }
+            // the job is read before it is given back to cam_task
+            __sync_synchronize();
+            cam_obj->copy_tail++;
+        }
+        // cam_task is deleted only after this task
+        portENTER_CRITICAL(&cam_obj->isr_lock);
+        TaskHandle_t task = cam_obj->task_handle;
+        portEXIT_CRITICAL(&cam_obj->isr_lock);
+        if (task) {
+            xTaskNotify(task, CAM_NOTIFY_COPY, eSetBits);
+        }
+    }
+}
+
+/* frame buffer bytes are reserved now, the data is there after cam_copy_wait */
+static size_t cam_copy(uint8_t *out, const uint8_t *in, size_t len, size_t expected)
+{
+    while (cam_obj->copy_head - cam_obj->copy_tail >= CAM_COPY_RING_LEN) {
+        xTaskNotifyWait(0, CAM_NOTIFY_COPY, NULL, portMAX_DELAY);
+    }
+    cam_copy_job_t *job = &cam_obj->copy_ring[cam_obj->copy_head % CAM_COPY_RING_LEN];
+    job->dst = out;
+    job->src = in;
+    job->len = len;
+    job->out = expected;
+    __sync_synchronize();
+    cam_obj->copy_head++;
+    xTaskNotifyGive(cam_obj->copy_task);
+    return expected;
+}
+
+/* returns the time spent waiting. the worker sets CAM_NOTIFY_COPY when the
+   ring is empty. ISR notifications taken here are not lost - cam_task
+   checks the event counters before it sleeps */
+static int64_t cam_copy_wait(void)
+{
+    if (cam_obj->copy_tail == cam_obj->copy_head) {
+        return 0;
+    }
+    int64_t start = esp_timer_get_time();
+    while (cam_obj->copy_tail != cam_obj->copy_head) {
+        xTaskNotifyWait(0, CAM_NOTIFY_COPY, NULL, portMAX_DELAY);
+    }
+    return esp_timer_get_time() - start;
+}
+
+/* half buffers not copied yet are still in use */
+static inline uint32_t cam_copy_pending(void)
+{
+    return cam_obj->copy_head - cam_obj->copy_tail;
+}
+#else
+static size_t cam_copy(uint8_t *out, const uint8_t *in, size_t len, size_t expected)
+{
+    int64_t t_copy = esp_timer_get_time();
+    WC_TRACE(WC_TR_COPY_B, len);
+    size_t r = ll_cam_memcpy(cam_obj, out, in, len);
+    WC_TRACE(WC_TR_COPY_E, r);
+    CAM_DMA_STAT_ADD_US(copy_us, esp_timer_get_time() - t_copy);
+    return r;
+}
+
+static inline int64_t cam_copy_wait(void)
+{
+    return 0;
+}
+
+static inline uint32_t cam_copy_pending(void)
+{
+    return 0;
+}
+#endif
+
 void IRAM_ATTR ll_cam_send_event(cam_obj_t *cam, cam_event_t cam_event, BaseType_t * HPTaskAwoken)
 {
-    if (xQueueSendFromISR(cam->event_queue, (void *)&cam_event, HPTaskAwoken) != pdTRUE) {
-        ll_cam_stop(cam);
-        cam->state = CAM_STATE_IDLE;
-        ESP_EARLY_LOGE(TAG, "EV-%s-OVF", cam_event==CAM_IN_SUC_EOF_EVENT ? "EOF" : "VSYNC");
+    int64_t t_isr = esp_timer_get_time();
+    portENTER_CRITICAL_ISR(&cam->isr_lock);
+    if (cam_event == CAM_VSYNC_EVENT) {
+        cam->isr_vsync_cnt++;
+        cam->isr_vsync_eof[cam->isr_vsync_cnt % CAM_VSYNC_MARKS] = cam->isr_eof_cnt;
+        WC_TRACE(WC_TR_VSYNC, cam->isr_vsync_cnt);
+    } else {
+        cam->isr_eof_cnt++;
+        WC_TRACE(WC_TR_EOF, cam->isr_eof_cnt);
+    }
+    // under the lock - cam_release_task clears the handle before the task is deleted
+    if (cam->task_handle) {
+        xTaskNotifyFromISR(cam->task_handle, CAM_NOTIFY_EVENT, eSetBits, HPTaskAwoken);
     }
+    portEXIT_CRITICAL_ISR(&cam->isr_lock);
+    // ll_cam_do_vsync sends the event from a task
+    __atomic_fetch_add(&cam->isr_us, (uint32_t)(esp_timer_get_time() - t_isr), __ATOMIC_RELAXED);
 }
 
-//Copy fram from DMA dma_buffer to fram dma_buffer
-static void cam_task(void *arg)
+/*
+ * Next event cam_task has not handled yet, in the order the ISRs saw them:
+ * EOFs counted before the pending VSYNC go first. Returns false when there
+ * is nothing to do or the task fell so far behind that the data is lost
+ * (the DMA ring was overwritten or the VSYNC marks were reused)
+ */
+static bool cam_next_event(uint32_t *eof_done, uint32_t *vsync_done, cam_event_t *event)
 {
-    int cnt = 0;
-    int frame_pos = 0;
-    cam_obj->state = CAM_STATE_IDLE;
-    cam_event_t cam_event = 0;
+    portENTER_CRITICAL(&cam_obj->isr_lock);
+    uint32_t eof_cnt = cam_obj->isr_eof_cnt;
+    uint32_t vsync_cnt = cam_obj->isr_vsync_cnt;
+    uint32_t vsync_eof = cam_obj->isr_vsync_eof[(*vsync_done + 1) % CAM_VSYNC_MARKS];
+    portEXIT_CRITICAL(&cam_obj->isr_lock);
 
-    xQueueReset(cam_obj->event_queue);
+    bool lost = (vsync_cnt - *vsync_done) >= CAM_VSYNC_MARKS;
+    if (cam_obj->state == CAM_STATE_READ_BUF && !cam_obj->psram_mode &&
+        (eof_cnt - *eof_done) + cam_copy_pending() >= cam_obj->dma_half_buffer_cnt) {
+        lost = true;
+    }
+    if (lost) {
+        CAM_DMA_STAT_INC(ovf_cnt);
+        CAM_STAT_INC(ev_ovf);
+        ll_cam_stop(cam_obj);
+        cam_obj->state = CAM_STATE_IDLE;
+        ESP_LOGW(TAG, "EV-OVF: %u EOF, %u VSYNC behind", eof_cnt - *eof_done, vsync_cnt - *vsync_done);
+        *eof_done = eof_cnt;
+        *vsync_done = vsync_cnt;
+        return false;
+    }
 
-    while (1) {
-        xQueueReceive(cam_obj->event_queue, (void *)&cam_event, portMAX_DELAY);
-        DBG_PIN_SET(1);
-        switch (cam_obj->state) {
-
-            case CAM_STATE_IDLE: {
-                if (cam_event == CAM_VSYNC_EVENT) {
-                    //DBG_PIN_SET(1);
-                    if(cam_start_frame(&frame_pos)){
-                        cam_obj->frames[frame_pos].fb.len = 0;
-                        cam_obj->state = CAM_STATE_READ_BUF;
-                    }
-                    cnt = 0;
+    if (vsync_cnt != *vsync_done && (int32_t)(vsync_eof - *eof_done) <= 0) {
+        (*vsync_done)++;
+        *event = CAM_VSYNC_EVENT;
+        return true;
+    }
+    if (eof_cnt != *eof_done) {
+        (*eof_done)++;
+        *event = CAM_IN_SUC_EOF_EVENT;
+        return true;
+    }
+    return false;
+}
+
+/* cam_task state besides cam_obj->state */
+typedef struct {
+    int cnt;                // half buffers of the current frame
+    int frame_pos;          // frame being captured
+    uint32_t eof_done;      // ISR events handled
+    uint32_t vsync_done;
+    int64_t waited;         // time the step spent waiting for the copies
+#if CONFIG_CAMERA_COPY_WORKER
+    uint32_t copy_bad;      // copy errors already reported
+#endif
+} cam_task_ctx_t;
+
+/*
+ * The frame read out after a VSYNC was exposed during the previous frame
+ * period, so the flash lit at VSYNC n covers the frames started at n+1...
+ * n+frames and goes off when the last of them is read out
+ */
+static void cam_flash_vsync(void)
+{
+    bool lit = false;
+    portENTER_CRITICAL(&s_flash_lock);
+    if (s_flash.pin >= 0) {
+        if (!s_flash.lit) {
+            gpio_ll_set_level(&GPIO, s_flash.pin, s_flash.on_level);
+            s_flash.lit = lit = true;
+            s_flash.off_vsync = cam_obj->vsync_cnt + 1 + s_flash.frames;
+            WC_TRACE(WC_TR_FLASH, 1);
+        } else if ((int32_t)(cam_obj->vsync_cnt - s_flash.off_vsync) >= 0) {
+            gpio_ll_set_level(&GPIO, s_flash.pin, !s_flash.on_level);
+            s_flash.pin = -1;
+            WC_TRACE(WC_TR_FLASH, 0);
+        }
+    }
+    portEXIT_CRITICAL(&s_flash_lock);
+
+    if (lit) {
+        //deliver only the frames exposed under the flash
+        if ((int32_t)(cam_obj->vsync_cnt + 1 - cam_obj->settle_vsync) > 0) {
+            cam_obj->settle_vsync = cam_obj->vsync_cnt + 1;
+        }
+        camera_fb_t *fb = NULL;
+        while (xQueueReceive(cam_obj->frame_buffer_queue, (void *)&fb, 0) == pdTRUE) {
+            cam_give(fb);
+        }
+    }
+}
+
+/* the cam_settle request - applied on cam_task, the only writer of
+   settle_vsync and the only one recycling the queued frames besides cam_take */
+static void cam_apply_settle(void)
+{
+    uint32_t req = cam_obj->settle_req;
+    cam_obj->settle_vsync = cam_obj->vsync_cnt + 1 + CONFIG_CAMERA_SETTLE_FRAMES;
+
+    //frames in the queue were captured before the change
+    camera_fb_t *fb = NULL;
+    while (xQueueReceive(cam_obj->frame_buffer_queue, (void *)&fb, 0) == pdTRUE) {
+        cam_give(fb);
+    }
+    cam_obj->settle_done = req;
+}
+
+/*
+ * Frame assembly: one VSYNC or EOF event at a time, in the order the ISRs
+ * saw them. Depends only on the event, ctx and cam_obj, so it can be
+ * replayed from an event trace
+ */
+static void cam_task_step(cam_task_ctx_t *ctx, cam_event_t cam_event)
+{
+    if (cam_event == CAM_VSYNC_EVENT) {
+        cam_obj->vsync_cnt++;
+        cam_flash_vsync();
+    }
+    switch (cam_obj->state) {
+
+        case CAM_STATE_IDLE: {
+            if (cam_event == CAM_VSYNC_EVENT) {
+                //DBG_PIN_SET(1);
+                // the copies of the dropped frame may still be running
+                ctx->waited += cam_copy_wait();
+                ctx->eof_done = cam_obj->isr_eof_cnt;
+                if(cam_start_frame(&ctx->frame_pos)){
+                    cam_obj->frames[ctx->frame_pos].fb.len = 0;
+                    cam_obj->state = CAM_STATE_READ_BUF;
                 }
+                ctx->cnt = 0;
             }
-            break;
+        }
+        break;
 
-            case CAM_STATE_READ_BUF: {
-                camera_fb_t * frame_buffer_event = &cam_obj->frames[frame_pos].fb;
-                size_t pixels_per_dma = (cam_obj->dma_half_buffer_size * cam_obj->fb_bytes_per_pixel) / (cam_obj->dma_bytes_per_item * cam_obj->in_bytes_per_pixel);
-
-                if (cam_event == CAM_IN_SUC_EOF_EVENT) {
-                    if(!cam_obj->psram_mode){
-                        if (cam_obj->fb_size < (frame_buffer_event->len + pixels_per_dma)) {
-                            ESP_LOGW(TAG, "FB-OVF");
-                            ll_cam_stop(cam_obj);
-                            DBG_PIN_SET(0);
-                            continue;
-                        }
-                        frame_buffer_event->len += ll_cam_memcpy(cam_obj,
-                            &frame_buffer_event->buf[frame_buffer_event->len],
-                            &cam_obj->dma_buffer[(cnt % cam_obj->dma_half_buffer_cnt) * cam_obj->dma_half_buffer_size],
-                            cam_obj->dma_half_buffer_size);
-                    }
-                    //Check for JPEG SOI in the first buffer. stop if not found
-                    if (cam_obj->jpeg_mode && cnt == 0 && cam_verify_jpeg_soi(frame_buffer_event->buf, frame_buffer_event->len) != 0) {
+        case CAM_STATE_READ_BUF: {
+            camera_fb_t * frame_buffer_event = &cam_obj->frames[ctx->frame_pos].fb;
+            size_t pixels_per_dma = (cam_obj->dma_half_buffer_size * cam_obj->fb_bytes_per_pixel) / (cam_obj->dma_bytes_per_item * cam_obj->in_bytes_per_pixel);
+
+            if (cam_event == CAM_IN_SUC_EOF_EVENT) {
+                CAM_DMA_STAT_INC(eof_cnt);
+                if(!cam_obj->psram_mode){
+                    if (cam_obj->fb_size < (frame_buffer_event->len + pixels_per_dma)) {
+                        ESP_LOGW(TAG, "FB-OVF");
+                        CAM_DMA_STAT_INC(fb_ovf_cnt);
+                        CAM_STAT_INC(fb_ovf);
                         ll_cam_stop(cam_obj);
-                        cam_obj->state = CAM_STATE_IDLE;
+                        return;
                     }
-                    cnt++;
-
-                } else if (cam_event == CAM_VSYNC_EVENT) {
-                    //DBG_PIN_SET(1);
+                    frame_buffer_event->len += cam_copy(
+                        &frame_buffer_event->buf[frame_buffer_event->len],
+                        &cam_obj->dma_buffer[(ctx->cnt % cam_obj->dma_half_buffer_cnt) * cam_obj->dma_half_buffer_size],
+                        cam_obj->dma_half_buffer_size, pixels_per_dma);
+                }
+                if (cam_obj->jpeg_mode && ctx->cnt == 0) {
+                    ctx->waited += cam_copy_wait();
+                }
+                //Check for JPEG SOI in the first buffer. stop if not found
+                if (cam_obj->jpeg_mode && ctx->cnt == 0 && cam_verify_jpeg_soi(frame_buffer_event->buf, frame_buffer_event->len) != 0) {
                     ll_cam_stop(cam_obj);
+                    cam_obj->state = CAM_STATE_IDLE;
+                }
+                ctx->cnt++;
 
-                    if (cnt || !cam_obj->jpeg_mode || cam_obj->psram_mode) {
-                        if (cam_obj->jpeg_mode) {
-                            if (!cam_obj->psram_mode) {
-                                if (cam_obj->fb_size < (frame_buffer_event->len + pixels_per_dma)) {
-                                    ESP_LOGW(TAG, "FB-OVF");
-                                    cnt--;
-                                } else {
-                                    frame_buffer_event->len += ll_cam_memcpy(cam_obj,
-                                        &frame_buffer_event->buf[frame_buffer_event->len],
-                                        &cam_obj->dma_buffer[(cnt % cam_obj->dma_half_buffer_cnt) * cam_obj->dma_half_buffer_size],
-                                        cam_obj->dma_half_buffer_size);
-                                }
+            } else if (cam_event == CAM_VSYNC_EVENT) {
+                //DBG_PIN_SET(1);
+                ll_cam_stop(cam_obj);
+                // EOFs after the VSYNC are the tail of the stopped transfer
+                ctx->eof_done = cam_obj->isr_eof_cnt;
+
+                if (ctx->cnt || !cam_obj->jpeg_mode || cam_obj->psram_mode) {
+                    if (cam_obj->jpeg_mode) {
+                        if (!cam_obj->psram_mode) {
+                            if (cam_obj->fb_size < (frame_buffer_event->len + pixels_per_dma)) {
+                                ESP_LOGW(TAG, "FB-OVF");
+                                CAM_DMA_STAT_INC(fb_ovf_cnt);
+                                CAM_STAT_INC(fb_ovf);
+                                ctx->cnt--;
+                            } else {
+                                frame_buffer_event->len += cam_copy(
+                                    &frame_buffer_event->buf[frame_buffer_event->len],
+                                    &cam_obj->dma_buffer[(ctx->cnt % cam_obj->dma_half_buffer_cnt) * cam_obj->dma_half_buffer_size],
+                                    cam_obj->dma_half_buffer_size, pixels_per_dma);
                             }
-                            cnt++;
                         }
+                        ctx->cnt++;
+                    }
 
-                        cam_obj->frames[frame_pos].en = 0;
+                    // all the data of the frame is in the frame buffer
+                    ctx->waited += cam_copy_wait();
+                    cam_obj->frames[ctx->frame_pos].en = 0;
+#if CONFIG_CAMERA_COPY_WORKER
+                    if (cam_obj->copy_bad != ctx->copy_bad) {
+                        ctx->copy_bad = cam_obj->copy_bad;
+                        cam_obj->frames[ctx->frame_pos].en = 1;
+                        ESP_LOGE(TAG, "FB-COPY: unexpected copy length");
+                        CAM_STAT_INC(fb_copy);
+                    }
+#endif
 
-                        if (cam_obj->psram_mode) {
-                            if (cam_obj->jpeg_mode) {
-                                frame_buffer_event->len = cnt * cam_obj->dma_half_buffer_size;
-                            } else {
-                                frame_buffer_event->len = cam_obj->recv_size;
-                            }
-                        } else if (!cam_obj->jpeg_mode) {
-                            if (frame_buffer_event->len != cam_obj->fb_size) {
-                                cam_obj->frames[frame_pos].en = 1;
-                                ESP_LOGE(TAG, "FB-SIZE: %u != %u", frame_buffer_event->len, cam_obj->fb_size);
-                            }
+                    //the frame was started before the sensor settled
+                    if ((int32_t)(cam_obj->frames[ctx->frame_pos].vsync - cam_obj->settle_vsync) < 0) {
+                        cam_obj->frames[ctx->frame_pos].en = 1;
+                    }
+
+                    if (cam_obj->psram_mode) {
+                        if (cam_obj->jpeg_mode) {
+                            frame_buffer_event->len = ctx->cnt * cam_obj->dma_half_buffer_size;
+                        } else {
+                            frame_buffer_event->len = cam_obj->recv_size;
                         }
-                        //send frame
-                        if(!cam_obj->frames[frame_pos].en && xQueueSend(cam_obj->frame_buffer_queue, (void *)&frame_buffer_event, 0) != pdTRUE) {
-                            //pop frame buffer from the queue
-                            camera_fb_t * fb2 = NULL;
-                            if(xQueueReceive(cam_obj->frame_buffer_queue, &fb2, 0) == pdTRUE) {
-                                //push the new frame to the end of the queue
-                                if (xQueueSend(cam_obj->frame_buffer_queue, (void *)&frame_buffer_event, 0) != pdTRUE) {
-                                    cam_obj->frames[frame_pos].en = 1;
-                                    ESP_LOGE(TAG, "FBQ-SND");
-                                }
-                                //free the popped buffer
-                                cam_give(fb2);
-                            } else {
-                                //queue is full and we could not pop a frame from it
-                                cam_obj->frames[frame_pos].en = 1;
-                                ESP_LOGE(TAG, "FBQ-RCV");
+                    } else if (!cam_obj->jpeg_mode) {
+                        if (frame_buffer_event->len != cam_obj->fb_size) {
+                            cam_obj->frames[ctx->frame_pos].en = 1;
+                            ESP_LOGE(TAG, "FB-SIZE: %u != %u", frame_buffer_event->len, cam_obj->fb_size);
+                            CAM_STAT_INC(fb_size);
+                        }
+                    }
+                    //send frame
+                    if(!cam_obj->frames[ctx->frame_pos].en && xQueueSend(cam_obj->frame_buffer_queue, (void *)&frame_buffer_event, 0) != pdTRUE) {
+                        //pop frame buffer from the queue
+                        camera_fb_t * fb2 = NULL;
+                        if(xQueueReceive(cam_obj->frame_buffer_queue, &fb2, 0) == pdTRUE) {
+                            //push the new frame to the end of the queue
+                            if (xQueueSend(cam_obj->frame_buffer_queue, (void *)&frame_buffer_event, 0) != pdTRUE) {
+                                cam_obj->frames[ctx->frame_pos].en = 1;
+                                ESP_LOGE(TAG, "FBQ-SND");
+                                CAM_STAT_INC(fbq_snd);
                             }
+                            //free the popped buffer
+                            cam_give(fb2);
+                        } else {
+                            //queue is full and we could not pop a frame from it
+                            cam_obj->frames[ctx->frame_pos].en = 1;
+                            ESP_LOGE(TAG, "FBQ-RCV");
+                            CAM_STAT_INC(fbq_rcv);
                         }
                     }
-
-                    if(!cam_start_frame(&frame_pos)){
-                        cam_obj->state = CAM_STATE_IDLE;
+                    if (!cam_obj->frames[ctx->frame_pos].en) {
+                        CAM_DMA_STAT_INC(frame_cnt);
+                        CAM_STAT_INC(frames_captured);
+                        WC_TRACE(WC_TR_FB_SEND, frame_buffer_event->len);
                     } else {
-                        cam_obj->frames[frame_pos].fb.len = 0;
+                        WC_TRACE(WC_TR_FB_DROP, ctx->frame_pos);
                     }
-                    cnt = 0;
                 }
+
+                if(!cam_start_frame(&ctx->frame_pos)){
+                    cam_obj->state = CAM_STATE_IDLE;
+                } else {
+                    cam_obj->frames[ctx->frame_pos].fb.len = 0;
+                }
+                ctx->cnt = 0;
             }
-            break;
         }
+        break;
+    }
+}
+
+//Copy fram from DMA dma_buffer to fram dma_buffer
+static void cam_task(void *arg)
+{
+    cam_task_ctx_t ctx = {0};
+    cam_event_t cam_event = 0;
+    cam_obj->state = CAM_STATE_IDLE;
+
+    portENTER_CRITICAL(&cam_obj->isr_lock);
+    ctx.eof_done = cam_obj->isr_eof_cnt;
+    ctx.vsync_done = cam_obj->isr_vsync_cnt;
+    portEXIT_CRITICAL(&cam_obj->isr_lock);
+#if CONFIG_CAMERA_COPY_WORKER
+    ctx.copy_bad = cam_obj->copy_bad;
+#endif
+
+    while (1) {
+        if (cam_obj->settle_done != cam_obj->settle_req) {
+            cam_apply_settle();
+        }
+        if (!cam_next_event(&ctx.eof_done, &ctx.vsync_done, &cam_event)) {
+            if (cam_obj->task_stop) {
+                // no copies in flight, cam_release_task deletes the task
+                cam_copy_wait();
+                cam_obj->task_parked = true;
+                vTaskSuspend(NULL);
+            }
+            xTaskNotifyWait(0, CAM_NOTIFY_EVENT | CAM_NOTIFY_SETTLE, NULL, portMAX_DELAY);
+            continue;
+        }
+        int64_t t_event = esp_timer_get_time();
+        ctx.waited = 0;
+        DBG_PIN_SET(1);
+        WC_TRACE(WC_TR_STEP_B, cam_event);
+        cam_task_step(&ctx, cam_event);
+        WC_TRACE(WC_TR_STEP_E, cam_obj->state);
         DBG_PIN_SET(0);
+        cam_account_busy(t_event + ctx.waited);
     }
 }
 
 static lldesc_t * allocate_dma_descriptors(uint32_t count, uint16_t size, uint8_t * buffer)
 {
-    lldesc_t *dma = (lldesc_t *)heap_caps_malloc(count * sizeof(lldesc_t), MALLOC_CAP_DMA);
+    lldesc_t *dma = (lldesc_t *)cam_arena_alloc(&s_dma_arena, count * sizeof(lldesc_t), 4);
     if (dma == NULL) {
         return dma;
     }
@@ -241,6 +744,15 @@ static esp_err_t cam_dma_config(const camera_config_t *config)
     if (0 == ret) {
         return ESP_FAIL;
     }
+#if CONFIG_CAMERA_COPY_WORKER
+    // every half buffer may wait for its copy, the ring must have room for one more
+    if (cam_obj->dma_half_buffer_cnt >= CAM_COPY_RING_LEN) {
+        ESP_LOGW(TAG, "%u half buffers do not fit the copy ring, cut to %u",
+                 cam_obj->dma_half_buffer_cnt, CAM_COPY_RING_LEN - 1);
+        cam_obj->dma_half_buffer_cnt = CAM_COPY_RING_LEN - 1;
+        cam_obj->dma_buffer_size = cam_obj->dma_half_buffer_cnt * cam_obj->dma_half_buffer_size;
+    }
+#endif
 
     cam_obj->dma_node_cnt = (cam_obj->dma_buffer_size) / cam_obj->dma_node_buffer_size; // Number of DMA nodes
     cam_obj->frame_copy_cnt = cam_obj->recv_size / cam_obj->dma_half_buffer_size; // Number of interrupted copies, ping-pong copy
@@ -251,8 +763,9 @@ static esp_err_t cam_dma_config(const camera_config_t *config)
     cam_obj->dma_buffer = NULL;
     cam_obj->dma = NULL;
 
-    cam_obj->frames = (cam_frame_t *)heap_caps_calloc(1, cam_obj->frame_cnt * sizeof(cam_frame_t), MALLOC_CAP_DEFAULT);
+    cam_obj->frames = (cam_frame_t *)cam_arena_alloc(&s_dma_arena, cam_obj->frame_cnt * sizeof(cam_frame_t), 4);
     CAM_CHECK(cam_obj->frames != NULL, "frames malloc failed", ESP_FAIL);
+    memset(cam_obj->frames, 0, cam_obj->frame_cnt * sizeof(cam_frame_t));
 
     uint8_t dma_align = 0;
     size_t fb_size = cam_obj->fb_size;
@@ -264,25 +777,28 @@ static esp_err_t cam_dma_config(const camera_config_t *config)
     }
 
     /* Allocate memory for frame buffer */
-    size_t alloc_size = fb_size * sizeof(uint8_t) + dma_align;
     uint32_t _caps = MALLOC_CAP_8BIT;
     if (CAMERA_FB_IN_DRAM == config->fb_location) {
         _caps |= MALLOC_CAP_INTERNAL;
     } else {
         _caps |= MALLOC_CAP_SPIRAM;
     }
+    size_t arena_size = (fb_size + CAM_FB_ARENA_ALIGN) * cam_obj->frame_cnt;
+    if (arena_size < CONFIG_CAMERA_FB_ARENA_SIZE) {
+        arena_size = CONFIG_CAMERA_FB_ARENA_SIZE;
+    } else if (s_fb_arena.base && arena_size > s_fb_arena.size) {
+        ESP_LOGW(TAG, "Frame buffer arena grows to %d Byte, increase CONFIG_CAMERA_FB_ARENA_SIZE", arena_size);
+    }
+    // nothing is carved from the fb arena yet, so it can be reserved again
+    CAM_CHECK(cam_arena_reserve(&s_fb_arena, arena_size, _caps), "frame buffer arena malloc failed", ESP_FAIL);
     for (int x = 0; x < cam_obj->frame_cnt; x++) {
         cam_obj->frames[x].dma = NULL;
-        cam_obj->frames[x].fb_offset = 0;
         cam_obj->frames[x].en = 0;
-        ESP_LOGI(TAG, "Allocating %d Byte frame buffer in %s", alloc_size, _caps & MALLOC_CAP_SPIRAM ? "PSRAM" : "OnBoard RAM");
-        cam_obj->frames[x].fb.buf = (uint8_t *)heap_caps_malloc(alloc_size, _caps);
+        ESP_LOGI(TAG, "Allocating %d Byte frame buffer in %s", fb_size, _caps & MALLOC_CAP_SPIRAM ? "PSRAM" : "OnBoard RAM");
+        cam_obj->frames[x].fb.buf = (uint8_t *)cam_arena_alloc(&s_fb_arena, fb_size, cam_obj->psram_mode ? dma_align : 4);
         CAM_CHECK(cam_obj->frames[x].fb.buf != NULL, "frame buffer malloc failed", ESP_FAIL);
         if (cam_obj->psram_mode) {
-            //align PSRAM buffer. TODO: save the offset so proper address can be freed later
-            cam_obj->frames[x].fb_offset = dma_align - ((uint32_t)cam_obj->frames[x].fb.buf & (dma_align - 1));
-            cam_obj->frames[x].fb.buf += cam_obj->frames[x].fb_offset;
-            ESP_LOGI(TAG, "Frame[%d]: Offset: %u, Addr: 0x%08X", x, cam_obj->frames[x].fb_offset, (uint32_t)cam_obj->frames[x].fb.buf);
+            ESP_LOGI(TAG, "Frame[%d]: Addr: 0x%08X", x, (uint32_t)cam_obj->frames[x].fb.buf);
             cam_obj->frames[x].dma = allocate_dma_descriptors(cam_obj->dma_node_cnt, cam_obj->dma_node_buffer_size, cam_obj->frames[x].fb.buf);
             CAM_CHECK(cam_obj->frames[x].dma != NULL, "frame dma malloc failed", ESP_FAIL);
         }
@@ -290,7 +806,7 @@ static esp_err_t cam_dma_config(const camera_config_t *config)
     }
 
     if (!cam_obj->psram_mode) {
-        cam_obj->dma_buffer = (uint8_t *)heap_caps_malloc(cam_obj->dma_buffer_size * sizeof(uint8_t), MALLOC_CAP_DMA);
+        cam_obj->dma_buffer = (uint8_t *)cam_arena_alloc(&s_dma_arena, cam_obj->dma_buffer_size * sizeof(uint8_t), 4);
         if(NULL == cam_obj->dma_buffer) {
             ESP_LOGE(TAG,"%s(%d): DMA buffer %d Byte malloc failed, the current largest free block:%d Byte", __FUNCTION__, __LINE__,
                      cam_obj->dma_buffer_size, heap_caps_get_largest_free_block(MALLOC_CAP_DMA));
@@ -311,8 +827,12 @@ esp_err_t cam_init(const camera_config_t *config)
     CAM_CHECK(NULL != config, "config pointer is invalid", ESP_ERR_INVALID_ARG);
 
     esp_err_t ret = ESP_OK;
-    cam_obj = (cam_obj_t *)heap_caps_calloc(1, sizeof(cam_obj_t), MALLOC_CAP_DMA);
+    CAM_CHECK(cam_arena_reserve(&s_dma_arena, CAM_DMA_BUFFER_MAX + CAM_DMA_ARENA_EXTRA, MALLOC_CAP_DMA),
+              "dma arena malloc error", ESP_ERR_NO_MEM);
+    cam_obj = (cam_obj_t *)cam_arena_alloc(&s_dma_arena, sizeof(cam_obj_t), 4);
     CAM_CHECK(NULL != cam_obj, "lcd_cam object malloc error", ESP_ERR_NO_MEM);
+    memset(cam_obj, 0, sizeof(cam_obj_t));
+    cam_obj->isr_lock = (portMUX_TYPE)portMUX_INITIALIZER_UNLOCKED;
 
     cam_obj->swap_data = 0;
     cam_obj->vsync_pin = config->pin_vsync;
@@ -332,17 +852,160 @@ esp_err_t cam_init(const camera_config_t *config)
     return ESP_OK;
 
 err:
-    free(cam_obj);
+    s_dma_arena.used = 0;
     cam_obj = NULL;
     return ESP_FAIL;
 }
 
-esp_err_t cam_config(const camera_config_t *config, framesize_t frame_size, uint16_t sensor_pid)
+static void cam_dma_geometry_lookup(pixformat_t format, framesize_t frame_size, cam_dma_geometry_t *geometry)
 {
-    CAM_CHECK(NULL != config, "config pointer is invalid", ESP_ERR_INVALID_ARG);
-    esp_err_t ret = ESP_OK;
+    memset(geometry, 0, sizeof(cam_dma_geometry_t));
+    for (int i = 0; i < s_dma_table_len; i++) {
+        if (s_dma_table[i].format == format && s_dma_table[i].frame_size == frame_size) {
+            *geometry = s_dma_table[i].geometry;
+            return;
+        }
+    }
+}
+
+bool cam_dma_layout_changes(pixformat_t format, framesize_t out_size)
+{
+    if (cam_obj == NULL) {
+        return false;
+    }
+    cam_dma_geometry_t geometry;
+    cam_dma_geometry_lookup(format, out_size, &geometry);
+    return memcmp(&geometry, &cam_obj->dma_geometry, sizeof(cam_dma_geometry_t)) != 0;
+}
+
+void cam_set_dma_geometry(pixformat_t format, framesize_t frame_size, const cam_dma_geometry_t *geometry)
+{
+    int i;
+    for (i = 0; i < s_dma_table_len; i++) {
+        if (s_dma_table[i].format == format && s_dma_table[i].frame_size == frame_size) {
+            break;
+        }
+    }
+    if (geometry == NULL) {
+        if (i < s_dma_table_len) {
+            s_dma_table[i] = s_dma_table[--s_dma_table_len];
+        }
+        return;
+    }
+    if (i == s_dma_table_len) {
+        if (s_dma_table_len == CAM_DMA_TABLE_LEN) {
+            // forget the oldest entry
+            memmove(&s_dma_table[0], &s_dma_table[1], sizeof(cam_dma_entry_t) * (CAM_DMA_TABLE_LEN - 1));
+            i = CAM_DMA_TABLE_LEN - 1;
+        } else {
+            s_dma_table_len++;
+        }
+    }
+    s_dma_table[i].format = format;
+    s_dma_table[i].frame_size = frame_size;
+    s_dma_table[i].geometry = *geometry;
+}
+
+int cam_dma_candidates(pixformat_t format, cam_dma_geometry_t *geometry)
+{
+    int n = 0;
+    if (format == PIXFORMAT_JPEG) {
+        // bytes per EOF interrupt vs number of half buffers the event queue can hold
+        static const uint16_t jpeg_layouts[][2] = {
+            {16384, 2048}, {16384, 4096}, {32768, 2048}, {32768, 4096}, {32768, 8192},
+        };
+        for (int i = 0; i < sizeof(jpeg_layouts) / sizeof(jpeg_layouts[0]) && n < CAM_DMA_CANDIDATES_MAX; i++) {
+            if (jpeg_layouts[i][0] > CAM_DMA_BUFFER_MAX) {
+                continue;
+            }
+#if CONFIG_CAMERA_COPY_WORKER
+            if (jpeg_layouts[i][0] / jpeg_layouts[i][1] >= CAM_COPY_RING_LEN) {
+                continue;
+            }
+#endif
+            geometry[n].buffer_size = jpeg_layouts[i][0];
+            geometry[n].half_buffer_size = jpeg_layouts[i][1];
+            n++;
+        }
+    } else {
+        for (uint32_t size = 8192; size <= CAM_DMA_BUFFER_MAX && n < CAM_DMA_CANDIDATES_MAX; size *= 2) {
+            geometry[n].buffer_size = size;
+            geometry[n].half_buffer_size = 0;
+            n++;
+        }
+    }
+    return n;
+}
+
+void cam_get_dma_stats(cam_dma_stats_t *stats, bool reset)
+{
+    if (cam_obj == NULL) {
+        if (stats) {
+            memset(stats, 0, sizeof(cam_dma_stats_t));
+        }
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    uint32_t isr_us = cam_obj->isr_us;
+    portENTER_CRITICAL(&s_stats_lock);
+    if (stats) {
+        *stats = cam_obj->dma_stats;
+        stats->period_us = now - s_stats_reset_us;
+        stats->isr_us = isr_us - s_stats_isr_us;
+    }
+    if (reset) {
+        memset(&cam_obj->dma_stats, 0, sizeof(cam_dma_stats_t));
+        s_stats_reset_us = now;
+        s_stats_isr_us = isr_us;
+    }
+    portEXIT_CRITICAL(&s_stats_lock);
+}
 
-    ret = ll_cam_set_sample_mode(cam_obj, (pixformat_t)config->pixel_format, config->xclk_freq_hz, sensor_pid);
+#define CAM_STAT_TAKE(field) (reset ? __atomic_exchange_n(&s_stats.field, 0, __ATOMIC_RELAXED) \
+                                    : __atomic_load_n(&s_stats.field, __ATOMIC_RELAXED))
+
+void cam_get_stats(camera_stats_t *stats, bool reset)
+{
+    camera_stats_t st;
+    st.frames_captured = CAM_STAT_TAKE(frames_captured);
+    st.fb_ovf = CAM_STAT_TAKE(fb_ovf);
+    st.no_soi = CAM_STAT_TAKE(no_soi);
+    st.no_eoi = CAM_STAT_TAKE(no_eoi);
+    st.ev_ovf = CAM_STAT_TAKE(ev_ovf);
+    st.fbq_snd = CAM_STAT_TAKE(fbq_snd);
+    st.fbq_rcv = CAM_STAT_TAKE(fbq_rcv);
+    st.fb_size = CAM_STAT_TAKE(fb_size);
+    st.fb_bad = CAM_STAT_TAKE(fb_bad);
+    st.fb_copy = CAM_STAT_TAKE(fb_copy);
+    st.fb_timeout = CAM_STAT_TAKE(fb_timeout);
+
+    portENTER_CRITICAL(&s_stats_lock);
+    st.frames_delivered = s_stats.frames_delivered;
+    st.bytes_delivered = s_stats.bytes_delivered;
+    if (reset) {
+        s_stats.frames_delivered = 0;
+        s_stats.bytes_delivered = 0;
+    }
+    portEXIT_CRITICAL(&s_stats_lock);
+    st.avg_frame_size = st.frames_delivered ? (uint32_t)(st.bytes_delivered / st.frames_delivered) : 0;
+
+    cam_dma_stats_t dma;
+    cam_get_dma_stats(&dma, reset);
+    for (int core = 0; core < 2; core++) {
+        st.core_busy[core] = dma.period_us ? (float)(dma.busy_us[core] * 100.0 / dma.period_us) : 0;
+    }
+
+    if (stats) {
+        *stats = st;
+    }
+}
+
+/* sample mode, DMA layout, buffers and queues. cam_obj and the ISR are kept.
+   the buffers are sized for frame_size, the DMA layout is the one for out_size */
+static esp_err_t cam_setup(const camera_config_t *config, framesize_t frame_size, framesize_t out_size,
+                           uint16_t sensor_pid)
+{
+    esp_err_t ret = ll_cam_set_sample_mode(cam_obj, (pixformat_t)config->pixel_format, config->xclk_freq_hz, sensor_pid);
 
     cam_obj->jpeg_mode = config->pixel_format == PIXFORMAT_JPEG;
 #if CONFIG_IDF_TARGET_ESP32
@@ -362,23 +1025,30 @@ esp_err_t cam_config(const camera_config_t *config, framesize_t frame_size, uint
         cam_obj->fb_size = cam_obj->width * cam_obj->height * cam_obj->fb_bytes_per_pixel;
     }
 
+    cam_dma_geometry_lookup((pixformat_t)config->pixel_format, out_size, &cam_obj->dma_geometry);
     ret = cam_dma_config(config);
-    CAM_CHECK_GOTO(ret == ESP_OK, "cam_dma_config failed", err);
-
-    cam_obj->event_queue = xQueueCreate(cam_obj->dma_half_buffer_cnt - 1, sizeof(cam_event_t));
-    CAM_CHECK_GOTO(cam_obj->event_queue != NULL, "event_queue create failed", err);
+    if (ret != ESP_OK) {
+        wc_mem_dump();
+    }
+    CAM_CHECK(ret == ESP_OK, "cam_dma_config failed", ESP_FAIL);
 
     size_t frame_buffer_queue_len = cam_obj->frame_cnt;
     if (config->grab_mode == CAMERA_GRAB_LATEST && cam_obj->frame_cnt > 1) {
         frame_buffer_queue_len = cam_obj->frame_cnt - 1;
     }
     cam_obj->frame_buffer_queue = xQueueCreate(frame_buffer_queue_len, sizeof(camera_fb_t*));
-    CAM_CHECK_GOTO(cam_obj->frame_buffer_queue != NULL, "frame_buffer_queue create failed", err);
-
-    ret = ll_cam_init_isr(cam_obj);
-    CAM_CHECK_GOTO(ret == ESP_OK, "cam intr alloc failed", err);
-
+    CAM_CHECK(cam_obj->frame_buffer_queue != NULL, "frame_buffer_queue create failed", ESP_FAIL);
+    return ESP_OK;
+}
 
+static void cam_create_task(void)
+{
+    cam_obj->task_stop = false;
+    cam_obj->task_parked = false;
+#if CONFIG_CAMERA_COPY_WORKER
+    cam_obj->copy_head = cam_obj->copy_tail = 0;
+    xTaskCreatePinnedToCore(cam_copy_task, "cam_copy", 2048, NULL, configMAX_PRIORITIES - 2, &cam_obj->copy_task, CAM_COPY_WORKER_CORE);
+#endif
 #if CONFIG_CAMERA_CORE0
     xTaskCreatePinnedToCore(cam_task, "cam_task", 2048, NULL, configMAX_PRIORITIES - 2, &cam_obj->task_handle, 0);
 #elif CONFIG_CAMERA_CORE1
@@ -386,7 +1056,58 @@ esp_err_t cam_config(const camera_config_t *config, framesize_t frame_size, uint
 #else
     xTaskCreate(cam_task, "cam_task", 2048, NULL, configMAX_PRIORITIES - 2, &cam_obj->task_handle);
 #endif
+}
+
+/* the task and the queues depend on the layout, everything else stays.
+   DMA is stopped: cam_task handles the events left and parks, then nothing
+   notifies it (the handle is cleared under isr_lock) and the copy worker,
+   the last one to notify it, is deleted before it */
+static void cam_release_task(void)
+{
+    TaskHandle_t task = cam_obj->task_handle;
+    if (task) {
+        cam_obj->task_stop = true;
+        xTaskNotify(task, CAM_NOTIFY_EVENT, eSetBits);
+        while (!cam_obj->task_parked) {
+            vTaskDelay(1);
+        }
+        portENTER_CRITICAL(&cam_obj->isr_lock);
+        cam_obj->task_handle = NULL;
+        portEXIT_CRITICAL(&cam_obj->isr_lock);
+    }
+#if CONFIG_CAMERA_COPY_WORKER
+    if (cam_obj->copy_task) {
+        // the ring is empty - cam_task waited for the copies before it parked
+        while (cam_obj->copy_tail != cam_obj->copy_head) {
+            vTaskDelay(1);
+        }
+        vTaskDelete(cam_obj->copy_task);
+        cam_obj->copy_task = NULL;
+    }
+#endif
+    if (task) {
+        vTaskDelete(task);
+    }
+    if (cam_obj->frame_buffer_queue) {
+        vQueueDelete(cam_obj->frame_buffer_queue);
+        cam_obj->frame_buffer_queue = NULL;
+    }
+}
+
+esp_err_t cam_config(const camera_config_t *config, framesize_t frame_size, uint16_t sensor_pid)
+{
+    CAM_CHECK(NULL != config, "config pointer is invalid", ESP_ERR_INVALID_ARG);
+    esp_err_t ret = ESP_OK;
 
+    ret = cam_setup(config, frame_size, frame_size, sensor_pid);
+    CAM_CHECK_GOTO(ret == ESP_OK, "cam setup failed", err);
+
+    ret = ll_cam_init_isr(cam_obj);
+    CAM_CHECK_GOTO(ret == ESP_OK, "cam intr alloc failed", err);
+
+    cam_create_task();
+
+    cam_arena_stats();
     ESP_LOGI(TAG, "cam config ok");
     return ESP_OK;
 
@@ -395,6 +1116,32 @@ err:
     return ESP_FAIL;
 }
 
+esp_err_t cam_reconfig(const camera_config_t *config, framesize_t frame_size, framesize_t out_size,
+                       uint16_t sensor_pid)
+{
+    CAM_CHECK(NULL != config, "config pointer is invalid", ESP_ERR_INVALID_ARG);
+    CAM_CHECK(NULL != cam_obj && NULL != cam_obj->task_handle, "cam is not configured", ESP_ERR_INVALID_STATE);
+
+    // no more DMA and VSYNC events, cam_task waits for them and can be dropped
+    cam_stop();
+    cam_release_task();
+
+    // carve the new layout over the old one, cam_obj stays at the arena start
+    s_fb_arena.used = 0;
+    s_dma_arena.used = ((uint8_t *)cam_obj - s_dma_arena.base) + sizeof(cam_obj_t);
+
+    esp_err_t ret = cam_setup(config, frame_size, out_size, sensor_pid);
+    if (ret != ESP_OK) {
+        cam_deinit();
+        return ret;
+    }
+    cam_create_task();
+
+    cam_arena_stats();
+    ESP_LOGI(TAG, "cam reconfig ok");
+    return ESP_OK;
+}
+
 esp_err_t cam_deinit(void)
 {
     if (!cam_obj) {
@@ -402,34 +1149,13 @@ esp_err_t cam_deinit(void)
     }
 
     cam_stop();
-    if (cam_obj->task_handle) {
-        vTaskDelete(cam_obj->task_handle);
-    }
-    if (cam_obj->event_queue) {
-        vQueueDelete(cam_obj->event_queue);
-    }
-    if (cam_obj->frame_buffer_queue) {
-        vQueueDelete(cam_obj->frame_buffer_queue);
-    }
-    if (cam_obj->dma) {
-        free(cam_obj->dma);
-    }
-    if (cam_obj->dma_buffer) {
-        free(cam_obj->dma_buffer);
-    }
-    if (cam_obj->frames) {
-        for (int x = 0; x < cam_obj->frame_cnt; x++) {
-            free(cam_obj->frames[x].fb.buf - cam_obj->frames[x].fb_offset);
-            if (cam_obj->frames[x].dma) {
-                free(cam_obj->frames[x].dma);
-            }
-        }
-        free(cam_obj->frames);
-    }
+    cam_release_task();
 
     ll_cam_deinit(cam_obj);
 
-    free(cam_obj);
+    // buffers, descriptors and cam_obj itself are in the arenas
+    s_fb_arena.used = 0;
+    s_dma_arena.used = 0;
     cam_obj = NULL;
     return ESP_OK;
 }
@@ -438,6 +1164,8 @@ void cam_stop(void)
 {
     ll_cam_vsync_intr_enable(cam_obj, false);
     ll_cam_stop(cam_obj);
+    //no more VSYNC to switch the flash off
+    cam_flash(-1, 0, 0);
 }
 
 void cam_start(void)
@@ -453,32 +1181,122 @@ void cam_do_snap(void) {
     ll_cam_start(cam_obj, frame);
 }
 
+void cam_flash(int pin, int on_level, uint8_t frames)
+{
+    portENTER_CRITICAL(&s_flash_lock);
+    if (s_flash.pin >= 0 && s_flash.lit) {
+        gpio_ll_set_level(&GPIO, s_flash.pin, !s_flash.on_level);
+        WC_TRACE(WC_TR_FLASH, 0);
+    }
+    s_flash.pin = frames ? pin : -1;
+    s_flash.on_level = on_level ? 1 : 0;
+    s_flash.frames = frames;
+    s_flash.lit = false;
+    portEXIT_CRITICAL(&s_flash_lock);
+}
+
+void cam_set_frame_hook(cam_frame_hook_t hook, void *arg)
+{
+    s_frame_hook = NULL;
+    __sync_synchronize();
+    s_frame_hook_arg = arg;
+    __sync_synchronize();
+    s_frame_hook = hook;
+}
+
+void cam_settle(uint16_t width, uint16_t height)
+{
+    if (width && height) {
+        cam_obj->out_width = width;
+        cam_obj->out_height = height;
+    }
+    //cam_task moves settle_vsync and recycles the queue, cam_take drops the frames until then
+    cam_obj->settle_req++;
+    TaskHandle_t task = cam_obj->task_handle;
+    if (task) {
+        xTaskNotify(task, CAM_NOTIFY_SETTLE, eSetBits);
+    }
+}
+
+/* the settle is not applied yet or the frame was started before the sensor settled */
+static bool cam_unsettled(camera_fb_t *fb)
+{
+    if (cam_obj->settle_done != cam_obj->settle_req) {
+        return true;
+    }
+    for (int x = 0; x < cam_obj->frame_cnt; x++) {
+        if (&cam_obj->frames[x].fb == fb) {
+            return (int32_t)(cam_obj->frames[x].vsync - cam_obj->settle_vsync) < 0;
+        }
+    }
+    return false;
+}
+
+static camera_fb_t *cam_delivered(camera_fb_t *fb)
+{
+    portENTER_CRITICAL(&s_stats_lock);
+    s_stats.frames_delivered++;
+    s_stats.bytes_delivered += fb->len;
+    portEXIT_CRITICAL(&s_stats_lock);
+    WC_TRACE(WC_TR_FB_TAKE, fb->len);
+    return fb;
+}
+
 camera_fb_t *cam_take(TickType_t timeout)
 {
     camera_fb_t *dma_buffer = NULL;
     TickType_t start = xTaskGetTickCount();
-    xQueueReceive(cam_obj->frame_buffer_queue, (void *)&dma_buffer, timeout);
-    if (dma_buffer) {
+    TickType_t left = timeout;
+    // the broken frames are returned and the next one is waited for the rest of the timeout
+    while (xQueueReceive(cam_obj->frame_buffer_queue, (void *)&dma_buffer, left) == pdTRUE && dma_buffer) {
+        if (timeout != portMAX_DELAY) {
+            TickType_t elapsed = xTaskGetTickCount() - start;
+            left = (elapsed < timeout) ? timeout - elapsed : 0;
+        }
+        // taken while cam_task was applying cam_settle
+        if (cam_unsettled(dma_buffer)) {
+            cam_give(dma_buffer);
+            dma_buffer = NULL;
+            continue;
+        }
         if(cam_obj->jpeg_mode){
             // find the end marker for JPEG. Data after that can be discarded
+#if CONFIG_CAMERA_JPEG_VALIDATE
+            int64_t t_eoi = esp_timer_get_time();
+#endif
             int offset_e = cam_verify_jpeg_eoi(dma_buffer->buf, dma_buffer->len);
             if (offset_e >= 0) {
                 // adjust buffer length
                 dma_buffer->len = offset_e + sizeof(JPEG_EOI_MARKER);
-                return dma_buffer;
+#if CONFIG_CAMERA_JPEG_VALIDATE
+                int64_t t_check = esp_timer_get_time();
+                const char *bad = cam_check_jpeg(dma_buffer->buf, dma_buffer->len, cam_obj->out_width, cam_obj->out_height);
+                ESP_LOGD(TAG, "JPEG check: eoi %lld us, markers %lld us", t_check - t_eoi, esp_timer_get_time() - t_check);
+                if (bad) {
+                    ESP_LOGW(TAG, "FB-BAD: %s", bad);
+                    CAM_STAT_INC(fb_bad);
+                    cam_give(dma_buffer);
+                    dma_buffer = NULL;
+                    continue;
+                }
+#endif
+                cam_frame_tap(dma_buffer);
+                return cam_delivered(dma_buffer);
             } else {
                 ESP_LOGW(TAG, "NO-EOI");
+                CAM_STAT_INC(no_eoi);
                 cam_give(dma_buffer);
-                return cam_take(timeout - (xTaskGetTickCount() - start));//recurse!!!!
+                dma_buffer = NULL;
+                continue;
             }
         } else if(cam_obj->psram_mode && cam_obj->in_bytes_per_pixel != cam_obj->fb_bytes_per_pixel){
             //currently this is used only for YUV to GRAYSCALE
             dma_buffer->len = ll_cam_memcpy(cam_obj, dma_buffer->buf, dma_buffer->buf, dma_buffer->len);
         }
-        return dma_buffer;
-    } else {
-        ESP_LOGW(TAG, "Failed to get the frame on time!");
+        return cam_delivered(dma_buffer);
     }
+    ESP_LOGW(TAG, "Failed to get the frame on time!");
+    CAM_STAT_INC(fb_timeout);
     return NULL;
 }
 
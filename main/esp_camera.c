@@ -27,6 +27,8 @@
 #include "cam_hal.h"
 #include "esp_camera.h"
 #include "xclk.h"
+#include "wc_mem.h"
+#include "esp_timer.h"
 #if CONFIG_OV2640_SUPPORT
 #include "ov2640.h"
 #endif
@@ -69,6 +71,9 @@ static const char *TAG = "camera";
 typedef struct {
     sensor_t sensor;
     camera_fb_t fb;
+    camera_config_t config;     // config passed to esp_camera_init
+    uint16_t win_width;         // output size of the sensor window, 0 - full frame
+    uint16_t win_height;
 } camera_state_t;
 
 static const char *CAMERA_SENSOR_NVS_KEY = "sensor";
@@ -128,7 +133,7 @@ static esp_err_t camera_probe(const camera_config_t *config, camera_model_t *out
         return ESP_ERR_INVALID_STATE;
     }
 
-    s_state = (camera_state_t *) calloc(sizeof(camera_state_t), 1);
+    s_state = (camera_state_t *) wc_mem_calloc(WC_MEM_CAMERA, sizeof(camera_state_t), 1, MALLOC_CAP_DEFAULT);
     if (!s_state) {
         return ESP_ERR_NO_MEM;
     }
@@ -280,6 +285,10 @@ esp_err_t esp_camera_init(const camera_config_t *config)
     }
     s_state->sensor.init_status(&s_state->sensor);
 
+    s_state->config = *config;
+    s_state->config.frame_size = frame_size;
+
+    cam_settle(resolution[frame_size].width, resolution[frame_size].height);
     cam_start();
 
     return ESP_OK;
@@ -290,17 +299,238 @@ fail:
 }
 
 esp_err_t esp_camera_set_framesize(framesize_t fsz) {
+    if (cam_dma_layout_changes(s_state->sensor.pixformat, fsz)) {
+        // the DMA layout picked for the new size - the capture is rebuilt
+        return esp_camera_set_pixformat(s_state->sensor.pixformat, fsz);
+    }
     cam_stop();
+    s_state->win_width = s_state->win_height = 0;
     s_state->sensor.status.framesize = fsz;
     if (s_state->sensor.set_framesize(&s_state->sensor, fsz) != 0) {
         ESP_LOGE(TAG, "Failed to set frame size");
         esp_camera_deinit();
         return ESP_ERR_CAMERA_FAILED_TO_SET_FRAME_SIZE;
     }
+    cam_settle(resolution[fsz].width, resolution[fsz].height);
     cam_start();
     return ESP_OK;
 }
 
+/* capture is rebuilt for config, the sensor is switched to its format and fsz */
+static esp_err_t camera_reconfigure(const camera_config_t *config, framesize_t fsz)
+{
+    pixformat_t format = (pixformat_t) config->pixel_format;
+
+    // sensor, SCCB, XCLK and the ISR stay as is - only the capture part is rebuilt
+    esp_err_t err = cam_reconfig(config, config->frame_size, fsz, s_state->sensor.id.PID);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to reconfigure the capture, error 0x%x", err);
+        return err;
+    }
+
+    if (s_state->sensor.set_pixformat(&s_state->sensor, format) != 0) {
+        ESP_LOGE(TAG, "Failed to set pixel format");
+        return ESP_ERR_CAMERA_FAILED_TO_SET_OUT_FORMAT;
+    }
+    s_state->win_width = s_state->win_height = 0;
+    s_state->sensor.status.framesize = fsz;
+    if (s_state->sensor.set_framesize(&s_state->sensor, fsz) != 0) {
+        ESP_LOGE(TAG, "Failed to set frame size");
+        return ESP_ERR_CAMERA_FAILED_TO_SET_FRAME_SIZE;
+    }
+    if (format == PIXFORMAT_JPEG) {
+        s_state->sensor.set_quality(&s_state->sensor, s_state->sensor.status.quality);
+    }
+
+    cam_settle(resolution[fsz].width, resolution[fsz].height);
+    cam_start();
+    return ESP_OK;
+}
+
+esp_err_t esp_camera_reconfigure(const camera_config_t *config)
+{
+    if (s_state == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (config == NULL || config->fb_count < 1) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    const camera_config_t *cur = &s_state->config;
+    if (config->pin_pwdn != cur->pin_pwdn || config->pin_reset != cur->pin_reset ||
+        config->pin_xclk != cur->pin_xclk || config->pin_sscb_sda != cur->pin_sscb_sda ||
+        config->pin_sscb_scl != cur->pin_sscb_scl || config->pin_d7 != cur->pin_d7 ||
+        config->pin_d6 != cur->pin_d6 || config->pin_d5 != cur->pin_d5 ||
+        config->pin_d4 != cur->pin_d4 || config->pin_d3 != cur->pin_d3 ||
+        config->pin_d2 != cur->pin_d2 || config->pin_d1 != cur->pin_d1 ||
+        config->pin_d0 != cur->pin_d0 || config->pin_vsync != cur->pin_vsync ||
+        config->pin_href != cur->pin_href || config->pin_pclk != cur->pin_pclk ||
+        config->xclk_freq_hz != cur->xclk_freq_hz) {
+        ESP_LOGE(TAG, "Pins and XCLK can be changed only by esp_camera_deinit/esp_camera_init");
+        return ESP_ERR_INVALID_ARG;
+    }
+    camera_sensor_info_t *info = esp_camera_sensor_get_info(&s_state->sensor.id);
+    if (config->pixel_format == PIXFORMAT_JPEG && info && !info->support_jpeg) {
+        ESP_LOGE(TAG, "JPEG format is not supported on this sensor");
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    camera_config_t c = *config;
+    if (info && c.frame_size > info->max_size) {
+        ESP_LOGW(TAG, "The frame size exceeds the maximum for this sensor, it will be forced to the maximum possible value");
+        c.frame_size = info->max_size;
+    }
+    framesize_t fsz = (framesize_t) c.frame_size;
+    if (c.pixel_format == PIXFORMAT_JPEG) {
+        s_state->sensor.status.quality = c.jpeg_quality;
+    }
+    int64_t start = esp_timer_get_time();
+    esp_err_t err = camera_reconfigure(&c, fsz);
+    if (err == ESP_OK) {
+        s_state->config = c;
+        ESP_LOGI(TAG, "Reconfigured in %lld us", esp_timer_get_time() - start);
+    }
+    return err;
+}
+
+esp_err_t esp_camera_set_pixformat(pixformat_t format, framesize_t fsz)
+{
+    if (s_state == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    camera_config_t config = s_state->config;
+    config.pixel_format = format;
+    if (format != PIXFORMAT_JPEG) {
+        // raw frames are allocated by the exact size, JPEG buffers keep the init size
+        config.frame_size = fsz;
+    }
+    return camera_reconfigure(&config, fsz);
+}
+
+esp_err_t esp_camera_set_window(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t out_w, uint16_t out_h)
+{
+    if (s_state == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (s_state->sensor.id.PID != OV2640_PID) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    w &= ~3;
+    h &= ~3;
+    out_w &= ~3;
+    out_h &= ~3;
+    if (!w || !h || !out_w || !out_h || out_w > w || out_h > h ||
+        x + w > resolution[FRAMESIZE_UXGA].width || y + h > resolution[FRAMESIZE_UXGA].height) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    cam_stop();
+    // OV2640: startX is the sensor mode (0 - UXGA), offset and total are the window
+    if (s_state->sensor.set_res_raw(&s_state->sensor, 0, 0, 0, 0, x, y, w, h, out_w, out_h, false, false) != 0) {
+        ESP_LOGE(TAG, "Failed to set window");
+        cam_start();
+        return ESP_ERR_CAMERA_FAILED_TO_SET_FRAME_SIZE;
+    }
+    s_state->win_width = out_w;
+    s_state->win_height = out_h;
+    cam_settle(out_w, out_h);
+    cam_start();
+    return ESP_OK;
+}
+
+#if CONFIG_CAMERA_DMA_AUTOTUNE
+esp_err_t esp_camera_tune_dma(uint8_t frames)
+{
+    if (s_state == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    pixformat_t format = s_state->sensor.pixformat;
+    framesize_t fsz = s_state->sensor.status.framesize;
+
+    cam_dma_geometry_t candidates[CAM_DMA_CANDIDATES_MAX];
+    int cnt = cam_dma_candidates(format, candidates);
+    int best = -1;
+    uint32_t best_score = UINT32_MAX;
+
+    for (int i = 0; i < cnt; i++) {
+        cam_set_dma_geometry(format, fsz, &candidates[i]);
+        if (esp_camera_set_pixformat(format, fsz) != ESP_OK) {
+            continue;
+        }
+        cam_get_dma_stats(NULL, true);
+        int64_t start = esp_timer_get_time();
+        int got = 0;
+        for (int f = 0; f < frames; f++) {
+            esp_camera_do_snap();
+            camera_fb_t *fb = esp_camera_fb_get();
+            if (fb) {
+                got++;
+                esp_camera_fb_return(fb);
+            }
+        }
+        int64_t elapsed = esp_timer_get_time() - start;
+        cam_dma_stats_t st;
+        cam_get_dma_stats(&st, false);
+
+        uint32_t period = st.period_us ? st.period_us : 1;
+        // measured CPU time of the capture: interrupts, cam_task and the copies.
+        // the interrupt entry and the task switches are not seen by the timer
+        uint64_t cpu_us = st.busy_us[0] + st.busy_us[1] + st.isr_us;
+        uint32_t eof_us = (st.eof_cnt && cpu_us > st.copy_us) ? (uint32_t)((cpu_us - st.copy_us) / st.eof_cnt) : 0;
+        ESP_LOGI(TAG, "DMA %u/%u: %d/%d frames in %lld ms, %u EOF (%u us each), copy %llu us, OVF %u, FB-OVF %u, core0 %u%%, core1 %u%%",
+                 candidates[i].buffer_size, candidates[i].half_buffer_size, got, frames, elapsed / 1000,
+                 st.eof_cnt, eof_us, st.copy_us, st.ovf_cnt, st.fb_ovf_cnt,
+                 (uint32_t)(st.busy_us[0] * 100 / period), (uint32_t)(st.busy_us[1] * 100 / period));
+        if (got < frames || st.ovf_cnt || st.fb_ovf_cnt) {
+            continue;
+        }
+        uint32_t score = (uint32_t)(cpu_us / got);
+        if (score < best_score) {
+            best_score = score;
+            best = i;
+        }
+    }
+
+    cam_set_dma_geometry(format, fsz, (best >= 0) ? &candidates[best] : NULL);
+    esp_err_t err = esp_camera_set_pixformat(format, fsz);
+    if (best < 0) {
+        ESP_LOGW(TAG, "No DMA layout without overflows, the default one is used");
+        return (err == ESP_OK) ? ESP_FAIL : err;
+    }
+    ESP_LOGI(TAG, "DMA layout for format %d, frame size %d: %u/%u, %u us per frame", format, fsz,
+             candidates[best].buffer_size, candidates[best].half_buffer_size, best_score);
+    return err;
+}
+#endif
+
+void esp_camera_get_stats(camera_stats_t *stats, bool reset)
+{
+    cam_get_stats(stats, reset);
+}
+
+void esp_camera_settle()
+{
+    if (s_state == NULL) {
+        return;
+    }
+    cam_settle(0, 0);
+}
+
+void esp_camera_flash(int pin, int on_level, uint8_t frames)
+{
+    if (s_state == NULL) {
+        return;
+    }
+    cam_flash(pin, on_level, frames);
+}
+
+void esp_camera_set_frame_hook(void (*hook)(const camera_fb_t *fb, void *arg), void *arg)
+{
+    if (s_state == NULL) {
+        return;
+    }
+    cam_set_frame_hook(hook, arg);
+}
+
 esp_err_t esp_camera_deinit()
 {
     esp_err_t ret = cam_deinit();
@@ -308,7 +538,7 @@ esp_err_t esp_camera_deinit()
     if (s_state) {
         SCCB_Deinit();
 
-        free(s_state);
+        wc_mem_free(s_state);
         s_state = NULL;
     }
 
@@ -324,7 +554,11 @@ camera_fb_t *esp_camera_fb_get()
     }
     camera_fb_t *fb = cam_take(FB_GET_TIMEOUT);
     //set the frame properties
-    if (fb) {
+    if (fb && s_state->win_width) {
+        fb->width = s_state->win_width;
+        fb->height = s_state->win_height;
+        fb->format = s_state->sensor.pixformat;
+    } else if (fb) {
         fb->width = resolution[s_state->sensor.status.framesize].width;
         fb->height = resolution[s_state->sensor.status.framesize].height;
         fb->format = s_state->sensor.pixformat;
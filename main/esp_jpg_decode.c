@@ -0,0 +1,738 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stddef.h>
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_jpg_decode.h"
+#include "wc_mem.h"
+
+static const char *TAG = "esp_jpg_decode";
+
+/* Baseline huffman JPEG decoder. The source is pulled through the reader
+   callback by small chunks, every decoded MCU is converted to RGB888 and
+   passed to the writer callback, so neither the source nor the output image
+   has to be in the internal memory. JPG_SCALE_2X/4X average the pixels of
+   the full IDCT, JPG_SCALE_8X takes the DC coefficient as the block value
+   and skips dequantization and IDCT of the AC coefficients. */
+
+#define JPG_IN_BUF_SIZE     1024
+
+#define M_SOF0  0xC0
+#define M_SOF1  0xC1
+#define M_DHT   0xC4
+#define M_RST0  0xD0
+#define M_SOI   0xD8
+#define M_EOI   0xD9
+#define M_SOS   0xDA
+#define M_DQT   0xDB
+#define M_DRI   0xDD
+
+static const uint8_t jpg_zigzag[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+typedef struct {
+    uint8_t  fast_len[256];      // code length for the 8 bit prefix, 0 - longer code
+    uint8_t  fast_val[256];
+    int32_t  maxcode[17];
+    int32_t  valptr[17];
+    uint16_t mincode[17];
+    uint8_t  vals[256];
+    bool     defined;
+} jpg_huff_t;
+
+typedef struct {
+    uint8_t id;
+    uint8_t h, v;
+    uint8_t tq;
+    uint8_t td, ta;
+    int     pred;
+    uint8_t plane[256];          // scaled samples of the component in the MCU
+} jpg_comp_t;
+
+typedef struct {
+    jpg_reader_cb reader;
+    jpg_writer_cb writer;
+    void * arg;
+    size_t len;
+    size_t index;
+    size_t pos;
+    size_t cnt;
+    uint32_t bits;
+    int nbits;
+    uint8_t marker;              // marker met inside the entropy coded data
+    bool error;
+    bool stopped;                // the writer returned false
+
+    uint16_t width, height;
+    uint8_t ncomp;
+    uint8_t hmax, vmax;
+    uint16_t restart;
+    uint16_t qt[4][64];          // quantization tables in zigzag order
+    jpg_huff_t dc[4];
+    jpg_huff_t ac[4];
+    jpg_comp_t comp[3];
+
+    uint8_t in[JPG_IN_BUF_SIZE];
+    uint8_t rgb[16 * 16 * 3];
+} jpg_decoder_t;
+
+static uint8_t jpg_read_byte(jpg_decoder_t * d)
+{
+    if (d->pos == d->cnt) {
+        size_t n = d->len - d->index;
+        if (n > JPG_IN_BUF_SIZE) {
+            n = JPG_IN_BUF_SIZE;
+        }
+        d->cnt = n ? d->reader(d->arg, d->index, d->in, n) : 0;
+        d->pos = 0;
+        if (d->cnt == 0) {
+            d->error = true;
+            return M_EOI;
+        }
+        d->index += d->cnt;
+    }
+    return d->in[d->pos++];
+}
+
+static uint16_t jpg_read_word(jpg_decoder_t * d)
+{
+    uint16_t w = jpg_read_byte(d) << 8;
+    return w | jpg_read_byte(d);
+}
+
+static void jpg_skip(jpg_decoder_t * d, size_t n)
+{
+    while (n-- && !d->error) {
+        jpg_read_byte(d);
+    }
+}
+
+/* keep at least 25 bits in the bit buffer. zeros are fed after a marker */
+static inline void jpg_fill_bits(jpg_decoder_t * d)
+{
+    while (d->nbits <= 24) {
+        uint32_t b = 0;
+        if (!d->marker) {
+            b = jpg_read_byte(d);
+            if (b == 0xFF) {
+                uint8_t b2 = jpg_read_byte(d);
+                while (b2 == 0xFF) {
+                    b2 = jpg_read_byte(d);
+                }
+                if (b2) {
+                    d->marker = b2;
+                    b = 0;
+                }
+            }
+        }
+        d->bits |= b << (24 - d->nbits);
+        d->nbits += 8;
+    }
+}
+
+static inline void jpg_skip_bits(jpg_decoder_t * d, int n)
+{
+    d->bits <<= n;
+    d->nbits -= n;
+}
+
+static inline int jpg_decode_huff(jpg_decoder_t * d, const jpg_huff_t * h)
+{
+    jpg_fill_bits(d);
+    uint32_t p = d->bits >> 24;
+    if (h->fast_len[p]) {
+        jpg_skip_bits(d, h->fast_len[p]);
+        return h->fast_val[p];
+    }
+    for (int l = 9; l <= 16; l++) {
+        int32_t code = d->bits >> (32 - l);
+        if (code <= h->maxcode[l]) {
+            jpg_skip_bits(d, l);
+            return h->vals[h->valptr[l] + code - h->mincode[l]];
+        }
+    }
+    d->error = true;
+    return 0;
+}
+
+static inline int jpg_receive_extend(jpg_decoder_t * d, int s)
+{
+    jpg_fill_bits(d);
+    int v = d->bits >> (32 - s);
+    jpg_skip_bits(d, s);
+    if (v < (1 << (s - 1))) {
+        v += (-1 << s) + 1;
+    }
+    return v;
+}
+
+static esp_err_t jpg_read_dht(jpg_decoder_t * d, int len)
+{
+    while (len > 0 && !d->error) {
+        uint8_t tc_th = jpg_read_byte(d);
+        uint8_t bits[17];
+        int cnt = 0;
+        if ((tc_th & 0x0F) > 3 || (tc_th >> 4) > 1) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        jpg_huff_t * h = (tc_th >> 4) ? &d->ac[tc_th & 0x0F] : &d->dc[tc_th & 0x0F];
+        for (int i = 1; i <= 16; i++) {
+            bits[i] = jpg_read_byte(d);
+            cnt += bits[i];
+        }
+        if (cnt > 256) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        for (int i = 0; i < cnt; i++) {
+            h->vals[i] = jpg_read_byte(d);
+        }
+        len -= 17 + cnt;
+
+        memset(h->fast_len, 0, sizeof(h->fast_len));
+        int32_t code = 0;
+        int k = 0;
+        for (int l = 1; l <= 16; l++) {
+            if (code + bits[l] > (1 << l)) {
+                // oversubscribed - the codes do not fit in l bits
+                h->defined = false;
+                return ESP_ERR_INVALID_ARG;
+            }
+            h->valptr[l] = k;
+            h->mincode[l] = code;
+            for (int i = 0; i < bits[l]; i++, k++, code++) {
+                if (l <= 8) {
+                    int shift = 8 - l;
+                    for (int j = 0; j < (1 << shift); j++) {
+                        h->fast_len[(code << shift) | j] = l;
+                        h->fast_val[(code << shift) | j] = h->vals[k];
+                    }
+                }
+            }
+            h->maxcode[l] = bits[l] ? code - 1 : -1;
+            code <<= 1;
+        }
+        h->defined = true;
+    }
+    return d->error ? ESP_FAIL : ESP_OK;
+}
+
+static esp_err_t jpg_read_dqt(jpg_decoder_t * d, int len)
+{
+    while (len > 0 && !d->error) {
+        uint8_t pq_tq = jpg_read_byte(d);
+        if ((pq_tq & 0x0F) > 3) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        uint16_t * q = d->qt[pq_tq & 0x0F];
+        for (int i = 0; i < 64; i++) {
+            q[i] = (pq_tq >> 4) ? jpg_read_word(d) : jpg_read_byte(d);
+        }
+        len -= 1 + ((pq_tq >> 4) ? 128 : 64);
+    }
+    return d->error ? ESP_FAIL : ESP_OK;
+}
+
+static esp_err_t jpg_read_sof(jpg_decoder_t * d)
+{
+    if (jpg_read_byte(d) != 8) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    d->height = jpg_read_word(d);
+    d->width = jpg_read_word(d);
+    d->ncomp = jpg_read_byte(d);
+    if (d->ncomp != 1 && d->ncomp != 3) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    d->hmax = d->vmax = 1;
+    for (int i = 0; i < d->ncomp; i++) {
+        jpg_comp_t * c = &d->comp[i];
+        c->id = jpg_read_byte(d);
+        uint8_t hv = jpg_read_byte(d);
+        c->h = hv >> 4;
+        c->v = hv & 0x0F;
+        c->tq = jpg_read_byte(d) & 0x03;
+        if (c->h < 1 || c->h > 2 || c->v < 1 || c->v > 2 || (i && (c->h != 1 || c->v != 1))) {
+            // only 4:4:4, 4:2:2 and 4:2:0 with the full resolution luma
+            return ESP_ERR_NOT_SUPPORTED;
+        }
+        if (c->h > d->hmax) d->hmax = c->h;
+        if (c->v > d->vmax) d->vmax = c->v;
+    }
+    if (d->ncomp == 1) {
+        d->comp[0].h = d->comp[0].v = 1;
+        d->hmax = d->vmax = 1;
+    }
+    if (!d->width || !d->height) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return d->error ? ESP_FAIL : ESP_OK;
+}
+
+static esp_err_t jpg_read_sos(jpg_decoder_t * d)
+{
+    uint8_t ns = jpg_read_byte(d);
+    if (ns != d->ncomp) {
+        // progressive-like multi scan images are not supported
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    for (int i = 0; i < ns; i++) {
+        uint8_t id = jpg_read_byte(d);
+        uint8_t t = jpg_read_byte(d);
+        jpg_comp_t * c = NULL;
+        for (int j = 0; j < d->ncomp; j++) {
+            if (d->comp[j].id == id) {
+                c = &d->comp[j];
+            }
+        }
+        if (c == NULL || (t >> 4) > 3 || (t & 0x0F) > 3 ||
+            !d->dc[t >> 4].defined || !d->ac[t & 0x0F].defined) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        c->td = t >> 4;
+        c->ta = t & 0x0F;
+    }
+    jpg_skip(d, 3); // Ss, Se, Ah/Al are fixed for the baseline
+    return d->error ? ESP_FAIL : ESP_OK;
+}
+
+#define CONST_BITS  13
+#define PASS1_BITS  2
+#define DESCALE(x, n)  (((x) + (1 << ((n) - 1))) >> (n))
+
+#define FIX_0_298631336  2446
+#define FIX_0_390180644  3196
+#define FIX_0_541196100  4433
+#define FIX_0_765366865  6270
+#define FIX_0_899976223  7373
+#define FIX_1_175875602  9633
+#define FIX_1_501321110  12299
+#define FIX_1_847759065  15137
+#define FIX_1_961570560  16069
+#define FIX_2_053119869  16819
+#define FIX_2_562915447  20995
+#define FIX_3_072711026  25172
+
+static inline uint8_t jpg_clamp(int v)
+{
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+/* integer inverse DCT (jidctint from IJG) of the dequantized block */
+static void IRAM_ATTR jpg_idct(const int32_t * in, uint8_t * out)
+{
+    int32_t tmp0, tmp1, tmp2, tmp3;
+    int32_t tmp10, tmp11, tmp12, tmp13;
+    int32_t z1, z2, z3, z4, z5;
+    int32_t ws[64];
+
+    for (int i = 0; i < 8; i++) {
+        const int32_t * p = in + i;
+        int32_t * w = ws + i;
+        if (!p[8] && !p[16] && !p[24] && !p[32] && !p[40] && !p[48] && !p[56]) {
+            int32_t dc = p[0] << PASS1_BITS;
+            for (int j = 0; j < 64; j += 8) {
+                w[j] = dc;
+            }
+            continue;
+        }
+        z2 = p[16];
+        z3 = p[48];
+        z1 = (z2 + z3) * FIX_0_541196100;
+        tmp2 = z1 - z3 * FIX_1_847759065;
+        tmp3 = z1 + z2 * FIX_0_765366865;
+        tmp0 = (p[0] + p[32]) << CONST_BITS;
+        tmp1 = (p[0] - p[32]) << CONST_BITS;
+        tmp10 = tmp0 + tmp3;
+        tmp13 = tmp0 - tmp3;
+        tmp11 = tmp1 + tmp2;
+        tmp12 = tmp1 - tmp2;
+
+        tmp0 = p[56];
+        tmp1 = p[40];
+        tmp2 = p[24];
+        tmp3 = p[8];
+        z1 = tmp0 + tmp3;
+        z2 = tmp1 + tmp2;
+        z3 = tmp0 + tmp2;
+        z4 = tmp1 + tmp3;
+        z5 = (z3 + z4) * FIX_1_175875602;
+        tmp0 *= FIX_0_298631336;
+        tmp1 *= FIX_2_053119869;
+        tmp2 *= FIX_3_072711026;
+        tmp3 *= FIX_1_501321110;
+        z1 *= -FIX_0_899976223;
+        z2 *= -FIX_2_562915447;
+        z3 *= -FIX_1_961570560;
+        z4 *= -FIX_0_390180644;
+        z3 += z5;
+        z4 += z5;
+        tmp0 += z1 + z3;
+        tmp1 += z2 + z4;
+        tmp2 += z2 + z3;
+        tmp3 += z1 + z4;
+
+        w[0]  = DESCALE(tmp10 + tmp3, CONST_BITS - PASS1_BITS);
+        w[56] = DESCALE(tmp10 - tmp3, CONST_BITS - PASS1_BITS);
+        w[8]  = DESCALE(tmp11 + tmp2, CONST_BITS - PASS1_BITS);
+        w[48] = DESCALE(tmp11 - tmp2, CONST_BITS - PASS1_BITS);
+        w[16] = DESCALE(tmp12 + tmp1, CONST_BITS - PASS1_BITS);
+        w[40] = DESCALE(tmp12 - tmp1, CONST_BITS - PASS1_BITS);
+        w[24] = DESCALE(tmp13 + tmp0, CONST_BITS - PASS1_BITS);
+        w[32] = DESCALE(tmp13 - tmp0, CONST_BITS - PASS1_BITS);
+    }
+
+    for (int i = 0; i < 8; i++) {
+        const int32_t * w = ws + i * 8;
+        uint8_t * o = out + i * 8;
+        z2 = w[2];
+        z3 = w[6];
+        z1 = (z2 + z3) * FIX_0_541196100;
+        tmp2 = z1 - z3 * FIX_1_847759065;
+        tmp3 = z1 + z2 * FIX_0_765366865;
+        tmp0 = (w[0] + w[4]) << CONST_BITS;
+        tmp1 = (w[0] - w[4]) << CONST_BITS;
+        tmp10 = tmp0 + tmp3;
+        tmp13 = tmp0 - tmp3;
+        tmp11 = tmp1 + tmp2;
+        tmp12 = tmp1 - tmp2;
+
+        tmp0 = w[7];
+        tmp1 = w[5];
+        tmp2 = w[3];
+        tmp3 = w[1];
+        z1 = tmp0 + tmp3;
+        z2 = tmp1 + tmp2;
+        z3 = tmp0 + tmp2;
+        z4 = tmp1 + tmp3;
+        z5 = (z3 + z4) * FIX_1_175875602;
+        tmp0 *= FIX_0_298631336;
+        tmp1 *= FIX_2_053119869;
+        tmp2 *= FIX_3_072711026;
+        tmp3 *= FIX_1_501321110;
+        z1 *= -FIX_0_899976223;
+        z2 *= -FIX_2_562915447;
+        z3 *= -FIX_1_961570560;
+        z4 *= -FIX_0_390180644;
+        z3 += z5;
+        z4 += z5;
+        tmp0 += z1 + z3;
+        tmp1 += z2 + z4;
+        tmp2 += z2 + z3;
+        tmp3 += z1 + z4;
+
+        o[0] = jpg_clamp(DESCALE(tmp10 + tmp3, CONST_BITS + PASS1_BITS + 3) + 128);
+        o[7] = jpg_clamp(DESCALE(tmp10 - tmp3, CONST_BITS + PASS1_BITS + 3) + 128);
+        o[1] = jpg_clamp(DESCALE(tmp11 + tmp2, CONST_BITS + PASS1_BITS + 3) + 128);
+        o[6] = jpg_clamp(DESCALE(tmp11 - tmp2, CONST_BITS + PASS1_BITS + 3) + 128);
+        o[2] = jpg_clamp(DESCALE(tmp12 + tmp1, CONST_BITS + PASS1_BITS + 3) + 128);
+        o[5] = jpg_clamp(DESCALE(tmp12 - tmp1, CONST_BITS + PASS1_BITS + 3) + 128);
+        o[3] = jpg_clamp(DESCALE(tmp13 + tmp0, CONST_BITS + PASS1_BITS + 3) + 128);
+        o[4] = jpg_clamp(DESCALE(tmp13 - tmp0, CONST_BITS + PASS1_BITS + 3) + 128);
+    }
+}
+
+/* decode one block of the component c and put it to the component plane
+   at block position (bx, by). the block takes (8 >> scale) pixels per side */
+static void jpg_decode_block(jpg_decoder_t * d, jpg_comp_t * c, int bx, int by, jpg_scale_t scale)
+{
+    const uint16_t * q = d->qt[c->tq];
+    int bs = 8 >> scale;
+    int stride = c->h * bs;
+    uint8_t * dst = c->plane + by * bs * stride + bx * bs;
+
+    int t = jpg_decode_huff(d, &d->dc[c->td]);
+    if (t) {
+        c->pred += jpg_receive_extend(d, t);
+    }
+
+    if (scale == JPG_SCALE_8X) {
+        // only the DC is required, AC coefficients are decoded to be skipped
+        const jpg_huff_t * ac = &d->ac[c->ta];
+        for (int k = 1; k < 64 && !d->error; k++) {
+            int rs = jpg_decode_huff(d, ac);
+            int s = rs & 0x0F;
+            if (s) {
+                k += rs >> 4;
+                jpg_fill_bits(d);
+                jpg_skip_bits(d, s);
+            } else if (rs == 0xF0) {
+                k += 15;
+            } else {
+                break;
+            }
+        }
+        dst[0] = jpg_clamp(DESCALE(c->pred * q[0], 3) + 128);
+        return;
+    }
+
+    int32_t coef[64];
+    uint8_t pix[64];
+    memset(coef, 0, sizeof(coef));
+    coef[0] = c->pred * q[0];
+    const jpg_huff_t * ac = &d->ac[c->ta];
+    for (int k = 1; k < 64 && !d->error; k++) {
+        int rs = jpg_decode_huff(d, ac);
+        int s = rs & 0x0F;
+        if (s) {
+            k += rs >> 4;
+            if (k > 63) {
+                d->error = true;
+                break;
+            }
+            coef[jpg_zigzag[k]] = jpg_receive_extend(d, s) * q[k];
+        } else if (rs == 0xF0) {
+            k += 15;
+        } else {
+            break;
+        }
+    }
+
+    jpg_idct(coef, pix);
+
+    if (scale == JPG_SCALE_NONE) {
+        for (int y = 0; y < 8; y++) {
+            memcpy(dst + y * stride, pix + y * 8, 8);
+        }
+        return;
+    }
+    int n = 1 << scale;
+    int sh = scale * 2;
+    for (int y = 0; y < bs; y++) {
+        for (int x = 0; x < bs; x++) {
+            int sum = 0;
+            for (int j = 0; j < n; j++) {
+                const uint8_t * s = pix + (y * n + j) * 8 + x * n;
+                for (int i = 0; i < n; i++) {
+                    sum += s[i];
+                }
+            }
+            dst[y * stride + x] = (sum + (1 << (sh - 1))) >> sh;
+        }
+    }
+}
+
+/* convert the decoded MCU planes to RGB888 */
+static void jpg_mcu_to_rgb(jpg_decoder_t * d, int w, int h, jpg_scale_t scale)
+{
+    int bs = 8 >> scale;
+    uint8_t * o = d->rgb;
+    const jpg_comp_t * cy = &d->comp[0];
+    int ystride = cy->h * bs;
+
+    if (d->ncomp == 1) {
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                o[0] = o[1] = o[2] = cy->plane[y * ystride + x];
+                o += 3;
+            }
+        }
+        return;
+    }
+
+    const jpg_comp_t * ccb = &d->comp[1];
+    const jpg_comp_t * ccr = &d->comp[2];
+    for (int y = 0; y < h; y++) {
+        int cy_off = (y / d->vmax) * bs;
+        for (int x = 0; x < w; x++) {
+            int yy = cy->plane[y * ystride + x];
+            int ci = cy_off + x / d->hmax;
+            int cb = ccb->plane[ci] - 128;
+            int cr = ccr->plane[ci] - 128;
+            o[0] = jpg_clamp(yy + ((91881 * cr + 32768) >> 16));
+            o[1] = jpg_clamp(yy - ((22554 * cb + 46802 * cr + 32768) >> 16));
+            o[2] = jpg_clamp(yy + ((116130 * cb + 32768) >> 16));
+            o += 3;
+        }
+    }
+}
+
+/* resync the entropy decoder on the restart marker */
+static void jpg_restart(jpg_decoder_t * d)
+{
+    d->bits = 0;
+    d->nbits = 0;
+    if (d->marker < M_RST0 || d->marker > M_RST0 + 7) {
+        // marker is not reached yet, search for it
+        uint8_t b = 0;
+        while (!d->error) {
+            uint8_t p = b;
+            b = jpg_read_byte(d);
+            if (p == 0xFF && b >= M_RST0 && b <= M_RST0 + 7) {
+                break;
+            }
+        }
+    }
+    d->marker = 0;
+    for (int i = 0; i < d->ncomp; i++) {
+        d->comp[i].pred = 0;
+    }
+}
+
+static esp_err_t jpg_decode_scan(jpg_decoder_t * d, jpg_scale_t scale)
+{
+    int outw = d->width >> scale;
+    int outh = d->height >> scale;
+    if (outw == 0) outw = 1;
+    if (outh == 0) outh = 1;
+
+    if (!d->writer(d->arg, 0, 0, outw, outh, NULL)) {
+        d->stopped = true;
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    int mcu_w = 8 * d->hmax;
+    int mcu_h = 8 * d->vmax;
+    int mcus_x = (d->width + mcu_w - 1) / mcu_w;
+    int mcus_y = (d->height + mcu_h - 1) / mcu_h;
+    int out_mw = mcu_w >> scale;
+    int out_mh = mcu_h >> scale;
+    int left = d->restart;
+
+    for (int my = 0; my < mcus_y; my++) {
+        for (int mx = 0; mx < mcus_x; mx++) {
+            if (d->restart) {
+                if (left == 0) {
+                    jpg_restart(d);
+                    left = d->restart;
+                }
+                left--;
+            }
+            for (int i = 0; i < d->ncomp; i++) {
+                jpg_comp_t * c = &d->comp[i];
+                for (int by = 0; by < c->v; by++) {
+                    for (int bx = 0; bx < c->h; bx++) {
+                        jpg_decode_block(d, c, bx, by, scale);
+                    }
+                }
+            }
+            if (d->error) {
+                ESP_LOGE(TAG, "Corrupted data at MCU %d,%d", mx, my);
+                return ESP_FAIL;
+            }
+            int x = mx * out_mw;
+            int y = my * out_mh;
+            if (x >= outw || y >= outh) {
+                continue;
+            }
+            int w = (x + out_mw > outw) ? outw - x : out_mw;
+            int h = (y + out_mh > outh) ? outh - y : out_mh;
+            jpg_mcu_to_rgb(d, w, h, scale);
+            if (!d->writer(d->arg, x, y, w, h, d->rgb)) {
+                d->stopped = true;
+                return ESP_ERR_INVALID_STATE;
+            }
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_jpg_decode(size_t len, jpg_scale_t scale, jpg_reader_cb reader, jpg_writer_cb writer, void * arg)
+{
+    if (!reader || !writer || scale > JPG_SCALE_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    jpg_decoder_t * d = (jpg_decoder_t *)wc_mem_malloc(WC_MEM_IMAGE, sizeof(jpg_decoder_t), MALLOC_CAP_8BIT);
+    if (d == NULL) {
+        ESP_LOGE(TAG, "Decoder malloc failed");
+        return ESP_ERR_NO_MEM;
+    }
+    memset(d, 0, offsetof(jpg_decoder_t, in));
+    d->reader = reader;
+    d->writer = writer;
+    d->arg = arg;
+    d->len = len;
+
+    esp_err_t res = ESP_FAIL;
+    bool sof = false;
+
+    if (jpg_read_byte(d) != 0xFF || jpg_read_byte(d) != M_SOI) {
+        ESP_LOGE(TAG, "No SOI marker");
+        goto done;
+    }
+    while (!d->error) {
+        uint8_t m = jpg_read_byte(d);
+        if (m != 0xFF) {
+            continue;
+        }
+        while (m == 0xFF) {
+            m = jpg_read_byte(d);
+        }
+        if (m == 0 || (m >= M_RST0 && m <= M_RST0 + 7)) {
+            continue;
+        }
+        if (m == M_EOI) {
+            break;
+        }
+        int seg = (int)jpg_read_word(d) - 2;
+        if (seg < 0) {
+            break;
+        }
+        switch (m) {
+        case M_SOF0:
+        case M_SOF1:
+            res = jpg_read_sof(d);
+            sof = (res == ESP_OK);
+            break;
+        case M_DHT:
+            res = jpg_read_dht(d, seg);
+            break;
+        case M_DQT:
+            res = jpg_read_dqt(d, seg);
+            break;
+        case M_DRI:
+            d->restart = jpg_read_word(d);
+            res = ESP_OK;
+            break;
+        case M_SOS:
+            if (!sof) {
+                res = ESP_ERR_INVALID_STATE;
+                break;
+            }
+            res = jpg_read_sos(d);
+            if (res == ESP_OK) {
+                res = jpg_decode_scan(d, scale);
+            }
+            goto done;
+        default:
+            if ((m & 0xF0) == 0xC0 && m != 0xC8 && m != 0xCC) {
+                // progressive, lossless or arithmetic coded frame
+                res = ESP_ERR_NOT_SUPPORTED;
+            } else {
+                jpg_skip(d, seg);
+                res = ESP_OK;
+            }
+            break;
+        }
+        if (res != ESP_OK) {
+            break;
+        }
+    }
+    if (res == ESP_OK) {
+        // EOI before the scan
+        res = ESP_FAIL;
+    }
+
+done:
+    if (d->stopped) {
+        ESP_LOGD(TAG, "JPEG decode stopped by the writer");
+    } else if (res != ESP_OK) {
+        ESP_LOGE(TAG, "JPEG decode failed: %d", res);
+    }
+    wc_mem_free(d);
+    return res;
+}
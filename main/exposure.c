@@ -0,0 +1,173 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <string.h>
+#include "esp_log.h"
+#include "esp_jpg_decode.h"
+#include "exposure.h"
+
+static const char *TAG = "exposure";
+
+/* sensor gain is agc_gain + 1 (1x - 31x), exposure is in lines */
+#define AGC_GAIN_MAX 30
+#define RATIO_SHIFT  8
+
+typedef struct {
+    const uint8_t * input;
+    uint32_t * hist;
+    uint32_t sum;
+    uint32_t cnt;
+} exposure_ctx_t;
+
+static size_t stats_read(void * arg, size_t index, uint8_t *buf, size_t len)
+{
+    exposure_ctx_t * ctx = (exposure_ctx_t *)arg;
+    memcpy(buf, ctx->input + index, len);
+    return len;
+}
+
+static bool stats_write(void * arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t *data)
+{
+    exposure_ctx_t * ctx = (exposure_ctx_t *)arg;
+    if (data == NULL) {
+        return true;
+    }
+    for (uint32_t i = 0; i < (uint32_t)w * h; i++) {
+        uint32_t l = (77 * data[0] + 150 * data[1] + 29 * data[2]) >> 8;
+        ctx->hist[l >> 4]++;
+        ctx->sum += l;
+        data += 3;
+    }
+    ctx->cnt += (uint32_t)w * h;
+    return true;
+}
+
+esp_err_t exposure_stats(const uint8_t * jpg, size_t len, uint32_t * hist, uint8_t * mean)
+{
+    exposure_ctx_t ctx = { jpg, hist, 0, 0 };
+    memset(hist, 0, sizeof(uint32_t) * EXPOSURE_HIST_BINS);
+    esp_err_t ret = esp_jpg_decode(len, JPG_SCALE_8X, stats_read, stats_write, &ctx);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    if (ctx.cnt == 0) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    *mean = ctx.sum / ctx.cnt;
+    return ESP_OK;
+}
+
+/* exposure lines available in the current sensor mode */
+static int max_aec_value(sensor_t * s)
+{
+    uint16_t h = resolution[s->status.framesize].height;
+    return (h > 600) ? 1200 : ((h > 300) ? 600 : 300);
+}
+
+/* new exposure * gain product scaled by target / mean. mean does not grow
+   past the clipped highlights (and does not fall under the crushed shadows),
+   so the step is doubled while a quarter of the frame is clipped */
+static uint32_t next_exposure(uint32_t cur, uint8_t mean, uint8_t target, const uint32_t * hist)
+{
+    uint32_t total = 0;
+    for (int i = 0; i < EXPOSURE_HIST_BINS; i++) {
+        total += hist[i];
+    }
+    uint32_t ratio = ((uint32_t)target << RATIO_SHIFT) / (mean ? mean : 1);
+    if (mean > target && hist[EXPOSURE_HIST_BINS - 1] * 4 > total) {
+        ratio >>= 1;
+    } else if (mean < target && hist[0] * 4 > total) {
+        ratio <<= 1;
+    }
+    if (ratio < (1 << RATIO_SHIFT) / 8) {
+        ratio = (1 << RATIO_SHIFT) / 8;
+    } else if (ratio > (8 << RATIO_SHIFT)) {
+        ratio = 8 << RATIO_SHIFT;
+    }
+    uint32_t e = (cur * ratio) >> RATIO_SHIFT;
+    return e ? e : 1;
+}
+
+/* exposure time is preferred, gain is added only for the rest */
+static void apply_exposure(sensor_t * s, uint32_t e, exposure_result_t * res)
+{
+    int max_aec = max_aec_value(s);
+    int max_gain = (2 << s->status.gainceiling) - 1;
+    if (max_gain > AGC_GAIN_MAX) {
+        max_gain = AGC_GAIN_MAX;
+    }
+    int aec = (e > max_aec) ? max_aec : e;
+    int gain = (e + aec - 1) / aec - 1;
+    if (gain > max_gain) {
+        gain = max_gain;
+    }
+    s->set_aec_value(s, aec);
+    s->set_agc_gain(s, gain);
+    res->aec_value = aec;
+    res->agc_gain = gain;
+}
+
+camera_fb_t * exposure_converge(uint8_t target, uint8_t tolerance, uint8_t max_frames, exposure_result_t * res)
+{
+    sensor_t * s = esp_camera_sensor_get();
+    memset(res, 0, sizeof(exposure_result_t));
+    if (s == NULL) {
+        return NULL;
+    }
+    // exposure and gain set by the sensor AEC/AGC for the previous frames
+    s->init_status(s);
+    res->aec_value = s->status.aec_value;
+    res->agc_gain = s->status.agc_gain;
+
+    camera_fb_t * fb = esp_camera_fb_get();
+    while (fb) {
+        res->frames++;
+        if (fb->format != PIXFORMAT_JPEG ||
+            exposure_stats(fb->buf, fb->len, res->hist, &res->mean) != ESP_OK) {
+            break;
+        }
+        int diff = (int)res->mean - target;
+        if (diff <= tolerance && diff >= -tolerance) {
+            res->converged = true;
+            break;
+        }
+        if (res->frames >= max_frames) {
+            break;
+        }
+        uint32_t cur = (uint32_t)(res->aec_value ? res->aec_value : 1) * (res->agc_gain + 1);
+        uint32_t e = next_exposure(cur, res->mean, target, res->hist);
+        ESP_LOGD(TAG, "mean %u, exposure %u -> %u", res->mean, cur, e);
+
+        esp_camera_fb_return(fb);
+        if (res->frames == 1) {
+            s->set_exposure_ctrl(s, 0);
+            s->set_gain_ctrl(s, 0);
+        }
+        apply_exposure(s, e, res);
+        // the frame exposed with the new values
+        esp_camera_settle();
+        esp_camera_do_snap();
+        fb = esp_camera_fb_get();
+    }
+    ESP_LOGI(TAG, "%s in %u frames, mean %u, aec %u, gain %u", res->converged ? "Converged" : "Not converged",
+             res->frames, res->mean, res->aec_value, res->agc_gain);
+    return fb;
+}
+
+void exposure_release()
+{
+    sensor_t * s = esp_camera_sensor_get();
+    if (s == NULL) {
+        return;
+    }
+    s->set_exposure_ctrl(s, 1);
+    s->set_gain_ctrl(s, 1);
+}
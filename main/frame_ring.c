@@ -0,0 +1,214 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "frame_ring.h"
+#include "wc_mem.h"
+
+static const char *TAG = "frame_ring";
+
+/* every record is placed in one piece - header followed by the jpeg data.
+   if the record does not fit the tail of the memory block, the ring wraps
+   and the rest of the block (from wrap to the end) is left unused */
+typedef struct {
+    uint32_t len;
+    uint32_t size;   // full record size with header and alignment
+    int64_t  ts_us;
+} frame_ring_rec_t;
+
+#define REC_ALIGN(x) (((x) + 3) & ~3)
+
+typedef struct {
+    uint8_t * mem;
+    size_t cap;
+    size_t head;     // offset of the next record
+    size_t tail;     // offset of the oldest record
+    size_t wrap;     // end of the used data when head < tail
+    size_t count;
+    size_t bytes;
+    uint32_t dropped; // frames not recorded while the ring was busy
+    int64_t max_age_us;
+    SemaphoreHandle_t mux;
+} frame_ring_t;
+
+static frame_ring_t ring = {0};
+
+static void ring_drop_oldest() {
+    frame_ring_rec_t * rec = (frame_ring_rec_t *) &ring.mem[ring.tail];
+    bool wrapped = ring.head <= ring.tail;
+    ring.tail += rec->size;
+    ring.bytes -= rec->len;
+    ring.count--;
+    if (ring.count == 0) {
+        ring.head = ring.tail = 0;
+        ring.wrap = ring.cap;
+    } else if (wrapped && ring.tail >= ring.wrap) {
+        ring.tail = 0;
+        ring.wrap = ring.cap;
+    }
+}
+
+/* try to find a place for the record with size need. head is moved to the
+   start of the block if the ring should wrap */
+static bool ring_fits(size_t need) {
+    if (ring.count == 0) {
+        ring.head = ring.tail = 0;
+        ring.wrap = ring.cap;
+        return need <= ring.cap;
+    }
+    if (ring.head > ring.tail) {
+        if (ring.cap - ring.head >= need)
+            return true;
+        if (ring.tail >= need) {
+            ring.wrap = ring.head;
+            ring.head = 0;
+            return true;
+        }
+        return false;
+    }
+    return (ring.tail - ring.head) >= need;
+}
+
+esp_err_t frame_ring_init(size_t capacity, uint32_t max_age_ms) {
+    if (ring.mem) return ESP_OK;
+
+    ring.mem = (uint8_t *) wc_mem_malloc(WC_MEM_FRAMES, capacity, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (ring.mem == NULL) {
+        ESP_LOGE(TAG, "Can't allocate %u bytes for pre-event ring", capacity);
+        return ESP_ERR_NO_MEM;
+    }
+    ring.mux = xSemaphoreCreateMutex();
+    if (ring.mux == NULL) {
+        wc_mem_free(ring.mem);
+        ring.mem = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+    ring.cap = capacity;
+    ring.wrap = capacity;
+    ring.head = ring.tail = 0;
+    ring.count = ring.bytes = 0;
+    ring.max_age_us = (int64_t) max_age_ms * 1000;
+
+    ESP_LOGI(TAG, "Pre-event ring allocated %u bytes, %u ms", capacity, max_age_ms);
+    return ESP_OK;
+}
+
+void frame_ring_push(const camera_fb_t * fb) {
+    if (ring.mem == NULL || fb == NULL || fb->len == 0) return;
+
+    size_t need = REC_ALIGN(sizeof(frame_ring_rec_t) + fb->len);
+    if (need > ring.cap) return;
+
+    int64_t ts = (int64_t) fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec;
+
+    /* the uploader copies the frames out with the ring locked - the frame
+       is dropped rather than stall the stream behind the copy */
+    if (xSemaphoreTake(ring.mux, 0) != pdTRUE) {
+        ring.dropped++;
+        return;
+    }
+    /* drop expired frames */
+    while (ring.count) {
+        frame_ring_rec_t * rec = (frame_ring_rec_t *) &ring.mem[ring.tail];
+        if (ts - rec->ts_us <= ring.max_age_us) break;
+        ring_drop_oldest();
+    }
+    /* drop the oldest frames until the new one fits */
+    while (!ring_fits(need))
+        ring_drop_oldest();
+
+    frame_ring_rec_t * rec = (frame_ring_rec_t *) &ring.mem[ring.head];
+    rec->len = fb->len;
+    rec->size = need;
+    rec->ts_us = ts;
+    memcpy(&ring.mem[ring.head + sizeof(frame_ring_rec_t)], fb->buf, fb->len);
+    ring.head += need;
+    ring.count++;
+    ring.bytes += fb->len;
+
+    xSemaphoreGive(ring.mux);
+}
+
+size_t frame_ring_foreach(int64_t from_us, int64_t to_us, frame_ring_cb cb, void * arg) {
+    size_t res = 0;
+    if (ring.mem == NULL) return 0;
+
+    if (xSemaphoreTake(ring.mux, portMAX_DELAY) == pdTRUE) {
+        size_t off = ring.tail;
+        for (size_t i = 0; i < ring.count; i++) {
+            if (ring.head <= ring.tail && off >= ring.wrap)
+                off = 0;
+            frame_ring_rec_t * rec = (frame_ring_rec_t *) &ring.mem[off];
+            if (rec->ts_us > from_us && rec->ts_us <= to_us) {
+                res++;
+                if (!cb(arg, &ring.mem[off + sizeof(frame_ring_rec_t)], rec->len, rec->ts_us))
+                    break;
+            }
+            off += rec->size;
+        }
+        xSemaphoreGive(ring.mux);
+    }
+    return res;
+}
+
+size_t frame_ring_copy(int64_t from_us, int64_t to_us, uint8_t * buf, size_t cap, int64_t * ts_us) {
+    size_t res = 0;
+    if (ring.mem == NULL) return 0;
+
+    if (xSemaphoreTake(ring.mux, portMAX_DELAY) == pdTRUE) {
+        size_t off = ring.tail;
+        for (size_t i = 0; i < ring.count; i++) {
+            if (ring.head <= ring.tail && off >= ring.wrap)
+                off = 0;
+            frame_ring_rec_t * rec = (frame_ring_rec_t *) &ring.mem[off];
+            if (rec->ts_us > from_us && rec->ts_us <= to_us) {
+                res = rec->len;
+                *ts_us = rec->ts_us;
+                if (rec->len <= cap)
+                    memcpy(buf, &ring.mem[off + sizeof(frame_ring_rec_t)], rec->len);
+                break;
+            }
+            off += rec->size;
+        }
+        xSemaphoreGive(ring.mux);
+    }
+    return res;
+}
+
+void frame_ring_get_usage(size_t * frames, size_t * bytes, uint32_t * dropped) {
+    *frames = 0;
+    *bytes = 0;
+    *dropped = 0;
+    if (ring.mem == NULL) return;
+
+    if (xSemaphoreTake(ring.mux, portMAX_DELAY) == pdTRUE) {
+        *frames = ring.count;
+        *bytes = ring.bytes;
+        *dropped = ring.dropped;
+        xSemaphoreGive(ring.mux);
+    }
+}
+
+void frame_ring_clear() {
+    if (ring.mem == NULL) return;
+
+    if (xSemaphoreTake(ring.mux, portMAX_DELAY) == pdTRUE) {
+        ring.head = ring.tail = 0;
+        ring.wrap = ring.cap;
+        ring.count = ring.bytes = 0;
+        xSemaphoreGive(ring.mux);
+    }
+}
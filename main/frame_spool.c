@@ -0,0 +1,428 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_partition.h"
+#include "esp_heap_caps.h"
+#include "esp_crc.h"
+#include "esp_log.h"
+#include "frame_spool.h"
+#include "wc_mem.h"
+
+static const char *TAG = "frame_spool";
+
+/* The spool is a circular log. Every flash sector starts with the sector
+   header, the rest of the sector is the data area. The data areas of all
+   sectors form the logical address space of the log, records are written
+   one after another and may cross the sector borders and the end of the
+   partition. Sectors are erased only when the head enters them, so each
+   sector is erased once per lap.
+
+   Records are marked with NOR-friendly states - bits are only cleared:
+   EMPTY -> VALID after the data is written, VALID -> SENT after upload. */
+
+#define SPOOL_SECTOR_MAGIC  0x4C4F5053  // "SPOL"
+#define SPOOL_REC_MAGIC     0x43455246  // "FREC"
+#define SPOOL_STATE_EMPTY   0xFFFFFFFF
+#define SPOOL_STATE_VALID   0x0000FFFF
+#define SPOOL_STATE_SENT    0x00000000
+#define SPOOL_NO_RECORD     0xFFFFFFFF
+
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;        // sector opening number, increased by every erase
+    uint32_t first_rec;  // offset in the data area of the first record started here
+    uint32_t reserved;
+} spool_sector_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t len;
+    uint32_t crc;        // crc32 of the data
+    int64_t  ts_us;
+    uint32_t hcrc;       // crc32 of the fields above
+    uint32_t state;
+} spool_rec_t;
+
+#define SPOOL_SEC_DATA     (SPI_FLASH_SEC_SIZE - sizeof(spool_sector_t))
+#define SPOOL_REC_SIZE(l)  ((sizeof(spool_rec_t) + (l) + 3) & ~3)
+#define SPOOL_HCRC_LEN     offsetof(spool_rec_t, hcrc)
+
+typedef struct {
+    const esp_partition_t * part;
+    uint32_t sec_cnt;
+    uint32_t total;          // logical size of the log
+    uint32_t head;           // logical offset of the next record
+    uint32_t tail;           // logical offset of the oldest unsent record
+    uint32_t pending;
+    uint32_t rec_seq;
+    uint32_t boot_seq;       // last record written before frame_spool_init
+    uint32_t sec_seq;
+    uint32_t opened;         // last erased sector
+    bool     first_set;      // first_rec field of the opened sector is written
+    SemaphoreHandle_t mux;
+} frame_spool_t;
+
+static frame_spool_t spool = {0};
+
+static inline uint32_t spool_sector_of(uint32_t loff) {
+    return (loff % spool.total) / SPOOL_SEC_DATA;
+}
+
+static inline uint32_t spool_wrap(uint32_t loff) {
+    return loff % spool.total;
+}
+
+static esp_err_t spool_read(uint32_t loff, void * dst, size_t len) {
+    uint8_t * p = (uint8_t *) dst;
+    while (len) {
+        loff = spool_wrap(loff);
+        uint32_t in_sec = loff % SPOOL_SEC_DATA;
+        size_t chunk = SPOOL_SEC_DATA - in_sec;
+        if (chunk > len) chunk = len;
+        size_t phys = (loff / SPOOL_SEC_DATA) * SPI_FLASH_SEC_SIZE + sizeof(spool_sector_t) + in_sec;
+        esp_err_t err = esp_partition_read(spool.part, phys, p, chunk);
+        if (err != ESP_OK) return err;
+        p += chunk;
+        loff += chunk;
+        len -= chunk;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t spool_write(uint32_t loff, const void * src, size_t len) {
+    const uint8_t * p = (const uint8_t *) src;
+    while (len) {
+        loff = spool_wrap(loff);
+        uint32_t in_sec = loff % SPOOL_SEC_DATA;
+        size_t chunk = SPOOL_SEC_DATA - in_sec;
+        if (chunk > len) chunk = len;
+        size_t phys = (loff / SPOOL_SEC_DATA) * SPI_FLASH_SEC_SIZE + sizeof(spool_sector_t) + in_sec;
+        esp_err_t err = esp_partition_write(spool.part, phys, p, chunk);
+        if (err != ESP_OK) return err;
+        p += chunk;
+        loff += chunk;
+        len -= chunk;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t spool_read_sector(uint32_t sec, spool_sector_t * hdr) {
+    return esp_partition_read(spool.part, sec * SPI_FLASH_SEC_SIZE, hdr, sizeof(spool_sector_t));
+}
+
+static bool spool_read_rec(uint32_t loff, spool_rec_t * rec) {
+    if (spool_read(loff, rec, sizeof(spool_rec_t)) != ESP_OK) return false;
+    if (rec->magic != SPOOL_REC_MAGIC) return false;
+    if (rec->hcrc != esp_crc32_le(0, (const uint8_t *) rec, SPOOL_HCRC_LEN)) return false;
+    return (SPOOL_REC_SIZE(rec->len) <= spool.total - 2 * SPOOL_SEC_DATA);
+}
+
+/* move the tail to the next unsent record */
+static void spool_skip_sent() {
+    spool_rec_t rec;
+    while (spool.pending && spool.tail != spool.head) {
+        if (!spool_read_rec(spool.tail, &rec)) {
+            // must never happen - the log is broken, drop everything
+            spool.tail = spool.head;
+            spool.pending = 0;
+            return;
+        }
+        if (rec.state == SPOOL_STATE_VALID) return;
+        spool.tail = spool_wrap(spool.tail + SPOOL_REC_SIZE(rec.len));
+    }
+    if (spool.pending == 0)
+        spool.tail = spool.head;
+}
+
+static void spool_drop_oldest() {
+    spool_rec_t rec;
+    if (spool_read_rec(spool.tail, &rec)) {
+        spool.tail = spool_wrap(spool.tail + SPOOL_REC_SIZE(rec.len));
+        spool.pending--;
+        spool_skip_sent();
+    } else {
+        spool.tail = spool.head;
+        spool.pending = 0;
+    }
+}
+
+/* is the oldest unsent record placed (even partially) in the sector sec */
+static bool spool_tail_in_sector(uint32_t sec) {
+    spool_rec_t rec;
+    if (spool.pending == 0) return false;
+    if (!spool_read_rec(spool.tail, &rec)) return true;
+    uint32_t sz = SPOOL_REC_SIZE(rec.len);
+    uint32_t first = spool_sector_of(spool.tail);
+    uint32_t last = spool_sector_of(spool.tail + sz - 1);
+    if (first <= last)
+        return (sec >= first && sec <= last);
+    return (sec >= first || sec <= last);
+}
+
+static esp_err_t spool_open_sector(uint32_t sec) {
+    while (spool_tail_in_sector(sec)) {
+        ESP_LOGW(TAG, "Spool is full, the oldest frame dropped");
+        spool_drop_oldest();
+    }
+
+    esp_err_t err = esp_partition_erase_range(spool.part, sec * SPI_FLASH_SEC_SIZE, SPI_FLASH_SEC_SIZE);
+    if (err != ESP_OK) return err;
+
+    spool_sector_t hdr;
+    hdr.magic = SPOOL_SECTOR_MAGIC;
+    hdr.seq = ++spool.sec_seq;
+    hdr.first_rec = SPOOL_NO_RECORD;
+    hdr.reserved = SPOOL_NO_RECORD;
+    err = esp_partition_write(spool.part, sec * SPI_FLASH_SEC_SIZE, &hdr, sizeof(hdr));
+    if (err != ESP_OK) return err;
+
+    spool.opened = sec;
+    spool.first_set = false;
+    return ESP_OK;
+}
+
+static esp_err_t spool_format() {
+    ESP_LOGW(TAG, "Formatting the spool partition");
+    spool.sec_seq = 0;
+    spool.rec_seq = 0;
+    spool.head = spool.tail = 0;
+    spool.pending = 0;
+    return spool_open_sector(0);
+}
+
+/* check that the sectors from *sec to target were opened one after another.
+   stale sectors from the previous lap break the sequence */
+static bool spool_follow(uint32_t * sec, uint32_t * seq, uint32_t target) {
+    spool_sector_t hdr;
+    while (*sec != target) {
+        uint32_t next = (*sec + 1) % spool.sec_cnt;
+        if (spool_read_sector(next, &hdr) != ESP_OK) return false;
+        if (hdr.magic != SPOOL_SECTOR_MAGIC || hdr.seq != *seq + 1) return false;
+        *sec = next;
+        *seq = hdr.seq;
+    }
+    return true;
+}
+
+/* walk the records from the oldest sector and restore head, tail and counters */
+static esp_err_t spool_recover() {
+    spool_sector_t hdr;
+    uint32_t min_seq = UINT32_MAX, max_seq = 0;
+    uint32_t min_sec = 0, max_sec = 0;
+    bool found = false;
+
+    for (uint32_t s = 0; s < spool.sec_cnt; s++) {
+        if (spool_read_sector(s, &hdr) != ESP_OK) return ESP_FAIL;
+        if (hdr.magic != SPOOL_SECTOR_MAGIC) continue;
+        found = true;
+        if (hdr.seq < min_seq) { min_seq = hdr.seq; min_sec = s; }
+        if (hdr.seq >= max_seq) { max_seq = hdr.seq; max_sec = s; }
+    }
+    if (!found) return spool_format();
+
+    spool.sec_seq = max_seq;
+    spool.opened = max_sec;
+    spool.pending = 0;
+    spool.rec_seq = 0;
+
+    /* find the first record started in the oldest sectors */
+    uint32_t sec = min_sec, seq = min_seq;
+    uint32_t loff = SPOOL_NO_RECORD;
+    while (true) {
+        if (spool_read_sector(sec, &hdr) != ESP_OK) return ESP_FAIL;
+        if (hdr.first_rec != SPOOL_NO_RECORD) {
+            loff = sec * SPOOL_SEC_DATA + hdr.first_rec;
+            break;
+        }
+        if (sec == max_sec || !spool_follow(&sec, &seq, (sec + 1) % spool.sec_cnt)) break;
+    }
+
+    if (loff == SPOOL_NO_RECORD) {
+        // no records at all - continue at the start of the newest sector
+        spool.head = spool.tail = max_sec * SPOOL_SEC_DATA;
+        spool.first_set = false;
+        return ESP_OK;
+    }
+
+    spool.tail = SPOOL_NO_RECORD;
+    spool_rec_t rec;
+    while (spool_follow(&sec, &seq, spool_sector_of(loff)) && spool_read_rec(loff, &rec)) {
+        uint32_t sz = SPOOL_REC_SIZE(rec.len);
+        uint32_t rsec = sec, rseq = seq;
+        // the record must not end in the stale sector
+        if (!spool_follow(&rsec, &rseq, spool_sector_of(loff + sz - 1))) break;
+        if (rec.state == SPOOL_STATE_EMPTY) {
+            // power was lost while the data was written. drop the record
+            uint32_t st = SPOOL_STATE_SENT;
+            spool_write(loff + offsetof(spool_rec_t, state), &st, sizeof(st));
+            ESP_LOGW(TAG, "Incomplete record %u dropped", rec.seq);
+        } else if (rec.state == SPOOL_STATE_VALID) {
+            if (spool.tail == SPOOL_NO_RECORD) spool.tail = loff;
+            spool.pending++;
+        }
+        spool.rec_seq = rec.seq;
+        loff = spool_wrap(loff + sz);
+        sec = rsec;
+        seq = rseq;
+    }
+    spool.head = loff;
+
+    /* the space after head must be erased. if there is a garbage -
+       continue from the next sector */
+    if (spool_sector_of(spool.head) == spool.opened) {
+        uint32_t word;
+        if (spool_read(spool.head, &word, sizeof(word)) != ESP_OK || word != 0xFFFFFFFF) {
+            spool.head = spool_wrap((spool_sector_of(spool.head) + 1) * SPOOL_SEC_DATA);
+        } else if (spool_read_sector(spool.opened, &hdr) == ESP_OK) {
+            spool.first_set = (hdr.first_rec != SPOOL_NO_RECORD);
+        }
+    }
+    if (spool.tail == SPOOL_NO_RECORD)
+        spool.tail = spool.head;
+
+    return ESP_OK;
+}
+
+esp_err_t frame_spool_init(const char * label) {
+    if (spool.part) return ESP_OK;
+
+    const esp_partition_t * part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+    if (part == NULL) {
+        ESP_LOGE(TAG, "Partition \"%s\" is not found", label);
+        return ESP_ERR_NOT_FOUND;
+    }
+    spool.mux = xSemaphoreCreateMutex();
+    if (spool.mux == NULL) return ESP_ERR_NO_MEM;
+
+    spool.part = part;
+    spool.sec_cnt = part->size / SPI_FLASH_SEC_SIZE;
+    spool.total = spool.sec_cnt * SPOOL_SEC_DATA;
+
+    esp_err_t err = spool_recover();
+    if (err != ESP_OK) {
+        vSemaphoreDelete(spool.mux);
+        spool.part = NULL;
+        return err;
+    }
+    spool.boot_seq = spool.rec_seq;
+    ESP_LOGI(TAG, "Spool opened: %u sectors, %u frames pending, head %u, tail %u",
+             spool.sec_cnt, spool.pending, spool.head, spool.tail);
+    return ESP_OK;
+}
+
+esp_err_t frame_spool_append(const uint8_t * buf, size_t len, int64_t ts_us) {
+    if (spool.part == NULL) return ESP_ERR_INVALID_STATE;
+
+    uint32_t sz = SPOOL_REC_SIZE(len);
+    // keep at least one sector between head and tail
+    if (sz > spool.total - 2 * SPOOL_SEC_DATA) return ESP_ERR_INVALID_SIZE;
+
+    esp_err_t err = ESP_FAIL;
+    if (xSemaphoreTake(spool.mux, portMAX_DELAY) == pdTRUE) {
+        /* erase all sectors the new record touches */
+        uint32_t first = spool_sector_of(spool.head);
+        uint32_t last = spool_sector_of(spool.head + sz - 1);
+        bool set_first = (first != spool.opened) || !spool.first_set;
+        uint32_t sec = first;
+        err = ESP_OK;
+        while (err == ESP_OK) {
+            if (sec != spool.opened)
+                err = spool_open_sector(sec);
+            if (sec == last) break;
+            sec = (sec + 1) % spool.sec_cnt;
+        }
+
+        spool_rec_t rec;
+        rec.magic = SPOOL_REC_MAGIC;
+        rec.seq = ++spool.rec_seq;
+        rec.len = len;
+        rec.crc = esp_crc32_le(0, buf, len);
+        rec.ts_us = ts_us;
+        rec.hcrc = esp_crc32_le(0, (const uint8_t *) &rec, SPOOL_HCRC_LEN);
+        rec.state = SPOOL_STATE_EMPTY;
+
+        if (err == ESP_OK && set_first) {
+            // the first record started in this sector
+            uint32_t in_sec = spool.head % SPOOL_SEC_DATA;
+            err = esp_partition_write(spool.part, first * SPI_FLASH_SEC_SIZE + offsetof(spool_sector_t, first_rec),
+                                      &in_sec, sizeof(in_sec));
+        }
+        // no records are started in the last opened sector if the record crosses the border
+        spool.first_set = (first == last);
+        if (err == ESP_OK)
+            err = spool_write(spool.head, &rec, sizeof(rec));
+        if (err == ESP_OK)
+            err = spool_write(spool.head + sizeof(rec), buf, len);
+        if (err == ESP_OK) {
+            rec.state = SPOOL_STATE_VALID;
+            err = spool_write(spool.head + offsetof(spool_rec_t, state), &rec.state, sizeof(rec.state));
+        }
+        if (err == ESP_OK) {
+            if (spool.pending == 0)
+                spool.tail = spool.head;
+            spool.pending++;
+        } else {
+            ESP_LOGE(TAG, "Frame append failed (%s)", esp_err_to_name(err));
+        }
+        // the space is spent anyway
+        spool.head = spool_wrap(spool.head + sz);
+
+        xSemaphoreGive(spool.mux);
+    }
+    return err;
+}
+
+size_t frame_spool_pending() {
+    return spool.pending;
+}
+
+esp_err_t frame_spool_flush(size_t max_cnt, frame_spool_sender cb, void * arg) {
+    if (spool.part == NULL) return ESP_ERR_INVALID_STATE;
+
+    esp_err_t err = ESP_OK;
+    if (xSemaphoreTake(spool.mux, portMAX_DELAY) == pdTRUE) {
+        while (max_cnt-- && spool.pending) {
+            spool_rec_t rec;
+            if (!spool_read_rec(spool.tail, &rec)) {
+                spool_drop_oldest();
+                continue;
+            }
+            uint8_t * buf = (uint8_t *) wc_mem_malloc(WC_MEM_FRAMES, rec.len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+            if (buf == NULL) {
+                err = ESP_ERR_NO_MEM;
+                break;
+            }
+            err = spool_read(spool.tail + sizeof(rec), buf, rec.len);
+            if (err == ESP_OK) {
+                if (esp_crc32_le(0, buf, rec.len) != rec.crc) {
+                    ESP_LOGW(TAG, "Record %u has bad crc, dropped", rec.seq);
+                } else {
+                    int64_t ts = ((int32_t) (rec.seq - spool.boot_seq) > 0) ? rec.ts_us : -1;
+                    err = cb(arg, buf, rec.len, ts);
+                }
+            }
+            wc_mem_free(buf);
+            if (err != ESP_OK) break;
+
+            rec.state = SPOOL_STATE_SENT;
+            spool_write(spool.tail + offsetof(spool_rec_t, state), &rec.state, sizeof(rec.state));
+            spool.tail = spool_wrap(spool.tail + SPOOL_REC_SIZE(rec.len));
+            spool.pending--;
+            spool_skip_sent();
+        }
+        xSemaphoreGive(spool.mux);
+    }
+    return err;
+}
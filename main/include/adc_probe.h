@@ -0,0 +1,74 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef ADC_PROBE_H_
+#define ADC_PROBE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "driver/adc.h"
+
+#define ADC_PROBE_MAX_MEDIAN 7
+
+typedef struct {
+    adc2_channel_t channel;
+    adc_atten_t atten;
+    uint8_t  oversample;         // raw reads averaged into one sample, 1-64
+    uint8_t  median;             // median filter window (odd, up to ADC_PROBE_MAX_MEDIAN), 1 - off
+    uint8_t  iir_shift;          // IIR filter y += (x - y) / 2^shift, 0 - off
+} adc_probe_config_t;
+
+/* adcval events. Thresholds are left back only when the value
+   passes them by hyst_mv */
+typedef struct {
+    uint32_t low_mv;             // the value falls below, 0 - off
+    uint32_t high_mv;            // the value rises above, 0 - off
+    uint32_t delta_mv;           // the value moved from the last event, 0 - off
+    uint32_t hyst_mv;
+} adc_probe_events_t;
+
+typedef struct {
+    uint32_t ts_ms;              // ms since boot
+    uint32_t mv;
+} adc_probe_point_t;
+
+esp_err_t adc_probe_init(const adc_probe_config_t * cfg, const adc_probe_events_t * ev);
+
+/**
+ * @brief Take one sample: oversampled raw reads, median, IIR, then calibration
+ *
+ * @param mv    filtered value, mV
+ * @param event true if the value crossed a threshold or moved by delta_mv
+ *
+ * @return ESP_OK, ESP_ERR_TIMEOUT if ADC2 is held by Wi-Fi for all the reads
+ */
+esp_err_t adc_probe_sample(uint32_t * mv, bool * event);
+
+/* last filtered value, mV */
+uint32_t adc_probe_value();
+
+/**
+ * @brief Copy the samples of the history ring taken after since_ms, oldest first.
+ *        Lock-free: samples overwritten while copying are dropped
+ *
+ * @param since_ms 0 - all the history
+ * @param max      at most max newest samples
+ *
+ * @return number of the samples copied
+ */
+size_t adc_probe_series(uint32_t since_ms, adc_probe_point_t * out, size_t max);
+
+void adc_probe_set_events(const adc_probe_events_t * ev);
+void adc_probe_get_events(adc_probe_events_t * ev);
+
+#endif
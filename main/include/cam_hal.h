@@ -21,6 +21,36 @@
 extern "C" {
 #endif
 
+/**
+ * @brief DMA layout of the capture. Zero fields keep the default values
+ */
+typedef struct {
+    uint32_t buffer_size;       // DMA buffer size limit
+    uint32_t half_buffer_size;  // bytes copied per EOF interrupt (JPEG only)
+} cam_dma_geometry_t;
+
+/**
+ * @brief Capture telemetry since the last reset
+ */
+typedef struct {
+    uint32_t eof_cnt;           // EOF interrupts handled by cam_task
+    uint32_t frame_cnt;         // frames passed to the queue
+    uint32_t ovf_cnt;           // EV-OVF - cam_task fell behind the DMA ring, the frame is lost
+    uint32_t fb_ovf_cnt;        // FB-OVF - the frame did not fit the frame buffer
+    uint64_t copy_us;           // time spent in copying from the DMA buffer
+    uint64_t busy_us[2];        // time cam_task and the copy worker ran on each core
+    uint64_t isr_us;            // time the capture interrupts spent on the events
+    uint64_t period_us;         // time since the reset
+} cam_dma_stats_t;
+
+#define CAM_DMA_CANDIDATES_MAX 5
+
+/**
+ * @brief Called by cam_take for every JPEG frame that passed the checks, on the
+ *        task that takes the frame. The frame must not be kept or changed
+ */
+typedef void (*cam_frame_hook_t)(const camera_fb_t *fb, void *arg);
+
 /**
  * @brief Uninitialize the lcd_cam module
  *
@@ -47,12 +77,102 @@ esp_err_t cam_init(const camera_config_t *config);
 
 esp_err_t cam_config(const camera_config_t *config, framesize_t frame_size, uint16_t sensor_pid);
 
+/**
+ * @brief Rebuild the capture for the new format, frame size, buffer count
+ *        or grab mode without releasing the pins, the ISR and cam_obj
+ *
+ * The buffers are carved again from the arenas kept by cam_deinit, so the
+ * heap is touched only when an arena is too small. All the frame buffers
+ * must be returned before the call. On failure the capture is deinitialized.
+ *
+ * @param frame_size Frame size the buffers are sized for
+ * @param out_size   Frame size of the sensor output, its DMA layout is used
+ *
+ * @return
+ *     - ESP_OK Success
+ *     - ESP_ERR_INVALID_STATE cam_config was not called
+ *     - ESP_FAIL No memory for the new layout
+ */
+esp_err_t cam_reconfig(const camera_config_t *config, framesize_t frame_size, framesize_t out_size,
+                       uint16_t sensor_pid);
+
 void cam_stop(void);
 
 void cam_start(void);
 
 void cam_do_snap(void);
 
+/**
+ * @brief Drop the frames captured before the sensor settles after reconfiguration
+ *
+ * Only frames started after CONFIG_CAMERA_SETTLE_FRAMES complete frames
+ * (counted by VSYNC) will be delivered. The request is applied by cam_task,
+ * which recycles the frames waiting in the queue; cam_take drops the frames
+ * taken before that.
+ *
+ * @param width  Expected width of the new frames (0 - keep the current value)
+ * @param height Expected height of the new frames (0 - keep the current value)
+ */
+void cam_settle(uint16_t width, uint16_t height);
+
+/**
+ * @brief Light the flash for the next frames
+ *
+ * The pin is switched by the capture task: on at the next VSYNC, off when
+ * the frames exposed under the flash are read out. Only these frames are
+ * delivered after the flash is lit, the queued frames are recycled.
+ *
+ * @param pin      GPIO of the flash, configured as output
+ * @param on_level level that lights the flash
+ * @param frames   frames to expose under the flash, 0 - cancel the request
+ *                 and switch the flash off
+ */
+void cam_flash(int pin, int on_level, uint8_t frames);
+
+/**
+ * @brief Set the hook that sees every JPEG frame taken by the application
+ *
+ * @param hook NULL - no hook
+ */
+void cam_set_frame_hook(cam_frame_hook_t hook, void *arg);
+
+/**
+ * @brief Set the DMA layout used by cam_config and cam_reconfig for the format
+ *        and the frame size of the sensor output
+ *
+ * @param geometry DMA layout, NULL - back to the default layout
+ */
+void cam_set_dma_geometry(pixformat_t format, framesize_t frame_size, const cam_dma_geometry_t *geometry);
+
+/**
+ * @brief Check if the output of the format and frame size needs another DMA
+ *        layout than the current one - the capture is to be rebuilt for it
+ */
+bool cam_dma_layout_changes(pixformat_t format, framesize_t out_size);
+
+/**
+ * @brief Fill the DMA layouts worth to try for the format
+ *
+ * @return number of the layouts, at most CAM_DMA_CANDIDATES_MAX
+ */
+int cam_dma_candidates(pixformat_t format, cam_dma_geometry_t *geometry);
+
+/**
+ * @brief Get the capture telemetry
+ *
+ * @param stats telemetry, may be NULL
+ * @param reset clear the counters
+ */
+void cam_get_dma_stats(cam_dma_stats_t *stats, bool reset);
+
+/**
+ * @brief Get the health counters of the pipeline, see camera_stats_t
+ *
+ * @param stats counters, may be NULL
+ * @param reset clear the counters
+ */
+void cam_get_stats(camera_stats_t *stats, bool reset);
+
 camera_fb_t *cam_take(TickType_t timeout);
 
 void cam_give(camera_fb_t *dma_buffer);
@@ -30,6 +30,7 @@ extern const char * WC_TAG;
 #define CAM_MODE_NONE   0x00
 #define CAM_MODE_STREAM 0x01
 #define CAM_MODE_SNAP   0x02
+#define CAM_MODE_ROI    0x03
 
 #define ADC_ENABLED
 #define OUT_ENABLED
@@ -69,7 +70,6 @@ struct _button_state {
 
 #ifdef ADC_ENABLED
 #define ADC_PIN         GPIO_NUM_15
-#define ADC_NO_OF_SAMPLES   4
 uint32_t board_get_adc_mV(void);
 #endif
 
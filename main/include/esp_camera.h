@@ -138,6 +138,27 @@ typedef struct {
     struct timeval timestamp;   /*!< Timestamp since boot of the first DMA buffer of the frame */
 } camera_fb_t;
 
+/**
+ * @brief Health counters of the capture pipeline since the last reset
+ */
+typedef struct {
+    uint32_t frames_captured;   // frames completed by the capture
+    uint32_t frames_delivered;  // frames returned by esp_camera_fb_get
+    uint64_t bytes_delivered;   // bytes in the delivered frames
+    uint32_t avg_frame_size;    // bytes_delivered / frames_delivered
+    uint32_t fb_ovf;            // FB-OVF - the frame did not fit the frame buffer
+    uint32_t no_soi;            // NO-SOI - JPEG frame without the start marker
+    uint32_t no_eoi;            // NO-EOI - JPEG frame without the end marker
+    uint32_t ev_ovf;            // EV-OVF - the capture fell behind the DMA
+    uint32_t fbq_snd;           // FBQ-SND - the frame could not be queued
+    uint32_t fbq_rcv;           // FBQ-RCV - the full queue could not be popped
+    uint32_t fb_size;           // FB-SIZE - raw frame of the wrong size
+    uint32_t fb_bad;            // FB-BAD - JPEG frame failed the validation
+    uint32_t fb_copy;           // FB-COPY - copy of the unexpected length
+    uint32_t fb_timeout;        // no frame for esp_camera_fb_get on time
+    float core_busy[2];         // % of the time cam_task and the copy worker ran on each core
+} camera_stats_t;
+
 #define ESP_ERR_CAMERA_BASE 0x20000
 #define ESP_ERR_CAMERA_NOT_DETECTED             (ESP_ERR_CAMERA_BASE + 1)
 #define ESP_ERR_CAMERA_FAILED_TO_SET_FRAME_SIZE (ESP_ERR_CAMERA_BASE + 2)
@@ -153,8 +174,8 @@ typedef struct {
  * allocates framebuffer and DMA buffers,
  * initializes parallel I2S input, and sets up DMA descriptors.
  *
- * Currently this function can only be called once and there is
- * no way to de-initialize this module.
+ * Call it once. Use esp_camera_reconfigure to change the format or the
+ * buffers later, esp_camera_deinit releases everything.
  *
  * @param config  Camera configuration parameters
  *
@@ -162,6 +183,13 @@ typedef struct {
  */
 esp_err_t esp_camera_init(const camera_config_t* config);
 
+/**
+ * @brief Switch the sensor output to the frame size.
+ *
+ * Only the sensor is switched, unless esp_camera_tune_dma picked another
+ * DMA layout for the new size - then the capture is rebuilt as by
+ * esp_camera_set_pixformat.
+ */
 esp_err_t esp_camera_set_framesize(framesize_t fsz);
 
 /**
@@ -210,6 +238,113 @@ esp_err_t esp_camera_load_from_nvs(const char *key);
 
 void esp_camera_do_snap();
 
+/**
+ * @brief Switch the pixel format and the frame size at runtime.
+ *
+ * Same as esp_camera_reconfigure, but the stored config is not changed.
+ * Buffers for JPEG keep the size of the frame_size passed to
+ * esp_camera_init, raw formats are allocated by fsz.
+ * All frame buffers must be returned before the call.
+ *
+ * @param format  New pixel format
+ * @param fsz     New frame size
+ *
+ * @return ESP_OK on success
+ */
+esp_err_t esp_camera_set_pixformat(pixformat_t format, framesize_t fsz);
+
+/**
+ * @brief Change pixel_format, frame_size, jpeg_quality, fb_count, fb_location
+ *        or grab_mode without esp_camera_deinit.
+ *
+ * DMA is stopped, buffers and descriptors are carved again from the memory
+ * kept since esp_camera_init (it grows only if the new layout does not fit)
+ * and the capture restarts. The sensor is not probed again, SCCB, XCLK and
+ * the interrupts stay. Pins and xclk_freq_hz must be the same as in
+ * esp_camera_init. All frame buffers must be returned before the call.
+ *
+ * @param config  Camera configuration parameters
+ *
+ * @return
+ *     - ESP_OK on success
+ *     - ESP_ERR_INVALID_ARG pins or XCLK differ
+ *     - ESP_ERR_NOT_SUPPORTED the sensor has no JPEG output
+ */
+esp_err_t esp_camera_reconfigure(const camera_config_t *config);
+
+/**
+ * @brief Capture the window of the sensor array instead of the whole frame (OV2640 only).
+ *
+ * The window is given in UXGA sensor pixels and scaled to out_w x out_h
+ * (out_w = w, out_h = h for the full sensor detail). All sizes are rounded
+ * down to a multiple of 4. If the sensor is already in UXGA mode (frame
+ * sizes above SVGA), only the window registers are written.
+ * esp_camera_set_framesize returns to the full view.
+ *
+ * @return ESP_OK on success, ESP_ERR_NOT_SUPPORTED for other sensors
+ */
+esp_err_t esp_camera_set_window(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t out_w, uint16_t out_h);
+
+/**
+ * @brief Pick the DMA layout for the current pixformat and frame size.
+ *
+ * Every candidate layout rebuilds the capture and grabs the frames, the one
+ * without event queue or frame buffer overflows and with the least copy time
+ * and EOF interrupts per frame is kept for this pixformat and frame size.
+ * The capture is rebuilt with it whenever the output switches to them,
+ * the other outputs keep their own layouts. Needs CONFIG_CAMERA_DMA_AUTOTUNE.
+ *
+ * @param frames  frames to grab for every layout
+ *
+ * @return ESP_OK on success, ESP_FAIL if every layout overflowed
+ */
+esp_err_t esp_camera_tune_dma(uint8_t frames);
+
+/**
+ * @brief Get the health counters of the capture pipeline.
+ *
+ * Counters are updated atomically by the capture task and the callers of
+ * esp_camera_fb_get, they survive esp_camera_reconfigure.
+ *
+ * @param stats  Counters since the last reset
+ * @param reset  Start counting again
+ */
+void esp_camera_get_stats(camera_stats_t *stats, bool reset);
+
+/**
+ * @brief Wait for the sensor to settle after its registers were changed.
+ *
+ * Frames started before CONFIG_CAMERA_SETTLE_FRAMES complete frames
+ * have passed are dropped, so the next esp_camera_fb_get returns
+ * the frame captured with the new settings.
+ * esp_camera_set_framesize calls it by itself.
+ */
+void esp_camera_settle();
+
+/**
+ * @brief Light the flash for the next frames.
+ *
+ * The flash goes on at the next VSYNC and off as soon as the frames exposed
+ * under it are read out, so the next esp_camera_fb_get returns the first of
+ * them. Timing follows the frame counter of the capture task.
+ *
+ * @param pin      GPIO of the flash, configured as output
+ * @param on_level Level that lights the flash
+ * @param frames   Frames to expose under the flash, 0 - switch the flash off
+ */
+void esp_camera_flash(int pin, int on_level, uint8_t frames);
+
+/**
+ * @brief Set the hook that sees every JPEG frame returned by esp_camera_fb_get.
+ *
+ * The hook runs in esp_camera_fb_get after the frame is trimmed to EOI and
+ * checked, so the capture task never waits for it. The frame must not be
+ * kept or changed.
+ *
+ * @param hook  void hook(const camera_fb_t *fb, void *arg), NULL - no hook
+ */
+void esp_camera_set_frame_hook(void (*hook)(const camera_fb_t *fb, void *arg), void *arg);
+
 #ifdef __cplusplus
 }
 #endif
@@ -34,6 +34,21 @@ typedef enum {
 typedef size_t (* jpg_reader_cb)(void * arg, size_t index, uint8_t *buf, size_t len);
 typedef bool (* jpg_writer_cb)(void * arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t *data);
 
+/**
+ * @brief Decode the baseline JPEG image by MCUs
+ *
+ * @param len       Length in bytes of the source image
+ * @param scale     Output scale. JPG_SCALE_8X uses only DC coefficients
+ * @param reader    Callback to read the source data from index
+ * @param writer    Callback to receive the RGB888 pixels of every MCU. It is called
+ *                  once with data == NULL and w, h of the output image before the first MCU
+ * @param arg       User argument passed to the callbacks
+ *
+ * @return
+ *     - ESP_OK Success
+ *     - ESP_ERR_NOT_SUPPORTED Progressive or unsupported subsampling
+ *     - ESP_ERR_INVALID_STATE Writer aborted the decoding
+ */
 esp_err_t esp_jpg_decode(size_t len, jpg_scale_t scale, jpg_reader_cb reader, jpg_writer_cb writer, void * arg);
 
 #ifdef __cplusplus
@@ -0,0 +1,62 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef EXPOSURE_H_
+#define EXPOSURE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_camera.h"
+
+#define EXPOSURE_HIST_BINS 16
+
+typedef struct {
+    uint8_t  mean;               // average luma of the delivered frame
+    uint8_t  frames;             // frames taken to converge
+    bool     converged;
+    uint16_t aec_value;          // exposure applied to the delivered frame
+    uint8_t  agc_gain;
+    uint32_t hist[EXPOSURE_HIST_BINS];
+} exposure_result_t;
+
+/**
+ * @brief Luma histogram of the JPEG frame. Only DC coefficients are decoded
+ *        (1/8 scale), so it costs a fraction of the full decoding
+ *
+ * @param hist  EXPOSURE_HIST_BINS bins, cleared before counting
+ * @param mean  average luma
+ *
+ * @return ESP_OK on success
+ */
+esp_err_t exposure_stats(const uint8_t * jpg, size_t len, uint32_t * hist, uint8_t * mean);
+
+/**
+ * @brief Take the JPEG frame and program the sensor exposure and gain by its
+ *        statistics until the average luma is close to the target. The sensor
+ *        AEC/AGC are switched off while converging
+ *
+ * @param target     average luma to reach
+ * @param tolerance  allowed difference from the target
+ * @param max_frames limit of the frames to take
+ *
+ * @return the last taken frame or NULL. Return it with esp_camera_fb_return
+ */
+camera_fb_t * exposure_converge(uint8_t target, uint8_t tolerance, uint8_t max_frames, exposure_result_t * res);
+
+/**
+ * @brief Return the exposure and gain control to the sensor. It starts from
+ *        the values found by exposure_converge
+ */
+void exposure_release();
+
+#endif
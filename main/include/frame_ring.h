@@ -0,0 +1,66 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef FRAME_RING_H_
+#define FRAME_RING_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_camera.h"
+
+/* callback for frame_ring_foreach. return false to stop the iteration */
+typedef bool (* frame_ring_cb)(void * arg, const uint8_t * buf, size_t len, int64_t ts_us);
+
+/**
+ * @brief Allocate the pre-event ring in PSRAM
+ *
+ * @param capacity  total size of the ring in bytes (headers included)
+ * @param max_age_ms frames older than this value are dropped
+ *
+ * @return ESP_OK on success, ESP_ERR_NO_MEM if the ring can not be allocated
+ */
+esp_err_t frame_ring_init(size_t capacity, uint32_t max_age_ms);
+
+/**
+ * @brief Copy the JPEG frame to the ring. The oldest frames are dropped
+ *        until the new one fits into the ring. Does not wait for the ring -
+ *        the frame is dropped and counted if the ring is locked
+ */
+void frame_ring_push(const camera_fb_t * fb);
+
+/**
+ * @brief Enumerate the frames from oldest to newest with
+ *        from_us < timestamp <= to_us. The ring is locked during the iteration
+ *
+ * @return number of the frames passed to the callback
+ */
+size_t frame_ring_foreach(int64_t from_us, int64_t to_us, frame_ring_cb cb, void * arg);
+
+/**
+ * @brief Copy the oldest frame with from_us < timestamp <= to_us out of the ring,
+ *        so the ring is not locked while the frame is used
+ *
+ * @param buf   frame data, nothing is copied if cap is less than the frame length
+ * @param ts_us timestamp of the frame
+ *
+ * @return length of the frame, 0 - no such frame
+ */
+size_t frame_ring_copy(int64_t from_us, int64_t to_us, uint8_t * buf, size_t cap, int64_t * ts_us);
+
+/* the number of frames and bytes are currently stored in the ring,
+   the number of frames dropped because the ring was locked */
+void frame_ring_get_usage(size_t * frames, size_t * bytes, uint32_t * dropped);
+
+void frame_ring_clear();
+
+#endif
@@ -0,0 +1,61 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef FRAME_SPOOL_H_
+#define FRAME_SPOOL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+/* callback for frame_spool_flush. the record is marked as sent only if ESP_OK returned.
+   ts_us is -1 for the frames spooled before the restart - their time is of another boot */
+typedef esp_err_t (* frame_spool_sender)(void * arg, uint8_t * buf, size_t len, int64_t ts_us);
+
+/**
+ * @brief Open the spool partition and restore the log state.
+ *        Unformatted partition is formatted, records interrupted by
+ *        power loss are skipped
+ *
+ * @param label label of the data partition (see partitions.csv)
+ *
+ * @return
+ *     - ESP_OK Success
+ *     - ESP_ERR_NOT_FOUND The partition is not found
+ *     - ESP_ERR_NO_MEM No memory to initialize the spool
+ */
+esp_err_t frame_spool_init(const char * label);
+
+/**
+ * @brief Append the frame to the end of the log. If the partition is full
+ *        the oldest unsent frames are overwritten
+ *
+ * @return
+ *     - ESP_OK Success
+ *     - ESP_ERR_INVALID_SIZE The frame is larger than the partition
+ *     - ESP_ERR_INVALID_STATE Spool is not initialized
+ */
+esp_err_t frame_spool_append(const uint8_t * buf, size_t len, int64_t ts_us);
+
+/* the number of frames waiting for upload */
+size_t frame_spool_pending();
+
+/**
+ * @brief Pass up to max_cnt oldest frames to the sender (oldest first)
+ *        and mark them as sent. Frames with bad checksum are dropped
+ *
+ * @return
+ *     - ESP_OK All passed frames are sent
+ *     - error code returned by the sender or by the flash read
+ */
+esp_err_t frame_spool_flush(size_t max_cnt, frame_spool_sender cb, void * arg);
+
+#endif
@@ -55,7 +55,7 @@ button_handle_t iot_button_create(gpio_num_t gpio_num, button_active_t active_le
  * @cb callback function for "TAP" action.
  * @arg Parameter for callback function
  * @note
- *        Button callback functions execute in the context of the timer service task.
+ *        Button callback functions execute in the context of the button task.
  *        It is therefore essential that button callback functions never attempt to block.
  *        For example, a button callback function must not call vTaskDelay(), vTaskDelayUntil(),
  *        or specify a non zero block time when accessing a queue or a semaphore.
@@ -73,7 +73,7 @@ esp_err_t iot_button_set_serial_cb(button_handle_t btn_handle, uint32_t start_af
  * @param cb callback function for "TAP" action.
  * @param arg Parameter for callback function
  * @note
- *        Button callback functions execute in the context of the timer service task.
+ *        Button callback functions execute in the context of the button task.
  *        It is therefore essential that button callback functions never attempt to block.
  *        For example, a button callback function must not call vTaskDelay(), vTaskDelayUntil(),
  *        or specify a non zero block time when accessing a queue or a semaphore.
@@ -92,7 +92,7 @@ esp_err_t iot_button_set_evt_cb(button_handle_t btn_handle, button_cb_type_t typ
  * @param arg Parameter for callback function
  *
  * @note
- *        Button callback functions execute in the context of the timer service task.
+ *        Button callback functions execute in the context of the button task.
  *        It is therefore essential that button callback functions never attempt to block.
  *        For example, a button callback function must not call vTaskDelay(), vTaskDelayUntil(),
  *        or specify a non zero block time when accessing a queue or a semaphore.
@@ -168,7 +168,7 @@ public:
      * @param cb callback function for "TAP" action.
      * @param arg Parameter for callback function
      * @note
-     *        Button callback functions execute in the context of the timer service task.
+     *        Button callback functions execute in the context of the button task.
      *        It is therefore essential that button callback functions never attempt to block.
      *        For example, a button callback function must not call vTaskDelay(), vTaskDelayUntil(),
      *        or specify a non zero block time when accessing a queue or a semaphore.
@@ -187,7 +187,7 @@ public:
      * @cb callback function for "TAP" action.
      * @arg Parameter for callback function
      * @note
-     *        Button callback functions execute in the context of the timer service task.
+     *        Button callback functions execute in the context of the button task.
      *        It is therefore essential that button callback functions never attempt to block.
      *        For example, a button callback function must not call vTaskDelay(), vTaskDelayUntil(),
      *        or specify a non zero block time when accessing a queue or a semaphore.
@@ -205,7 +205,7 @@ public:
      * @param arg Parameter for callback function
      *
      * @note
-     *        Button callback functions execute in the context of the timer service task.
+     *        Button callback functions execute in the context of the button task.
      *        It is therefore essential that button callback functions never attempt to block.
      *        For example, a button callback function must not call vTaskDelay(), vTaskDelayUntil(),
      *        or specify a non zero block time when accessing a queue or a semaphore.
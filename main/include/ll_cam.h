@@ -34,6 +34,7 @@
 #include "freertos/queue.h"
 #include "freertos/task.h"
 #include "freertos/semphr.h"
+#include "cam_hal.h"
 
 #if __has_include("esp_private/periph_ctrl.h")
 # include "esp_private/periph_ctrl.h"
@@ -64,11 +65,29 @@
 
 #define LCD_CAM_DMA_NODE_BUFFER_MAX_SIZE  (4092)
 
+/* EOF counts at the last VSYNCs. cam_task falling behind by more VSYNCs resyncs */
+#define CAM_VSYNC_MARKS 4
+
 typedef enum {
     CAM_IN_SUC_EOF_EVENT = 0,
     CAM_VSYNC_EVENT
 } cam_event_t;
 
+#if CONFIG_CAMERA_COPY_WORKER
+/* half buffer copies queued for the worker. cam_dma_config keeps dma_half_buffer_cnt
+   strictly below it (the JPEG candidates have at most 16), a power of two for the
+   wrap of copy_head and copy_tail */
+#define CAM_COPY_RING_LEN 32
+_Static_assert((CAM_COPY_RING_LEN & (CAM_COPY_RING_LEN - 1)) == 0, "CAM_COPY_RING_LEN must be a power of two");
+
+typedef struct {
+    uint8_t *dst;
+    const uint8_t *src;
+    uint32_t len;       // bytes in the DMA buffer
+    uint32_t out;       // bytes expected in the frame buffer
+} cam_copy_job_t;
+#endif
+
 typedef enum {
     CAM_STATE_IDLE = 0,
     CAM_STATE_READ_BUF = 1,
@@ -77,9 +96,9 @@ typedef enum {
 typedef struct {
     camera_fb_t fb;
     uint8_t en;
+    uint32_t vsync;     // number of the VSYNC the frame was started at
     //for RGB/YUV modes
     lldesc_t *dma;
-    size_t fb_offset;
 } cam_frame_t;
 
 typedef struct {
@@ -97,9 +116,10 @@ typedef struct {
 
     cam_frame_t *frames;
 
-    QueueHandle_t event_queue;
     QueueHandle_t frame_buffer_queue;
-    TaskHandle_t task_handle;
+    TaskHandle_t task_handle;         // changed under isr_lock, read under it by the ISR and the worker
+    volatile bool task_stop;          // cam_task finishes the events and parks
+    volatile bool task_parked;
     intr_handle_t cam_intr_handle;
 
     uint8_t dma_num;//ESP32-S3
@@ -120,7 +140,34 @@ typedef struct {
     uint8_t fb_bytes_per_pixel;
     uint32_t fb_size;
 
+    //frame settling
+    volatile uint32_t vsync_cnt;
+    volatile uint32_t settle_vsync;   // frames started before this VSYNC are dropped
+    volatile uint32_t settle_req;     // cam_settle requests, applied by cam_task
+    volatile uint32_t settle_done;
+    uint16_t out_width;               // expected size of JPEG frame
+    uint16_t out_height;
+
     cam_state_t state;
+
+    //ISR events. counters only grow, cam_task is notified and catches up
+    portMUX_TYPE isr_lock;
+    volatile uint32_t isr_eof_cnt;
+    volatile uint32_t isr_vsync_cnt;
+    volatile uint32_t isr_vsync_eof[CAM_VSYNC_MARKS]; // isr_eof_cnt at the VSYNC, by isr_vsync_cnt
+    volatile uint32_t isr_us;         // time spent in ll_cam_send_event, wraps
+
+#if CONFIG_CAMERA_COPY_WORKER
+    //single producer (cam_task), single consumer (copy worker) ring
+    cam_copy_job_t copy_ring[CAM_COPY_RING_LEN];
+    volatile uint32_t copy_head;      // jobs queued, written by cam_task
+    volatile uint32_t copy_tail;      // jobs done, written by the worker
+    volatile uint32_t copy_bad;       // copies of unexpected length
+    TaskHandle_t copy_task;
+#endif
+
+    cam_dma_geometry_t dma_geometry;  // requested DMA layout
+    cam_dma_stats_t dma_stats;
 } cam_obj_t;
 
 
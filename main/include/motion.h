@@ -0,0 +1,70 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef MOTION_H_
+#define MOTION_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+#define MOTION_HIST_BINS 16
+#define MOTION_MAX_TILES 64
+
+typedef struct {
+    uint8_t  tiles_x;
+    uint8_t  tiles_y;
+    uint8_t  changed_cnt;        // number of changed tiles
+    uint8_t  mean;               // average luma of the frame
+    bool     lighting;           // the whole scene changed - not a motion
+    uint64_t changed;            // bitmask of changed tiles, row by row
+    uint8_t  tile_mean[MOTION_MAX_TILES];
+    uint32_t hist[MOTION_HIST_BINS];
+} motion_result_t;
+
+/*
+ * Kernels. Buffers must be 4-byte aligned and len must be a multiple of 4,
+ * every 32-bit word is processed as four pixels at once
+ */
+
+/* number of pixels with |a/2 - b/2| > threshold/2 - the values are compared in 7 bits */
+size_t motion_diff_count(const uint8_t * a, const uint8_t * b, size_t len, uint8_t threshold);
+
+/* sum of the pixels */
+uint32_t motion_sum(const uint8_t * p, size_t len);
+
+/* add the pixels to the histogram of MOTION_HIST_BINS bins */
+void motion_histogram(const uint8_t * p, size_t len, uint32_t * hist);
+
+/**
+ * @brief Prepare the reference frame for the grayscale frames of size width x height
+ *
+ * @param width  frame width, tile size must divide it by multiple of 4
+ * @param height frame height
+ * @param tile   tile side in pixels
+ *
+ * @return ESP_OK on success
+ */
+esp_err_t motion_init(uint16_t width, uint16_t height, uint16_t tile);
+
+/**
+ * @brief Compare the grayscale frame with the reference, then store it
+ *        as the new reference. The first frame only becomes the reference
+ *
+ * @param threshold    minimal pixel difference
+ * @param tile_percent percent of changed pixels to mark the tile as changed
+ *
+ * @return true if motion is detected
+ */
+bool motion_process(const uint8_t * gray, size_t len, uint8_t threshold, uint8_t tile_percent, motion_result_t * res);
+
+#endif
@@ -0,0 +1,59 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef OUT_SEQ_H_
+#define OUT_SEQ_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+#define OUT_SEQ_MAX_STEPS 16
+/* shorter holds are extended - the alarm must be set ahead of the counter */
+#define OUT_SEQ_MIN_HOLD_US 20
+
+/* bit n of the masks is GPIO n */
+typedef struct {
+    uint64_t set_mask;
+    uint64_t clr_mask;
+    uint32_t hold_us;            // until the next step
+} out_seq_step_t;
+
+/* takes TIMER_GROUP_0 / TIMER_0 with 1 us resolution */
+esp_err_t out_seq_init();
+
+/**
+ * @brief Set and clear the output pins - one write of the set and the clear
+ *        register per bank (GPIO0-31, GPIO32-39), other pins are not touched
+ */
+void out_seq_apply(uint64_t set_mask, uint64_t clr_mask);
+
+/**
+ * @brief Stop the running sequence and start a new one. The first step is
+ *        applied at once, the next ones from the timer interrupt
+ *
+ * @param repeat passes of the sequence, 0 - until stopped. The hold of the
+ *               last step is kept only between the passes
+ *
+ * @return ESP_ERR_INVALID_ARG if cnt is 0 or more than OUT_SEQ_MAX_STEPS
+ */
+esp_err_t out_seq_start(const out_seq_step_t * steps, size_t cnt, uint32_t repeat);
+
+/* the pins keep the levels of the last applied step */
+void out_seq_stop();
+
+bool out_seq_busy();
+
+/* the pins of the running sequence, 0 - no sequence */
+uint64_t out_seq_pins();
+
+#endif
@@ -0,0 +1,82 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef TILE_STREAM_H_
+#define TILE_STREAM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_camera.h"
+
+/*
+ * TILE_JPEG frame. All the values are little-endian
+ *
+ *   tile_frame_hdr_t
+ *   count times:
+ *     tile_hdr_t
+ *     JPEG image of the tile (len bytes)
+ *
+ * Tiles are numbered row by row. The keyframe contains all the tiles, other
+ * frames contain only the tiles changed since they were sent last time
+ */
+
+#define TILE_STREAM_VERSION   1
+#define TILE_FLAG_KEYFRAME    0x01
+
+typedef struct __attribute__((packed)) {
+    uint8_t  version;
+    uint8_t  flags;
+    uint16_t tile;               // tile side in pixels
+    uint16_t width;              // frame size
+    uint16_t height;
+    uint32_t seq;                // frame number
+    uint16_t count;              // tiles in this frame
+} tile_frame_hdr_t;
+
+typedef struct __attribute__((packed)) {
+    uint16_t index;
+    uint32_t len;
+} tile_hdr_t;
+
+/**
+ * @brief Prepare the signatures of the tiles
+ *
+ * @param width  frame width
+ * @param height frame height
+ * @param tile   tile side, a multiple of 16 dividing both width and height
+ *
+ * @return ESP_OK on success
+ */
+esp_err_t tile_stream_init(uint16_t width, uint16_t height, uint16_t tile);
+
+/**
+ * @brief Next frame will be the keyframe (e.g. the stream was reconnected)
+ */
+void tile_stream_force_keyframe();
+
+/**
+ * @brief Encode the tiles of the JPEG stream frame changed since they were
+ *        sent last time. Every keyframe_period frame is the keyframe.
+ *        The block averages come from the DC-only (1/8 scale) decoding, the
+ *        frame is decoded in full only down to the last changed row of tiles
+ *
+ * @param threshold  minimal difference of the 8x8 block average luma
+ *                   to treat the tile as changed
+ * @param out        packet, valid until the next call
+ *
+ * @return ESP_OK on success
+ */
+esp_err_t tile_stream_encode(const camera_fb_t * fb, uint8_t quality, uint8_t threshold, uint16_t keyframe_period,
+                             const uint8_t ** out, size_t * out_len);
+
+#endif
@@ -0,0 +1,60 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef WC_MEM_H_
+#define WC_MEM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_heap_caps.h"
+
+/*
+ * Tagged allocations. Every block keeps its size and tag in a small header,
+ * so it must be released with wc_mem_free (never with free).
+ * Buffers given away to the code freeing them with free() (fmt2jpg output,
+ * cJSON and HTTP/2 buffers of the components) are not tracked
+ */
+
+typedef enum {
+    WC_MEM_CAMERA = 0,           // camera state and frame buffers
+    WC_MEM_CAM_DMA,              // cam_obj, DMA descriptors and DMA buffer
+    WC_MEM_IMAGE,                // JPEG encoder, decoder and converters work buffers
+    WC_MEM_FRAMES,               // pre-event ring, spool, snapshot copy, tile stream, motion
+    WC_MEM_TAG_MAX
+} wc_mem_tag_t;
+
+typedef enum {
+    WC_MEM_INTERNAL = 0,
+    WC_MEM_DMA,
+    WC_MEM_SPIRAM,
+    WC_MEM_CLASS_MAX
+} wc_mem_class_t;
+
+typedef struct {
+    uint32_t cur;                // bytes allocated now
+    uint32_t peak;               // max of cur
+} wc_mem_stat_t;
+
+void * wc_mem_malloc(wc_mem_tag_t tag, size_t size, uint32_t caps);
+void * wc_mem_calloc(wc_mem_tag_t tag, size_t n, size_t size, uint32_t caps);
+void * wc_mem_realloc(wc_mem_tag_t tag, void * ptr, size_t size, uint32_t caps);
+void wc_mem_free(void * ptr);
+
+/* copy of the counters by tag and memory class */
+void wc_mem_get_stats(wc_mem_stat_t stats[WC_MEM_TAG_MAX][WC_MEM_CLASS_MAX]);
+
+const char * wc_mem_tag_name(wc_mem_tag_t tag);
+const char * wc_mem_class_name(wc_mem_class_t cls);
+
+/* log the counters and the free heap */
+void wc_mem_dump();
+
+#endif
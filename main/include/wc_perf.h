@@ -0,0 +1,44 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef WC_PERF_H_
+#define WC_PERF_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Throughput and latency of the uploads. Latencies are kept in a log-linear
+ * histogram (4 buckets per power of two, up to ~65 s), so the percentiles
+ * are within 25% and no samples are stored
+ */
+
+typedef enum {
+    WC_PERF_SNAP = 0,            // "dosnap" request to the uploaded snapshot
+    WC_PERF_STREAM,              // start of the frame capture to the sent stream frame
+    WC_PERF_MAX
+} wc_perf_kind_t;
+
+typedef struct {
+    uint32_t count;              // uploads
+    uint64_t bytes;
+    uint32_t period_ms;          // since start or reset
+    uint32_t p50_ms;
+    uint32_t p90_ms;
+    uint32_t p99_ms;
+    uint32_t max_ms;
+} wc_perf_stats_t;
+
+void wc_perf_add(wc_perf_kind_t kind, int64_t latency_us, size_t bytes);
+void wc_perf_get(wc_perf_kind_t kind, wc_perf_stats_t * stats, bool reset);
+
+#endif
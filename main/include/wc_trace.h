@@ -0,0 +1,65 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef WC_TRACE_H_
+#define WC_TRACE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "sdkconfig.h"
+
+/*
+ * Binary event trace. Each core writes its own ring of 8 byte records,
+ * so WC_TRACE is safe in ISRs and costs a timer read and two stores
+ * with the interrupts masked.
+ * Without CONFIG_WC_TRACE the macro is empty.
+ * tools/trace2chrome.py converts the "gettrace" response to Chrome trace
+ * JSON - keep its event table in sync with this enum
+ */
+
+typedef enum {
+    WC_TR_VSYNC = 1,             // VSYNC ISR, arg - VSYNC count
+    WC_TR_EOF,                   // DMA EOF ISR, arg - EOF count
+    WC_TR_STEP_B,                // cam_task handles an event, arg - event
+    WC_TR_STEP_E,                // arg - new cam_task state
+    WC_TR_COPY_B,                // half buffer copy from DMA, arg - bytes
+    WC_TR_COPY_E,
+    WC_TR_FB_SEND,               // frame queued by cam_task, arg - bytes
+    WC_TR_FB_DROP,               // frame dropped by cam_task, arg - frame slot
+    WC_TR_FB_TAKE,               // frame taken by the application, arg - bytes
+    WC_TR_UPLOAD_B,              // frame sent to the server, arg - bytes
+    WC_TR_UPLOAD_E,
+    WC_TR_MSG_B,                 // incoming message dispatch, arg - first 3 chars of the kind
+    WC_TR_MSG_E,
+    WC_TR_FLASH,                 // flash switched by cam_task, arg - 1 on, 0 off
+    WC_TR_EV_MAX
+} wc_trace_ev_t;
+
+typedef struct {
+    uint32_t ts;                 // low 32 bits of esp_timer_get_time()
+    uint32_t ev  : 8;
+    uint32_t arg : 24;
+} wc_trace_rec_t;
+
+#if CONFIG_WC_TRACE
+void wc_trace_emit(wc_trace_ev_t ev, uint32_t arg);
+
+#define WC_TRACE(ev, arg) wc_trace_emit((ev), (uint32_t)(arg))
+
+/* copy of the last records of the core, oldest first. The ring is copied
+   on its core with the interrupts masked. *older - the number of the
+   records not copied */
+size_t wc_trace_read(int core, wc_trace_rec_t * recs, size_t max, uint32_t * older);
+#else
+#define WC_TRACE(ev, arg)
+#endif
+
+#endif
@@ -392,7 +392,8 @@ uint8_t ll_cam_get_dma_align(cam_obj_t *cam)
 }
 
 static bool ll_cam_calc_rgb_dma(cam_obj_t *cam){
-    size_t dma_half_buffer_max = CONFIG_CAMERA_DMA_BUFFER_SIZE_MAX / 2 / cam->dma_bytes_per_item;
+    size_t dma_limit = cam->dma_geometry.buffer_size ? cam->dma_geometry.buffer_size : CONFIG_CAMERA_DMA_BUFFER_SIZE_MAX;
+    size_t dma_half_buffer_max = dma_limit / 2 / cam->dma_bytes_per_item;
     size_t dma_buffer_max = 2 * dma_half_buffer_max;
     size_t node_max = LCD_CAM_DMA_NODE_BUFFER_MAX_SIZE / cam->dma_bytes_per_item;
 
@@ -462,9 +463,15 @@ bool ll_cam_dma_sizes(cam_obj_t *cam)
 {
     cam->dma_bytes_per_item = ll_cam_bytes_per_sample(sampling_mode);
     if (cam->jpeg_mode) {
-        cam->dma_half_buffer_cnt = 8;
-        cam->dma_node_buffer_size = 2048;
-        cam->dma_half_buffer_size = cam->dma_node_buffer_size * 2;
+        // default - 8 half buffers of 4096 bytes
+        size_t half = cam->dma_geometry.half_buffer_size ? cam->dma_geometry.half_buffer_size : 4096;
+        size_t total = cam->dma_geometry.buffer_size ? cam->dma_geometry.buffer_size : 8 * half;
+        cam->dma_node_buffer_size = (half < 2048) ? half : 2048;
+        cam->dma_half_buffer_size = half;
+        cam->dma_half_buffer_cnt = total / half;
+        if (cam->dma_half_buffer_cnt < 2) {
+            cam->dma_half_buffer_cnt = 2;
+        }
         cam->dma_buffer_size = cam->dma_half_buffer_cnt * cam->dma_half_buffer_size;
     } else {
         return ll_cam_calc_rgb_dma(cam);
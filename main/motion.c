@@ -0,0 +1,152 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "motion.h"
+#include "wc_mem.h"
+
+static const char *TAG = "motion";
+
+#define LO7 0x7F7F7F7FU
+#define HI1 0x80808080U
+
+typedef struct {
+    uint8_t * ref;
+    uint16_t width;
+    uint16_t height;
+    uint16_t tile;
+    bool has_ref;
+} motion_state_t;
+
+static motion_state_t st = {0};
+
+/* both values are halved to 7 bits, so 128 + a - b never borrows
+   from the neighbour byte. the sign bit of every byte selects
+   a - b or b - a */
+size_t IRAM_ATTR motion_diff_count(const uint8_t * a, const uint8_t * b, size_t len, uint8_t threshold)
+{
+    const uint32_t * wa = (const uint32_t *) a;
+    const uint32_t * wb = (const uint32_t *) b;
+    uint32_t k = (0x7F - (threshold >> 1)) * 0x01010101U;
+    size_t cnt = 0;
+
+    for (size_t i = 0; i < len / 4; i++) {
+        uint32_t ha = (wa[i] >> 1) & LO7, hb = (wb[i] >> 1) & LO7;
+        uint32_t d = (ha | HI1) - hb;
+        uint32_t m = ((d & HI1) >> 7) * 0xFF;
+        uint32_t ad = ((d & m) | (((hb | HI1) - ha) & ~m)) & LO7;
+        // high bit is set in the bytes where ad > threshold / 2
+        cnt += (uint32_t) ((((ad + k) & HI1) >> 7) * 0x01010101U) >> 24;
+    }
+    return cnt;
+}
+
+/* two 16-bit lanes are accumulated, each word adds at most 510 to a lane */
+uint32_t IRAM_ATTR motion_sum(const uint8_t * p, size_t len)
+{
+    const uint32_t * w = (const uint32_t *) p;
+    size_t n = len / 4;
+    uint32_t total = 0;
+
+    while (n) {
+        size_t chunk = n > 128 ? 128 : n;
+        uint32_t s = 0;
+        for (size_t i = 0; i < chunk; i++) {
+            s += (w[i] & 0x00FF00FF) + ((w[i] >> 8) & 0x00FF00FF);
+        }
+        total += (s & 0xFFFF) + (s >> 16);
+        w += chunk;
+        n -= chunk;
+    }
+    return total;
+}
+
+void IRAM_ATTR motion_histogram(const uint8_t * p, size_t len, uint32_t * hist)
+{
+    const uint32_t * w = (const uint32_t *) p;
+    for (size_t i = 0; i < len / 4; i++) {
+        uint32_t v = w[i];
+        hist[(v >> 4) & 0x0F]++;
+        hist[(v >> 12) & 0x0F]++;
+        hist[(v >> 20) & 0x0F]++;
+        hist[v >> 28]++;
+    }
+}
+
+esp_err_t motion_init(uint16_t width, uint16_t height, uint16_t tile)
+{
+    if (tile == 0 || (tile & 3) || (width % tile) || (width / tile) * (height / tile) > MOTION_MAX_TILES) {
+        ESP_LOGE(TAG, "Bad tile size %u for %ux%u", tile, width, height);
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (st.ref && st.width == width && st.height == height) {
+        st.tile = tile;
+        return ESP_OK;
+    }
+    wc_mem_free(st.ref);
+    st.ref = (uint8_t *) wc_mem_malloc(WC_MEM_FRAMES, (size_t) width * height, MALLOC_CAP_8BIT);
+    if (st.ref == NULL) {
+        ESP_LOGE(TAG, "Can't allocate the reference frame");
+        return ESP_ERR_NO_MEM;
+    }
+    st.width = width;
+    st.height = height;
+    st.tile = tile;
+    st.has_ref = false;
+    return ESP_OK;
+}
+
+bool motion_process(const uint8_t * gray, size_t len, uint8_t threshold, uint8_t tile_percent, motion_result_t * res)
+{
+    size_t frame_len = (size_t) st.width * st.height;
+    memset(res, 0, sizeof(motion_result_t));
+    if (st.ref == NULL || len < frame_len) {
+        return false;
+    }
+
+    res->tiles_x = st.width / st.tile;
+    res->tiles_y = st.height / st.tile;
+    motion_histogram(gray, frame_len, res->hist);
+
+    uint32_t tile_px = (uint32_t) st.tile * st.tile;
+    uint32_t total = 0;
+    for (int ty = 0; ty < res->tiles_y; ty++) {
+        for (int tx = 0; tx < res->tiles_x; tx++) {
+            int n = ty * res->tiles_x + tx;
+            size_t cnt = 0;
+            uint32_t sum = 0;
+            for (int r = 0; r < st.tile; r++) {
+                size_t off = ((size_t) ty * st.tile + r) * st.width + (size_t) tx * st.tile;
+                if (st.has_ref)
+                    cnt += motion_diff_count(&gray[off], &st.ref[off], st.tile, threshold);
+                sum += motion_sum(&gray[off], st.tile);
+            }
+            res->tile_mean[n] = sum / tile_px;
+            total += sum;
+            if (cnt * 100 > tile_px * tile_percent) {
+                res->changed |= (1ULL << n);
+                res->changed_cnt++;
+            }
+        }
+    }
+    int ntiles = res->tiles_x * res->tiles_y;
+    res->mean = total / (tile_px * ntiles);
+    // most of the tiles changed at once - light switch or exposure jump
+    res->lighting = (res->changed_cnt * 4 >= ntiles * 3);
+
+    memcpy(st.ref, gray, frame_len);
+    st.has_ref = true;
+
+    return res->changed_cnt && !res->lighting;
+}
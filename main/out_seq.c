@@ -0,0 +1,159 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "driver/timer.h"
+#include "soc/gpio_struct.h"
+#include "esp_log.h"
+#include "out_seq.h"
+
+static const char *TAG = "out_seq";
+
+#define OUT_SEQ_GROUP   TIMER_GROUP_0
+#define OUT_SEQ_TIMER   TIMER_0
+/* APB 80 MHz / 80 - 1 us per tick */
+#define OUT_SEQ_DIVIDER 80
+
+static out_seq_step_t s_steps[OUT_SEQ_MAX_STEPS];
+static size_t s_cnt = 0;
+static size_t s_pos = 0;
+static uint32_t s_left = 0;             // passes left, 0 - until stopped
+static uint64_t s_alarm = 0;
+static uint64_t s_pins = 0;             // driven by the steps
+static volatile bool s_busy = false;
+
+/* guards the sequence state */
+static portMUX_TYPE s_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/* the set/clear registers change only the given pins - the pins driven by
+   other code (gpio_set_level, cam_hal flash) are not written back */
+static inline void IRAM_ATTR out_seq_write(uint64_t set_mask, uint64_t clr_mask)
+{
+    uint32_t s0 = (uint32_t) set_mask, c0 = (uint32_t) clr_mask;
+    uint32_t s1 = (uint32_t) (set_mask >> 32), c1 = (uint32_t) (clr_mask >> 32);
+    if (c0)
+        GPIO.out_w1tc = c0;
+    if (s0)
+        GPIO.out_w1ts = s0;
+    if (c1)
+        GPIO.out1_w1tc.val = c1;
+    if (s1)
+        GPIO.out1_w1ts.val = s1;
+}
+
+/* is there a step after s_pos */
+static inline bool out_seq_has_next()
+{
+    return (s_pos + 1 < s_cnt) || (s_left != 1);
+}
+
+static bool IRAM_ATTR out_seq_isr(void * arg)
+{
+    portENTER_CRITICAL_ISR(&s_mux);
+    if (s_busy) {
+        if (++s_pos == s_cnt) {
+            s_pos = 0;
+            if (s_left)
+                s_left--;
+        }
+        const out_seq_step_t * st = &s_steps[s_pos];
+        out_seq_write(st->set_mask, st->clr_mask);
+        if (out_seq_has_next()) {
+            s_alarm += st->hold_us;
+            timer_group_set_alarm_value_in_isr(OUT_SEQ_GROUP, OUT_SEQ_TIMER, s_alarm);
+            timer_group_enable_alarm_in_isr(OUT_SEQ_GROUP, OUT_SEQ_TIMER);
+        } else
+            s_busy = false;
+    }
+    portEXIT_CRITICAL_ISR(&s_mux);
+    return false;
+}
+
+esp_err_t out_seq_init()
+{
+    timer_config_t config = {
+        .divider = OUT_SEQ_DIVIDER,
+        .counter_dir = TIMER_COUNT_UP,
+        .counter_en = TIMER_PAUSE,
+        .alarm_en = TIMER_ALARM_EN,
+        .auto_reload = TIMER_AUTORELOAD_DIS,
+        .intr_type = TIMER_INTR_LEVEL,
+    };
+    esp_err_t err = timer_init(OUT_SEQ_GROUP, OUT_SEQ_TIMER, &config);
+    if (err == ESP_OK)
+        err = timer_enable_intr(OUT_SEQ_GROUP, OUT_SEQ_TIMER);
+    if (err == ESP_OK)
+        err = timer_isr_callback_add(OUT_SEQ_GROUP, OUT_SEQ_TIMER, out_seq_isr, NULL, 0);
+    if (err != ESP_OK)
+        ESP_LOGE(TAG, "Timer is not configured: 0x%x", err);
+    return err;
+}
+
+void out_seq_apply(uint64_t set_mask, uint64_t clr_mask)
+{
+    out_seq_write(set_mask, clr_mask);
+}
+
+void out_seq_stop()
+{
+    timer_pause(OUT_SEQ_GROUP, OUT_SEQ_TIMER);
+    // the interrupt may be pending yet
+    portENTER_CRITICAL(&s_mux);
+    s_busy = false;
+    portEXIT_CRITICAL(&s_mux);
+}
+
+esp_err_t out_seq_start(const out_seq_step_t * steps, size_t cnt, uint32_t repeat)
+{
+    if (cnt == 0 || cnt > OUT_SEQ_MAX_STEPS)
+        return ESP_ERR_INVALID_ARG;
+
+    out_seq_stop();
+
+    memcpy(s_steps, steps, cnt * sizeof(out_seq_step_t));
+    for (size_t i = 0; i < cnt; i++)
+        if (s_steps[i].hold_us < OUT_SEQ_MIN_HOLD_US)
+            s_steps[i].hold_us = OUT_SEQ_MIN_HOLD_US;
+    s_pins = 0;
+    for (size_t i = 0; i < cnt; i++)
+        s_pins |= s_steps[i].set_mask | s_steps[i].clr_mask;
+    s_cnt = cnt;
+    s_pos = 0;
+    s_left = repeat;
+    s_alarm = s_steps[0].hold_us;
+
+    bool has_next = out_seq_has_next();
+    if (has_next) {
+        timer_set_counter_value(OUT_SEQ_GROUP, OUT_SEQ_TIMER, 0);
+        timer_set_alarm_value(OUT_SEQ_GROUP, OUT_SEQ_TIMER, s_alarm);
+        timer_set_alarm(OUT_SEQ_GROUP, OUT_SEQ_TIMER, TIMER_ALARM_EN);
+    }
+
+    portENTER_CRITICAL(&s_mux);
+    out_seq_write(s_steps[0].set_mask, s_steps[0].clr_mask);
+    s_busy = has_next;
+    portEXIT_CRITICAL(&s_mux);
+
+    if (has_next)
+        timer_start(OUT_SEQ_GROUP, OUT_SEQ_TIMER);
+    return ESP_OK;
+}
+
+bool out_seq_busy()
+{
+    return s_busy;
+}
+
+uint64_t out_seq_pins()
+{
+    return s_busy ? s_pins : 0;
+}
@@ -25,6 +25,10 @@ static const char* TAG = "ov2640";
 #endif
 
 static volatile ov2640_bank_t reg_bank = BANK_MAX;
+/* sensor mode and pixformat applied by the last set_window. if they are not
+   changed, only the DSP window and zoom registers are rewritten */
+static ov2640_sensor_mode_t cur_mode = OV2640_MODE_MAX;
+static pixformat_t cur_mode_format = PIXFORMAT_JPEG;
 static int set_bank(sensor_t *sensor, ov2640_bank_t bank)
 {
     int res = 0;
@@ -101,6 +105,7 @@ static int write_reg_bits(sensor_t *sensor, uint8_t bank, uint8_t reg, uint8_t m
 static int reset(sensor_t *sensor)
 {
     int ret = 0;
+    cur_mode = OV2640_MODE_MAX;
     WRITE_REG_OR_RETURN(BANK_SENSOR, COM7, COM7_SRST);
     vTaskDelay(10 / portTICK_PERIOD_MS);
     WRITE_REGS_OR_RETURN(ov2640_settings_cif);
@@ -134,7 +139,9 @@ static int set_pixformat(sensor_t *sensor, pixformat_t pixformat)
     return ret;
 }
 
-static int set_window(sensor_t *sensor, ov2640_sensor_mode_t mode, int offset_x, int offset_y, int max_x, int max_y, int w, int h){
+/* roi - the call of the region of interest (set_res_raw), it only can skip
+   the sensor mode and clocks when they are applied already */
+static int set_window(sensor_t *sensor, ov2640_sensor_mode_t mode, int offset_x, int offset_y, int max_x, int max_y, int w, int h, bool roi){
     int ret = 0;
     const uint8_t (*regs)[2];
     ov2640_clk_t c;
@@ -158,6 +165,16 @@ static int set_window(sensor_t *sensor, ov2640_sensor_mode_t mode, int offset_x,
         {0, 0}
     };
 
+    if (roi && mode == cur_mode && sensor->pixformat == cur_mode_format) {
+        // same sensor mode and clocks - move the window only
+        WRITE_REG_OR_RETURN(BANK_DSP, R_BYPASS, R_BYPASS_DSP_BYPAS);
+        WRITE_REGS_OR_RETURN(win_regs);
+        WRITE_REG_OR_RETURN(BANK_DSP, R_BYPASS, R_BYPASS_DSP_EN);
+        //the output format is set again after the window as on the full path
+        return set_pixformat(sensor, sensor->pixformat);
+    }
+    cur_mode = OV2640_MODE_MAX;
+
     if (sensor->pixformat == PIXFORMAT_JPEG) {
         c.clk_2x = 0;
         c.clk_div = 0;
@@ -203,7 +220,11 @@ static int set_window(sensor_t *sensor, ov2640_sensor_mode_t mode, int offset_x,
 
     vTaskDelay(10 / portTICK_PERIOD_MS);
     //required when changing resolution
-    set_pixformat(sensor, sensor->pixformat);
+    ret = set_pixformat(sensor, sensor->pixformat);
+    if (ret == 0) {
+        cur_mode = mode;
+        cur_mode_format = sensor->pixformat;
+    }
 
     return ret;
 }
@@ -241,7 +262,7 @@ static int set_framesize(sensor_t *sensor, framesize_t framesize)
         offset_y /= 2;
     }
 
-    ret = set_window(sensor, mode, offset_x, offset_y, max_x, max_y, w, h);
+    ret = set_window(sensor, mode, offset_x, offset_y, max_x, max_y, w, h, false);
     return ret;
 }
 
@@ -487,7 +508,7 @@ static int set_reg(sensor_t *sensor, int reg, int mask, int value)
 
 static int set_res_raw(sensor_t *sensor, int startX, int startY, int endX, int endY, int offsetX, int offsetY, int totalX, int totalY, int outputX, int outputY, bool scale, bool binning)
 {
-    return set_window(sensor, (ov2640_sensor_mode_t)startX, offsetX, offsetY, totalX, totalY, outputX, outputY);
+    return set_window(sensor, (ov2640_sensor_mode_t)startX, offsetX, offsetY, totalX, totalY, outputX, outputY, true);
 }
 
 static int _set_pll(sensor_t *sensor, int bypass, int multiplier, int sys_div, int root_2x, int pre_div, int seld5, int pclk_manual, int pclk_div)
@@ -0,0 +1,343 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <string.h>
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "img_converters.h"
+#include "esp_jpg_decode.h"
+#include "tile_stream.h"
+#include "wc_mem.h"
+
+static const char *TAG = "tile_stream";
+
+#define SIG_BLOCK 8
+
+typedef struct {
+    uint16_t width;
+    uint16_t height;
+    uint16_t tile;
+    uint16_t tiles;
+    uint16_t sig_len;            // blocks in the tile
+    uint8_t * sig;               // block averages of the tiles as they were sent
+    uint8_t * luma;              // block averages of the frame - luma of the 1/8 scale decoding
+    uint8_t * changed;           // the tiles to send
+    uint8_t * strip;             // BGR pixels of a row of tiles
+    uint8_t * tile_buf;          // pixels of the tile being encoded
+    uint8_t * buf;               // packet
+    size_t cap;
+    size_t len;
+    uint32_t seq;
+    uint16_t since_key;
+    bool need_key;
+} tile_stream_t;
+
+static tile_stream_t ts = {0};
+
+static bool tile_reserve(size_t len)
+{
+    if (len <= ts.cap) {
+        return true;
+    }
+    size_t cap = ts.cap ? ts.cap : 16384;
+    while (cap < len) {
+        cap *= 2;
+    }
+    uint8_t * nb = (uint8_t *)wc_mem_realloc(WC_MEM_FRAMES, ts.buf, cap, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (nb == NULL) {
+        nb = (uint8_t *)wc_mem_realloc(WC_MEM_FRAMES, ts.buf, cap, MALLOC_CAP_DEFAULT);
+    }
+    if (nb == NULL) {
+        return false;
+    }
+    ts.buf = nb;
+    ts.cap = cap;
+    return true;
+}
+
+static uint8_t * tile_alloc(size_t len, bool spiram)
+{
+    uint8_t * p = NULL;
+    if (spiram) {
+        p = (uint8_t *)wc_mem_malloc(WC_MEM_FRAMES, len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    }
+    if (p == NULL) {
+        p = (uint8_t *)wc_mem_malloc(WC_MEM_FRAMES, len, MALLOC_CAP_8BIT);
+    }
+    return p;
+}
+
+static void tile_free_buffers()
+{
+    wc_mem_free(ts.sig);
+    wc_mem_free(ts.luma);
+    wc_mem_free(ts.changed);
+    wc_mem_free(ts.strip);
+    wc_mem_free(ts.tile_buf);
+    ts.sig = ts.luma = ts.changed = ts.strip = ts.tile_buf = NULL;
+}
+
+/* JPEG of the tile is appended after its tile_hdr_t */
+typedef struct {
+    size_t base;
+} tile_out_t;
+
+static size_t tile_out(void * arg, size_t index, const void * data, size_t len)
+{
+    tile_out_t * o = (tile_out_t *)arg;
+    if (!tile_reserve(o->base + index + len)) {
+        return 0;
+    }
+    memcpy(ts.buf + o->base + index, data, len);
+    if (o->base + index + len > ts.len) {
+        ts.len = o->base + index + len;
+    }
+    return len;
+}
+
+esp_err_t tile_stream_init(uint16_t width, uint16_t height, uint16_t tile)
+{
+    if (tile == 0 || (tile & 15) || (width % tile) || (height % tile)) {
+        ESP_LOGE(TAG, "Bad tile size %u for %ux%u", tile, width, height);
+        return ESP_ERR_INVALID_ARG;
+    }
+    uint16_t tiles = (width / tile) * (height / tile);
+    uint16_t sig_len = (tile / SIG_BLOCK) * (tile / SIG_BLOCK);
+
+    tile_free_buffers();
+    ts.sig = tile_alloc((size_t)tiles * sig_len, false);
+    ts.luma = tile_alloc((size_t)(width / SIG_BLOCK) * (height / SIG_BLOCK), false);
+    ts.changed = tile_alloc(tiles, false);
+    ts.strip = tile_alloc((size_t)width * tile * 3, true);
+    ts.tile_buf = tile_alloc((size_t)tile * tile * 3, true);
+    if (!ts.sig || !ts.luma || !ts.changed || !ts.strip || !ts.tile_buf) {
+        ESP_LOGE(TAG, "Can't allocate the tile buffers");
+        tile_free_buffers();
+        return ESP_ERR_NO_MEM;
+    }
+    ts.width = width;
+    ts.height = height;
+    ts.tile = tile;
+    ts.tiles = tiles;
+    ts.sig_len = sig_len;
+    ts.need_key = true;
+    return ESP_OK;
+}
+
+void tile_stream_force_keyframe()
+{
+    ts.need_key = true;
+}
+
+/* the decoding of the stream frame */
+typedef struct {
+    const camera_fb_t * fb;
+    uint8_t quality;
+    int row;                     // the row of tiles in the strip, -1 - none yet
+    int last_row;                // the decoding stops after this row
+    uint16_t count;              // tiles in the packet
+    bool done;                   // the last changed row is encoded
+    bool failed;
+} tile_frame_t;
+
+static size_t tile_jpg_read(void * arg, size_t index, uint8_t * buf, size_t len)
+{
+    const camera_fb_t * fb = ((tile_frame_t *)arg)->fb;
+    memcpy(buf, fb->buf + index, len);
+    return len;
+}
+
+/* 1/8 scale - every pixel is the average of the 8x8 block */
+static bool tile_luma_write(void * arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t * data)
+{
+    uint16_t lw = ts.width / SIG_BLOCK;
+    if (data == NULL) {
+        return w == lw && h == ts.height / SIG_BLOCK;
+    }
+    for (uint16_t iy = 0; iy < h; iy++) {
+        uint8_t * o = ts.luma + (size_t)(y + iy) * lw + x;
+        for (uint16_t ix = 0; ix < w; ix++, data += 3) {
+            *o++ = (uint8_t)((19595 * data[0] + 38470 * data[1] + 7471 * data[2] + 32768) >> 16);
+        }
+    }
+    return true;
+}
+
+/* the block averages of the tile from the frame luma */
+static void tile_signature(uint16_t tx, uint16_t ty, uint8_t * sig)
+{
+    uint16_t lw = ts.width / SIG_BLOCK;
+    int blocks = ts.tile / SIG_BLOCK;
+    const uint8_t * p = ts.luma + (size_t)ty * blocks * lw + (size_t)tx * blocks;
+    for (int by = 0; by < blocks; by++) {
+        memcpy(sig, p, blocks);
+        sig += blocks;
+        p += lw;
+    }
+}
+
+static bool tile_changed(uint16_t tx, uint16_t ty, const uint8_t * sent, uint8_t threshold)
+{
+    uint16_t lw = ts.width / SIG_BLOCK;
+    int blocks = ts.tile / SIG_BLOCK;
+    const uint8_t * p = ts.luma + (size_t)ty * blocks * lw + (size_t)tx * blocks;
+    for (int by = 0; by < blocks; by++) {
+        for (int bx = 0; bx < blocks; bx++) {
+            int d = (int)p[bx] - *sent++;
+            if (d > threshold || d < -threshold) {
+                return true;
+            }
+        }
+        p += lw;
+    }
+    return false;
+}
+
+static bool tile_encode(uint16_t n, uint16_t tx, uint8_t quality)
+{
+    size_t stride = (size_t)ts.width * 3;
+    size_t row = (size_t)ts.tile * 3;
+    const uint8_t * t = ts.strip + (size_t)tx * row;
+    for (int r = 0; r < ts.tile; r++) {
+        memcpy(ts.tile_buf + r * row, t + r * stride, row);
+    }
+
+    size_t hdr_pos = ts.len;
+    if (!tile_reserve(hdr_pos + sizeof(tile_hdr_t))) {
+        return false;
+    }
+    ts.len += sizeof(tile_hdr_t);
+    tile_out_t o = { ts.len };
+    if (!fmt2jpg_cb(ts.tile_buf, row * ts.tile, ts.tile, ts.tile, PIXFORMAT_RGB888, quality, tile_out, &o)) {
+        return false;
+    }
+    tile_hdr_t hdr = { n, ts.len - o.base };
+    memcpy(ts.buf + hdr_pos, &hdr, sizeof(tile_hdr_t));
+    return true;
+}
+
+/* the changed tiles of the decoded row are encoded and their signatures are kept */
+static bool tile_flush_row(tile_frame_t * f)
+{
+    uint16_t tiles_x = ts.width / ts.tile;
+    for (uint16_t tx = 0; tx < tiles_x; tx++) {
+        uint16_t n = f->row * tiles_x + tx;
+        if (!ts.changed[n]) {
+            continue;
+        }
+        if (!tile_encode(n, tx, f->quality)) {
+            ESP_LOGE(TAG, "Tile %u encoding failed", n);
+            return false;
+        }
+        // compare with the tile as the receiver has it - no slow drift
+        tile_signature(tx, f->row, ts.sig + (size_t)n * ts.sig_len);
+        f->count++;
+    }
+    return true;
+}
+
+/* full scale - the MCUs are gathered into the strip of a row of tiles */
+static bool tile_strip_write(void * arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t * data)
+{
+    tile_frame_t * f = (tile_frame_t *)arg;
+    if (data == NULL) {
+        return w == ts.width && h == ts.height;
+    }
+    int row = y / ts.tile;
+    if (row != f->row) {
+        if (f->row >= 0 && !tile_flush_row(f)) {
+            f->failed = true;
+            return false;
+        }
+        if (row > f->last_row) {
+            f->done = true;
+            return false; // nothing more to send
+        }
+        f->row = row;
+    }
+    size_t stride = (size_t)ts.width * 3;
+    for (uint16_t iy = 0; iy < h; iy++) {
+        uint8_t * o = ts.strip + (size_t)(y - row * ts.tile + iy) * stride + (size_t)x * 3;
+        for (uint16_t ix = 0; ix < w; ix++, data += 3, o += 3) {
+            // RGB888 of to_jpg is stored as BGR
+            o[0] = data[2];
+            o[1] = data[1];
+            o[2] = data[0];
+        }
+    }
+    return true;
+}
+
+esp_err_t tile_stream_encode(const camera_fb_t * fb, uint8_t quality, uint8_t threshold, uint16_t keyframe_period,
+                             const uint8_t ** out, size_t * out_len)
+{
+    if (fb->format != PIXFORMAT_JPEG) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    if (ts.sig == NULL || fb->width != ts.width || fb->height != ts.height) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (!tile_reserve(sizeof(tile_frame_hdr_t))) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    tile_frame_t f = { fb, quality, -1, -1, 0, false, false };
+    // only the DC coefficients are decoded for the block averages
+    esp_err_t err = esp_jpg_decode(fb->len, JPG_SCALE_8X, tile_jpg_read, tile_luma_write, &f);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Frame is not decoded (%d)", err);
+        return err;
+    }
+
+    bool key = ts.need_key || (keyframe_period && ts.since_key >= keyframe_period);
+    uint16_t tiles_x = ts.width / ts.tile;
+    for (uint16_t n = 0; n < ts.tiles; n++) {
+        ts.changed[n] = key || tile_changed(n % tiles_x, n / tiles_x, ts.sig + (size_t)n * ts.sig_len, threshold);
+        if (ts.changed[n]) {
+            f.last_row = n / tiles_x;
+        }
+    }
+
+    ts.len = sizeof(tile_frame_hdr_t);
+    if (f.last_row >= 0) {
+        // the writer stops the decoding after the last changed row
+        err = esp_jpg_decode(fb->len, JPG_SCALE_NONE, tile_jpg_read, tile_strip_write, &f);
+        if (!f.done && (err != ESP_OK || !tile_flush_row(&f))) {
+            f.failed = true;
+        }
+        if (f.failed) {
+            ESP_LOGE(TAG, "Tiles are not encoded (%d)", err);
+            ts.need_key = true;
+            return ESP_FAIL;
+        }
+    }
+
+    tile_frame_hdr_t hdr = {
+        .version = TILE_STREAM_VERSION,
+        .flags = key ? TILE_FLAG_KEYFRAME : 0,
+        .tile = ts.tile,
+        .width = ts.width,
+        .height = ts.height,
+        .seq = ts.seq++,
+        .count = f.count,
+    };
+    memcpy(ts.buf, &hdr, sizeof(tile_frame_hdr_t));
+    if (key) {
+        ts.need_key = false;
+        ts.since_key = 0;
+    }
+    ts.since_key++;
+    ESP_LOGD(TAG, "Frame %u: %u tiles, %zu bytes%s", hdr.seq, f.count, ts.len, key ? ", keyframe" : "");
+
+    *out = ts.buf;
+    *out_len = ts.len;
+    return ESP_OK;
+}
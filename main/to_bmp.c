@@ -0,0 +1,253 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stddef.h>
+#include <string.h>
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "img_converters.h"
+
+static const char *TAG = "to_bmp";
+
+#define BMP_HEADER_LEN 54
+
+typedef struct __attribute__((packed)) {
+    uint32_t filesize;
+    uint32_t reserved;
+    uint32_t fileoffset_to_pixelarray;
+    uint32_t dibheadersize;
+    int32_t  width;
+    int32_t  height;
+    uint16_t planes;
+    uint16_t bitsperpixel;
+    uint32_t compression;
+    uint32_t imagesize;
+    uint32_t ypixelpermeter;
+    uint32_t xpixelpermeter;
+    uint32_t numcolorspallette;
+    uint32_t mostimpcolor;
+} bmp_header_t;
+
+static inline uint8_t bmp_clamp(int v)
+{
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+static inline void yuv2bgr(int y, int u, int v, uint8_t * dst)
+{
+    u -= 128;
+    v -= 128;
+    dst[0] = bmp_clamp(y + ((113443 * u) >> 16));
+    dst[1] = bmp_clamp(y - ((22554 * u + 46802 * v) >> 16));
+    dst[2] = bmp_clamp(y + ((91881 * v) >> 16));
+}
+
+/* convert count pixels of the raw format to BGR */
+static bool convert_row(const uint8_t * src, size_t count, pixformat_t format, uint8_t * dst)
+{
+    switch (format) {
+    case PIXFORMAT_GRAYSCALE:
+        for (size_t i = 0; i < count; i++) {
+            dst[0] = dst[1] = dst[2] = src[i];
+            dst += 3;
+        }
+        break;
+    case PIXFORMAT_RGB565:
+        for (size_t i = 0; i < count; i++) {
+            uint8_t hb = *src++;
+            uint8_t lb = *src++;
+            dst[0] = (lb & 0x1F) << 3;
+            dst[1] = (hb & 0x07) << 5 | (lb & 0xE0) >> 3;
+            dst[2] = hb & 0xF8;
+            dst += 3;
+        }
+        break;
+    case PIXFORMAT_YUV422:
+        // Y0 U Y1 V
+        for (size_t i = 0; i + 1 < count; i += 2) {
+            yuv2bgr(src[0], src[1], src[3], dst);
+            yuv2bgr(src[2], src[1], src[3], dst + 3);
+            src += 4;
+            dst += 6;
+        }
+        if (count & 1) {
+            yuv2bgr(src[0], src[1], src[3], dst);
+        }
+        break;
+    case PIXFORMAT_RGB888:
+        memcpy(dst, src, count * 3);
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+static int raw_bpp(pixformat_t format)
+{
+    switch (format) {
+    case PIXFORMAT_GRAYSCALE:
+        return 1;
+    case PIXFORMAT_RGB565:
+    case PIXFORMAT_YUV422:
+        return 2;
+    case PIXFORMAT_RGB888:
+        return 3;
+    default:
+        return 0;
+    }
+}
+
+typedef struct {
+    const uint8_t * input;
+    uint8_t * output;
+    size_t stride;               // output row length in bytes, 0 - packed rows
+    uint16_t width;              // output image size, limits the written area
+    uint16_t height;
+    bool rgb565;
+} jpg_dest_t;
+
+static size_t _jpg_read(void * arg, size_t index, uint8_t *buf, size_t len)
+{
+    jpg_dest_t * jpeg = (jpg_dest_t *)arg;
+    memcpy(buf, jpeg->input + index, len);
+    return len;
+}
+
+static bool _jpg_write(void * arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t *data)
+{
+    jpg_dest_t * jpeg = (jpg_dest_t *)arg;
+    if (data == NULL) {
+        // start of the image
+        if (jpeg->width == 0) {
+            jpeg->width = w;
+            jpeg->height = h;
+        }
+        if (jpeg->stride == 0) {
+            jpeg->stride = (size_t)jpeg->width * (jpeg->rgb565 ? 2 : 3);
+        }
+        return true;
+    }
+    if (x >= jpeg->width || y >= jpeg->height) {
+        return true;
+    }
+    uint16_t cw = (x + w > jpeg->width) ? jpeg->width - x : w;
+    uint16_t ch = (y + h > jpeg->height) ? jpeg->height - y : h;
+    for (uint16_t iy = 0; iy < ch; iy++) {
+        const uint8_t * s = data + (size_t)iy * w * 3;
+        uint8_t * o = jpeg->output + (size_t)(y + iy) * jpeg->stride;
+        if (jpeg->rgb565) {
+            o += (size_t)x * 2;
+            for (uint16_t ix = 0; ix < cw; ix++) {
+                uint8_t r = *s++;
+                uint8_t g = *s++;
+                uint8_t b = *s++;
+                *o++ = (r & 0xF8) | (g >> 5);
+                *o++ = ((g << 3) & 0xE0) | (b >> 3);
+            }
+        } else {
+            o += (size_t)x * 3;
+            for (uint16_t ix = 0; ix < cw; ix++) {
+                o[2] = *s++;
+                o[1] = *s++;
+                o[0] = *s++;
+                o += 3;
+            }
+        }
+    }
+    return true;
+}
+
+bool jpg2rgb565(const uint8_t *src, size_t src_len, uint8_t * out, jpg_scale_t scale)
+{
+    jpg_dest_t jpeg = { src, out, 0, 0, 0, true };
+    return esp_jpg_decode(src_len, scale, _jpg_read, _jpg_write, &jpeg) == ESP_OK;
+}
+
+bool fmt2rgb888(const uint8_t *src_buf, size_t src_len, pixformat_t format, uint8_t * rgb_buf)
+{
+    if (format == PIXFORMAT_JPEG) {
+        jpg_dest_t jpeg = { src_buf, rgb_buf, 0, 0, 0, false };
+        return esp_jpg_decode(src_len, JPG_SCALE_NONE, _jpg_read, _jpg_write, &jpeg) == ESP_OK;
+    }
+    int bpp = raw_bpp(format);
+    if (bpp == 0) {
+        ESP_LOGE(TAG, "Unsupported format %d", format);
+        return false;
+    }
+    return convert_row(src_buf, src_len / bpp, format, rgb_buf);
+}
+
+bool fmt2bmp(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t ** out, size_t * out_len)
+{
+    int bpp = raw_bpp(format);
+    if (bpp == 0 && format != PIXFORMAT_JPEG) {
+        ESP_LOGE(TAG, "Unsupported format %d", format);
+        return false;
+    }
+    if (bpp && src_len < (size_t)width * height * bpp) {
+        ESP_LOGE(TAG, "Bad source image");
+        return false;
+    }
+
+    size_t row_len = ((size_t)width * 3 + 3) & ~3;
+    size_t out_size = BMP_HEADER_LEN + row_len * height;
+    uint8_t * out_buf = (uint8_t *)heap_caps_malloc(out_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (out_buf == NULL) {
+        out_buf = (uint8_t *)malloc(out_size);
+    }
+    if (out_buf == NULL) {
+        ESP_LOGE(TAG, "BMP buffer malloc failed");
+        return false;
+    }
+
+    out_buf[0] = 'B';
+    out_buf[1] = 'M';
+    bmp_header_t * bitmap = (bmp_header_t *)&out_buf[2];
+    memset(bitmap, 0, sizeof(bmp_header_t));
+    bitmap->filesize = out_size;
+    bitmap->fileoffset_to_pixelarray = BMP_HEADER_LEN;
+    bitmap->dibheadersize = 40;
+    bitmap->width = width;
+    bitmap->height = -height; // top-down
+    bitmap->planes = 1;
+    bitmap->bitsperpixel = 24;
+    bitmap->imagesize = row_len * height;
+    bitmap->ypixelpermeter = 0x0B13; // 72 dpi
+    bitmap->xpixelpermeter = 0x0B13;
+
+    uint8_t * dst = out_buf + BMP_HEADER_LEN;
+    if (format == PIXFORMAT_JPEG) {
+        jpg_dest_t jpeg = { src, dst, row_len, width, height, false };
+        memset(dst, 0, row_len * height);
+        if (esp_jpg_decode(src_len, JPG_SCALE_NONE, _jpg_read, _jpg_write, &jpeg) != ESP_OK) {
+            free(out_buf);
+            return false;
+        }
+        *out = out_buf;
+        *out_len = out_size;
+        return true;
+    }
+    for (uint16_t y = 0; y < height; y++) {
+        convert_row(src + (size_t)y * width * bpp, width, format, dst);
+        memset(dst + (size_t)width * 3, 0, row_len - (size_t)width * 3);
+        dst += row_len;
+    }
+
+    *out = out_buf;
+    *out_len = out_size;
+    return true;
+}
+
+bool frame2bmp(camera_fb_t * fb, uint8_t ** out, size_t * out_len)
+{
+    return fmt2bmp(fb->buf, fb->len, fb->width, fb->height, fb->format, out, out_len);
+}
@@ -0,0 +1,703 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stddef.h>
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "img_converters.h"
+#include "wc_mem.h"
+
+static const char *TAG = "to_jpg";
+
+/* Baseline JPEG encoder. The source image is converted to YCbCr by
+   stripes of one MCU row (8 lines for grayscale, 16 lines for 4:2:0 color),
+   so only the stripe is kept in memory. Blocks are transformed with
+   the integer DCT (jfdctint), quantized with the precomputed reciprocals
+   and coded with the standard Huffman tables. The output is passed
+   to the callback by small chunks. */
+
+#define JPG_OUT_BUF_SIZE    1024
+
+static const uint8_t jpg_zigzag[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+static const uint8_t std_lum_qt[64] = {
+    16, 11, 10, 16,  24,  40,  51,  61,
+    12, 12, 14, 19,  26,  58,  60,  55,
+    14, 13, 16, 24,  40,  57,  69,  56,
+    14, 17, 22, 29,  51,  87,  80,  62,
+    18, 22, 37, 56,  68, 109, 103,  77,
+    24, 35, 55, 64,  81, 104, 113,  92,
+    49, 64, 78, 87, 103, 121, 120, 101,
+    72, 92, 95, 98, 112, 100, 103,  99
+};
+
+static const uint8_t std_chr_qt[64] = {
+    17, 18, 24, 47, 99, 99, 99, 99,
+    18, 21, 26, 66, 99, 99, 99, 99,
+    24, 26, 56, 99, 99, 99, 99, 99,
+    47, 66, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99
+};
+
+static const uint8_t dc_lum_bits[16] = {0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0};
+static const uint8_t dc_chr_bits[16] = {0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0};
+static const uint8_t dc_vals[12] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+
+static const uint8_t ac_lum_bits[16] = {0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d};
+static const uint8_t ac_lum_vals[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+    0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+    0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa
+};
+
+static const uint8_t ac_chr_bits[16] = {0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77};
+static const uint8_t ac_chr_vals[162] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+    0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+    0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa
+};
+
+typedef struct {
+    uint16_t code[256];
+    uint8_t  size[256];
+} jpg_huff_t;
+
+/* tables prepared for the last used quality */
+typedef struct {
+    uint8_t  quality;
+    uint8_t  qt[2][64];          // quantization tables in natural order
+    uint16_t recip[2][64];       // 2^16 / (8 * qt) - jfdctint output is scaled by 8
+    jpg_huff_t dc[2];
+    jpg_huff_t ac[2];
+    bool     huff_ready;
+} jpg_tables_t;
+
+static jpg_tables_t * s_tables = NULL;
+
+typedef struct {
+    jpg_out_cb cb;
+    void * arg;
+    size_t index;
+    size_t pos;
+    uint32_t bit_buf;
+    int      bit_cnt;
+    bool     failed;
+    int      last_dc[3];
+    const jpg_tables_t * t;
+    uint8_t  buf[JPG_OUT_BUF_SIZE];
+} jpg_encoder_t;
+
+static void jpg_build_huff(jpg_huff_t * h, const uint8_t * bits, const uint8_t * vals)
+{
+    uint16_t code = 0;
+    int k = 0;
+    memset(h, 0, sizeof(jpg_huff_t));
+    for (int len = 1; len <= 16; len++) {
+        for (int i = 0; i < bits[len - 1]; i++) {
+            h->code[vals[k]] = code++;
+            h->size[vals[k]] = len;
+            k++;
+        }
+        code <<= 1;
+    }
+}
+
+static bool jpg_prepare_tables(uint8_t quality)
+{
+    if (s_tables == NULL) {
+        s_tables = (jpg_tables_t *)wc_mem_calloc(WC_MEM_IMAGE, 1, sizeof(jpg_tables_t), MALLOC_CAP_8BIT);
+        if (s_tables == NULL) {
+            return false;
+        }
+    }
+    if (!s_tables->huff_ready) {
+        jpg_build_huff(&s_tables->dc[0], dc_lum_bits, dc_vals);
+        jpg_build_huff(&s_tables->dc[1], dc_chr_bits, dc_vals);
+        jpg_build_huff(&s_tables->ac[0], ac_lum_bits, ac_lum_vals);
+        jpg_build_huff(&s_tables->ac[1], ac_chr_bits, ac_chr_vals);
+        s_tables->huff_ready = true;
+        s_tables->quality = 0;
+    }
+    if (s_tables->quality != quality) {
+        int scale = (quality < 50) ? (5000 / quality) : (200 - quality * 2);
+        for (int i = 0; i < 64; i++) {
+            int ql = (std_lum_qt[i] * scale + 50) / 100;
+            int qc = (std_chr_qt[i] * scale + 50) / 100;
+            ql = ql < 1 ? 1 : (ql > 255 ? 255 : ql);
+            qc = qc < 1 ? 1 : (qc > 255 ? 255 : qc);
+            s_tables->qt[0][i] = ql;
+            s_tables->qt[1][i] = qc;
+            s_tables->recip[0][i] = (uint16_t)((65536 + ql * 4) / (ql * 8));
+            s_tables->recip[1][i] = (uint16_t)((65536 + qc * 4) / (qc * 8));
+        }
+        s_tables->quality = quality;
+    }
+    return true;
+}
+
+static void jpg_flush(jpg_encoder_t * e)
+{
+    if (e->pos && !e->failed) {
+        if (e->cb(e->arg, e->index, e->buf, e->pos) != e->pos) {
+            e->failed = true;
+        }
+        e->index += e->pos;
+    }
+    e->pos = 0;
+}
+
+static inline void jpg_put_byte(jpg_encoder_t * e, uint8_t b)
+{
+    e->buf[e->pos++] = b;
+    if (e->pos == JPG_OUT_BUF_SIZE) {
+        jpg_flush(e);
+    }
+}
+
+static void jpg_put_bytes(jpg_encoder_t * e, const uint8_t * data, size_t len)
+{
+    while (len--) {
+        jpg_put_byte(e, *data++);
+    }
+}
+
+static inline void jpg_put_word(jpg_encoder_t * e, uint16_t w)
+{
+    jpg_put_byte(e, w >> 8);
+    jpg_put_byte(e, w & 0xFF);
+}
+
+static inline void jpg_put_bits(jpg_encoder_t * e, uint32_t code, int size)
+{
+    e->bit_buf = (e->bit_buf << size) | (code & ((1UL << size) - 1));
+    e->bit_cnt += size;
+    while (e->bit_cnt >= 8) {
+        uint8_t b = (e->bit_buf >> (e->bit_cnt - 8)) & 0xFF;
+        jpg_put_byte(e, b);
+        if (b == 0xFF) {
+            jpg_put_byte(e, 0);
+        }
+        e->bit_cnt -= 8;
+    }
+}
+
+static void jpg_write_headers(jpg_encoder_t * e, uint16_t width, uint16_t height, int comps)
+{
+    static const uint8_t app0[] = {
+        0xFF, 0xE0, 0x00, 0x10, 'J', 'F', 'I', 'F', 0x00, 0x01, 0x01, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00
+    };
+    jpg_put_word(e, 0xFFD8);
+    jpg_put_bytes(e, app0, sizeof(app0));
+
+    // DQT
+    for (int t = 0; t < (comps == 1 ? 1 : 2); t++) {
+        jpg_put_word(e, 0xFFDB);
+        jpg_put_word(e, 2 + 65);
+        jpg_put_byte(e, t);
+        for (int i = 0; i < 64; i++) {
+            jpg_put_byte(e, e->t->qt[t][jpg_zigzag[i]]);
+        }
+    }
+
+    // SOF0
+    jpg_put_word(e, 0xFFC0);
+    jpg_put_word(e, 8 + 3 * comps);
+    jpg_put_byte(e, 8);
+    jpg_put_word(e, height);
+    jpg_put_word(e, width);
+    jpg_put_byte(e, comps);
+    for (int c = 0; c < comps; c++) {
+        jpg_put_byte(e, c + 1);
+        jpg_put_byte(e, (c == 0 && comps == 3) ? 0x22 : 0x11);
+        jpg_put_byte(e, c ? 1 : 0);
+    }
+
+    // DHT
+    const uint8_t * bits[4] = {dc_lum_bits, ac_lum_bits, dc_chr_bits, ac_chr_bits};
+    const uint8_t * vals[4] = {dc_vals, ac_lum_vals, dc_vals, ac_chr_vals};
+    const uint8_t classes[4] = {0x00, 0x10, 0x01, 0x11};
+    for (int t = 0; t < (comps == 1 ? 2 : 4); t++) {
+        int cnt = 0;
+        for (int i = 0; i < 16; i++) {
+            cnt += bits[t][i];
+        }
+        jpg_put_word(e, 0xFFC4);
+        jpg_put_word(e, 2 + 1 + 16 + cnt);
+        jpg_put_byte(e, classes[t]);
+        jpg_put_bytes(e, bits[t], 16);
+        jpg_put_bytes(e, vals[t], cnt);
+    }
+
+    // SOS
+    jpg_put_word(e, 0xFFDA);
+    jpg_put_word(e, 6 + 2 * comps);
+    jpg_put_byte(e, comps);
+    for (int c = 0; c < comps; c++) {
+        jpg_put_byte(e, c + 1);
+        jpg_put_byte(e, c ? 0x11 : 0x00);
+    }
+    jpg_put_byte(e, 0);
+    jpg_put_byte(e, 63);
+    jpg_put_byte(e, 0);
+}
+
+#define CONST_BITS  13
+#define PASS1_BITS  2
+#define DESCALE(x, n)  (((x) + (1 << ((n) - 1))) >> (n))
+
+#define FIX_0_298631336  2446
+#define FIX_0_390180644  3196
+#define FIX_0_541196100  4433
+#define FIX_0_765366865  6270
+#define FIX_0_899976223  7373
+#define FIX_1_175875602  9633
+#define FIX_1_501321110  12299
+#define FIX_1_847759065  15137
+#define FIX_1_961570560  16069
+#define FIX_2_053119869  16819
+#define FIX_2_562915447  20995
+#define FIX_3_072711026  25172
+
+/* integer forward DCT (jfdctint from IJG). output is scaled up by 8 */
+static void IRAM_ATTR jpg_fdct(int32_t * data)
+{
+    int32_t tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+    int32_t tmp10, tmp11, tmp12, tmp13;
+    int32_t z1, z2, z3, z4, z5;
+    int32_t * p;
+
+    for (p = data; p < data + 64; p += 8) {
+        tmp0 = p[0] + p[7];
+        tmp7 = p[0] - p[7];
+        tmp1 = p[1] + p[6];
+        tmp6 = p[1] - p[6];
+        tmp2 = p[2] + p[5];
+        tmp5 = p[2] - p[5];
+        tmp3 = p[3] + p[4];
+        tmp4 = p[3] - p[4];
+
+        tmp10 = tmp0 + tmp3;
+        tmp13 = tmp0 - tmp3;
+        tmp11 = tmp1 + tmp2;
+        tmp12 = tmp1 - tmp2;
+
+        p[0] = (tmp10 + tmp11) << PASS1_BITS;
+        p[4] = (tmp10 - tmp11) << PASS1_BITS;
+
+        z1 = (tmp12 + tmp13) * FIX_0_541196100;
+        p[2] = DESCALE(z1 + tmp13 * FIX_0_765366865, CONST_BITS - PASS1_BITS);
+        p[6] = DESCALE(z1 - tmp12 * FIX_1_847759065, CONST_BITS - PASS1_BITS);
+
+        z1 = tmp4 + tmp7;
+        z2 = tmp5 + tmp6;
+        z3 = tmp4 + tmp6;
+        z4 = tmp5 + tmp7;
+        z5 = (z3 + z4) * FIX_1_175875602;
+
+        tmp4 *= FIX_0_298631336;
+        tmp5 *= FIX_2_053119869;
+        tmp6 *= FIX_3_072711026;
+        tmp7 *= FIX_1_501321110;
+        z1 *= -FIX_0_899976223;
+        z2 *= -FIX_2_562915447;
+        z3 *= -FIX_1_961570560;
+        z4 *= -FIX_0_390180644;
+
+        z3 += z5;
+        z4 += z5;
+
+        p[7] = DESCALE(tmp4 + z1 + z3, CONST_BITS - PASS1_BITS);
+        p[5] = DESCALE(tmp5 + z2 + z4, CONST_BITS - PASS1_BITS);
+        p[3] = DESCALE(tmp6 + z2 + z3, CONST_BITS - PASS1_BITS);
+        p[1] = DESCALE(tmp7 + z1 + z4, CONST_BITS - PASS1_BITS);
+    }
+
+    for (p = data; p < data + 8; p++) {
+        tmp0 = p[0] + p[56];
+        tmp7 = p[0] - p[56];
+        tmp1 = p[8] + p[48];
+        tmp6 = p[8] - p[48];
+        tmp2 = p[16] + p[40];
+        tmp5 = p[16] - p[40];
+        tmp3 = p[24] + p[32];
+        tmp4 = p[24] - p[32];
+
+        tmp10 = tmp0 + tmp3;
+        tmp13 = tmp0 - tmp3;
+        tmp11 = tmp1 + tmp2;
+        tmp12 = tmp1 - tmp2;
+
+        p[0] = DESCALE(tmp10 + tmp11, PASS1_BITS);
+        p[32] = DESCALE(tmp10 - tmp11, PASS1_BITS);
+
+        z1 = (tmp12 + tmp13) * FIX_0_541196100;
+        p[16] = DESCALE(z1 + tmp13 * FIX_0_765366865, CONST_BITS + PASS1_BITS);
+        p[48] = DESCALE(z1 - tmp12 * FIX_1_847759065, CONST_BITS + PASS1_BITS);
+
+        z1 = tmp4 + tmp7;
+        z2 = tmp5 + tmp6;
+        z3 = tmp4 + tmp6;
+        z4 = tmp5 + tmp7;
+        z5 = (z3 + z4) * FIX_1_175875602;
+
+        tmp4 *= FIX_0_298631336;
+        tmp5 *= FIX_2_053119869;
+        tmp6 *= FIX_3_072711026;
+        tmp7 *= FIX_1_501321110;
+        z1 *= -FIX_0_899976223;
+        z2 *= -FIX_2_562915447;
+        z3 *= -FIX_1_961570560;
+        z4 *= -FIX_0_390180644;
+
+        z3 += z5;
+        z4 += z5;
+
+        p[56] = DESCALE(tmp4 + z1 + z3, CONST_BITS + PASS1_BITS);
+        p[40] = DESCALE(tmp5 + z2 + z4, CONST_BITS + PASS1_BITS);
+        p[24] = DESCALE(tmp6 + z2 + z3, CONST_BITS + PASS1_BITS);
+        p[8] = DESCALE(tmp7 + z1 + z4, CONST_BITS + PASS1_BITS);
+    }
+}
+
+static inline int jpg_bit_count(int v)
+{
+    int n = 0;
+    while (v) {
+        n++;
+        v >>= 1;
+    }
+    return n;
+}
+
+/* encode one 8x8 block from the plane with the given stride */
+static void jpg_encode_block(jpg_encoder_t * e, const uint8_t * src, size_t stride, int comp)
+{
+    int32_t data[64];
+    int16_t coef[64];
+    int t = comp ? 1 : 0;
+
+    for (int y = 0; y < 8; y++) {
+        for (int x = 0; x < 8; x++) {
+            data[y * 8 + x] = (int32_t)src[x] - 128;
+        }
+        src += stride;
+    }
+
+    jpg_fdct(data);
+
+    const uint16_t * recip = e->t->recip[t];
+    for (int i = 0; i < 64; i++) {
+        int n = jpg_zigzag[i];
+        int32_t v = data[n];
+        if (v < 0) {
+            coef[i] = -(int16_t)(((uint32_t)(-v) * recip[n] + 0x8000) >> 16);
+        } else {
+            coef[i] = (int16_t)(((uint32_t)v * recip[n] + 0x8000) >> 16);
+        }
+    }
+
+    // DC
+    int diff = coef[0] - e->last_dc[comp];
+    e->last_dc[comp] = coef[0];
+    int v = diff < 0 ? -diff : diff;
+    int nbits = jpg_bit_count(v);
+    jpg_put_bits(e, e->t->dc[t].code[nbits], e->t->dc[t].size[nbits]);
+    if (nbits) {
+        jpg_put_bits(e, diff < 0 ? diff - 1 : diff, nbits);
+    }
+
+    // AC
+    const jpg_huff_t * ac = &e->t->ac[t];
+    int run = 0;
+    for (int i = 1; i < 64; i++) {
+        int c = coef[i];
+        if (c == 0) {
+            run++;
+            continue;
+        }
+        while (run > 15) {
+            jpg_put_bits(e, ac->code[0xF0], ac->size[0xF0]);
+            run -= 16;
+        }
+        v = c < 0 ? -c : c;
+        nbits = jpg_bit_count(v);
+        int sym = (run << 4) | nbits;
+        jpg_put_bits(e, ac->code[sym], ac->size[sym]);
+        jpg_put_bits(e, c < 0 ? c - 1 : c, nbits);
+        run = 0;
+    }
+    if (run) {
+        jpg_put_bits(e, ac->code[0x00], ac->size[0x00]);
+    }
+}
+
+static inline uint8_t jpg_clamp(int v)
+{
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+static inline void jpg_get_rgb(const uint8_t * src, pixformat_t format, int * r, int * g, int * b)
+{
+    if (format == PIXFORMAT_RGB565) {
+        uint8_t hb = src[0];
+        uint8_t lb = src[1];
+        *r = hb & 0xF8;
+        *g = ((hb & 0x07) << 5) | ((lb & 0xE0) >> 3);
+        *b = (lb & 0x1F) << 3;
+    } else { // PIXFORMAT_RGB888 stored as BGR
+        *b = src[0];
+        *g = src[1];
+        *r = src[2];
+    }
+}
+
+/* convert the stripe of 16 lines to Y (stride w16) and subsampled Cb/Cr (stride w16 / 2) */
+static void jpg_convert_color_stripe(const uint8_t * src, uint16_t width, uint16_t height, pixformat_t format,
+                                     int y0, size_t w16, uint8_t * yp, uint8_t * cbp, uint8_t * crp)
+{
+    int bpp = (format == PIXFORMAT_RGB888) ? 3 : 2;
+    size_t cstride = w16 / 2;
+
+    for (int ly = 0; ly < 16; ly += 2) {
+        int sy0 = y0 + ly;
+        int sy1 = sy0 + 1;
+        if (sy0 >= height) sy0 = height - 1;
+        if (sy1 >= height) sy1 = height - 1;
+        const uint8_t * row0 = src + (size_t)sy0 * width * bpp;
+        const uint8_t * row1 = src + (size_t)sy1 * width * bpp;
+        uint8_t * yr0 = yp + (size_t)ly * w16;
+        uint8_t * yr1 = yr0 + w16;
+        uint8_t * cbr = cbp + (size_t)(ly / 2) * cstride;
+        uint8_t * crr = crp + (size_t)(ly / 2) * cstride;
+
+        for (size_t x = 0; x < w16; x += 2) {
+            int sx0 = x < width ? x : width - 1;
+            int sx1 = (x + 1) < width ? x + 1 : width - 1;
+            int cb = 0, cr = 0;
+
+            if (format == PIXFORMAT_YUV422) {
+                // Y0 U Y1 V, chroma is shared by the pixel pair
+                int px = sx0 & ~1;
+                yr0[x] = row0[sx0 * 2];
+                yr0[x + 1] = row0[sx1 * 2];
+                yr1[x] = row1[sx0 * 2];
+                yr1[x + 1] = row1[sx1 * 2];
+                cb = row0[px * 2 + 1] + row1[px * 2 + 1];
+                cr = row0[px * 2 + 3] + row1[px * 2 + 3];
+                cbr[x / 2] = (cb + 1) >> 1;
+                crr[x / 2] = (cr + 1) >> 1;
+                continue;
+            }
+
+            const uint8_t * pix[4] = {
+                row0 + sx0 * bpp, row0 + sx1 * bpp, row1 + sx0 * bpp, row1 + sx1 * bpp
+            };
+            uint8_t * yo[4] = {&yr0[x], &yr0[x + 1], &yr1[x], &yr1[x + 1]};
+            for (int i = 0; i < 4; i++) {
+                int r, g, b;
+                jpg_get_rgb(pix[i], format, &r, &g, &b);
+                *yo[i] = (uint8_t)((19595 * r + 38470 * g + 7471 * b + 32768) >> 16);
+                cb += -11059 * r - 21709 * g + 32768 * b;
+                cr += 32768 * r - 27439 * g - 5329 * b;
+            }
+            cbr[x / 2] = jpg_clamp(((cb + (1 << 17)) >> 18) + 128);
+            crr[x / 2] = jpg_clamp(((cr + (1 << 17)) >> 18) + 128);
+        }
+    }
+}
+
+static void jpg_convert_gray_stripe(const uint8_t * src, uint16_t width, uint16_t height,
+                                    int y0, size_t w8, uint8_t * yp)
+{
+    for (int ly = 0; ly < 8; ly++) {
+        int sy = y0 + ly;
+        if (sy >= height) sy = height - 1;
+        const uint8_t * row = src + (size_t)sy * width;
+        uint8_t * yr = yp + (size_t)ly * w8;
+        memcpy(yr, row, width);
+        memset(yr + width, row[width - 1], w8 - width);
+    }
+}
+
+bool fmt2jpg_cb(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, jpg_out_cb cb, void * arg)
+{
+    int bpp;
+    switch (format) {
+    case PIXFORMAT_GRAYSCALE:
+        bpp = 1;
+        break;
+    case PIXFORMAT_RGB565:
+    case PIXFORMAT_YUV422:
+        bpp = 2;
+        break;
+    case PIXFORMAT_RGB888:
+        bpp = 3;
+        break;
+    default:
+        ESP_LOGE(TAG, "Unsupported format %d", format);
+        return false;
+    }
+    if (!src || !cb || !width || !height || src_len < (size_t)width * height * bpp) {
+        ESP_LOGE(TAG, "Bad source image");
+        return false;
+    }
+    if (quality < 1) {
+        quality = 1;
+    } else if (quality > 100) {
+        quality = 100;
+    }
+    if (!jpg_prepare_tables(quality)) {
+        ESP_LOGE(TAG, "Tables malloc failed");
+        return false;
+    }
+
+    bool gray = (format == PIXFORMAT_GRAYSCALE);
+    int mcu = gray ? 8 : 16;
+    size_t wm = (width + mcu - 1) & ~(mcu - 1);
+    size_t stripe_size = wm * mcu + (gray ? 0 : wm * 8);   // Y + Cb + Cr
+
+    jpg_encoder_t * e = (jpg_encoder_t *)wc_mem_malloc(WC_MEM_IMAGE, sizeof(jpg_encoder_t), MALLOC_CAP_8BIT);
+    uint8_t * stripe = (uint8_t *)wc_mem_malloc(WC_MEM_IMAGE, stripe_size, MALLOC_CAP_8BIT);
+    if (!e || !stripe) {
+        ESP_LOGE(TAG, "Stripe malloc failed");
+        wc_mem_free(e);
+        wc_mem_free(stripe);
+        return false;
+    }
+    memset(e, 0, offsetof(jpg_encoder_t, buf));
+    e->cb = cb;
+    e->arg = arg;
+    e->t = s_tables;
+
+    jpg_write_headers(e, width, height, gray ? 1 : 3);
+
+    uint8_t * yp = stripe;
+    uint8_t * cbp = stripe + wm * mcu;
+    uint8_t * crp = cbp + wm * 4;
+
+    for (int y = 0; y < height && !e->failed; y += mcu) {
+        if (gray) {
+            jpg_convert_gray_stripe(src, width, height, y, wm, yp);
+            for (size_t x = 0; x < wm; x += 8) {
+                jpg_encode_block(e, yp + x, wm, 0);
+            }
+        } else {
+            jpg_convert_color_stripe(src, width, height, format, y, wm, yp, cbp, crp);
+            for (size_t x = 0; x < wm; x += 16) {
+                jpg_encode_block(e, yp + x, wm, 0);
+                jpg_encode_block(e, yp + x + 8, wm, 0);
+                jpg_encode_block(e, yp + 8 * wm + x, wm, 0);
+                jpg_encode_block(e, yp + 8 * wm + x + 8, wm, 0);
+                jpg_encode_block(e, cbp + x / 2, wm / 2, 1);
+                jpg_encode_block(e, crp + x / 2, wm / 2, 2);
+            }
+        }
+    }
+
+    // pad the last byte with 1s and finish
+    if (e->bit_cnt) {
+        jpg_put_bits(e, 0x7F, 8 - e->bit_cnt);
+    }
+    jpg_put_word(e, 0xFFD9);
+    jpg_flush(e);
+
+    bool res = !e->failed;
+    wc_mem_free(stripe);
+    wc_mem_free(e);
+    return res;
+}
+
+bool frame2jpg_cb(camera_fb_t * fb, uint8_t quality, jpg_out_cb cb, void * arg)
+{
+    return fmt2jpg_cb(fb->buf, fb->len, fb->width, fb->height, fb->format, quality, cb, arg);
+}
+
+typedef struct {
+    uint8_t * buf;
+    size_t len;
+    size_t cap;
+} jpg_mem_dest_t;
+
+static size_t jpg_mem_out(void * arg, size_t index, const void * data, size_t len)
+{
+    jpg_mem_dest_t * d = (jpg_mem_dest_t *)arg;
+    if (index + len > d->cap) {
+        size_t cap = d->cap * 2;
+        while (cap < index + len) {
+            cap *= 2;
+        }
+        uint8_t * nb = (uint8_t *)heap_caps_realloc(d->buf, cap, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (nb == NULL) {
+            nb = (uint8_t *)realloc(d->buf, cap);
+        }
+        if (nb == NULL) {
+            return 0;
+        }
+        d->buf = nb;
+        d->cap = cap;
+    }
+    memcpy(d->buf + index, data, len);
+    d->len = index + len;
+    return len;
+}
+
+bool fmt2jpg(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, uint8_t ** out, size_t * out_len)
+{
+    jpg_mem_dest_t d;
+    d.len = 0;
+    d.cap = ((size_t)width * height / 8) + 1024;
+    d.buf = (uint8_t *)heap_caps_malloc(d.cap, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (d.buf == NULL) {
+        d.buf = (uint8_t *)malloc(d.cap);
+    }
+    if (d.buf == NULL) {
+        ESP_LOGE(TAG, "JPG buffer malloc failed");
+        return false;
+    }
+    if (!fmt2jpg_cb(src, src_len, width, height, format, quality, jpg_mem_out, &d)) {
+        free(d.buf);
+        return false;
+    }
+    *out = d.buf;
+    *out_len = d.len;
+    return true;
+}
+
+bool frame2jpg(camera_fb_t * fb, uint8_t quality, uint8_t ** out, size_t * out_len)
+{
+    return fmt2jpg(fb->buf, fb->len, fb->width, fb->height, fb->format, quality, out, out_len);
+}
@@ -0,0 +1,154 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "soc/soc_memory_layout.h"
+#include "esp_log.h"
+#include "wc_mem.h"
+
+static const char *TAG = "wc_mem";
+
+#define WC_MEM_MAGIC 0xC3A5
+
+/* 8 bytes - keeps the alignment of the heap block */
+typedef struct {
+    uint32_t size;
+    uint8_t  tag;
+    uint8_t  cls;
+    uint16_t magic;
+} wc_mem_hdr_t;
+
+static const char * const tag_names[WC_MEM_TAG_MAX] = {
+    "camera", "cam_dma", "image", "frames",
+};
+
+static const char * const class_names[WC_MEM_CLASS_MAX] = {
+    "internal", "dma", "spiram",
+};
+
+static portMUX_TYPE mem_mux = portMUX_INITIALIZER_UNLOCKED;
+static wc_mem_stat_t mem_stats[WC_MEM_TAG_MAX][WC_MEM_CLASS_MAX] = {0};
+
+/* the block may land in PSRAM even without MALLOC_CAP_SPIRAM */
+static wc_mem_class_t mem_class(const void * ptr, uint32_t caps)
+{
+    if (esp_ptr_external_ram(ptr))
+        return WC_MEM_SPIRAM;
+    if (caps & MALLOC_CAP_DMA)
+        return WC_MEM_DMA;
+    return WC_MEM_INTERNAL;
+}
+
+static void * mem_account(wc_mem_tag_t tag, wc_mem_hdr_t * hdr, size_t size, uint32_t caps)
+{
+    hdr->size = size;
+    hdr->tag = tag;
+    hdr->cls = mem_class(hdr, caps);
+    hdr->magic = WC_MEM_MAGIC;
+
+    wc_mem_stat_t * st = &mem_stats[tag][hdr->cls];
+    taskENTER_CRITICAL(&mem_mux);
+    st->cur += size;
+    if (st->cur > st->peak)
+        st->peak = st->cur;
+    taskEXIT_CRITICAL(&mem_mux);
+    return hdr + 1;
+}
+
+static wc_mem_hdr_t * mem_release(void * ptr)
+{
+    wc_mem_hdr_t * hdr = ((wc_mem_hdr_t *) ptr) - 1;
+    if (hdr->magic != WC_MEM_MAGIC) {
+        ESP_LOGE(TAG, "Block %p was not allocated by wc_mem", ptr);
+        abort();
+    }
+    wc_mem_stat_t * st = &mem_stats[hdr->tag][hdr->cls];
+    taskENTER_CRITICAL(&mem_mux);
+    st->cur -= hdr->size;
+    taskEXIT_CRITICAL(&mem_mux);
+    hdr->magic = 0;
+    return hdr;
+}
+
+void * wc_mem_malloc(wc_mem_tag_t tag, size_t size, uint32_t caps)
+{
+    wc_mem_hdr_t * hdr = (wc_mem_hdr_t *) heap_caps_malloc(size + sizeof(wc_mem_hdr_t), caps);
+    if (hdr == NULL) {
+        ESP_LOGW(TAG, "%s: %u bytes (caps 0x%x) malloc failed", tag_names[tag], size, caps);
+        return NULL;
+    }
+    return mem_account(tag, hdr, size, caps);
+}
+
+void * wc_mem_calloc(wc_mem_tag_t tag, size_t n, size_t size, uint32_t caps)
+{
+    void * ptr = wc_mem_malloc(tag, n * size, caps);
+    if (ptr)
+        memset(ptr, 0, n * size);
+    return ptr;
+}
+
+void * wc_mem_realloc(wc_mem_tag_t tag, void * ptr, size_t size, uint32_t caps)
+{
+    if (ptr == NULL)
+        return wc_mem_malloc(tag, size, caps);
+    wc_mem_hdr_t * old = mem_release(ptr);
+    wc_mem_hdr_t * hdr = (wc_mem_hdr_t *) heap_caps_realloc(old, size + sizeof(wc_mem_hdr_t), caps);
+    if (hdr == NULL) {
+        // the old block is still valid
+        ESP_LOGW(TAG, "%s: %u bytes (caps 0x%x) realloc failed", tag_names[tag], size, caps);
+        mem_account(old->tag, old, old->size, caps);
+        return NULL;
+    }
+    return mem_account(tag, hdr, size, caps);
+}
+
+void wc_mem_free(void * ptr)
+{
+    if (ptr == NULL)
+        return;
+    free(mem_release(ptr));
+}
+
+void wc_mem_get_stats(wc_mem_stat_t stats[WC_MEM_TAG_MAX][WC_MEM_CLASS_MAX])
+{
+    taskENTER_CRITICAL(&mem_mux);
+    memcpy(stats, mem_stats, sizeof(mem_stats));
+    taskEXIT_CRITICAL(&mem_mux);
+}
+
+const char * wc_mem_tag_name(wc_mem_tag_t tag)
+{
+    return (tag < WC_MEM_TAG_MAX) ? tag_names[tag] : "?";
+}
+
+const char * wc_mem_class_name(wc_mem_class_t cls)
+{
+    return (cls < WC_MEM_CLASS_MAX) ? class_names[cls] : "?";
+}
+
+void wc_mem_dump()
+{
+    wc_mem_stat_t st[WC_MEM_TAG_MAX][WC_MEM_CLASS_MAX];
+    wc_mem_get_stats(st);
+    for (int t = 0; t < WC_MEM_TAG_MAX; t++) {
+        ESP_LOGW(TAG, "%-8s internal %u (peak %u), dma %u (peak %u), spiram %u (peak %u)", tag_names[t],
+                 st[t][WC_MEM_INTERNAL].cur, st[t][WC_MEM_INTERNAL].peak,
+                 st[t][WC_MEM_DMA].cur, st[t][WC_MEM_DMA].peak,
+                 st[t][WC_MEM_SPIRAM].cur, st[t][WC_MEM_SPIRAM].peak);
+    }
+    ESP_LOGW(TAG, "free: internal %u, dma %u (largest %u), spiram %u (largest %u)",
+             heap_caps_get_free_size(MALLOC_CAP_INTERNAL),
+             heap_caps_get_free_size(MALLOC_CAP_DMA), heap_caps_get_largest_free_block(MALLOC_CAP_DMA),
+             heap_caps_get_free_size(MALLOC_CAP_SPIRAM), heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM));
+}
@@ -0,0 +1,97 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+#include "wc_perf.h"
+
+/* 0..3 ms, then 4 buckets for each power of two up to 2^15 ms */
+#define PERF_BUCKETS 60
+
+typedef struct {
+    uint32_t count;
+    uint64_t bytes;
+    uint32_t max_ms;
+    int64_t  start_us;
+    uint32_t hist[PERF_BUCKETS];
+} perf_t;
+
+static portMUX_TYPE perf_mux = portMUX_INITIALIZER_UNLOCKED;
+static perf_t perf[WC_PERF_MAX] = {0};
+
+static int perf_bucket(uint32_t ms)
+{
+    if (ms < 4)
+        return ms;
+    int e = 31 - __builtin_clz(ms);
+    if (e > 15)
+        return PERF_BUCKETS - 1;
+    return 4 + (e - 2) * 4 + ((ms >> (e - 2)) & 3);
+}
+
+/* the largest value of the bucket */
+static uint32_t perf_bucket_ms(int idx)
+{
+    if (idx < 4)
+        return idx;
+    int e = (idx - 4) / 4 + 2;
+    uint32_t m = (idx - 4) % 4;
+    return ((4 + m + 1) << (e - 2)) - 1;
+}
+
+static uint32_t perf_percentile(const perf_t * p, uint32_t pct)
+{
+    uint32_t target = (p->count * pct + 99) / 100;
+    uint32_t sum = 0;
+    for (int i = 0; i < PERF_BUCKETS; i++) {
+        sum += p->hist[i];
+        if (sum >= target && sum > 0) {
+            uint32_t ms = perf_bucket_ms(i);
+            return (ms < p->max_ms) ? ms : p->max_ms;
+        }
+    }
+    return p->max_ms;
+}
+
+void wc_perf_add(wc_perf_kind_t kind, int64_t latency_us, size_t bytes)
+{
+    uint32_t ms = (latency_us > 0) ? (uint32_t) (latency_us / 1000) : 0;
+    perf_t * p = &perf[kind];
+    taskENTER_CRITICAL(&perf_mux);
+    p->count++;
+    p->bytes += bytes;
+    if (ms > p->max_ms)
+        p->max_ms = ms;
+    p->hist[perf_bucket(ms)]++;
+    taskEXIT_CRITICAL(&perf_mux);
+}
+
+void wc_perf_get(wc_perf_kind_t kind, wc_perf_stats_t * stats, bool reset)
+{
+    perf_t p;
+    int64_t now = esp_timer_get_time();
+    taskENTER_CRITICAL(&perf_mux);
+    p = perf[kind];
+    if (reset) {
+        memset(&perf[kind], 0, sizeof(perf_t));
+        perf[kind].start_us = now;
+    }
+    taskEXIT_CRITICAL(&perf_mux);
+
+    stats->count = p.count;
+    stats->bytes = p.bytes;
+    stats->period_ms = (uint32_t) ((now - p.start_us) / 1000);
+    stats->p50_ms = perf_percentile(&p, 50);
+    stats->p90_ms = perf_percentile(&p, 90);
+    stats->p99_ms = perf_percentile(&p, 99);
+    stats->max_ms = p.max_ms;
+}
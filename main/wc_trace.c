@@ -0,0 +1,88 @@
+/* HTTP2 Web Camera Client Device
+
+   Part of WCWebCamServer project
+
+   Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "esp_ipc.h"
+#include "wc_trace.h"
+
+#if CONFIG_WC_TRACE
+
+#if (CONFIG_WC_TRACE_LEN & (CONFIG_WC_TRACE_LEN - 1)) != 0
+#error "CONFIG_WC_TRACE_LEN must be a power of two"
+#endif
+
+typedef struct {
+    uint32_t head;               // records written since start
+    wc_trace_rec_t recs[CONFIG_WC_TRACE_LEN];
+} wc_trace_ring_t;
+
+static DRAM_ATTR wc_trace_ring_t rings[portNUM_PROCESSORS];
+
+/* only the own core writes the ring, with the interrupts masked - so a
+   record is never half written when wc_trace_read copies the ring there */
+void IRAM_ATTR wc_trace_emit(wc_trace_ev_t ev, uint32_t arg)
+{
+    uint32_t irq = portSET_INTERRUPT_MASK_FROM_ISR();
+    wc_trace_ring_t * r = &rings[xPortGetCoreID()];
+    wc_trace_rec_t * rec = &r->recs[r->head++ & (CONFIG_WC_TRACE_LEN - 1)];
+    rec->ts = (uint32_t) esp_timer_get_time();
+    rec->ev = ev;
+    rec->arg = arg;
+    portCLEAR_INTERRUPT_MASK_FROM_ISR(irq);
+}
+
+typedef struct {
+    wc_trace_rec_t * recs;
+    size_t max;
+    size_t n;
+    uint32_t older;
+} wc_trace_copy_t;
+
+/* runs on the core of the ring */
+static void wc_trace_copy(void * arg)
+{
+    wc_trace_copy_t * c = (wc_trace_copy_t *) arg;
+    uint32_t irq = portSET_INTERRUPT_MASK_FROM_ISR();
+    wc_trace_ring_t * r = &rings[xPortGetCoreID()];
+    uint32_t head = r->head;
+    uint32_t n = (head < CONFIG_WC_TRACE_LEN) ? head : CONFIG_WC_TRACE_LEN;
+    if (n > c->max)
+        n = c->max;
+    for (uint32_t i = 0; i < n; i++)
+        c->recs[i] = r->recs[(head - n + i) & (CONFIG_WC_TRACE_LEN - 1)];
+    portCLEAR_INTERRUPT_MASK_FROM_ISR(irq);
+    c->n = n;
+    c->older = head - n;
+}
+
+size_t wc_trace_read(int core, wc_trace_rec_t * recs, size_t max, uint32_t * older)
+{
+    wc_trace_copy_t c = { .recs = recs, .max = max };
+    if (core < 0 || core >= portNUM_PROCESSORS) {
+        *older = 0;
+        return 0;
+    }
+#if CONFIG_FREERTOS_UNICORE
+    wc_trace_copy(&c);
+#else
+    if (esp_ipc_call_blocking(core, wc_trace_copy, &c) != ESP_OK) {
+        *older = 0;
+        return 0;
+    }
+#endif
+    *older = c.older;
+    return c.n;
+}
+
+#endif
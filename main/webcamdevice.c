@@ -19,6 +19,38 @@
 #include "nvs_flash.h"
 #include "driver/gpio.h"
 #include "esp_camera.h"
+#include "wc_mem.h"
+#include "wc_trace.h"
+#include "wc_perf.h"
+#ifdef ADC_ENABLED
+#include "adc_probe.h"
+#endif
+#ifdef OUT_ENABLED
+#include "out_seq.h"
+#endif
+#ifdef CONFIG_WC_PREEVENT_RING
+#include "frame_ring.h"
+#endif
+#ifdef CONFIG_WC_SPOOL
+#include "frame_spool.h"
+#endif
+#ifdef CONFIG_WC_MOTION
+#include "motion.h"
+#include "esp_jpg_decode.h"
+#endif
+#ifdef CONFIG_WC_EXPOSURE
+#include "exposure.h"
+#endif
+#ifdef CONFIG_WC_TILE_STREAM
+#include "tile_stream.h"
+#endif
+#ifdef CONFIG_WC_THUMB
+#include "esp_heap_caps.h"
+#include "img_converters.h"
+#endif
+#ifdef CONFIG_WC_TRACE
+#include "mbedtls/base64.h"
+#endif
 
 const char *WC_TAG = "camhttp2-rsp";
 
@@ -35,6 +67,8 @@ struct _out_state out_pins[OUT_CNT] = {
     { OUT_OFF, OUT_OFF, OUT_1 },
     { OUT_OFF, OUT_OFF, OUT_2 },
 };
+/* index in out_pins by GPIO number, -1 - not an output */
+static int8_t out_index[GPIO_NUM_MAX];
 #endif
 
 #ifdef INP_ENABLED
@@ -47,12 +81,8 @@ struct _button_state buttons[BUTTONS_CNT] = {
 #endif
 
 #ifdef ADC_ENABLED
-static esp_adc_cal_characteristics_t *adc_chars;
 static adc_channel_t adc_channel;
-static SemaphoreHandle_t adc_mux = NULL;
-volatile uint32_t adc_value = 0; // value in mV
-static esp_timer_handle_t adc_probe;
-#define ADC_PROBE_TIMER_DELTA 2000000
+#define ADC_PROBE_TIMER_DELTA (CONFIG_WC_ADC_PERIOD_MS * 1000)
 #endif
 
 /* Frame size for snap */
@@ -60,7 +90,12 @@ static esp_timer_handle_t adc_probe;
 /* Frame size for streaming. must be less or equal CAM_SNAP_FRAMESIZE */
 #define CAM_STREAM_FRAMESIZE FRAMESIZE_VGA
 
+#ifdef CONFIG_WC_TILE_STREAM
+/* only the changed tiles of the JPEG stream frames are sent */
+#define WC_SUB_PROTO "TILE_JPEG"
+#else
 #define WC_SUB_PROTO "RAW_JPEG"
+#endif
 
 /* camera config - ov2640 driver */
 static camera_config_t camera_config = {
@@ -99,11 +134,112 @@ static camera_config_t camera_config = {
 
 volatile int8_t cur_cam_mode = CAM_MODE_SNAP;
 
+#ifdef CONFIG_WC_MOTION
+/* the capture failed to switch - it is rebuilt before the next probe */
+static bool motion_cam_reinit = false;
+/* cost of the checks - the decode of the stream frame or
+   the capture switch of the probe (frame buffers, DMA, sensor output) */
+static uint32_t motion_checks = 0;
+static uint64_t motion_cost_us = 0;
+/* grayscale frame of MOTION_FRAMESIZE from the DC of the stream frame,
+   every 8x8 block of the stream fills motion_dc_rep x motion_dc_rep pixels */
+static uint8_t * motion_gray = NULL;
+static uint8_t motion_dc_rep = 0;
+#endif
+
+/* region of the sensor array captured instead of the full view on snap.
+   coordinates are in UXGA sensor pixels */
+typedef struct {
+    bool on;
+    uint16_t x, y, w, h;
+    uint16_t out_w, out_h;
+} cam_roi_t;
+
+static cam_roi_t cam_roi = {0};
+
+/* validate and store the region, the output is scaled down to fit
+   the snap frame buffers */
+static bool set_camera_roi(int x, int y, int w, int h)
+{
+    if (w <= 0 || h <= 0) {
+        cam_roi.on = false;
+        return true;
+    }
+    w &= ~3;
+    h &= ~3;
+    if (w < 16 || h < 16 || x < 0 || y < 0 ||
+        x + w > resolution[FRAMESIZE_UXGA].width ||
+        y + h > resolution[FRAMESIZE_UXGA].height)
+        return false;
+
+    uint32_t out_w = w, out_h = h;
+    if (out_w > resolution[CAM_SNAP_FRAMESIZE].width) {
+        out_h = out_h * resolution[CAM_SNAP_FRAMESIZE].width / out_w;
+        out_w = resolution[CAM_SNAP_FRAMESIZE].width;
+    }
+    if (out_h > resolution[CAM_SNAP_FRAMESIZE].height) {
+        out_w = out_w * resolution[CAM_SNAP_FRAMESIZE].height / out_h;
+        out_h = resolution[CAM_SNAP_FRAMESIZE].height;
+    }
+
+    cam_roi.x = x;
+    cam_roi.y = y;
+    cam_roi.w = w;
+    cam_roi.h = h;
+    cam_roi.out_w = out_w & ~3;
+    cam_roi.out_h = out_h & ~3;
+    cam_roi.on = true;
+    return true;
+}
+
 /* MSGS */
 static const char * JSON_RPC_DOSNAP      =  "dosnap";
+static const char * JSON_RPC_ROI         =  "roi";
+static const char * JSON_RPC_X           =  "x";
+static const char * JSON_RPC_Y           =  "y";
+static const char * JSON_RPC_W           =  "w";
+static const char * JSON_RPC_H           =  "h";
+static const char * JSON_RPC_GETMEM      =  "getmem";
+static const char * JSON_RPC_FREE        =  "free";
+static const char * JSON_RPC_RESP_MAX    =  "h2pc_resp_max";
+static const char * JSON_RPC_GETSTATS    =  "getstats";
+static const char * JSON_RPC_STATS       =  "stats";
+static const char * JSON_RPC_RESET       =  "reset";
+static const char * JSON_RPC_CAPTURED    =  "captured";
+static const char * JSON_RPC_DELIVERED   =  "delivered";
+static const char * JSON_RPC_BYTES       =  "bytes";
+static const char * JSON_RPC_AVGSIZE     =  "avgsize";
+static const char * JSON_RPC_FBOVF       =  "fbovf";
+static const char * JSON_RPC_NOSOI       =  "nosoi";
+static const char * JSON_RPC_NOEOI       =  "noeoi";
+static const char * JSON_RPC_EVOVF       =  "evovf";
+static const char * JSON_RPC_FBQSND      =  "fbqsnd";
+static const char * JSON_RPC_FBQRCV      =  "fbqrcv";
+static const char * JSON_RPC_FBSIZE      =  "fbsize";
+static const char * JSON_RPC_FBBAD       =  "fbbad";
+static const char * JSON_RPC_FBCOPY      =  "fbcopy";
+static const char * JSON_RPC_TIMEOUT     =  "timeout";
+static const char * JSON_RPC_CAMBUSY     =  "cambusy";
+static const char * JSON_RPC_SNAP        =  "snap";
+static const char * JSON_RPC_STREAM      =  "stream";
+static const char * JSON_RPC_COUNT       =  "count";
+static const char * JSON_RPC_PERIOD      =  "period";
+static const char * JSON_RPC_RATE        =  "rate";
+static const char * JSON_RPC_LAT         =  "lat";
 #ifdef ADC_ENABLED
 static const char * JSON_RPC_GET_ADCVAL  =  "getadcval";
 static const char * JSON_RPC_ADCVAL      =  "adcval";
+static const char * JSON_RPC_LOW         =  "low";
+static const char * JSON_RPC_HIGH        =  "high";
+static const char * JSON_RPC_DELTA       =  "delta";
+static const char * JSON_RPC_HYST        =  "hyst";
+static const char * JSON_RPC_GETADCSERIES=  "getadcseries";
+static const char * JSON_RPC_ADCSERIES   =  "adcseries";
+static const char * JSON_RPC_SINCE       =  "since";
+static const char * JSON_RPC_MAX         =  "max";
+static const char * JSON_RPC_LAST        =  "last";
+static const char * JSON_RPC_DT          =  "dt";
+static const char * JSON_RPC_DV          =  "dv";
 #endif
 #ifdef INP_ENABLED
 static const char * JSON_RPC_BTN         =  "btn";
@@ -113,6 +249,47 @@ static const char * JSON_RPC_BTNEVENT    =  "btnevent";
 static const char * JSON_RPC_OUTPUT      =  "output";
 static const char * JSON_RPC_LEVEL       =  "level";
 static const char * JSON_RPC_PIN         =  "pin";
+static const char * JSON_RPC_OUTPUTS     =  "outputs";
+static const char * JSON_RPC_LEVELS      =  "levels";
+static const char * JSON_RPC_STEPS       =  "steps";
+static const char * JSON_RPC_REPEAT      =  "repeat";
+static const char * JSON_RPC_HOLD_US     =  "us";
+static const char * JSON_RPC_FLASH       =  "flash";
+#endif
+#ifdef CONFIG_WC_PREEVENT_RING
+static const char * JSON_RPC_PREEVENT    =  "preevent";
+#endif
+#ifdef CONFIG_WC_SPOOL
+static const char * JSON_RPC_SPOOLED     =  "spooled";
+#endif
+#if defined(CONFIG_WC_PREEVENT_RING) || defined(CONFIG_WC_SPOOL) || defined(ADC_ENABLED)
+static const char * JSON_RPC_TS          =  "ts";
+#endif
+#ifdef CONFIG_WC_THUMB
+static const char * JSON_RPC_GETTHUMB    =  "getthumb";
+#endif
+#ifdef CONFIG_WC_MOTION
+static const char * JSON_RPC_MOTION      =  "motion";
+static const char * JSON_RPC_TILES       =  "tiles";
+static const char * JSON_RPC_MOTIONUS    =  "motionus";
+#endif
+#if defined(CONFIG_WC_MOTION) || defined(CONFIG_WC_EXPOSURE)
+static const char * JSON_RPC_MEAN        =  "mean";
+#endif
+#ifdef CONFIG_WC_EXPOSURE
+static const char * JSON_RPC_SNAPINFO    =  "snapinfo";
+static const char * JSON_RPC_FRAMES      =  "frames";
+#endif
+#if defined(CONFIG_WC_EXPOSURE) || defined(OUT_ENABLED)
+static const char * JSON_RPC_MS          =  "ms";
+#endif
+#ifdef CONFIG_WC_TRACE
+static const char * JSON_RPC_GETTRACE    =  "gettrace";
+static const char * JSON_RPC_TRACE       =  "trace";
+static const char * JSON_RPC_OLDER       =  "older";
+#endif
+#if defined(CONFIG_WC_TRACE) || defined(ADC_ENABLED)
+static const char * JSON_RPC_NOW         =  "now";
 #endif
 
 /* Modes in state-machina */
@@ -123,34 +300,236 @@ static const char * JSON_RPC_PIN         =  "pin";
 // is need to get new voltage value
 #define  MODE_ADC_PROBE             BIT12
 #endif
+#ifdef CONFIG_WC_PREEVENT_RING
+// is need to upload the pre-event frames
+#define  MODE_SEND_PREEVENT         BIT13
+#endif
+#ifdef CONFIG_WC_THUMB
+// is need to upload the thumbnail of the last snapshot
+#define  MODE_SEND_THUMB            BIT14
+#endif
+#ifdef CONFIG_WC_MOTION
+// is need to grab the grayscale frame for motion detection
+#define  MODE_MOTION_PROBE          BIT15
+#endif
+#if CONFIG_WC_STATS_PERIOD > 0
+// is need to push the camera stats
+#define  MODE_PUSH_STATS            BIT16
+#endif
+
+#ifdef CONFIG_WC_MOTION
+/* Frame size for motion detection */
+#define MOTION_FRAMESIZE FRAMESIZE_QQVGA
+#endif
 
 /* timers */
 #define STREAM_NEXT_FRAME_TIMER_DELTA 1000000
 #define LOC_GET_MSG_TIMER_DELTA       5000000
 #define LOC_SEND_MSG_TIMER_DELTA      5000000
 
+#ifdef CONFIG_WC_SPOOL
+/* the snapshots are taken offline too - they go to the spool */
+#define SEND_FB_REQ_BITMASK           MODE_SEND_FB
+#else
+#define SEND_FB_REQ_BITMASK           (AUTHORIZED_BIT|MODE_SEND_FB)
+#endif
+
+#if defined(CONFIG_WC_PREEVENT_RING) || (defined(CONFIG_WC_SPOOL) && CONFIG_WC_SPOOL_OFFLINE_PERIOD > 0)
+#define OFFLINE_CAPTURE
+/* last captures of the step timer while the device is offline */
+static int64_t offline_frame_us = 0;
+static int64_t offline_snap_us = 0;
+#endif
+
+#ifdef CONFIG_WC_PREEVENT_RING
+/* pre-event ring upload window - (preevent_sent_us, preevent_trigger_us] */
+static portMUX_TYPE preevent_mux = portMUX_INITIALIZER_UNLOCKED;
+static int64_t preevent_trigger_us = 0;
+static int64_t preevent_sent_us = 0;
+#endif
+
+#ifdef CONFIG_WC_THUMB
+/* copy of the last snapshot in PSRAM */
+static uint8_t * last_snap = NULL;
+static size_t last_snap_len = 0;
+static size_t last_snap_cap = 0;
+#endif
+
+/* time of the last dosnap request */
+static int64_t snap_request_us = 0;
+
+#ifdef OUT_ENABLED
+/* frames of the snapshot exposed under OUT_LED_FLASH, 0 - no flash */
+#ifdef CONFIG_WC_EXPOSURE
+#define SNAP_FLASH_FRAMES CONFIG_WC_EXPOSURE_MAX_FRAMES // all the frames to converge are lit
+#else
+#define SNAP_FLASH_FRAMES 1
+#endif
+#define SNAP_FLASH_MAX_FRAMES 10
+static uint8_t snap_flash_frames = 0;
+#endif
+
 /* forward decrlarations */
 #ifdef ADC_ENABLED
-uint32_t locked_get_adc_voltage();
+static void set_adc_events(const cJSON * iparams);
+static void add_adc_events(cJSON * params);
+static bool add_adc_series(cJSON * params, const cJSON * iparams);
+#endif
+#ifdef OUT_ENABLED
+static bool board_outputs(cJSON * params, const cJSON * iparams);
 #endif
 
+/* capture time of the frame, us since boot */
+static int64_t fb_time_us(const camera_fb_t * pic) {
+    return (int64_t) pic->timestamp.tv_sec * 1000000 + pic->timestamp.tv_usec;
+}
+
 static camera_fb_t * camera_take_pic() {
     camera_fb_t *pic = esp_camera_fb_get();
 
     // use pic->buf to access the image
-    ESP_LOGI(WC_TAG, "Picture taken. Its size was: %zu bytes", pic->len);
+    ESP_LOGD(WC_TAG, "Picture taken. Its size was: %zu bytes", pic->len);
+
+    return pic;
+}
+
+#ifdef CONFIG_WC_THUMB
+static void keep_last_snap(const camera_fb_t * pic) {
+    if (pic->len > last_snap_cap) {
+        wc_mem_free(last_snap);
+        last_snap_len = last_snap_cap = 0;
+        last_snap = (uint8_t *) wc_mem_malloc(WC_MEM_FRAMES, pic->len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (last_snap == NULL) {
+            ESP_LOGW(WC_TAG, "No memory to keep the snapshot for thumbnails");
+            return;
+        }
+        last_snap_cap = pic->len;
+    }
+    memcpy(last_snap, pic->buf, pic->len);
+    last_snap_len = pic->len;
+}
+
+typedef struct {
+    uint8_t * rgb;
+    uint16_t w, h;
+} thumb_ctx;
+
+static size_t thumb_read(void * arg, size_t index, uint8_t * buf, size_t len) {
+    memcpy(buf, &last_snap[index], len);
+    return len;
+}
+
+static bool thumb_write(void * arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t * data) {
+    thumb_ctx * ctx = (thumb_ctx *) arg;
+    if (data == NULL) {
+        ctx->w = w;
+        ctx->h = h;
+        ctx->rgb = (uint8_t *) wc_mem_malloc(WC_MEM_IMAGE, (size_t) w * h * 3, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        return (ctx->rgb != NULL);
+    }
+    // decoder gives RGB, PIXFORMAT_RGB888 of the encoder is BGR
+    for (uint16_t j = 0; j < h; j++) {
+        uint8_t * o = &ctx->rgb[((size_t) (y + j) * ctx->w + x) * 3];
+        for (uint16_t i = 0; i < w; i++) {
+            o[2] = *data++;
+            o[1] = *data++;
+            o[0] = *data++;
+            o += 3;
+        }
+    }
+    return true;
+}
+
+static void send_thumb() {
+    thumb_ctx ctx = { NULL, 0, 0 };
+    uint8_t * jpg = NULL;
+    size_t jpg_len = 0;
+    bool sent = true;
+
+    if (esp_jpg_decode(last_snap_len, JPG_SCALE_8X, thumb_read, thumb_write, &ctx) == ESP_OK &&
+        fmt2jpg(ctx.rgb, (size_t) ctx.w * ctx.h * 3, ctx.w, ctx.h, PIXFORMAT_RGB888,
+                CONFIG_WC_THUMB_QUALITY, &jpg, &jpg_len)) {
+        ESP_LOGI(WC_TAG, "Thumbnail %ux%u, %u bytes", ctx.w, ctx.h, jpg_len);
+        sent = (h2pc_req_send_media_record_sync((char *) jpg, jpg_len) == ESP_OK);
+        free(jpg);
+    } else {
+        ESP_LOGE(WC_TAG, "Thumbnail is not created");
+    }
+    wc_mem_free(ctx.rgb);
+
+    if (sent)
+        h2pca_locked_CLR_STATE(MODE_SEND_THUMB);
+}
+#endif
 
+#ifdef CONFIG_WC_EXPOSURE
+static camera_fb_t * camera_take_exposed_pic() {
+    exposure_result_t res;
+    camera_fb_t *pic = exposure_converge(CONFIG_WC_EXPOSURE_TARGET, CONFIG_WC_EXPOSURE_TOLERANCE,
+                                         CONFIG_WC_EXPOSURE_MAX_FRAMES, &res);
+    if (pic == NULL) {
+        exposure_release();
+        return NULL;
+    }
+    ESP_LOGD(WC_TAG, "Picture taken. Its size was: %zu bytes", pic->len);
+
+    /* time from the request to the exposed frame */
+    int64_t ms = snap_request_us ? (esp_timer_get_time() - snap_request_us) / 1000 : 0;
+    cJSON * params = cJSON_CreateObject();
+    cJSON_AddNumberToObject(params, JSON_RPC_MS, (double) ms);
+    cJSON_AddNumberToObject(params, JSON_RPC_FRAMES, res.frames);
+    cJSON_AddNumberToObject(params, JSON_RPC_MEAN, res.mean);
+    h2pc_om_add_msg_res(JSON_RPC_SNAPINFO, "", params, res.converged); // params owned by msg now
     return pic;
 }
+#endif
 
 static void send_snap() {
 
+    #ifdef CONFIG_WC_EXPOSURE
+    camera_fb_t *pic = camera_take_exposed_pic();
+    if (pic == NULL)
+        return;
+    #else
     camera_fb_t *pic = camera_take_pic();
+    #endif
 
-    int res = h2pc_req_send_media_record_sync((char *) pic->buf, pic->len);
+    #ifdef CONFIG_WC_THUMB
+    keep_last_snap(pic);
+    #endif
+
+    int res = ESP_FAIL;
+    if (h2pca_locked_CHK_STATE(AUTHORIZED_BIT) && h2pc_get_connected()) {
+        WC_TRACE(WC_TR_UPLOAD_B, pic->len);
+        res = h2pc_req_send_media_record_sync((char *) pic->buf, pic->len);
+        WC_TRACE(WC_TR_UPLOAD_E, res == ESP_OK);
+        if (res == ESP_OK) {
+            // snapshots not requested by "dosnap" are counted from the capture
+            int64_t from_us = snap_request_us ? snap_request_us : fb_time_us(pic);
+            wc_perf_add(WC_PERF_SNAP, esp_timer_get_time() - from_us, pic->len);
+            snap_request_us = 0;
+        }
+    }
+
+    #ifdef CONFIG_WC_SPOOL
+    if (res != ESP_OK) {
+        /* the snapshot can't go out - keep it in flash until it can */
+        int64_t ts = fb_time_us(pic);
+        if (frame_spool_append(pic->buf, pic->len, ts) == ESP_OK) {
+            ESP_LOGI(WC_TAG, "Snapshot spooled, %u frames pending", frame_spool_pending());
+            snap_request_us = 0;
+            res = ESP_OK;
+        }
+    }
+    #endif
 
     esp_camera_fb_return(pic);
 
+    #ifdef CONFIG_WC_EXPOSURE
+    /* the sensor AEC/AGC continue from the found values */
+    exposure_release();
+    #endif
+
     if (res == ESP_OK)
         h2pca_locked_CLR_STATE(MODE_SEND_FB);
 }
@@ -161,12 +540,34 @@ static void send_next_frame() {
 
     // prepare path?query string
 
+    WC_TRACE(WC_TR_UPLOAD_B, pic->len);
+
+    size_t sent_len = pic->len;
+    #ifdef CONFIG_WC_TILE_STREAM
+    if (!h2pc_get_is_streaming())
+        tile_stream_force_keyframe();
+    const uint8_t * packet;
+    size_t packet_len;
+    if (tile_stream_encode(pic, CONFIG_WC_TILE_QUALITY, CONFIG_WC_TILE_THRESHOLD,
+                           CONFIG_WC_TILE_KEYFRAME, &packet, &packet_len) != ESP_OK) {
+        ESP_LOGW(WC_TAG, "Tile frame is not encoded");
+        WC_TRACE(WC_TR_UPLOAD_E, 0);
+        esp_camera_fb_return(pic);
+        return;
+    }
+    h2pc_os_prepare_frame((char *) packet, packet_len);
+    sent_len = packet_len;
+    #else
     h2pc_os_prepare_frame((char *) pic->buf, pic->len);
+    #endif
 
     if (!h2pc_get_is_streaming())
         h2pc_os_prepare(WC_SUB_PROTO);
 
     h2pc_os_wait_for_frame();
+    WC_TRACE(WC_TR_UPLOAD_E, 1);
+    if (h2pc_get_connected())
+        wc_perf_add(WC_PERF_STREAM, esp_timer_get_time() - fb_time_us(pic), sent_len);
 
     esp_camera_fb_return(pic);
 
@@ -174,25 +575,311 @@ static void send_next_frame() {
         h2pca_locked_CLR_STATE(MODE_STREAM_NEXT_FRAME);
 }
 
+#ifdef CONFIG_WC_SPOOL
+static esp_err_t send_spooled_frame(void * arg, uint8_t * buf, size_t len, int64_t ts_us) {
+    esp_err_t res = h2pc_req_send_media_record_sync((char *) buf, len);
+    if (res == ESP_OK) {
+        // capture time in ms relative to the upload, null - spooled before the restart
+        cJSON * ts = cJSON_CreateArray();
+        cJSON_AddItemToArray(ts, (ts_us < 0) ? cJSON_CreateNull() :
+                                 cJSON_CreateNumber((double) ((ts_us - esp_timer_get_time()) / 1000)));
+        cJSON * params = cJSON_CreateObject();
+        cJSON_AddItemToObject(params, JSON_RPC_TS, ts);
+        h2pc_om_add_msg_res(JSON_RPC_SPOOLED, "", params, true); // params owned by msg now
+    }
+    return res;
+}
+#endif
+
+#ifdef CONFIG_WC_PREEVENT_RING
+static void preevent_trigger() {
+    taskENTER_CRITICAL(&preevent_mux);
+    preevent_trigger_us = esp_timer_get_time();
+    taskEXIT_CRITICAL(&preevent_mux);
+    h2pca_locked_SET_STATE(MODE_SEND_PREEVENT);
+}
+
+/* cam_take - the stream frames taken by the device are recorded */
+static void preevent_tap(const camera_fb_t * fb, void * arg) {
+    if (cur_cam_mode == CAM_MODE_STREAM)
+        frame_ring_push(fb);
+}
+
+static void send_preevent() {
+    int64_t to_us;
+    taskENTER_CRITICAL(&preevent_mux);
+    to_us = preevent_trigger_us;
+    taskEXIT_CRITICAL(&preevent_mux);
+
+    /* the frames are copied out one by one - cam_take keeps pushing to the ring while uploading.
+       the buffer grows to the largest frame, the copy is repeated after the growth */
+    cJSON * ts = cJSON_CreateArray();
+    bool ok = true;
+    uint8_t * buf = NULL;
+    size_t cap = 0;
+    int64_t ts_us;
+    size_t len;
+    while ((len = frame_ring_copy(preevent_sent_us, to_us, buf, cap, &ts_us)) > 0) {
+        if (len > cap) {
+            wc_mem_free(buf);
+            buf = (uint8_t *) wc_mem_malloc(WC_MEM_FRAMES, len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+            cap = buf ? len : 0;
+            if (buf == NULL) {
+                // the frame is skipped, not retried by every step
+                ESP_LOGE(WC_TAG, "Can't allocate %u bytes for pre-event frame", len);
+                preevent_sent_us = ts_us;
+            }
+            continue;
+        }
+        if (h2pc_req_send_media_record_sync((char *) buf, len) != ESP_OK) {
+            ok = false;
+            break;
+        }
+        preevent_sent_us = ts_us;
+        // time in ms relative to the trigger moment
+        cJSON_AddItemToArray(ts, cJSON_CreateNumber((double) ((ts_us - to_us) / 1000)));
+    }
+    wc_mem_free(buf);
+
+    /* only the frames uploaded by this call - the ones sent before a failure are not repeated */
+    if (cJSON_GetArraySize(ts) > 0) {
+        cJSON * params = cJSON_CreateObject();
+        cJSON_AddItemToObject(params, JSON_RPC_TS, ts);
+        h2pc_om_add_msg_res(JSON_RPC_PREEVENT, "", params, true); // params owned by msg now
+    } else {
+        cJSON_Delete(ts);
+    }
+
+    if (ok) {
+        bool retrigger;
+        taskENTER_CRITICAL(&preevent_mux);
+        retrigger = (to_us != preevent_trigger_us);
+        taskEXIT_CRITICAL(&preevent_mux);
+        if (!retrigger)
+            h2pca_locked_CLR_STATE(MODE_SEND_PREEVENT);
+    }
+}
+#endif
+
+/* {"camera":{"internal":[cur,peak],"dma":[..],"spiram":[..]},..,
+    "free":{"internal":[free,largest],..},"h2pc_resp_max":n} */
+static void add_mem_stats(cJSON * params) {
+    static const uint32_t caps[WC_MEM_CLASS_MAX] = {MALLOC_CAP_INTERNAL, MALLOC_CAP_DMA, MALLOC_CAP_SPIRAM};
+    wc_mem_stat_t st[WC_MEM_TAG_MAX][WC_MEM_CLASS_MAX];
+    wc_mem_get_stats(st);
+
+    for (int t = 0; t < WC_MEM_TAG_MAX; t++) {
+        cJSON * tag = cJSON_CreateObject();
+        for (int c = 0; c < WC_MEM_CLASS_MAX; c++) {
+            int v[2] = {st[t][c].cur, st[t][c].peak};
+            cJSON_AddItemToObject(tag, wc_mem_class_name(c), cJSON_CreateIntArray(v, 2));
+        }
+        cJSON_AddItemToObject(params, wc_mem_tag_name(t), tag);
+    }
+    cJSON * fr = cJSON_CreateObject();
+    for (int c = 0; c < WC_MEM_CLASS_MAX; c++) {
+        int v[2] = {heap_caps_get_free_size(caps[c]), heap_caps_get_largest_free_block(caps[c])};
+        cJSON_AddItemToObject(fr, wc_mem_class_name(c), cJSON_CreateIntArray(v, 2));
+    }
+    cJSON_AddItemToObject(params, JSON_RPC_FREE, fr);
+    // the response buffer of the HTTP/2 client is allocated by the component
+    cJSON_AddNumberToObject(params, JSON_RPC_RESP_MAX, CONFIG_H2PC_MAXIMUM_RESP_BUFFER);
+}
+
+/* {"count":n,"bytes":n,"period":ms,"rate":per_second,"lat":[p50,p90,p99,max]} */
+static void add_perf_stats(cJSON * params, const char * name, wc_perf_kind_t kind, bool reset) {
+    wc_perf_stats_t st;
+    wc_perf_get(kind, &st, reset);
+    cJSON * perf = cJSON_CreateObject();
+    cJSON_AddNumberToObject(perf, JSON_RPC_COUNT, st.count);
+    cJSON_AddNumberToObject(perf, JSON_RPC_BYTES, (double) st.bytes);
+    cJSON_AddNumberToObject(perf, JSON_RPC_PERIOD, st.period_ms);
+    cJSON_AddNumberToObject(perf, JSON_RPC_RATE, st.period_ms ? (double) st.count * 1000.0 / st.period_ms : 0.0);
+    int lat[4] = {st.p50_ms, st.p90_ms, st.p99_ms, st.max_ms};
+    cJSON_AddItemToObject(perf, JSON_RPC_LAT, cJSON_CreateIntArray(lat, 4));
+    cJSON_AddItemToObject(params, name, perf);
+}
+
+/* health counters of the camera pipeline */
+static void add_camera_stats(cJSON * params, bool reset) {
+    camera_stats_t st;
+    esp_camera_get_stats(&st, reset);
+    cJSON_AddNumberToObject(params, JSON_RPC_CAPTURED, st.frames_captured);
+    cJSON_AddNumberToObject(params, JSON_RPC_DELIVERED, st.frames_delivered);
+    cJSON_AddNumberToObject(params, JSON_RPC_BYTES, (double) st.bytes_delivered);
+    cJSON_AddNumberToObject(params, JSON_RPC_AVGSIZE, st.avg_frame_size);
+    cJSON_AddNumberToObject(params, JSON_RPC_FBOVF, st.fb_ovf);
+    cJSON_AddNumberToObject(params, JSON_RPC_NOSOI, st.no_soi);
+    cJSON_AddNumberToObject(params, JSON_RPC_NOEOI, st.no_eoi);
+    cJSON_AddNumberToObject(params, JSON_RPC_EVOVF, st.ev_ovf);
+    cJSON_AddNumberToObject(params, JSON_RPC_FBQSND, st.fbq_snd);
+    cJSON_AddNumberToObject(params, JSON_RPC_FBQRCV, st.fbq_rcv);
+    cJSON_AddNumberToObject(params, JSON_RPC_FBSIZE, st.fb_size);
+    cJSON_AddNumberToObject(params, JSON_RPC_FBBAD, st.fb_bad);
+    cJSON_AddNumberToObject(params, JSON_RPC_FBCOPY, st.fb_copy);
+    cJSON_AddNumberToObject(params, JSON_RPC_TIMEOUT, st.fb_timeout);
+    cJSON * busy = cJSON_CreateArray();
+    for (int core = 0; core < 2; core++) {
+        cJSON_AddItemToArray(busy, cJSON_CreateNumber((int) (st.core_busy[core] * 10.0f + 0.5f) / 10.0));
+    }
+    cJSON_AddItemToObject(params, JSON_RPC_CAMBUSY, busy);
+    add_perf_stats(params, JSON_RPC_SNAP, WC_PERF_SNAP, reset);
+    add_perf_stats(params, JSON_RPC_STREAM, WC_PERF_STREAM, reset);
+    #ifdef CONFIG_WC_PREEVENT_RING
+    size_t ring_frames, ring_bytes;
+    uint32_t ring_dropped;
+    frame_ring_get_usage(&ring_frames, &ring_bytes, &ring_dropped);
+    int ring[3] = {ring_frames, ring_bytes, ring_dropped};
+    cJSON_AddItemToObject(params, JSON_RPC_PREEVENT, cJSON_CreateIntArray(ring, 3));
+    #endif
+    #ifdef CONFIG_WC_MOTION
+    /* the average cost of the motion checks */
+    cJSON_AddNumberToObject(params, JSON_RPC_MOTIONUS, motion_checks ? (double) (motion_cost_us / motion_checks) : 0);
+    if (reset) {
+        motion_checks = 0;
+        motion_cost_us = 0;
+    }
+    #endif
+}
+
+#ifdef CONFIG_WC_TRACE
+/* {"now":ts,"trace":["<records of core 0>",..],"older":[n0,..]} -
+   raw records in base64, "now" - the low 32 bits of the device time in us */
+static bool add_trace(cJSON * params) {
+    const size_t b64_cap = ((CONFIG_WC_TRACE_LEN * sizeof(wc_trace_rec_t) + 2) / 3) * 4 + 1;
+    wc_trace_rec_t * recs = (wc_trace_rec_t *) malloc(CONFIG_WC_TRACE_LEN * sizeof(wc_trace_rec_t));
+    unsigned char * b64 = (unsigned char *) malloc(b64_cap);
+    if (recs == NULL || b64 == NULL) {
+        free(recs);
+        free(b64);
+        return false;
+    }
+
+    cJSON * trace = cJSON_CreateArray();
+    cJSON * older = cJSON_CreateArray();
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        uint32_t n_older;
+        size_t n = wc_trace_read(core, recs, CONFIG_WC_TRACE_LEN, &n_older);
+        size_t b64_len = 0;
+        mbedtls_base64_encode(b64, b64_cap, &b64_len, (const unsigned char *) recs, n * sizeof(wc_trace_rec_t));
+        b64[b64_len] = 0;
+        cJSON_AddItemToArray(trace, cJSON_CreateString((const char *) b64));
+        cJSON_AddItemToArray(older, cJSON_CreateNumber(n_older));
+    }
+    // after the reading - every record is older than now
+    cJSON_AddNumberToObject(params, JSON_RPC_NOW, (double) (uint32_t) esp_timer_get_time());
+    cJSON_AddItemToObject(params, JSON_RPC_TRACE, trace);
+    cJSON_AddItemToObject(params, JSON_RPC_OLDER, older);
+
+    free(recs);
+    free(b64);
+    return true;
+}
+
+/* first chars of the message kind for the trace records */
+static uint32_t trace_kind(const char * msgk) {
+    uint32_t v = 0;
+    for (int i = 0; i < 3 && msgk[i]; i++)
+        v |= ((uint32_t) (uint8_t) msgk[i]) << (i * 8);
+    return v;
+}
+#endif
+
 bool on_incoming_msg(const cJSON * src, const cJSON * kind, const cJSON * iparams, const cJSON * msg_id) {
     char * src_s = src->valuestring;
     if (strcmp(src_s, h2pca_app->device_name) != 0) {
 
         if (kind) {
             char * msgk = kind->valuestring;
+            WC_TRACE(WC_TR_MSG_B, trace_kind(msgk));
             cJSON * params = cJSON_CreateObject();
             if (msg_id)
                 cJSON_AddNumberToObject(params, JSON_RPC_MID, msg_id->valuedouble);
             #ifdef ADC_ENABLED
             if (strcmp(JSON_RPC_GET_ADCVAL, msgk) == 0) {
-                cJSON_AddNumberToObject(params, JSON_RPC_ADCVAL, (double) locked_get_adc_voltage());
+                if (iparams)
+                    set_adc_events(iparams);
+                cJSON_AddNumberToObject(params, JSON_RPC_ADCVAL, (double) adc_probe_value());
+                add_adc_events(params);
                 h2pc_om_add_msg_res(JSON_RPC_ADCVAL, src_s, params, true);
             } else
+            if (strcmp(JSON_RPC_GETADCSERIES, msgk) == 0) {
+                bool ok = add_adc_series(params, iparams);
+                h2pc_om_add_msg_res(JSON_RPC_ADCSERIES, src_s, params, ok);
+            } else
             #endif
             if (strcmp(JSON_RPC_DOSNAP, msgk) == 0) {
+                #ifdef OUT_ENABLED
+                cJSON * sflash = iparams ? cJSON_GetObjectItem(iparams, JSON_RPC_FLASH) : NULL;
+                if (cJSON_IsTrue(sflash))
+                    snap_flash_frames = SNAP_FLASH_FRAMES;
+                else if (cJSON_IsNumber(sflash) && sflash->valueint > 0)
+                    snap_flash_frames = (sflash->valueint > SNAP_FLASH_MAX_FRAMES) ? SNAP_FLASH_MAX_FRAMES : sflash->valueint;
+                else
+                    snap_flash_frames = 0;
+                if (snap_flash_frames && (out_seq_pins() & (1ULL << OUT_LED_FLASH))) {
+                    // the flash pin is given to cam_task
+                    out_seq_stop();
+                }
+                #endif
                 h2pc_om_add_msg_res(JSON_RPC_DOSNAP, src_s, params, true);
+                snap_request_us = esp_timer_get_time();
                 h2pca_locked_SET_STATE(MODE_SEND_FB);
             } else
+            if (strcmp(JSON_RPC_GETSTATS, msgk) == 0) {
+                cJSON * sreset = iparams ? cJSON_GetObjectItem(iparams, JSON_RPC_RESET) : NULL;
+                add_camera_stats(params, sreset && cJSON_IsTrue(sreset));
+                h2pc_om_add_msg_res(JSON_RPC_STATS, src_s, params, true);
+            } else
+            if (strcmp(JSON_RPC_GETMEM, msgk) == 0) {
+                add_mem_stats(params);
+                h2pc_om_add_msg_res(JSON_RPC_GETMEM, src_s, params, true);
+            } else
+            #ifdef CONFIG_WC_TRACE
+            if (strcmp(JSON_RPC_GETTRACE, msgk) == 0) {
+                bool ok = add_trace(params);
+                h2pc_om_add_msg_res(JSON_RPC_GETTRACE, src_s, params, ok);
+            } else
+            #endif
+            if (strcmp(JSON_RPC_ROI, msgk) == 0) {
+                bool ok;
+                if (iparams) {
+                    cJSON * sx = cJSON_GetObjectItem(iparams, JSON_RPC_X);
+                    cJSON * sy = cJSON_GetObjectItem(iparams, JSON_RPC_Y);
+                    cJSON * sw = cJSON_GetObjectItem(iparams, JSON_RPC_W);
+                    cJSON * sh = cJSON_GetObjectItem(iparams, JSON_RPC_H);
+                    if (sw && sh) {
+                        ok = set_camera_roi(sx ? sx->valueint : 0, sy ? sy->valueint : 0,
+                                            sw->valueint, sh->valueint);
+                    } else {
+                        ok = false;
+                    }
+                } else {
+                    // no params - back to the full view
+                    ok = set_camera_roi(0, 0, 0, 0);
+                }
+                if (ok && cam_roi.on) {
+                    cJSON_AddNumberToObject(params, JSON_RPC_X, cam_roi.x);
+                    cJSON_AddNumberToObject(params, JSON_RPC_Y, cam_roi.y);
+                    cJSON_AddNumberToObject(params, JSON_RPC_W, cam_roi.w);
+                    cJSON_AddNumberToObject(params, JSON_RPC_H, cam_roi.h);
+                }
+                h2pc_om_add_msg_res(JSON_RPC_ROI, src_s, params, ok);
+            } else
+            #ifdef CONFIG_WC_PREEVENT_RING
+            if (strcmp(JSON_RPC_PREEVENT, msgk) == 0) {
+                h2pc_om_add_msg_res(JSON_RPC_PREEVENT, src_s, params, true);
+                preevent_trigger();
+            } else
+            #endif
+            #ifdef CONFIG_WC_THUMB
+            if (strcmp(JSON_RPC_GETTHUMB, msgk) == 0) {
+                bool ok = (last_snap_len > 0);
+                h2pc_om_add_msg_res(JSON_RPC_GETTHUMB, src_s, params, ok);
+                if (ok)
+                    h2pca_locked_SET_STATE(MODE_SEND_THUMB);
+            } else
+            #endif
             #ifdef OUT_ENABLED
             if (strcmp(JSON_RPC_OUTPUT, msgk) == 0) {
                 if (iparams) {
@@ -213,11 +900,16 @@ bool on_incoming_msg(const cJSON * src, const cJSON * kind, const cJSON * iparam
                     h2pc_om_add_msg_res(JSON_RPC_OUTPUT, src_s, params, false);
                 }
             } else
+            if (strcmp(JSON_RPC_OUTPUTS, msgk) == 0) {
+                bool ok = board_outputs(params, iparams);
+                h2pc_om_add_msg_res(JSON_RPC_OUTPUTS, src_s, params, ok);
+            } else
             #endif
             {
                 // you should delete params - no msg is sended
                 cJSON_Delete(params);
             }
+            WC_TRACE(WC_TR_MSG_E, 0);
         }
     }
 
@@ -250,6 +942,14 @@ static esp_err_t set_camera_buffer_size(int8_t  acam_mode)
         case CAM_MODE_STREAM:
             fsz = CAM_STREAM_FRAMESIZE;
             break;
+        case CAM_MODE_ROI:
+            //the sensor stays in its mode, only the window is moved
+            if (esp_camera_set_window(cam_roi.x, cam_roi.y, cam_roi.w, cam_roi.h,
+                                      cam_roi.out_w, cam_roi.out_h) == ESP_OK)
+                return ESP_OK;
+            ESP_LOGW(WC_TAG, "Region of interest is not supported, full view is used");
+            fsz = CAM_SNAP_FRAMESIZE;
+            break;
         default:
             fsz = 0;
             break;
@@ -274,6 +974,9 @@ static void button_tap_cb(void* arg)
             cJSON * params = cJSON_CreateObject();
             cJSON_AddStringToObject(params, JSON_RPC_BTN, arg);
             h2pc_om_add_msg_res(JSON_RPC_BTNEVENT, "", params, true); // params owned by msg now
+            #if defined(CONFIG_WC_PREEVENT_RING) && defined(CONFIG_WC_PREEVENT_ON_BUTTON)
+            preevent_trigger();
+            #endif
             return;
         }
     }
@@ -292,27 +995,117 @@ static void board_buttons_init(void)
 #ifdef OUT_ENABLED
 void board_out_operation(uint8_t pin, uint8_t onoff)
 {
-    for (int i = 0; i < OUT_CNT; i++) {
-        if (out_pins[i].pin != pin) {
-            continue;
-        }
-        if (onoff != out_pins[i].previous) {
-            gpio_set_level(pin, onoff);
-            out_pins[i].previous = onoff;
-        }
+    if (pin >= GPIO_NUM_MAX || out_index[pin] < 0) {
+        ESP_LOGE(WC_TAG, "Out is not found!");
         return;
     }
-    ESP_LOGE(WC_TAG, "Out is not found!");
+    // the level may be changed by a sequence - always write it
+    uint64_t mask = 1ULL << pin;
+    out_seq_apply(onoff ? mask : 0, onoff ? 0 : mask);
+    out_pins[out_index[pin]].previous = onoff;
+}
+
+/* {"2":1,"14":0} to the masks */
+static bool board_out_masks(const cJSON * levels, out_seq_step_t * step)
+{
+    step->set_mask = step->clr_mask = 0;
+    if (!cJSON_IsObject(levels))
+        return false;
+    cJSON * item;
+    cJSON_ArrayForEach(item, levels) {
+        char * end;
+        long pin = strtol(item->string, &end, 10);
+        if (!cJSON_IsNumber(item) || end == item->string || *end != 0 ||
+            pin < 0 || pin >= GPIO_NUM_MAX || out_index[pin] < 0) {
+            ESP_LOGE(WC_TAG, "Out %s is not found!", item->string);
+            return false;
+        }
+        if (item->valueint)
+            step->set_mask |= 1ULL << pin;
+        else
+            step->clr_mask |= 1ULL << pin;
+    }
+    return true;
+}
+
+/* cam_task drives the flash pin while a snapshot under the flash is pending */
+static bool board_out_flash_busy(uint64_t pins)
+{
+    if (snap_flash_frames && (pins & (1ULL << OUT_LED_FLASH))) {
+        ESP_LOGW(WC_TAG, "Flash is armed, its pin is busy");
+        return true;
+    }
+    return false;
+}
+
+/* "levels" - set the pins at once,
+   "steps":[{"levels":{..},"ms":hold},..],"repeat":n - run the sequence.
+   Any of them stops the running sequence, no params - only stops it.
+   The flash pin is refused while a snapshot under the flash is pending */
+static bool board_outputs(cJSON * params, const cJSON * iparams) {
+    cJSON * slevels = iparams ? cJSON_GetObjectItem(iparams, JSON_RPC_LEVELS) : NULL;
+    cJSON * ssteps = iparams ? cJSON_GetObjectItem(iparams, JSON_RPC_STEPS) : NULL;
+
+    if (slevels) {
+        out_seq_step_t step;
+        if (!board_out_masks(slevels, &step) || board_out_flash_busy(step.set_mask | step.clr_mask))
+            return false;
+        out_seq_stop();
+        out_seq_apply(step.set_mask, step.clr_mask);
+        cJSON_AddNumberToObject(params, JSON_RPC_STEPS, 1);
+        return true;
+    }
+    if (!ssteps) {
+        out_seq_stop();
+        cJSON_AddNumberToObject(params, JSON_RPC_STEPS, 0);
+        return true;
+    }
+
+    int cnt = cJSON_GetArraySize(ssteps);
+    if (!cJSON_IsArray(ssteps) || cnt < 1 || cnt > OUT_SEQ_MAX_STEPS)
+        return false;
+    out_seq_step_t steps[OUT_SEQ_MAX_STEPS];
+    uint64_t pins = 0;
+    for (int i = 0; i < cnt; i++) {
+        cJSON * sstep = cJSON_GetArrayItem(ssteps, i);
+        if (!board_out_masks(cJSON_GetObjectItem(sstep, JSON_RPC_LEVELS), &steps[i]))
+            return false;
+        cJSON * sms = cJSON_GetObjectItem(sstep, JSON_RPC_MS);
+        cJSON * sus = cJSON_GetObjectItem(sstep, JSON_RPC_HOLD_US);
+        // a string or a bool would be a 0 us hold
+        if ((sms && !cJSON_IsNumber(sms)) || (sus && !cJSON_IsNumber(sus)))
+            return false;
+        double hold = sus ? sus->valuedouble : (sms ? sms->valuedouble * 1000.0 : 0.0);
+        if (hold < 0 || hold > UINT32_MAX)
+            return false;
+        steps[i].hold_us = (uint32_t) hold;
+        pins |= steps[i].set_mask | steps[i].clr_mask;
+    }
+    if (board_out_flash_busy(pins))
+        return false;
+    cJSON * srepeat = cJSON_GetObjectItem(iparams, JSON_RPC_REPEAT);
+    // a string or a bool would be 0 - until stopped
+    if (srepeat && (!cJSON_IsNumber(srepeat) || srepeat->valuedouble < 0 || srepeat->valuedouble > UINT32_MAX))
+        return false;
+    uint32_t repeat = srepeat ? (uint32_t) srepeat->valuedouble : 1;
+
+    if (out_seq_start(steps, cnt, repeat) != ESP_OK)
+        return false;
+    cJSON_AddNumberToObject(params, JSON_RPC_STEPS, cnt);
+    return true;
 }
 
 static void board_out_init(void)
 {
+    memset(out_index, -1, sizeof(out_index));
     for (int i = 0; i < OUT_CNT; i++) {
         gpio_pad_select_gpio(out_pins[i].pin);
         gpio_set_direction(out_pins[i].pin, GPIO_MODE_OUTPUT);
         gpio_set_level(out_pins[i].pin, OUT_OFF);
         out_pins[i].previous = OUT_OFF;
+        out_index[out_pins[i].pin] = i;
     }
+    out_seq_init();
 }
 #endif
 
@@ -338,37 +1131,106 @@ static void board_adc_init(void)
             adc_channel = 3;
             break;
     }
-    adc_mux = xSemaphoreCreateMutex();
-    adc_chars = calloc(1, sizeof(esp_adc_cal_characteristics_t));
-    //esp_adc_cal_value_t val_type =
-    esp_adc_cal_characterize(ADC_UNIT_2, ADC_ATTEN_DB_0, ADC_WIDTH_BIT_12, 1100, adc_chars);
-    adc2_config_channel_atten((adc2_channel_t)adc_channel, ADC_ATTEN_DB_0);
+    adc_probe_config_t cfg = {
+        .channel = (adc2_channel_t) adc_channel,
+        .atten = ADC_ATTEN_DB_0,
+        .oversample = CONFIG_WC_ADC_OVERSAMPLE,
+        .median = CONFIG_WC_ADC_MEDIAN,
+        .iir_shift = CONFIG_WC_ADC_IIR_SHIFT,
+    };
+    adc_probe_events_t ev = {
+        .low_mv = CONFIG_WC_ADC_LOW_MV,
+        .high_mv = CONFIG_WC_ADC_HIGH_MV,
+        .delta_mv = CONFIG_WC_ADC_DELTA_MV,
+        .hyst_mv = CONFIG_WC_ADC_HYST_MV,
+    };
+    if (adc_probe_init(&cfg, &ev) != ESP_OK)
+        ESP_LOGE(WC_TAG, "ADC probe is not initialized");
 }
 
+/* filtered value in mV. "adcval" is pushed when it crosses the thresholds */
 uint32_t board_get_adc_mV(void) {
-    int adc_new_value = 0;
-    //Multisampling
-    for (int i = 0; i < ADC_NO_OF_SAMPLES; i++) {
-        int raw;
-        adc2_get_raw((adc2_channel_t)adc_channel, ADC_WIDTH_BIT_12, &raw);
-        adc_new_value += raw;
-    }
-    adc_new_value /= ADC_NO_OF_SAMPLES;
-    if (xSemaphoreTake(adc_mux, portMAX_DELAY) == pdTRUE) {
-        adc_value = adc_new_value;
-        xSemaphoreGive(adc_mux);
+    uint32_t mv;
+    bool event = false;
+    if (adc_probe_sample(&mv, &event) != ESP_OK) {
+        // ADC2 is busy with Wi-Fi - keep the last value
+        mv = adc_probe_value();
+    }
+    if (event) {
+        cJSON * params = cJSON_CreateObject();
+        cJSON_AddNumberToObject(params, JSON_RPC_ADCVAL, (double) mv);
+        h2pc_om_add_msg_res(JSON_RPC_ADCVAL, "", params, true); // params owned by msg now
     }
     h2pca_locked_CLR_STATE(MODE_ADC_PROBE);
-    return ( adc_new_value );
+    return mv;
 }
 
-uint32_t locked_get_adc_voltage() {
-    uint32_t v = 0;
-    if (xSemaphoreTake(adc_mux, portMAX_DELAY) == pdTRUE) {
-        v = adc_value;
-        xSemaphoreGive(adc_mux);
+/* "low", "high", "delta", "hyst" in mV, 0 - off */
+static void set_adc_events(const cJSON * iparams) {
+    const char * keys[4] = {JSON_RPC_LOW, JSON_RPC_HIGH, JSON_RPC_DELTA, JSON_RPC_HYST};
+    adc_probe_events_t ev;
+    adc_probe_get_events(&ev);
+    uint32_t * vals[4] = {&ev.low_mv, &ev.high_mv, &ev.delta_mv, &ev.hyst_mv};
+    bool changed = false;
+    for (int i = 0; i < 4; i++) {
+        cJSON * v = cJSON_GetObjectItem(iparams, keys[i]);
+        if (cJSON_IsNumber(v) && v->valueint >= 0) {
+            *vals[i] = v->valueint;
+            changed = true;
+        }
     }
-    return v;
+    if (changed)
+        adc_probe_set_events(&ev);
+}
+
+/* {"now":ms,"ts":t0,"adcval":v0,"dt":[t1-t0,..],"dv":[v1-v0,..],"last":tn} -
+   "last" is "since" of the next request. Times are ms since boot */
+static bool add_adc_series(cJSON * params, const cJSON * iparams) {
+    uint32_t since = 0;
+    size_t max = CONFIG_WC_ADC_SERIES_LEN;
+    if (iparams) {
+        cJSON * ssince = cJSON_GetObjectItem(iparams, JSON_RPC_SINCE);
+        cJSON * smax = cJSON_GetObjectItem(iparams, JSON_RPC_MAX);
+        if (cJSON_IsNumber(ssince) && ssince->valuedouble >= 0)
+            since = (uint32_t) ssince->valuedouble;
+        if (cJSON_IsNumber(smax) && smax->valueint > 0 && smax->valueint < max)
+            max = smax->valueint;
+    }
+    adc_probe_point_t * pts = (adc_probe_point_t *) malloc(max * sizeof(adc_probe_point_t));
+    int * deltas = (int *) malloc(max * 2 * sizeof(int));
+    if (pts == NULL || deltas == NULL) {
+        free(pts);
+        free(deltas);
+        return false;
+    }
+
+    size_t n = adc_probe_series(since, pts, max);
+    cJSON_AddNumberToObject(params, JSON_RPC_NOW, (double) (uint32_t) (esp_timer_get_time() / 1000));
+    if (n > 0) {
+        int * dt = deltas;
+        int * dv = deltas + max;
+        for (size_t i = 1; i < n; i++) {
+            dt[i - 1] = (int) (pts[i].ts_ms - pts[i - 1].ts_ms);
+            dv[i - 1] = (int) pts[i].mv - (int) pts[i - 1].mv;
+        }
+        cJSON_AddNumberToObject(params, JSON_RPC_TS, pts[0].ts_ms);
+        cJSON_AddNumberToObject(params, JSON_RPC_ADCVAL, pts[0].mv);
+        cJSON_AddItemToObject(params, JSON_RPC_DT, cJSON_CreateIntArray(dt, n - 1));
+        cJSON_AddItemToObject(params, JSON_RPC_DV, cJSON_CreateIntArray(dv, n - 1));
+        cJSON_AddNumberToObject(params, JSON_RPC_LAST, pts[n - 1].ts_ms);
+    }
+    free(pts);
+    free(deltas);
+    return true;
+}
+
+static void add_adc_events(cJSON * params) {
+    adc_probe_events_t ev;
+    adc_probe_get_events(&ev);
+    cJSON_AddNumberToObject(params, JSON_RPC_LOW, ev.low_mv);
+    cJSON_AddNumberToObject(params, JSON_RPC_HIGH, ev.high_mv);
+    cJSON_AddNumberToObject(params, JSON_RPC_DELTA, ev.delta_mv);
+    cJSON_AddNumberToObject(params, JSON_RPC_HYST, ev.hyst_mv);
 }
 
 static void sync_adc_probe_task_cb(h2pca_task_id id,
@@ -380,6 +1242,148 @@ static void sync_adc_probe_task_cb(h2pca_task_id id,
 
 #endif
 
+#ifdef CONFIG_WC_MOTION
+static bool reinit_camera() {
+    esp_camera_deinit();
+    if (init_camera() != ESP_OK)
+        return false;
+    cur_cam_mode = CAM_MODE_SNAP; // camera_config
+    return true;
+}
+
+static size_t motion_dc_read(void * arg, size_t index, uint8_t * buf, size_t len) {
+    memcpy(buf, &((const camera_fb_t *) arg)->buf[index], len);
+    return len;
+}
+
+/* 1/8 scale - every pixel is the average of the 8x8 block, it is repeated to MOTION_FRAMESIZE */
+static bool motion_dc_write(void * arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t * data) {
+    uint16_t mw = resolution[MOTION_FRAMESIZE].width;
+    if (data == NULL)
+        return (w * motion_dc_rep == mw) && (h * motion_dc_rep == resolution[MOTION_FRAMESIZE].height);
+    for (uint16_t j = 0; j < h; j++) {
+        uint8_t * row = &motion_gray[(size_t) (y + j) * motion_dc_rep * mw + (size_t) x * motion_dc_rep];
+        uint8_t * o = row;
+        for (uint16_t i = 0; i < w; i++, data += 3) {
+            memset(o, (19595 * data[0] + 38470 * data[1] + 7471 * data[2] + 32768) >> 16, motion_dc_rep);
+            o += motion_dc_rep;
+        }
+        for (uint8_t r = 1; r < motion_dc_rep; r++)
+            memcpy(&row[(size_t) r * mw], row, (size_t) w * motion_dc_rep);
+    }
+    return true;
+}
+
+/* the stream frame is compared - only the DC of it is decoded, the capture is not touched */
+static bool motion_from_stream(motion_result_t * res) {
+    if (motion_gray == NULL)
+        return false;
+    esp_camera_do_snap();
+    camera_fb_t * pic = esp_camera_fb_get();
+    if (pic == NULL)
+        return false;
+    int64_t start = esp_timer_get_time();
+    esp_err_t err = esp_jpg_decode(pic->len, JPG_SCALE_8X, motion_dc_read, motion_dc_write, pic);
+    esp_camera_fb_return(pic);
+    if (err != ESP_OK) {
+        ESP_LOGW(WC_TAG, "Motion check skipped, stream frame is not decoded (%d)", err);
+        return false;
+    }
+    bool detected = motion_process(motion_gray, (size_t) resolution[MOTION_FRAMESIZE].width * resolution[MOTION_FRAMESIZE].height,
+                                   CONFIG_WC_MOTION_THRESHOLD, CONFIG_WC_MOTION_TILE_PERCENT, res);
+    int64_t decode_us = esp_timer_get_time() - start;
+    motion_checks++;
+    motion_cost_us += decode_us;
+    ESP_LOGD(WC_TAG, "Motion check: stream frame compared in %lld us", decode_us);
+    return detected;
+}
+
+/* no stream is running - the capture is switched to grayscale for one frame and back */
+static bool motion_probe(motion_result_t * res) {
+    int64_t start = esp_timer_get_time();
+    esp_err_t err = esp_camera_set_pixformat(PIXFORMAT_GRAYSCALE, MOTION_FRAMESIZE);
+    if (err != ESP_OK) {
+        ESP_LOGE(WC_TAG, "Motion probe skipped, grayscale capture failed: %s", esp_err_to_name(err));
+        motion_cam_reinit = true;
+        return false;
+    }
+    int64_t switch_us = esp_timer_get_time() - start;
+
+    bool detected = false;
+    esp_camera_do_snap();
+    camera_fb_t * pic = esp_camera_fb_get();
+    if (pic) {
+        detected = motion_process(pic->buf, pic->len, CONFIG_WC_MOTION_THRESHOLD,
+                                  CONFIG_WC_MOTION_TILE_PERCENT, res);
+        esp_camera_fb_return(pic);
+    }
+
+    /* back to the JPEG snapshots */
+    start = esp_timer_get_time();
+    err = esp_camera_set_pixformat(PIXFORMAT_JPEG, CAM_SNAP_FRAMESIZE);
+    if (cur_cam_mode == CAM_MODE_ROI)
+        cur_cam_mode = CAM_MODE_SNAP; // the window was reset with the framesize
+    if (err != ESP_OK) {
+        ESP_LOGE(WC_TAG, "Capture is not restored after the motion probe: %s", esp_err_to_name(err));
+        // no frames until the camera is rebuilt
+        if (!reinit_camera())
+            motion_cam_reinit = true;
+    } else {
+        switch_us += esp_timer_get_time() - start;
+        motion_checks++;
+        motion_cost_us += switch_us;
+        ESP_LOGD(WC_TAG, "Motion probe: capture switched in %lld us", switch_us);
+    }
+    return detected;
+}
+
+static void check_motion() {
+    if (motion_cam_reinit) {
+        if (!reinit_camera()) {
+            h2pca_locked_CLR_STATE(MODE_MOTION_PROBE);
+            return;
+        }
+        motion_cam_reinit = false;
+    }
+    motion_result_t res;
+    memset(&res, 0, sizeof(motion_result_t));
+    bool detected = (cur_cam_mode == CAM_MODE_STREAM) ? motion_from_stream(&res) : motion_probe(&res);
+    if (detected) {
+        cJSON * params = cJSON_CreateObject();
+        cJSON * tiles = cJSON_CreateArray();
+        for (int i = 0; i < res.tiles_x * res.tiles_y; i++) {
+            if (res.changed & (1ULL << i))
+                cJSON_AddItemToArray(tiles, cJSON_CreateNumber(i));
+        }
+        cJSON_AddItemToObject(params, JSON_RPC_TILES, tiles);
+        cJSON_AddNumberToObject(params, JSON_RPC_MEAN, res.mean);
+        h2pc_om_add_msg_res(JSON_RPC_MOTION, "", params, true); // params owned by msg now
+    } else if (res.lighting) {
+        ESP_LOGI(WC_TAG, "Scene lighting changed, mean %u", res.mean);
+    }
+    h2pca_locked_CLR_STATE(MODE_MOTION_PROBE);
+}
+
+static void sync_motion_task_cb(h2pca_task_id id,
+                                     h2pca_state cur_state,
+                                     void * user_data,
+                                     uint32_t * restart_period) {
+    check_motion();
+}
+#endif
+
+#if CONFIG_WC_STATS_PERIOD > 0
+static void sync_stats_task_cb(h2pca_task_id id,
+                                     h2pca_state cur_state,
+                                     void * user_data,
+                                     uint32_t * restart_period) {
+    cJSON * params = cJSON_CreateObject();
+    add_camera_stats(params, false);
+    h2pc_om_add_msg_res(JSON_RPC_STATS, "", params, true); // params owned by msg now
+    h2pca_locked_CLR_STATE(MODE_PUSH_STATS);
+}
+#endif
+
 static void sync_stream_task_cb(h2pca_task_id id,
                                      h2pca_state cur_state,
                                      void * user_data,
@@ -389,15 +1393,72 @@ static void sync_stream_task_cb(h2pca_task_id id,
     send_next_frame();
 }
 
+#ifdef OFFLINE_CAPTURE
+/* the step timer captures while the device is not authorized on the server:
+   the stream frames are recorded by preevent_tap, the snapshots are spooled */
+static void offline_capture() {
+    int64_t now = esp_timer_get_time();
+    #ifdef CONFIG_WC_PREEVENT_RING
+    if (now - offline_frame_us >= STREAM_NEXT_FRAME_TIMER_DELTA) {
+        offline_frame_us = now;
+        ESP_ERROR_CHECK(set_camera_buffer_size(CAM_MODE_STREAM));
+        esp_camera_do_snap();
+        camera_fb_t * pic = esp_camera_fb_get();
+        if (pic)
+            esp_camera_fb_return(pic);
+    }
+    #endif
+    #if defined(CONFIG_WC_SPOOL) && CONFIG_WC_SPOOL_OFFLINE_PERIOD > 0
+    if (now - offline_snap_us >= (int64_t) CONFIG_WC_SPOOL_OFFLINE_PERIOD * 1000000) {
+        offline_snap_us = now;
+        h2pca_locked_SET_STATE(MODE_SEND_FB);
+    }
+    #endif
+}
+#endif
+
 static void on_step_finished() {
-    if (h2pca_locked_CHK_STATE(AUTHORIZED_BIT|MODE_SEND_FB)) {
+    #ifdef OFFLINE_CAPTURE
+    if (!h2pca_locked_CHK_STATE(AUTHORIZED_BIT))
+        offline_capture();
+    #endif
+    if (h2pca_locked_CHK_STATE(SEND_FB_REQ_BITMASK)) {
         /* send framebuffer */
-        ESP_ERROR_CHECK(set_camera_buffer_size(CAM_MODE_SNAP));
-        esp_camera_do_snap();
-        vTaskDelay(500);
+        ESP_ERROR_CHECK(set_camera_buffer_size(cam_roi.on ? CAM_MODE_ROI : CAM_MODE_SNAP));
+        #ifdef OUT_ENABLED
+        /* lit by cam_task on VSYNC, the first frame under the flash is taken */
+        if (snap_flash_frames)
+            esp_camera_flash(OUT_LED_FLASH, OUT_ON, snap_flash_frames);
+        #endif
         send_snap();
+        #ifdef OUT_ENABLED
+        if (snap_flash_frames) {
+            esp_camera_flash(OUT_LED_FLASH, OUT_ON, 0);
+            if (!h2pca_locked_CHK_STATE(MODE_SEND_FB))
+                snap_flash_frames = 0;
+        }
+        #endif
         ESP_ERROR_CHECK(set_camera_buffer_size(CAM_MODE_STREAM));
     }
+    #ifdef CONFIG_WC_PREEVENT_RING
+    if (h2pca_locked_CHK_STATE(AUTHORIZED_BIT|MODE_SEND_PREEVENT)) {
+        /* upload the frames recorded before the event */
+        send_preevent();
+    }
+    #endif
+    #ifdef CONFIG_WC_THUMB
+    if (h2pca_locked_CHK_STATE(AUTHORIZED_BIT|MODE_SEND_THUMB)) {
+        /* upload the preview of the last snapshot */
+        send_thumb();
+    }
+    #endif
+    #ifdef CONFIG_WC_SPOOL
+    if (h2pca_locked_CHK_STATE(AUTHORIZED_BIT) && h2pc_get_connected() && frame_spool_pending()) {
+        /* catch up with the snapshots taken while offline */
+        if (frame_spool_flush(CONFIG_WC_SPOOL_FLUSH_CHUNK, send_spooled_frame, NULL) == ESP_OK)
+            ESP_LOGI(WC_TAG, "Spooled frames sent, %u frames pending", frame_spool_pending());
+    }
+    #endif
 }
 
 static void on_ble_cfg_finished() {
@@ -440,7 +1501,6 @@ void app_main()
     ESP_ERROR_CHECK(h2pca_task_pool_add_task(&(app_cfg.tasks), tsk));
 
     #ifdef ADC_ENABLED
-    esp_timer_start_periodic(adc_probe, ADC_PROBE_TIMER_DELTA);
     tsk = h2pca_new_task("ADC", 2, NULL, &err);
     ESP_ERROR_CHECK(err);
     tsk->on_sync = &sync_adc_probe_task_cb;
@@ -450,6 +1510,26 @@ void app_main()
     ESP_ERROR_CHECK(h2pca_task_pool_add_task(&(app_cfg.tasks), tsk));
     #endif
 
+    #ifdef CONFIG_WC_MOTION
+    tsk = h2pca_new_task("Motion", 3, NULL, &err);
+    ESP_ERROR_CHECK(err);
+    tsk->on_sync = &sync_motion_task_cb;
+    tsk->apply_bitmask = MODE_MOTION_PROBE;
+    tsk->req_bitmask = AUTHORIZED_BIT;
+    tsk->period = CONFIG_WC_MOTION_PERIOD * 1000;
+    ESP_ERROR_CHECK(h2pca_task_pool_add_task(&(app_cfg.tasks), tsk));
+    #endif
+
+    #if CONFIG_WC_STATS_PERIOD > 0
+    tsk = h2pca_new_task("Stats", 4, NULL, &err);
+    ESP_ERROR_CHECK(err);
+    tsk->on_sync = &sync_stats_task_cb;
+    tsk->apply_bitmask = MODE_PUSH_STATS;
+    tsk->req_bitmask = AUTHORIZED_BIT;
+    tsk->period = CONFIG_WC_STATS_PERIOD * 1000000;
+    ESP_ERROR_CHECK(h2pca_task_pool_add_task(&(app_cfg.tasks), tsk));
+    #endif
+
     h2pca_app = h2pca_init(&app_cfg, &err);
 
     if (h2pca_app == NULL) {
@@ -457,6 +1537,42 @@ void app_main()
         ESP_ERROR_CHECK(err);
     }
     ESP_ERROR_CHECK( init_camera() );
+    #ifdef CONFIG_CAMERA_DMA_AUTOTUNE
+    /* DMA layouts for the snapshots and for the stream frames - the main workload.
+       the capture is rebuilt on the mode switch only if they differ */
+    ESP_ERROR_CHECK(set_camera_buffer_size(CAM_MODE_SNAP));
+    esp_camera_tune_dma(CONFIG_CAMERA_DMA_AUTOTUNE_FRAMES);
+    ESP_ERROR_CHECK(set_camera_buffer_size(CAM_MODE_STREAM));
+    esp_camera_tune_dma(CONFIG_CAMERA_DMA_AUTOTUNE_FRAMES);
+    #endif
+
+    #ifdef CONFIG_WC_PREEVENT_RING
+    if (frame_ring_init(CONFIG_WC_PREEVENT_RING_SIZE, CONFIG_WC_PREEVENT_SECONDS * 1000) == ESP_OK)
+        esp_camera_set_frame_hook(preevent_tap, NULL);
+    else
+        ESP_LOGW(WC_TAG, "Pre-event ring is disabled");
+    #endif
+    #ifdef CONFIG_WC_MOTION
+    if (motion_init(resolution[MOTION_FRAMESIZE].width, resolution[MOTION_FRAMESIZE].height,
+                    CONFIG_WC_MOTION_TILE) != ESP_OK)
+        ESP_LOGW(WC_TAG, "Motion detection is disabled");
+    else if ((resolution[MOTION_FRAMESIZE].width * 8) % resolution[CAM_STREAM_FRAMESIZE].width == 0) {
+        motion_dc_rep = resolution[MOTION_FRAMESIZE].width * 8 / resolution[CAM_STREAM_FRAMESIZE].width;
+        motion_gray = (uint8_t *) wc_mem_malloc(WC_MEM_FRAMES, (size_t) resolution[MOTION_FRAMESIZE].width *
+                                                resolution[MOTION_FRAMESIZE].height, MALLOC_CAP_8BIT);
+    }
+    if (motion_gray == NULL)
+        ESP_LOGW(WC_TAG, "Motion is not checked while streaming");
+    #endif
+    #ifdef CONFIG_WC_TILE_STREAM
+    if (tile_stream_init(resolution[CAM_STREAM_FRAMESIZE].width, resolution[CAM_STREAM_FRAMESIZE].height,
+                         CONFIG_WC_TILE_SIZE) != ESP_OK)
+        ESP_LOGE(WC_TAG, "Tile stream is not initialized");
+    #endif
+    #ifdef CONFIG_WC_SPOOL
+    if (frame_spool_init(CONFIG_WC_SPOOL_PARTITION) != ESP_OK)
+        ESP_LOGW(WC_TAG, "Offline spool is disabled");
+    #endif
 
     /* start main task */
     h2pca_start(0);
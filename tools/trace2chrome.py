@@ -0,0 +1,114 @@
+#!/usr/bin/env python3
+#
+# HTTP2 Web Camera Client Device
+#
+# Part of WCWebCamServer project
+#
+# Copyright (c) 2022 Ilya Medvedkov <sggdev.im@gmail.com>
+#
+# Converts the "gettrace" response of the device to Chrome trace JSON
+# (chrome://tracing, https://ui.perfetto.dev).
+#
+# usage: trace2chrome.py gettrace.json [out.json]
+#
+# The input is the whole message {"msg":"gettrace","params":{...}} or only
+# its params. Keep EVENTS in sync with wc_trace_ev_t (main/include/wc_trace.h)
+#
+# The begin and end records are paired across the cores into complete
+# events on the core of the begin, "end_core" is set if the span ended
+# on the other one
+
+import base64
+import json
+import struct
+import sys
+
+EVENTS = {
+    1: "vsync",
+    2: "eof",
+    3: "step",
+    4: "step",
+    5: "copy",
+    6: "copy",
+    7: "fb_send",
+    8: "fb_drop",
+    9: "fb_take",
+    10: "upload",
+    11: "upload",
+    12: "msg",
+    13: "msg",
+    14: "flash",
+}
+BEGIN = {3, 5, 10, 12}
+END = {4, 6, 11, 13}
+MSG_B = 12
+
+
+def msg_kind(arg):
+    return bytes((arg >> (i * 8)) & 0xFF for i in range(3)).rstrip(b"\0").decode("ascii", "replace")
+
+
+def convert(params):
+    now = int(params["now"])
+    recs = []
+    for core, b64 in enumerate(params["trace"]):
+        raw = base64.b64decode(b64)
+        for ts, w in struct.iter_unpack("<II", raw):
+            # the device time is truncated to 32 bits, count back from "now"
+            us = now - ((now - ts) & 0xFFFFFFFF)
+            recs.append((us, core, w & 0xFF, w >> 8))
+    # the records of all the cores in time order: a task without affinity
+    # may begin a span on one core and end it on the other
+    recs.sort(key=lambda r: r[0])
+    events = []
+    open_spans = {}
+    for us, core, ev, arg in recs:
+        name = EVENTS.get(ev, "ev%d" % ev)
+        args = {"kind": msg_kind(arg)} if ev == MSG_B else {"arg": arg}
+        if ev in BEGIN:
+            open_spans.setdefault(name, []).append({"name": name, "pid": 0, "tid": core, "ts": us,
+                                                    "ph": "X", "args": args})
+        elif ev in END and open_spans.get(name):
+            e = open_spans[name].pop()
+            e["dur"] = us - e["ts"]
+            e["args"]["end_arg"] = arg
+            if core != e["tid"]:
+                e["args"]["end_core"] = core
+            events.append(e)
+        else:
+            # an end without its begin (overwritten in the ring) is shown as an instant
+            events.append({"name": name, "pid": 0, "tid": core, "ts": us, "ph": "i", "s": "t", "args": args})
+    # spans not ended when the trace was read
+    for spans in open_spans.values():
+        for e in spans:
+            e["ph"] = "B"
+            events.append(e)
+    events.sort(key=lambda e: (e["tid"], e["ts"]))
+    if events:
+        t0 = min(e["ts"] for e in events)
+        for e in events:
+            e["ts"] -= t0
+    meta = [{"name": "thread_name", "ph": "M", "pid": 0, "tid": core, "args": {"name": "core%d" % core}}
+            for core in range(len(params["trace"]))]
+    return {"traceEvents": meta + events, "displayTimeUnit": "ms",
+            "otherData": {"older": params.get("older", [])}}
+
+
+def main(argv):
+    if len(argv) < 2:
+        sys.stderr.write("usage: trace2chrome.py gettrace.json [out.json]\n")
+        return 1
+    with open(argv[1]) as f:
+        data = json.load(f)
+    params = data.get("params", data)
+    out = json.dumps(convert(params))
+    if len(argv) > 2:
+        with open(argv[2], "w") as f:
+            f.write(out)
+    else:
+        sys.stdout.write(out)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))